@@ -0,0 +1,356 @@
+#!/usr/bin/env python3
+"""Host side of the 01_uart benchmark (UART_bench.elf).
+
+Measures, for each baud rate and write size:
+
+  * sustained host -> target throughput, timed on the target with the DWT
+    cycle counter (sink),
+  * sustained target -> host throughput, timed on both sides (source),
+  * bytes lost or corrupted in either direction,
+  * end-to-end echo latency percentiles, timed on the host.
+
+The serial port is driven through termios only, so any tty works: a USB
+serial adapter, or the pseudo terminal created by --stand-in. The stand-in
+answers the same protocol from a thread on the host, so the harness can be
+run (and changed) without a board; its numbers only reflect the host.
+
+Protocol: see the comment at the top of src/bench_main.c.
+"""
+
+import argparse
+import array
+import fcntl
+import os
+import select
+import struct
+import sys
+import termios
+import threading
+import time
+
+INFO, ECHO, SINK, SOURCE, BAUD, STATS = (ord(c) for c in "IESGBT")
+PATTERN = 255
+
+STATS_NAMES = (
+	"tx_bytes", "tx_cycles", "tx_wakeups", "rx_bytes", "rx_irqs",
+	"rx_dropped", "rx_overruns", "rx_throttled",
+	"tx_frames", "rx_frames", "rx_crc_errors", "rx_oversize", "rx_no_buffer",
+)
+
+
+def crc32_stm32(data):
+	"""CRC of the STM32 CRC unit over little-endian words, last one zero-padded."""
+	crc = 0xFFFFFFFF
+	data = bytes(data) + bytes(-len(data) % 4)
+	for (word,) in struct.iter_unpack("<I", data):
+		crc ^= word
+		for _ in range(32):
+			crc = ((crc << 1) ^ 0x04C11DB7) if crc & 0x80000000 else (crc << 1)
+			crc &= 0xFFFFFFFF
+	return crc
+
+
+def cobs_encode(data):
+	out = bytearray()
+	start = 0
+	while True:
+		end = start
+		while end < len(data) and end - start < 254 and data[end] != 0:
+			end += 1
+		code = end - start + 1
+		out.append(code)
+		out += data[start:end]
+		if end == len(data):
+			break
+		start = end if code == 0xFF else end + 1
+	return bytes(out)
+
+
+def cobs_decode(data):
+	out = bytearray()
+	pos = 0
+	zero = False
+	while pos < len(data):
+		code = data[pos]
+		if code == 0 or pos + code > len(data):
+			raise ValueError("bad COBS block")
+		if zero:
+			out.append(0)
+		out += data[pos + 1:pos + code]
+		zero = code != 0xFF
+		pos += code
+	return bytes(out)
+
+
+def frame_encode(payload):
+	crc = struct.pack("<I", crc32_stm32(payload))
+	return cobs_encode(bytes(payload) + crc) + b"\0"
+
+
+def frame_decode(body):
+	data = cobs_decode(body)
+	if len(data) < 4 or struct.unpack("<I", data[-4:])[0] != crc32_stm32(data[:-4]):
+		raise ValueError("bad frame CRC")
+	return data[:-4]
+
+
+def pattern(count, phase=0):
+	return bytes(1 + (phase + x) % PATTERN for x in range(count))
+
+
+class Link:
+	"""A raw tty with frame and delimiter-terminated reads."""
+
+	# struct termios2 from asm-generic/termbits.h, for rates without a Bxxx.
+	TCGETS2 = 0x802C542A
+	TCSETS2 = 0x402C542B
+	BOTHER = 0o010000
+	CBAUD = 0o010017
+
+	def __init__(self, path):
+		self.fd = os.open(path, os.O_RDWR | os.O_NOCTTY)
+		attr = termios.tcgetattr(self.fd)
+		attr[0] = 0							# iflag
+		attr[1] = 0							# oflag
+		attr[2] = termios.CS8 | termios.CREAD | termios.CLOCAL
+		attr[3] = 0							# lflag
+		attr[6][termios.VMIN] = 0
+		attr[6][termios.VTIME] = 0
+		termios.tcsetattr(self.fd, termios.TCSANOW, attr)
+		self.pending = bytearray()
+
+	def set_baud(self, rate):
+		if not os.isatty(self.fd):
+			return
+		name = "B%d" % rate
+		if hasattr(termios, name):
+			attr = termios.tcgetattr(self.fd)
+			attr[4] = attr[5] = getattr(termios, name)
+			termios.tcsetattr(self.fd, termios.TCSADRAIN, attr)
+			return
+		buf = array.array("I", bytes(44))
+		fcntl.ioctl(self.fd, self.TCGETS2, buf)
+		buf[2] = (buf[2] & ~self.CBAUD) | self.BOTHER	# c_cflag
+		buf[9] = buf[10] = rate							# c_ispeed, c_ospeed
+		fcntl.ioctl(self.fd, self.TCSETS2, buf)
+
+	def write(self, data):
+		view = memoryview(data)
+		while view:
+			select.select([], [self.fd], [])
+			view = view[os.write(self.fd, view):]
+
+	def read_until_zero(self, timeout, on_data=None):
+		"""Returns the bytes before the next zero, or None on timeout."""
+		deadline = time.monotonic() + timeout
+		while True:
+			end = self.pending.find(0)
+			if end >= 0:
+				body = bytes(self.pending[:end])
+				del self.pending[:end + 1]
+				return body
+			left = deadline - time.monotonic()
+			if left <= 0 or not select.select([self.fd], [], [], left)[0]:
+				return None
+			chunk = os.read(self.fd, 65536)
+			if on_data is not None:
+				on_data(chunk)
+			self.pending += chunk
+
+	def send_frame(self, payload):
+		self.write(frame_encode(payload))
+
+	def read_frame(self, timeout=2.0):
+		while True:
+			body = self.read_until_zero(timeout)
+			if body is None:
+				raise TimeoutError("no reply from target")
+			if body:
+				return frame_decode(body)
+
+	def request(self, cmd, *words, payload=b"", timeout=2.0):
+		self.send_frame(bytes([cmd]) + struct.pack("<%dI" % len(words), *words) + payload)
+		reply = self.read_frame(timeout)
+		if not reply or reply[0] != cmd:
+			raise ValueError("unexpected reply %r" % reply[:1])
+		return reply[1:]
+
+	def drain(self):
+		self.pending.clear()
+		while select.select([self.fd], [], [], 0.05)[0]:
+			os.read(self.fd, 65536)
+
+
+class StandIn(threading.Thread):
+	"""Answers the benchmark protocol on the master side of a pty."""
+
+	CPU_HZ = 72000000
+
+	def __init__(self, fd):
+		super().__init__(daemon=True)
+		self.link = Link.__new__(Link)
+		self.link.fd = fd
+		self.link.pending = bytearray()
+		self.baud = 115200
+		self.stats = [0] * len(STATS_NAMES)
+
+	def cycles(self):
+		return int(time.perf_counter() * self.CPU_HZ) & 0xFFFFFFFF
+
+	def reply(self, cmd, *words, payload=b""):
+		self.link.send_frame(bytes([cmd]) + struct.pack("<%dI" % len(words), *words) + payload)
+
+	def run(self):
+		while True:
+			body = self.link.read_until_zero(3600)
+			if not body:
+				continue
+			try:
+				req = frame_decode(body)
+			except ValueError:
+				self.stats[10] += 1
+				continue
+			self.stats[9] += 1
+			cmd, args = req[0], req[1:]
+			words = struct.unpack("<%dI" % (len(args) // 4), args[:len(args) // 4 * 4])
+			if cmd == INFO:
+				self.reply(INFO, self.CPU_HZ, self.baud, 2, 1, 256, 256, 128)
+			elif cmd == ECHO:
+				self.reply(ECHO, 0, payload=args)
+			elif cmd == SINK:
+				self.sink(words[0])
+			elif cmd == SOURCE:
+				data = pattern(words[0])
+				start = self.cycles()
+				self.link.write(data + b"\0")
+				self.reply(SOURCE, (self.cycles() - start) & 0xFFFFFFFF, words[0])
+			elif cmd == BAUD:
+				self.baud = words[0]
+				self.reply(BAUD, 1, words[0], 0)
+			elif cmd == STATS:
+				self.reply(STATS, 8, *self.stats)
+
+	def sink(self, count):
+		self.reply(SINK)
+		got = bytearray(self.link.pending)
+		self.link.pending.clear()
+		start = self.cycles()
+		first = len(got)
+		while len(got) < count:
+			if not select.select([self.link.fd], [], [], 0.5)[0]:
+				break
+			chunk = os.read(self.link.fd, 65536)
+			if not got:
+				start, first = self.cycles(), len(chunk)
+			got += chunk
+		end = self.cycles()
+		bad = sum(a != b for a, b in zip(got, pattern(len(got))))
+		self.reply(SINK, len(got), (end - start) & 0xFFFFFFFF, first, bad, 0, 0)
+
+
+def percentile(values, p):
+	values = sorted(values)
+	return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+
+def run_echo(link, count, size):
+	latency = []
+	payload = pattern(size)
+	send_cycles = []
+	for _ in range(count):
+		start = time.perf_counter()
+		reply = link.request(ECHO, payload=payload)
+		latency.append((time.perf_counter() - start) * 1e6)
+		if reply[4:] != payload:
+			raise ValueError("echo payload corrupted")
+		send_cycles.append(struct.unpack("<I", reply[:4])[0])
+	return latency, send_cycles[1:]
+
+
+def run_sink(link, cpu_hz, count, chunk):
+	link.request(SINK, count)
+	data = pattern(count)
+	for x in range(0, count, chunk):
+		link.write(data[x:x + chunk])
+	received, cycles, first, bad, dropped, overruns = struct.unpack(
+		"<6I", link.read_frame(timeout=count * 20 / 9600 + 2)[1:25])
+	rate = (received - first) * cpu_hz / cycles if cycles else 0
+	return rate, count - received, bad, dropped, overruns
+
+
+def run_source(link, cpu_hz, count, chunk, copy):
+	raw = []
+	stamps = []
+
+	def on_data(chunk_data):
+		stamps.append(time.perf_counter())
+		raw.append(chunk_data)
+
+	link.send_frame(bytes([SOURCE]) + struct.pack("<3I", count, chunk, copy))
+	body = link.read_until_zero(count * 20 / 9600 + 2, on_data)
+	if body is None:
+		raise TimeoutError("source data did not end")
+	reply = link.read_frame()
+	cycles, sent = struct.unpack("<2I", reply[1:9])
+	host_rate = len(body) / (stamps[-1] - stamps[0]) if len(stamps) > 1 else 0
+	bad = sum(a != b for a, b in zip(body, pattern(len(body))))
+	return sent * cpu_hz / cycles if cycles else 0, host_rate, sent - len(body), bad
+
+
+def main():
+	parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+	where = parser.add_mutually_exclusive_group(required=True)
+	where.add_argument("--port", help="serial device of the target")
+	where.add_argument("--stand-in", action="store_true", help="run against a pty stand-in")
+	parser.add_argument("--start-baud", type=int, default=115200, help="rate the target boots at")
+	parser.add_argument("--bauds", default="115200,921600,2250000,4500000")
+	parser.add_argument("--chunks", default="1,16,64,512", help="write sizes in bytes")
+	parser.add_argument("--bytes", type=int, default=65536, help="bulk transfer size")
+	parser.add_argument("--echoes", type=int, default=200)
+	parser.add_argument("--echo-size", type=int, default=16)
+	parser.add_argument("--copy", action="store_true", help="source copies instead of sending in place")
+	args = parser.parse_args()
+
+	if args.stand_in:
+		master, slave = os.openpty()
+		StandIn(master).start()
+		link = Link(os.ttyname(slave))
+	else:
+		link = Link(args.port)
+	link.set_baud(args.start_baud)
+	link.drain()
+
+	for baud in (int(b) for b in args.bauds.split(",")):
+		ok, actual, error = struct.unpack("<IIi", link.request(BAUD, baud)[:12])
+		if not ok:
+			print("%8d  not reachable" % baud)
+			continue
+		link.set_baud(baud)
+		time.sleep(0.05)
+		link.drain()
+
+		cpu_hz, _, tx_mode, rx_mode, tx_ring, rx_ring, _ = struct.unpack("<7I", link.request(INFO)[:28])
+		latency, send_cycles = run_echo(link, args.echoes, args.echo_size)
+		print("\nbaud %d (actual %d, %+d ppm), tx mode %d, rx mode %d, rings %d/%d"
+			% (baud, actual, error, tx_mode, rx_mode, tx_ring, rx_ring))
+		print("echo %d B: p50 %.0f us  p90 %.0f us  p99 %.0f us  max %.0f us  frame send %d cycles"
+			% (args.echo_size, percentile(latency, 50), percentile(latency, 90),
+				percentile(latency, 99), max(latency),
+				percentile(send_cycles, 50) if send_cycles else 0))
+		print("%6s %12s %6s %5s %8s %12s %12s %6s %5s"
+			% ("chunk", "sink B/s", "lost", "bad", "overrun", "source B/s", "host B/s", "lost", "bad"))
+		for chunk in (int(c) for c in args.chunks.split(",")):
+			sink_rate, sink_lost, sink_bad, dropped, overruns = run_sink(link, cpu_hz, args.bytes, chunk)
+			src_rate, host_rate, src_lost, src_bad = run_source(link, cpu_hz, args.bytes, chunk, args.copy)
+			print("%6d %12.0f %6d %5d %8d %12.0f %12.0f %6d %5d"
+				% (chunk, sink_rate, sink_lost + dropped, sink_bad, overruns,
+					src_rate, host_rate, src_lost, src_bad))
+
+	stats = link.request(STATS)
+	words = struct.unpack("<%dI" % (len(stats) // 4), stats)
+	print("\n" + "  ".join("%s %d" % kv for kv in zip(STATS_NAMES, words[1:])))
+	return 0
+
+
+if __name__ == "__main__":
+	sys.exit(main())
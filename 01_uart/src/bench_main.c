@@ -0,0 +1,302 @@
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "uart.h"
+#include "uart_frame.h"
+
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/dbgmcu.h>
+#include <libopencm3/cm3/dwt.h>
+
+/*
+ * Benchmark image for the UART pipeline, driven by bench/uart_bench.py.
+ *
+ * Requests are frames (see uart_frame.c) whose first byte is the command;
+ * each one is answered with a frame starting with the same byte. Numbers
+ * are little-endian 32-bit words. Bulk data for BENCH_SINK and
+ * BENCH_SOURCE is sent raw, as the pattern 1, 2, ... 255, 1, 2, ... which
+ * has no zero byte and so cannot be taken for a frame delimiter.
+ */
+#define BENCH_INFO		'I'	// -> cpu_hz, baud, tx_mode, rx_mode, tx_ring, rx_ring, frame_max
+#define BENCH_ECHO		'E'	// payload -> send_cycles, payload
+#define BENCH_SINK		'S'	// count -> (ready) ... received, cycles, first, mismatches, dropped, overruns
+#define BENCH_SOURCE	'G'	// count, chunk, copy -> raw data, 0x00, cycles, count
+#define BENCH_BAUD		'B'	// baud -> ok, actual, error_ppm; then switches
+#define BENCH_STATS		'T'	// -> words, UartStats, UartFrameStats
+
+/* The sink gives up after the line has been quiet this long. */
+#define BENCH_SINK_IDLE		pdMS_TO_TICKS(500)
+
+/* Largest write BENCH_SOURCE issues. */
+#define BENCH_CHUNK_MAX		512
+
+#define BENCH_PATTERN		255
+
+static const UartConfig console_cfg = {
+	.baud = UART_BAUD,
+	.flow_control = UART_FLOW_CONTROL,
+};
+
+static Uart* console;
+static UartFramer framer;
+
+/* Pattern bytes, long enough to send any chunk from any phase in place. */
+static uint8_t pattern[BENCH_PATTERN + BENCH_CHUNK_MAX];
+
+static uint8_t reply[UART_FRAME_MAX];
+static uint32_t reply_len;
+
+/* Cycles the previous echo spent in uart_frame_send(). */
+static uint32_t echo_send_cycles;
+
+static void
+reply_start(uint8_t cmd)
+{
+	reply[0] = cmd;
+	reply_len = 1;
+}
+
+static void
+reply_u32(uint32_t value)
+{
+	memcpy(&reply[reply_len], &value, sizeof value);
+	reply_len += sizeof value;
+}
+
+static void
+reply_send(void)
+{
+	uart_frame_send(&framer, reply, reply_len);
+}
+
+static uint32_t
+request_u32(const UartFrame* req, uint32_t index)
+{
+	uint32_t value = 0;
+	uint32_t offs = 1 + index * sizeof value;
+
+	if (offs + sizeof value <= req->len)
+		memcpy(&value, &req->data[offs], sizeof value);
+	return (value);
+}
+
+static void
+bench_info(void)
+{
+	UartBaud baud;
+
+	uart_get_baud(console, &baud);
+
+	reply_start(BENCH_INFO);
+	reply_u32(rcc_ahb_frequency);
+	reply_u32(baud.actual);
+	reply_u32(UART_TX_MODE);
+	reply_u32(UART_RX_MODE);
+	reply_u32(UART_TX_RING_SIZE);
+	reply_u32(UART_RX_RING_SIZE);
+	reply_u32(UART_FRAME_MAX);
+	reply_send();
+}
+
+static void
+bench_echo(const UartFrame* req)
+{
+	uint32_t len = req->len - 1;
+	uint32_t start;
+
+	if (len > sizeof reply - 1 - sizeof echo_send_cycles)
+		len = sizeof reply - 1 - sizeof echo_send_cycles;
+
+	reply_start(BENCH_ECHO);
+	reply_u32(echo_send_cycles);
+	memcpy(&reply[reply_len], &req->data[1], len);
+	reply_len += len;
+
+	start = dwt_read_cycle_counter();
+	reply_send();
+	echo_send_cycles = dwt_read_cycle_counter() - start;
+}
+
+/**
+ * Receives 'count' raw pattern bytes, timing them from the first span to
+ * the last. The host only starts sending once the ready reply is in.
+ */
+static void
+bench_sink(uint32_t count)
+{
+	UartStats before, after;
+	uint32_t received = 0, first = 0, mismatches = 0;
+	uint32_t start = 0, end = 0;
+	uint8_t expect = 1;
+
+	uart_get_stats(console, &before);
+	reply_start(BENCH_SINK);
+	reply_send();
+
+	while (received < count) {
+		const uint8_t* span;
+		uint32_t n = uart_read_span(console, &span, BENCH_SINK_IDLE);
+
+		if (n == 0)
+			break;
+		if (received == 0) {
+			start = dwt_read_cycle_counter();
+			first = n;
+		}
+
+		for (uint32_t x = 0; x < n; ++x) {
+			if (span[x] != expect)
+				++mismatches;
+			expect = expect == BENCH_PATTERN ? 1 : expect + 1;
+		}
+
+		received += n;
+		uart_read_consume(console, n);
+		end = dwt_read_cycle_counter();
+	}
+
+	uart_get_stats(console, &after);
+
+	reply_start(BENCH_SINK);
+	reply_u32(received);
+	reply_u32(end - start);
+	reply_u32(first);
+	reply_u32(mismatches);
+	reply_u32(after.rx_dropped - before.rx_dropped);
+	reply_u32(after.rx_overruns - before.rx_overruns);
+	reply_send();
+}
+
+/**
+ * Sends 'count' raw pattern bytes in writes of 'chunk', copied or in
+ * place, and times them until the last stop bit has left.
+ */
+static void
+bench_source(uint32_t count, uint32_t chunk, bool copy)
+{
+	static const uint8_t delimiter = 0;
+	uint32_t sent = 0;
+	uint32_t start;
+
+	if (chunk == 0 || chunk > BENCH_CHUNK_MAX)
+		chunk = BENCH_CHUNK_MAX;
+
+	start = dwt_read_cycle_counter();
+	while (sent < count) {
+		uint32_t n = count - sent < chunk ? count - sent : chunk;
+		const uint8_t* data = &pattern[sent % BENCH_PATTERN];
+
+		if (copy)
+			uart_write(console, data, n);
+		else
+			uart_write_static(console, data, n);
+		sent += n;
+	}
+	uart_flush(console);
+
+	reply_start(BENCH_SOURCE);
+	reply_u32(dwt_read_cycle_counter() - start);
+	reply_u32(sent);
+	uart_write_static(console, &delimiter, 1);
+	reply_send();
+}
+
+static void
+bench_baud(uint32_t rate)
+{
+	UartBaud baud;
+	bool ok = uart_baud_calc(rcc_apb2_frequency, rate, &baud);
+
+	reply_start(BENCH_BAUD);
+	reply_u32(ok);
+	reply_u32(baud.actual);
+	reply_u32(baud.error_ppm);
+	reply_send();
+
+	if (ok)
+		uart_set_baud(console, rate, NULL);	// Flushes the reply first.
+}
+
+static void
+bench_stats(void)
+{
+	UartStats st;
+
+	uart_get_stats(console, &st);
+
+	reply_start(BENCH_STATS);
+	reply_u32(sizeof st / sizeof(uint32_t));
+	memcpy(&reply[reply_len], &st, sizeof st);
+	reply_len += sizeof st;
+	memcpy(&reply[reply_len], &framer.stats, sizeof framer.stats);
+	reply_len += sizeof framer.stats;
+	reply_send();
+}
+
+static void
+bench_request(const UartFrame* req)
+{
+	if (req->len == 0)
+		return;
+
+	switch (req->data[0]) {
+	case BENCH_INFO:
+		bench_info();
+		break;
+	case BENCH_ECHO:
+		bench_echo(req);
+		break;
+	case BENCH_SINK:
+		bench_sink(request_u32(req, 0));
+		break;
+	case BENCH_SOURCE:
+		bench_source(request_u32(req, 0), request_u32(req, 1), request_u32(req, 2) != 0);
+		break;
+	case BENCH_BAUD:
+		bench_baud(request_u32(req, 0));
+		break;
+	case BENCH_STATS:
+		bench_stats();
+		break;
+	}
+}
+
+static void
+task_bench(void* args __attribute((unused)))
+{
+	for (;;) {
+		UartFrame* req;
+
+		uart_frame_poll(&framer, portMAX_DELAY);
+		while ((req = uart_frame_receive(&framer, 0)) != NULL) {
+			bench_request(req);
+			uart_frame_free(&framer, req);
+		}
+	}
+}
+
+int
+main(void)
+{
+	rcc_clock_setup_pll(&rcc_hse_configs[RCC_CLOCK_HSE8_72MHZ]);
+
+	/* Keep the core clock, and with it the DWT cycle counter, running
+	 * while the idle task sleeps in WFI. */
+	DBGMCU_CR |= DBGMCU_CR_SLEEP;
+	dwt_enable_cycle_counter();
+
+	for (uint32_t x = 0; x < sizeof pattern; ++x)
+		pattern[x] = 1 + x % BENCH_PATTERN;
+
+	console = uart_init(UART_PORT1, &console_cfg);
+	uart_frame_init(&framer, console);
+
+	xTaskCreate(task_bench, "BENCH", 200, NULL, tskIDLE_PRIORITY + 1, NULL);
+
+	vTaskStartScheduler();
+
+	for (;;);
+
+	return (0);
+}
@@ -1,14 +1,27 @@
 #include "FreeRTOS.h"
 #include "task.h"
-#include "queue.h"
+#include "uart.h"
+#include "uart_frame.h"
+#include "ringbuf_bench.h"
+#include "runtime_stats.h"
 
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/gpio.h>
-#include <libopencm3/stm32/usart.h>
-#include <libopencm3/cm3/nvic.h>
-// #include <libopencm3/stm32/common/usart_common_all.h>
 
-static QueueHandle_t queue_TX, queue_RX;
+#define KEY_STATUS	0x14	// Ctrl-T, as in BSD's SIGINFO.
+#define KEY_BENCH	0x02	// Ctrl-B
+#define KEY_AUTOBAUD	0x01	// Ctrl-A
+#define KEY_FRAMES	0x06	// Ctrl-F
+
+#define AUTOBAUD_TIMEOUT	pdMS_TO_TICKS(10000)
+
+static const UartConfig console_cfg = {
+	.baud = UART_BAUD,
+	.flow_control = UART_FLOW_CONTROL,
+};
+
+static Uart* console;
+static UartFramer framer;
 
 static bool inline
 isLower(char ch)
@@ -39,7 +52,6 @@ init_clock(void)
 {
 	rcc_periph_clock_enable(RCC_GPIOA);
 	rcc_periph_clock_enable(RCC_GPIOC);
-	rcc_periph_clock_enable(RCC_USART1);
 }
 
 static void
@@ -55,84 +67,196 @@ init_LED(void)
 	gpio_set(GPIOC, GPIO13);
 }
 
+/**
+ * Blocking read of keystrokes.
+*/
+static char
+read_char(void)
+{
+	char ch = uart_getc(console);
+
+	gpio_toggle(GPIOC, GPIO13);
+	return ch;
+}
+
 static void
-init_uart(void)
+write_char(char ch)
 {
-	queue_TX = xQueueCreate(256, sizeof(char));
-	queue_RX = xQueueCreate(256, sizeof(char));
+	uart_putc(console, ch);
+}
 
-	nvic_enable_irq(NVIC_USART1_IRQ);
+/**
+ * Writes a string constant. It is queued in place, so it must not be a
+ * buffer that is about to change.
+ */
+static void
+write_string(const char* str)
+{
+	uart_puts_static(console, str);
+}
 
-	gpio_set_mode(
-		GPIOA,
-		GPIO_MODE_OUTPUT_50_MHZ,
-		GPIO_CNF_OUTPUT_ALTFN_PUSHPULL,
-		GPIO_USART1_TX
-	);
+static void
+write_number(uint32_t num)
+{
+	char buf[11];
+	char* p = &buf[sizeof buf - 1];
 
-	gpio_set_mode(
-		GPIOA,
-		GPIO_MODE_INPUT,
-		GPIO_CNF_INPUT_FLOAT,
-		GPIO_USART1_RX
-	);
+	*p = '\0';
+	do {
+		*--p = '0' + (num % 10);
+		num /= 10;
+	} while (num != 0);
 
-	usart_set_baudrate(USART1, 115200);
-	usart_set_databits(USART1, 8);
-	usart_set_stopbits(USART1, USART_STOPBITS_1);
-	usart_set_mode(USART1, USART_MODE_TX_RX);
-	usart_set_parity(USART1, USART_PARITY_NONE);
+	uart_puts(console, p);	// On the stack: must be copied.
+}
 
-	usart_enable_rx_interrupt(USART1);
-	usart_enable(USART1);
+/**
+ * Prints the share of time spent in the idle task since the last call,
+ * from the run-time stats counters.
+ */
+static void
+write_idle(void)
+{
+	static uint32_t last_idle, last_total;
+	uint32_t idle = ulTaskGetIdleRunTimeCounter();
+	uint32_t total = runtime_stats_counter();
+	uint32_t d_idle = idle - last_idle;
+	uint32_t d_total = total - last_total;
+
+	last_idle = idle;
+	last_total = total;
+
+	write_string("idle: ");
+	write_number(d_total ? (uint32_t)((uint64_t)d_idle * 100 / d_total) : 0);
+	write_string("%\n");
 }
 
-void
-USART1_IRQHandler(void)
+static void
+write_signed(int32_t num)
 {
-	char ch;
-	BaseType_t hpTask = pdFALSE;
+	if (num < 0) {
+		write_char('-');
+		num = -num;
+	}
+	write_number(num);
+}
 
-	while (((USART_SR(USART1) & USART_SR_RXNE) != 0)) {
-		ch = usart_recv(USART1);
+static void
+write_baud(const UartBaud* baud)
+{
+	write_string("baud: ");
+	write_number(baud->actual);
+	write_string(" error: ");
+	write_signed(baud->error_ppm);
+	write_string(" ppm\n");
+}
 
-		xQueueSendToBackFromISR(queue_RX, &ch, &hpTask);
-	}
+/**
+ * Re-synchronises to the terminal: the user switches it to the new rate
+ * and holds down 'U' until the prompt comes back.
+ */
+static void
+write_autobaud(void)
+{
+	UartBaud baud;
+
+	write_string("\nsend U at the new rate...\n");
+	if (uart_autobaud(console, AUTOBAUD_TIMEOUT, &baud))
+		write_baud(&baud);
+	else
+		write_string("no rate detected\n");
 }
 
 /**
- * Blocking read of keystrokes.
-*/
-static char
-read_char(void)
+ * Prints the driver counters, so the transmit and receive modes can be
+ * compared on the same traffic.
+ */
+static void
+write_status(void)
 {
-	char ch;
+	UartStats st;
+	UartBaud baud;
+
+	uart_get_stats(console, &st);
+	uart_get_baud(console, &baud);
+
+	write_string("\ntx bytes: ");
+	write_number(st.tx_bytes);
+	write_string(" cycles: ");
+	write_number(st.tx_cycles);
+	write_string(" cycles/byte: ");
+	write_number(st.tx_bytes ? st.tx_cycles / st.tx_bytes : 0);
+	write_string(" wakeups: ");
+	write_number(st.tx_wakeups);
+	write_string("\nrx bytes: ");
+	write_number(st.rx_bytes);
+	write_string(" irqs: ");
+	write_number(st.rx_irqs);
+	write_string(" dropped: ");
+	write_number(st.rx_dropped);
+	write_string(" overruns: ");
+	write_number(st.rx_overruns);
+	write_string(" throttled: ");
+	write_number(st.rx_throttled);
+	write_string("\nframes tx: ");
+	write_number(framer.stats.tx_frames);
+	write_string(" rx: ");
+	write_number(framer.stats.rx_frames);
+	write_string(" crc errors: ");
+	write_number(framer.stats.rx_crc_errors);
+	write_string(" dropped: ");
+	write_number(framer.stats.rx_oversize + framer.stats.rx_no_buffer);
+	write_string("\n");
+	write_baud(&baud);
+	write_idle();
+}
 
-	while (xQueueReceive(queue_RX, &ch, 0) != pdPASS)
-		taskYIELD();
-	
-	gpio_toggle(GPIOC, GPIO13);
-	return ch;
+static void
+write_per_byte(const char* name, uint32_t cycles, uint32_t bytes)
+{
+	write_string(name);
+	write_number(cycles / bytes);
+	write_string(" cycles/byte\n");
 }
 
+/** Runs the queue vs. ring buffer comparison and prints the results. */
 static void
-write_char(char ch)
+write_bench(void)
 {
-_again:
-	while (xQueueSend(queue_TX, &ch, 0) != pdPASS)
-		taskYIELD();
-	
-	if (ch == '\n') {
-		ch = '\r';
-		goto _again;
-	}
+	RingBenchResult res;
+
+	ringbuf_bench(4096, &res);
+
+	write_string("\n");
+	write_per_byte("queue per byte: ", res.queue_cycles, res.bytes);
+	write_per_byte("ring per byte:  ", res.ring_byte_cycles, res.bytes);
+	write_per_byte("ring per span:  ", res.ring_span_cycles, res.bytes);
 }
 
+/**
+ * Packet loopback: every frame received is sent back as it is, until an
+ * empty frame arrives.
+ */
 static void
-write_string(char* str)
+run_frames(void)
 {
-	while (*str != '\0')
-		write_char(*str++);
+	bool done = false;
+
+	write_string("\nframe mode, send an empty frame to leave\n");
+	uart_flush(console);
+
+	while (!done) {
+		UartFrame* frame;
+
+		uart_frame_poll(&framer, portMAX_DELAY);
+		while ((frame = uart_frame_receive(&framer, 0)) != NULL) {
+			if (frame->len == 0)
+				done = true;
+			else
+				uart_frame_send(&framer, frame->data, frame->len);
+			uart_frame_free(&framer, frame);
+		}
+	}
 }
 
 static void
@@ -146,6 +270,19 @@ task_main(void* args __attribute((unused)))
 
 		char ch = read_char();
 
+		if (ch == KEY_STATUS || ch == KEY_BENCH || ch == KEY_AUTOBAUD || ch == KEY_FRAMES) {
+			if (ch == KEY_STATUS)
+				write_status();
+			else if (ch == KEY_BENCH)
+				write_bench();
+			else if (ch == KEY_AUTOBAUD)
+				write_autobaud();
+			else
+				run_frames();
+			write_string(isOut ? ">> " : "<< ");
+			continue;
+		}
+
 		if (isOut) {
 			write_string("<< ");
 			isOut = false;
@@ -165,27 +302,9 @@ task_main(void* args __attribute((unused)))
 	}
 }
 
-static void
-task_transmit(void* args __attribute((unused)))
-{
-	char ch;
-
-	for (;;) {
-		while (xQueueReceive(queue_TX, &ch, portMAX_DELAY) != pdPASS)
-			taskYIELD();
-		
-		while (!usart_get_flag(USART1, USART_SR_TXE))
-			taskYIELD();
-
-		usart_send(USART1, ch);
-	}
-}
-
 static void
 task_blink(void* args __attribute((unused)))
 {
-	char ch;
-
 	for (;;) {
 		vTaskDelay(pdMS_TO_TICKS(2000));
 		gpio_toggle(GPIOC, GPIO13);
@@ -199,11 +318,11 @@ main(void)
 
 	init_clock();
 	init_LED();
-	init_uart();
+	console = uart_init(UART_PORT1, &console_cfg);
+	uart_frame_init(&framer, console);
 
-	xTaskCreate(task_main, "MAIN", 100, NULL, configMAX_PRIORITIES - 1, NULL);
-	xTaskCreate(task_transmit, "TRANSMIT", 100, NULL, configMAX_PRIORITIES - 1, NULL);
-	xTaskCreate(task_blink, "BLINK", 100, NULL, configMAX_PRIORITIES - 1, NULL);
+	xTaskCreate(task_main, "MAIN", 100, NULL, tskIDLE_PRIORITY + 1, NULL);
+	xTaskCreate(task_blink, "BLINK", 100, NULL, tskIDLE_PRIORITY + 1, NULL);
 
 	vTaskStartScheduler();
 	
@@ -0,0 +1,1079 @@
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "ringbuf.h"
+#include "uart.h"
+#include "uart_baud.h"
+
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/usart.h>
+#include <libopencm3/stm32/dma.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/dwt.h>
+
+#if (UART_TX_RING_SIZE & (UART_TX_RING_SIZE - 1)) != 0
+#error "UART_TX_RING_SIZE must be a power of two"
+#endif
+
+#if UART_RX_HIGH_WATERMARK + UART_RX_RTS_SLACK > UART_RX_RING_SIZE
+#error "UART_RX_HIGH_WATERMARK leaves no room for UART_RX_RTS_SLACK"
+#endif
+
+#if (UART_TX_DESC_COUNT & (UART_TX_DESC_COUNT - 1)) != 0
+#error "UART_TX_DESC_COUNT must be a power of two"
+#endif
+
+#if (UART_RX_RING_SIZE & (UART_RX_RING_SIZE - 1)) != 0
+#error "UART_RX_RING_SIZE must be a power of two"
+#endif
+
+/* CNDTR is 16 bits wide. */
+#define UART_TX_DMA_MAX		0xFFFF
+
+/* The USART and DMA interrupts must stay below
+ * configMAX_SYSCALL_INTERRUPT_PRIORITY to be allowed to call the FromISR
+ * API. */
+#define UART_IRQ_PRIORITY	(configMAX_SYSCALL_INTERRUPT_PRIORITY + 0x10)
+
+/* UART_TX_MODE_TASK: the same as the writers in main.c and bench_main.c. */
+#define UART_TASK_PRIORITY	(tskIDLE_PRIORITY + 1)
+
+/** Fixed wiring of one USART. */
+typedef struct {
+	uint32_t usart;
+	enum rcc_periph_clken rcc;
+	enum rcc_periph_clken gpio_rcc;
+	uint32_t gpio;			// Bank of all four pins.
+	uint16_t tx_pin;
+	uint16_t rx_pin;
+	uint16_t cts_pin;
+	uint16_t rts_pin;
+	uint8_t irq;
+	uint8_t tx_dma;			// DMA1 channel served by TXE.
+	uint8_t rx_dma;			// DMA1 channel served by RXNE.
+	uint8_t tx_dma_irq;
+	uint8_t rx_dma_irq;
+} UartHw;
+
+static const UartHw uart_hw[UART_PORT_COUNT] = {
+	[UART_PORT1] = {
+		USART1, RCC_USART1, RCC_GPIOA, GPIOA,
+		GPIO_USART1_TX, GPIO_USART1_RX, GPIO_USART1_CTS, GPIO_USART1_RTS,
+		NVIC_USART1_IRQ, DMA_CHANNEL4, DMA_CHANNEL5,
+		NVIC_DMA1_CHANNEL4_IRQ, NVIC_DMA1_CHANNEL5_IRQ
+	},
+	[UART_PORT2] = {
+		USART2, RCC_USART2, RCC_GPIOA, GPIOA,
+		GPIO_USART2_TX, GPIO_USART2_RX, GPIO_USART2_CTS, GPIO_USART2_RTS,
+		NVIC_USART2_IRQ, DMA_CHANNEL7, DMA_CHANNEL6,
+		NVIC_DMA1_CHANNEL7_IRQ, NVIC_DMA1_CHANNEL6_IRQ
+	},
+	[UART_PORT3] = {
+		USART3, RCC_USART3, RCC_GPIOB, GPIOB,
+		GPIO_USART3_TX, GPIO_USART3_RX, GPIO_USART3_CTS, GPIO_USART3_RTS,
+		NVIC_USART3_IRQ, DMA_CHANNEL2, DMA_CHANNEL3,
+		NVIC_DMA1_CHANNEL2_IRQ, NVIC_DMA1_CHANNEL3_IRQ
+	},
+};
+
+#if UART_TX_MODE == UART_TX_MODE_DMA
+/**
+ * One buffer queued for UART_TX_MODE_DMA. 'staged' is the number of TX ring
+ * bytes the descriptor covers, released when it completes; it is 0 for
+ * caller-owned buffers sent in place.
+ */
+typedef struct {
+	const uint8_t* data;
+	uint16_t len;
+	uint16_t staged;
+} UartTxDesc;
+#endif
+
+struct Uart {
+	const UartHw* hw;				// NULL until uart_init().
+	UartPortId id;
+	bool flow_control;
+	UartStats stats;
+	UartBaud baud;
+
+	/**
+	 * RX ring. In UART_RX_MODE_DMA its storage is the target of the RX DMA
+	 * channel in circular mode, and the HT, TC and IDLE interrupts commit
+	 * whatever the channel has stored since the last one.
+	 */
+	uint8_t rx_buf[UART_RX_RING_SIZE];
+	RingBuf rx_ring;
+
+	/* Consumer sleeping in uart_read_line(). Unlike a plain ring reader it
+	 * is only woken by a line terminator, or once 'line_need' bytes are
+	 * waiting. */
+	TaskHandle_t volatile line_reader;
+	volatile uint32_t line_need;
+	bool line_skip_lf;				// Last line ended in '\r': drop a following '\n'.
+
+	volatile bool rx_throttled;		// RTS deasserted.
+
+	/**
+	 * TX ring. In UART_TX_MODE_DMA it only stages data that has to be
+	 * copied, and is released in descriptor order.
+	 */
+	uint8_t tx_buf[UART_TX_RING_SIZE];
+	RingBuf tx_ring;
+
+#if UART_TX_MODE != UART_TX_MODE_TASK
+	/** Transmit state shared between the writer and the TX interrupts. */
+	struct {
+#if UART_TX_MODE == UART_TX_MODE_DMA
+		UartTxDesc desc[UART_TX_DESC_COUNT];
+		volatile uint32_t desc_head;	// Next free descriptor.
+		volatile uint32_t desc_tail;	// Descriptor on the DMA, or next to start.
+		volatile bool dma_active;
+		volatile TaskHandle_t writer;	// Writer waiting for a free descriptor.
+#endif
+		volatile TaskHandle_t flusher;	// Task waiting in uart_flush().
+		volatile bool busy;				// Set until TC reports the line idle.
+	} tx;
+#endif
+};
+
+static Uart ports[UART_PORT_COUNT];
+
+#if UART_TX_MODE == UART_TX_MODE_TASK
+/* The one task that moves TX bytes for every port. */
+static TaskHandle_t uart_task;
+#endif
+
+#if UART_TX_MODE != UART_TX_MODE_TASK
+/**
+ * Reports the end of the last stop bit to uart_flush(). TC is only armed
+ * once the transmit path has run dry.
+ */
+static void
+uart_tx_complete_isr(Uart* u, BaseType_t* hpTask)
+{
+	usart_disable_tx_complete_interrupt(u->hw->usart);
+
+#if UART_TX_MODE == UART_TX_MODE_IRQ
+	if (ringbuf_used(&u->tx_ring) != 0)
+		return;
+#else
+	if (u->tx.dma_active || u->tx.desc_head != u->tx.desc_tail)
+		return;
+#endif
+
+	u->tx.busy = false;
+	if (u->tx.flusher != NULL) {
+		vTaskNotifyGiveFromISR(u->tx.flusher, hpTask);
+		u->tx.flusher = NULL;
+	}
+}
+#endif
+
+#if UART_TX_MODE == UART_TX_MODE_DMA
+/** Hands the descriptor at 'desc_tail' to the TX DMA channel. */
+static void
+uart_tx_dma_start(Uart* u)
+{
+	const UartTxDesc* d = &u->tx.desc[u->tx.desc_tail & (UART_TX_DESC_COUNT - 1)];
+	uint8_t ch = u->hw->tx_dma;
+
+	if (!u->tx.dma_active)
+		USART_SR(u->hw->usart) = ~USART_SR_TC;	// Stale TC would end uart_flush() early.
+
+	dma_disable_channel(DMA1, ch);
+	dma_set_memory_address(DMA1, ch, (uint32_t)d->data);
+	dma_set_number_of_data(DMA1, ch, d->len);
+	dma_enable_channel(DMA1, ch);
+	u->tx.dma_active = true;
+}
+
+/**
+ * Retires the finished descriptor and immediately starts the next one, so
+ * queued buffers go out back-to-back with one interrupt per buffer.
+ */
+static void
+uart_tx_dma_isr(Uart* u)
+{
+	BaseType_t hpTask = pdFALSE;
+	uint32_t start = dwt_read_cycle_counter();
+	const UartTxDesc* d = &u->tx.desc[u->tx.desc_tail & (UART_TX_DESC_COUNT - 1)];
+
+	dma_clear_interrupt_flags(DMA1, u->hw->tx_dma, DMA_TCIF);
+
+	u->stats.tx_bytes += d->len;
+	if (d->staged != 0)
+		ringbuf_read_release(&u->tx_ring, d->staged);
+	u->tx.desc_tail += 1;
+
+	if (u->tx.desc_head != u->tx.desc_tail) {
+		uart_tx_dma_start(u);
+	} else {
+		u->tx.dma_active = false;
+		usart_enable_tx_complete_interrupt(u->hw->usart);
+	}
+
+	if (u->tx.writer != NULL) {
+		vTaskNotifyGiveFromISR(u->tx.writer, &hpTask);
+		u->tx.writer = NULL;
+		++u->stats.tx_wakeups;
+	}
+
+	u->stats.tx_cycles += dwt_read_cycle_counter() - start;
+	portYIELD_FROM_ISR(hpTask);
+}
+#endif
+
+/**
+ * Transmit side of the USART interrupt. On TXE the next byte from the ring
+ * is loaded; once the ring is empty TXE is masked and TC is armed so that
+ * the end of the last stop bit can be reported to uart_flush().
+ */
+#if UART_TX_MODE == UART_TX_MODE_IRQ
+static void
+uart_tx_isr(Uart* u, uint32_t sr, BaseType_t* hpTask)
+{
+	uint32_t usart = u->hw->usart;
+	uint32_t start = dwt_read_cycle_counter();
+
+	if ((sr & USART_SR_TXE) != 0 && (USART_CR1(usart) & USART_CR1_TXEIE) != 0) {
+		const uint8_t* data;
+
+		if (ringbuf_read_span(&u->tx_ring, &data) != 0) {
+			bool waiting = u->tx_ring.writer != NULL;
+
+			USART_DR(usart) = *data;
+			++u->stats.tx_bytes;
+			ringbuf_read_release(&u->tx_ring, 1);	// Wakes the writer at the low watermark.
+			if (waiting && u->tx_ring.writer == NULL)
+				++u->stats.tx_wakeups;
+		} else {
+			usart_disable_tx_interrupt(usart);
+			usart_enable_tx_complete_interrupt(usart);
+		}
+	}
+
+	/* Sample TC again: the DR write above clears it. */
+	if ((USART_CR1(usart) & USART_CR1_TCIE) != 0 && (USART_SR(usart) & USART_SR_TC) != 0)
+		uart_tx_complete_isr(u, hpTask);
+
+	u->stats.tx_cycles += dwt_read_cycle_counter() - start;
+}
+#endif
+
+/**
+ * Deasserts RTS once the RX ring reaches UART_RX_HIGH_WATERMARK. Called from
+ * the RX interrupts after committing data.
+ */
+static void
+uart_rx_throttle(Uart* u)
+{
+	if (u->flow_control && !u->rx_throttled
+		&& ringbuf_used(&u->rx_ring) >= UART_RX_HIGH_WATERMARK) {
+		gpio_set(u->hw->gpio, u->hw->rts_pin);	// Active low.
+		u->rx_throttled = true;
+		++u->stats.rx_throttled;
+	}
+}
+
+/**
+ * Frees 'len' bytes of the RX ring, and asserts RTS again if that drained
+ * it to UART_RX_LOW_WATERMARK. The critical section keeps the RX interrupt
+ * from throttling between the check and the pin write.
+ */
+static void
+uart_rx_release(Uart* u, uint32_t len)
+{
+	ringbuf_read_release(&u->rx_ring, len);
+
+	if (u->rx_throttled) {
+		taskENTER_CRITICAL();
+		if (u->rx_throttled && ringbuf_used(&u->rx_ring) <= UART_RX_LOW_WATERMARK) {
+			gpio_clear(u->hw->gpio, u->hw->rts_pin);
+			u->rx_throttled = false;
+		}
+		taskEXIT_CRITICAL();
+	}
+}
+
+/**
+ * Looks at 'n' bytes just committed at ring position 'from' and wakes a
+ * waiting uart_read_line() if they complete a line.
+ */
+static void
+uart_rx_line_check(Uart* u, uint32_t from, uint32_t n)
+{
+	TaskHandle_t task;
+	BaseType_t hpTask = pdFALSE;
+
+	if (u->line_reader == NULL)
+		return;
+
+	while (n-- > 0) {
+		uint8_t ch = u->rx_buf[from++ & (UART_RX_RING_SIZE - 1)];
+
+		if (ch == '\r' || ch == '\n')
+			break;
+	}
+	if (n == UINT32_MAX && ringbuf_used(&u->rx_ring) < u->line_need)
+		return;	// No terminator, and the line still fits.
+
+	task = __atomic_exchange_n(&u->line_reader, NULL, __ATOMIC_SEQ_CST);
+	if (task != NULL) {
+		vTaskNotifyGiveFromISR(task, &hpTask);
+		portYIELD_FROM_ISR(hpTask);
+	}
+}
+
+#if UART_RX_MODE == UART_RX_MODE_DMA
+/**
+ * Publishes whatever the DMA has stored since the last call. The amount is
+ * derived from CNDTR, so a burst costs one interrupt however long it is.
+ */
+static void
+uart_rx_dma_update(Uart* u)
+{
+	uint32_t pos = UART_RX_RING_SIZE - dma_get_number_of_data(DMA1, u->hw->rx_dma);
+	uint32_t n = (pos - u->rx_ring.head) & (UART_RX_RING_SIZE - 1);
+
+	++u->stats.rx_irqs;
+	if (n == 0)
+		return;
+
+	u->stats.rx_bytes += n;
+	ringbuf_write_commit(&u->rx_ring, n);
+	uart_rx_throttle(u);
+	uart_rx_line_check(u, u->rx_ring.head - n, n);
+}
+
+/** Half and full ring marks, so a stream without gaps is still published. */
+static void
+uart_rx_dma_isr(Uart* u)
+{
+	dma_clear_interrupt_flags(DMA1, u->hw->rx_dma, DMA_HTIF | DMA_TCIF);
+	uart_rx_dma_update(u);
+}
+#endif
+
+static void
+uart_isr(Uart* u)
+{
+	BaseType_t hpTask = pdFALSE;
+	uint32_t usart = u->hw->usart;
+	uint32_t sr __attribute__((unused)) = USART_SR(usart);
+
+#if UART_RX_MODE == UART_RX_MODE_IRQ
+	uint32_t rsr;
+	uint8_t ch;
+
+	while (((rsr = USART_SR(usart)) & USART_SR_RXNE) != 0) {
+		ch = usart_recv(usart);	// Also clears ORE.
+
+		if ((rsr & USART_SR_ORE) != 0)
+			++u->stats.rx_overruns;
+		if (ringbuf_write(&u->rx_ring, &ch, 1) == 0)
+			++u->stats.rx_dropped;
+		else
+			uart_rx_line_check(u, u->rx_ring.head - 1, 1);
+		++u->stats.rx_bytes;
+		++u->stats.rx_irqs;
+	}
+	uart_rx_throttle(u);
+#else
+	if ((sr & USART_SR_IDLE) != 0) {
+		(void)USART_DR(usart);	// SR then DR read clears IDLE, and ORE.
+		if ((sr & USART_SR_ORE) != 0)
+			++u->stats.rx_overruns;
+		uart_rx_dma_update(u);
+	}
+#endif
+
+#if UART_TX_MODE == UART_TX_MODE_IRQ
+	uart_tx_isr(u, sr, &hpTask);
+#elif UART_TX_MODE == UART_TX_MODE_DMA
+	if ((USART_CR1(usart) & USART_CR1_TCIE) != 0 && (sr & USART_SR_TC) != 0)
+		uart_tx_complete_isr(u, &hpTask);
+#endif
+
+	portYIELD_FROM_ISR(hpTask);
+}
+
+/* Vectors. Each one is only enabled once its port has been initialized. */
+
+void
+USART1_IRQHandler(void)
+{
+	uart_isr(&ports[UART_PORT1]);
+}
+
+void
+USART2_IRQHandler(void)
+{
+	uart_isr(&ports[UART_PORT2]);
+}
+
+void
+USART3_IRQHandler(void)
+{
+	uart_isr(&ports[UART_PORT3]);
+}
+
+#if UART_TX_MODE == UART_TX_MODE_DMA
+void
+DMA1_Channel4_IRQHandler(void)
+{
+	uart_tx_dma_isr(&ports[UART_PORT1]);
+}
+
+void
+DMA1_Channel7_IRQHandler(void)
+{
+	uart_tx_dma_isr(&ports[UART_PORT2]);
+}
+
+void
+DMA1_Channel2_IRQHandler(void)
+{
+	uart_tx_dma_isr(&ports[UART_PORT3]);
+}
+#endif
+
+/* Channel 6 is shared with TIM1_CH3, used by the baud rate detection. */
+void
+DMA1_Channel6_IRQHandler(void)
+{
+	if (uart_baud_detect_isr())
+		return;
+#if UART_RX_MODE == UART_RX_MODE_DMA
+	uart_rx_dma_isr(&ports[UART_PORT2]);
+#endif
+}
+
+#if UART_RX_MODE == UART_RX_MODE_DMA
+void
+DMA1_Channel5_IRQHandler(void)
+{
+	uart_rx_dma_isr(&ports[UART_PORT1]);
+}
+
+void
+DMA1_Channel3_IRQHandler(void)
+{
+	uart_rx_dma_isr(&ports[UART_PORT3]);
+}
+#endif
+
+#if UART_TX_MODE == UART_TX_MODE_TASK
+/**
+ * Legacy transmit path: one byte at a time from each TX ring, spin-yielding
+ * on TXE. One task serves every port; writers wake it with a notification
+ * bit per port. It runs at the writers' priority, so the yield hands the CPU
+ * to them in turn rather than straight back to itself. Only a notification
+ * counts as a wake-up, and cycles are only accounted while the task is
+ * actually running.
+ */
+static void
+task_uart(void* args __attribute((unused)))
+{
+	uint32_t woken = 0;
+
+	for (;;) {
+		bool pending = false;
+
+		for (uint32_t x = 0; x < UART_PORT_COUNT; ++x) {
+			Uart* u = &ports[x];
+			const uint8_t* data;
+			uint32_t start;
+
+			if (u->hw == NULL || ringbuf_read_span(&u->tx_ring, &data) == 0)
+				continue;
+
+			start = dwt_read_cycle_counter();
+			if ((woken & (1u << x)) != 0)
+				++u->stats.tx_wakeups;
+			if (usart_get_flag(u->hw->usart, USART_SR_TXE)) {
+				usart_send(u->hw->usart, *data);
+				ringbuf_read_release(&u->tx_ring, 1);
+				++u->stats.tx_bytes;
+			}
+			pending = true;
+			u->stats.tx_cycles += dwt_read_cycle_counter() - start;
+		}
+
+		woken = 0;
+		if (pending) {
+			taskYIELD();
+		} else {
+			xTaskNotifyWait(0, ~0u, &woken, portMAX_DELAY);
+		}
+	}
+}
+#endif
+
+/**
+ * Brings up port 'id' with the line settings in 'cfg' and returns its
+ * driver instance. Ports are independent and may be used from different
+ * tasks; each one has a single reader and a single writer.
+ */
+Uart*
+uart_init(UartPortId id, const UartConfig* cfg)
+{
+	Uart* u = &ports[id];
+	const UartHw* hw = &uart_hw[id];
+	uint32_t usart = hw->usart;
+
+	configASSERT(id < UART_PORT_COUNT && u->hw == NULL);
+
+	dwt_enable_cycle_counter();
+
+	u->hw = hw;
+	u->id = id;
+	u->flow_control = cfg->flow_control;
+	ringbuf_init(&u->rx_ring, u->rx_buf, sizeof u->rx_buf);
+	ringbuf_init(&u->tx_ring, u->tx_buf, sizeof u->tx_buf);
+
+	rcc_periph_clock_enable(hw->gpio_rcc);
+	rcc_periph_clock_enable(hw->rcc);
+
+	nvic_set_priority(hw->irq, UART_IRQ_PRIORITY);
+	nvic_enable_irq(hw->irq);
+
+	gpio_set_mode(
+		hw->gpio,
+		GPIO_MODE_OUTPUT_50_MHZ,
+		GPIO_CNF_OUTPUT_ALTFN_PUSHPULL,
+		hw->tx_pin
+	);
+
+	gpio_set_mode(
+		hw->gpio,
+		GPIO_MODE_INPUT,
+		GPIO_CNF_INPUT_FLOAT,
+		hw->rx_pin
+	);
+
+	if (!uart_baud_calc(rcc_get_usart_clk_freq(usart), cfg->baud, &u->baud))
+		configASSERT(0);	// The rate cannot be generated from this clock.
+	USART_BRR(usart) = u->baud.brr;
+	usart_set_databits(usart, 8);
+	usart_set_stopbits(usart, USART_STOPBITS_1);
+	usart_set_mode(usart, USART_MODE_TX_RX);
+	usart_set_parity(usart, USART_PARITY_NONE);
+
+	if (u->flow_control) {
+		gpio_clear(hw->gpio, hw->rts_pin);	// Ready to receive.
+		gpio_set_mode(
+			hw->gpio,
+			GPIO_MODE_OUTPUT_50_MHZ,
+			GPIO_CNF_OUTPUT_PUSHPULL,
+			hw->rts_pin
+		);
+
+		gpio_set_mode(
+			hw->gpio,
+			GPIO_MODE_INPUT,
+			GPIO_CNF_INPUT_FLOAT,
+			hw->cts_pin
+		);
+
+		usart_set_flow_control(usart, USART_FLOWCONTROL_CTS);
+	}
+
+#if UART_RX_MODE == UART_RX_MODE_IRQ
+	usart_enable_rx_interrupt(usart);
+#else
+	rcc_periph_clock_enable(RCC_DMA1);
+
+	dma_channel_reset(DMA1, hw->rx_dma);
+	dma_set_peripheral_address(DMA1, hw->rx_dma, (uint32_t)&USART_DR(usart));
+	dma_set_memory_address(DMA1, hw->rx_dma, (uint32_t)u->rx_buf);
+	dma_set_number_of_data(DMA1, hw->rx_dma, UART_RX_RING_SIZE);
+	dma_set_read_from_peripheral(DMA1, hw->rx_dma);
+	dma_enable_memory_increment_mode(DMA1, hw->rx_dma);
+	dma_set_peripheral_size(DMA1, hw->rx_dma, DMA_CCR_PSIZE_8BIT);
+	dma_set_memory_size(DMA1, hw->rx_dma, DMA_CCR_MSIZE_8BIT);
+	dma_set_priority(DMA1, hw->rx_dma, DMA_CCR_PL_HIGH);
+	dma_enable_circular_mode(DMA1, hw->rx_dma);
+	dma_enable_half_transfer_interrupt(DMA1, hw->rx_dma);
+	dma_enable_transfer_complete_interrupt(DMA1, hw->rx_dma);
+
+	nvic_set_priority(hw->rx_dma_irq, UART_IRQ_PRIORITY);
+	nvic_enable_irq(hw->rx_dma_irq);
+
+	dma_enable_channel(DMA1, hw->rx_dma);
+	usart_enable_rx_dma(usart);
+	usart_enable_idle_interrupt(usart);
+#endif
+
+#if UART_TX_MODE == UART_TX_MODE_DMA
+	rcc_periph_clock_enable(RCC_DMA1);
+
+	dma_channel_reset(DMA1, hw->tx_dma);
+	dma_set_peripheral_address(DMA1, hw->tx_dma, (uint32_t)&USART_DR(usart));
+	dma_set_read_from_memory(DMA1, hw->tx_dma);
+	dma_enable_memory_increment_mode(DMA1, hw->tx_dma);
+	dma_set_peripheral_size(DMA1, hw->tx_dma, DMA_CCR_PSIZE_8BIT);
+	dma_set_memory_size(DMA1, hw->tx_dma, DMA_CCR_MSIZE_8BIT);
+	dma_set_priority(DMA1, hw->tx_dma, DMA_CCR_PL_MEDIUM);
+	dma_enable_transfer_complete_interrupt(DMA1, hw->tx_dma);
+
+	nvic_set_priority(hw->tx_dma_irq, UART_IRQ_PRIORITY);
+	nvic_enable_irq(hw->tx_dma_irq);
+
+	usart_enable_tx_dma(usart);
+#endif
+	usart_enable(usart);
+
+#if UART_TX_MODE == UART_TX_MODE_TASK
+	if (uart_task == NULL)
+		xTaskCreate(task_uart, "UART", 100, NULL, UART_TASK_PRIORITY, &uart_task);
+#endif
+
+	return (u);
+}
+
+/**
+ * Returns the longest contiguous run of received bytes, waiting up to
+ * 'timeout' ticks for the first one. The bytes stay in the ring until
+ * released with uart_read_consume(). If the DMA has lapped the consumer,
+ * the overwritten bytes are skipped and counted as dropped.
+ */
+uint32_t
+uart_read_span(Uart* u, const uint8_t** data, TickType_t timeout)
+{
+	uint32_t len;
+
+	if (!ringbuf_wait_read(&u->rx_ring, 1, timeout))
+		return (0);
+
+	len = ringbuf_read_span(&u->rx_ring, data);
+#if UART_RX_MODE == UART_RX_MODE_DMA
+	u->stats.rx_dropped = u->rx_ring.overwritten;
+#endif
+	return (len);
+}
+
+/** Releases 'len' bytes returned by uart_read_span(). */
+void
+uart_read_consume(Uart* u, uint32_t len)
+{
+	uart_rx_release(u, len);
+}
+
+/**
+ * Reads up to 'len' bytes, sleeping up to 'timeout' ticks for the first
+ * one. Returns the number of bytes read, 0 on timeout.
+ */
+uint32_t
+uart_read(Uart* u, void* data, uint32_t len, TickType_t timeout)
+{
+	const uint8_t* span;
+
+	if (uart_read_span(u, &span, timeout) == 0)
+		return (0);
+
+	len = ringbuf_read(&u->rx_ring, data, len);
+	uart_rx_release(u, 0);
+	return (len);
+}
+
+/**
+ * Line-assembled read: sleeps until a whole line has arrived and copies it
+ * to 'line' without its terminator. The terminator is '\r', '\n' or "\r\n".
+ * A line longer than 'size' - 1 is returned in pieces. The caller is woken
+ * once per line, not once per byte.
+ *
+ * Returns the line length, or -1 if 'timeout' ticks passed first; a partial
+ * line then stays buffered for the next call.
+ */
+int32_t
+uart_read_line(Uart* u, char* line, uint32_t size, TickType_t timeout)
+{
+	TimeOut_t start;
+	uint32_t got = 0;	// Bytes already copied to 'line' and scanned.
+
+	configASSERT(size > 1);
+	vTaskSetTimeOutState(&start);
+
+	for (;;) {
+		uint32_t n = ringbuf_peek(&u->rx_ring, got, &line[got], size - 1 - got);
+
+		if (got == 0 && n > 0 && u->line_skip_lf) {
+			u->line_skip_lf = false;
+			if (line[0] == '\n') {
+				uart_rx_release(u, 1);
+				continue;
+			}
+		}
+
+		for (; n > 0; --n, ++got) {
+			if (line[got] == '\r' || line[got] == '\n') {
+				u->line_skip_lf = line[got] == '\r';
+				line[got] = '\0';
+				uart_rx_release(u, got + 1);
+				return (got);
+			}
+		}
+
+		if (got == size - 1) {
+			line[got] = '\0';
+			uart_rx_release(u, got);
+			return (got);
+		}
+
+		u->line_need = size - 1;
+		__atomic_store_n(&u->line_reader, xTaskGetCurrentTaskHandle(), __ATOMIC_SEQ_CST);
+		if (ringbuf_used(&u->rx_ring) == got) {
+			if (xTaskCheckForTimeOut(&start, &timeout) != pdFALSE) {
+				__atomic_store_n(&u->line_reader, NULL, __ATOMIC_SEQ_CST);
+				return (-1);
+			}
+			ulTaskNotifyTake(pdTRUE, timeout);
+		}
+		__atomic_store_n(&u->line_reader, NULL, __ATOMIC_SEQ_CST);
+	}
+}
+
+/**
+ * Blocking read of keystrokes.
+*/
+char
+uart_getc(Uart* u)
+{
+	const uint8_t* data;
+	char ch;
+
+	while (uart_read_span(u, &data, portMAX_DELAY) == 0)
+		;
+
+	ch = *data;
+	uart_read_consume(u, 1);
+	return ch;
+}
+
+#if UART_TX_MODE != UART_TX_MODE_DMA
+
+/** Gets the transmit path going after bytes were added to the TX ring. */
+static void
+uart_tx_kick(Uart* u)
+{
+#if UART_TX_MODE == UART_TX_MODE_IRQ
+	u->tx.busy = true;
+
+	/* TXEIE stays set while the ISR still has bytes to send, so it only
+	 * needs re-arming at the start of a burst. The ISR also modifies CR1,
+	 * hence the critical section around the read-modify-write. */
+	if ((USART_CR1(u->hw->usart) & USART_CR1_TXEIE) == 0) {
+		taskENTER_CRITICAL();
+		usart_enable_tx_interrupt(u->hw->usart);
+		taskEXIT_CRITICAL();
+	}
+#else
+	xTaskNotify(uart_task, 1u << u->id, eSetBits);
+#endif
+}
+
+/**
+ * Appends 'len' bytes to the TX ring. When the ring is full the caller
+ * sleeps until it has drained to UART_TX_LOW_WATERMARK, so a long write
+ * costs one wake-up per (UART_TX_RING_SIZE - UART_TX_LOW_WATERMARK) bytes.
+ * Only one task may write to a port at a time.
+ */
+static void
+uart_put_raw(Uart* u, const uint8_t* data, uint32_t len)
+{
+	while (len > 0) {
+		uint32_t n = ringbuf_write(&u->tx_ring, data, len);
+
+		if (n != 0)
+			uart_tx_kick(u);
+
+		data += n;
+		len -= n;
+		if (len > 0)
+			ringbuf_wait_write(&u->tx_ring, UART_TX_RING_SIZE - UART_TX_LOW_WATERMARK, portMAX_DELAY);
+	}
+}
+
+#else
+
+/**
+ * Queues 'len' bytes at 'data' for DMA. A buffer that directly follows the
+ * last descriptor not yet handed to the DMA is merged into it, so runs of
+ * small staged writes still go out as one transfer. Sleeps while all
+ * descriptors are in use.
+ */
+static void
+uart_tx_queue(Uart* u, const uint8_t* data, uint32_t len, uint32_t staged)
+{
+	UartTxDesc* last;
+
+	while ((u->tx.desc_head - u->tx.desc_tail) >= UART_TX_DESC_COUNT) {
+		u->tx.writer = xTaskGetCurrentTaskHandle();
+		if ((u->tx.desc_head - u->tx.desc_tail) < UART_TX_DESC_COUNT) {
+			u->tx.writer = NULL;
+			break;
+		}
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+	}
+
+	taskENTER_CRITICAL();
+
+	last = &u->tx.desc[(u->tx.desc_head - 1) & (UART_TX_DESC_COUNT - 1)];
+	if (u->tx.desc_head != u->tx.desc_tail
+		&& !(u->tx.dma_active && u->tx.desc_head - 1 == u->tx.desc_tail)
+		&& last->data + last->len == data
+		&& last->len + len <= UART_TX_DMA_MAX) {
+		last->len += len;
+		last->staged += staged;
+	} else {
+		UartTxDesc* d = &u->tx.desc[u->tx.desc_head & (UART_TX_DESC_COUNT - 1)];
+
+		d->data = data;
+		d->len = len;
+		d->staged = staged;
+		u->tx.desc_head += 1;
+	}
+
+	u->tx.busy = true;
+	if (!u->tx.dma_active)
+		uart_tx_dma_start(u);
+
+	taskEXIT_CRITICAL();
+}
+
+/**
+ * Copies a buffer of unknown lifetime into the TX ring and queues it. Only
+ * the wrap point of the ring splits it into two descriptors.
+ */
+static void
+uart_tx_stage(Uart* u, const uint8_t* data, uint32_t len)
+{
+	while (len > 0) {
+		uint8_t* span;
+		uint32_t n = ringbuf_write_span(&u->tx_ring, &span);
+
+		if (n == 0) {
+			ringbuf_wait_write(&u->tx_ring, UART_TX_RING_SIZE - UART_TX_LOW_WATERMARK, portMAX_DELAY);
+			continue;
+		}
+		if (n > len)
+			n = len;
+
+		memcpy(span, data, n);
+		ringbuf_write_commit(&u->tx_ring, n);
+		uart_tx_queue(u, span, n, n);
+
+		data += n;
+		len -= n;
+	}
+}
+
+#endif
+
+/**
+ * Sends 'len' bytes. With 'copy' false the buffer is sent in place and must
+ * stay untouched until it has gone out (flash constants, static tables).
+ */
+static void
+uart_tx_write(Uart* u, const uint8_t* data, uint32_t len, bool copy __attribute__((unused)))
+{
+#if UART_TX_MODE == UART_TX_MODE_DMA
+	while (len > 0) {
+		uint32_t n = len < UART_TX_DMA_MAX ? len : UART_TX_DMA_MAX;
+
+		if (copy)
+			uart_tx_stage(u, data, n);
+		else
+			uart_tx_queue(u, data, n, 0);
+
+		data += n;
+		len -= n;
+	}
+#else
+	uart_put_raw(u, data, len);
+#endif
+}
+
+/**
+ * Sends a string, translating each '\n' into "\n\r". The text is cut at the
+ * newlines and the '\r' comes from flash, so with 'copy' false a whole
+ * string costs one descriptor per line.
+ */
+static void
+uart_tx_text(Uart* u, const char* str, bool copy)
+{
+	static const uint8_t cr = '\r';
+
+	while (*str != '\0') {
+		const char* end = str;
+
+		while (*end != '\0' && *end != '\n')
+			++end;
+		if (*end == '\n')
+			++end;
+
+		uart_tx_write(u, (const uint8_t*)str, end - str, copy);
+		if (end[-1] == '\n')
+			uart_tx_write(u, &cr, 1, false);
+
+		str = end;
+	}
+}
+
+void
+uart_putc(Uart* u, char ch)
+{
+	char str[2] = { ch, '\0' };
+
+	uart_tx_text(u, str, true);
+}
+
+void
+uart_puts(Uart* u, const char* str)
+{
+	uart_tx_text(u, str, true);
+}
+
+/**
+ * As uart_puts(), but without copying: 'str' must outlive the transfer,
+ * which string literals do.
+ */
+void
+uart_puts_static(Uart* u, const char* str)
+{
+	uart_tx_text(u, str, false);
+}
+
+/** Sends 'len' raw bytes, copying them first. */
+void
+uart_write(Uart* u, const void* data, uint32_t len)
+{
+	uart_tx_write(u, data, len, true);
+}
+
+/** Sends 'len' raw bytes in place; 'data' must outlive the transfer. */
+void
+uart_write_static(Uart* u, const void* data, uint32_t len)
+{
+	uart_tx_write(u, data, len, false);
+}
+
+/**
+ * Returns the longest contiguous free run of the TX ring, sleeping while the
+ * ring is full. Output built there is sent in place by uart_write_commit(),
+ * so a producer that formats or encodes its data never copies it again.
+ */
+uint32_t
+uart_write_span(Uart* u, uint8_t** span)
+{
+	uint32_t len;
+
+	while ((len = ringbuf_write_span(&u->tx_ring, span)) == 0)
+		ringbuf_wait_write(&u->tx_ring, UART_TX_RING_SIZE - UART_TX_LOW_WATERMARK, portMAX_DELAY);
+	return (len);
+}
+
+/** Sends the first 'len' bytes of the span returned by uart_write_span(). */
+void
+uart_write_commit(Uart* u, uint32_t len)
+{
+	uint8_t* span;
+
+	if (len == 0)
+		return;
+
+	ringbuf_write_span(&u->tx_ring, &span);
+	ringbuf_write_commit(&u->tx_ring, len);
+#if UART_TX_MODE == UART_TX_MODE_DMA
+	uart_tx_queue(u, span, len, len);
+#else
+	(void)span;
+	uart_tx_kick(u);
+#endif
+}
+
+/**
+ * Waits until every queued byte, including the final stop bit, has left
+ * the shift register.
+ */
+void
+uart_flush(Uart* u)
+{
+#if UART_TX_MODE == UART_TX_MODE_TASK
+	while (ringbuf_used(&u->tx_ring) != 0 || !usart_get_flag(u->hw->usart, USART_SR_TC))
+		taskYIELD();
+#else
+	u->tx.flusher = xTaskGetCurrentTaskHandle();
+	while (u->tx.busy)
+		ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(10));
+	u->tx.flusher = NULL;
+#endif
+}
+
+/**
+ * Switches to 'baud' once everything queued has been sent. Returns false,
+ * leaving the rate unchanged, if it is out of range or too far off; 'res',
+ * if not NULL, receives the divisor and error either way.
+ */
+bool
+uart_set_baud(Uart* u, uint32_t baud, UartBaud* res)
+{
+	UartBaud cfg;
+	bool ok = uart_baud_calc(rcc_get_usart_clk_freq(u->hw->usart), baud, &cfg);
+
+	if (res != NULL)
+		*res = cfg;
+	if (!ok)
+		return (false);
+
+	uart_flush(u);
+	USART_BRR(u->hw->usart) = cfg.brr;
+	u->baud = cfg;
+	return (true);
+}
+
+/** The rate in use, with its divisor and error. */
+void
+uart_get_baud(Uart* u, UartBaud* res)
+{
+	*res = u->baud;
+}
+
+/**
+ * Waits up to 'timeout' ticks for the remote end to send a stream of 'U'
+ * characters, then switches to the rate measured. Whatever was received
+ * at the old rate is discarded, so only the consumer task may call this.
+ *
+ * Only USART1 has its RX pin on a timer channel, and the capture DMA is the
+ * channel USART2 receives on: this fails on other ports, and while USART2
+ * is running with UART_RX_MODE_DMA.
+ */
+bool
+uart_autobaud(Uart* u, TickType_t timeout, UartBaud* res)
+{
+	const uint8_t* span;
+	uint32_t baud, n;
+
+	if (u->id != UART_PORT1)
+		return (false);
+	if (UART_RX_MODE == UART_RX_MODE_DMA && ports[UART_PORT2].hw != NULL)
+		return (false);
+
+	baud = uart_baud_detect(timeout);
+	if (baud == 0 || !uart_set_baud(u, baud, res))
+		return (false);
+
+	while ((n = uart_read_span(u, &span, 0)) != 0)
+		uart_read_consume(u, n);
+	return (true);
+}
+
+void
+uart_get_stats(Uart* u, UartStats* out)
+{
+	taskENTER_CRITICAL();
+	*out = u->stats;
+	taskEXIT_CRITICAL();
+}
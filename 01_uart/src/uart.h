@@ -0,0 +1,140 @@
+#ifndef UART_H
+#define UART_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "FreeRTOS.h"
+#include "uart_baud.h"
+
+/* Transmit path selection. */
+#define UART_TX_MODE_TASK	0	/* Shared UART task polls TXE of every port. */
+#define UART_TX_MODE_IRQ	1	/* USARTn_IRQHandler drains the TX ring on TXE/TC. */
+#define UART_TX_MODE_DMA	2	/* TX DMA channel sends a chain of buffer descriptors. */
+
+#ifndef UART_TX_MODE
+#define UART_TX_MODE		UART_TX_MODE_DMA
+#endif
+
+/* Receive path selection. */
+#define UART_RX_MODE_IRQ	0	/* RXNE interrupt pushes every byte into the RX ring. */
+#define UART_RX_MODE_DMA	1	/* RX DMA channel fills a circular ring, HT/TC/IDLE publish it. */
+
+#ifndef UART_RX_MODE
+#define UART_RX_MODE		UART_RX_MODE_DMA
+#endif
+
+/* Rate of the console port. USART1 reaches APB2 / 16 (4.5 Mbaud at 72 MHz),
+ * USART2 and USART3 APB1 / 16. At multi-megabaud rates use
+ * UART_RX_MODE_DMA: one interrupt per byte does not keep up. */
+#ifndef UART_BAUD
+#define UART_BAUD			115200
+#endif
+
+/* Size of the TX ring in bytes. Must be a power of two. */
+#ifndef UART_TX_RING_SIZE
+#define UART_TX_RING_SIZE	256
+#endif
+
+/* A writer blocked on a full TX ring is woken once the ring drains down to
+ * this many bytes, rather than after every byte. */
+#ifndef UART_TX_LOW_WATERMARK
+#define UART_TX_LOW_WATERMARK	(UART_TX_RING_SIZE / 4)
+#endif
+
+/* Number of buffers that can be queued for UART_TX_MODE_DMA. Must be a
+ * power of two. */
+#ifndef UART_TX_DESC_COUNT
+#define UART_TX_DESC_COUNT	16
+#endif
+
+/* Size of the circular DMA RX ring in bytes. Must be a power of two. */
+#ifndef UART_RX_RING_SIZE
+#define UART_RX_RING_SIZE	256
+#endif
+
+/* RTS/CTS flow control on the console port. See UartConfig. */
+#ifndef UART_FLOW_CONTROL
+#define UART_FLOW_CONTROL	0
+#endif
+
+/* Bytes the remote end may still send after RTS is deasserted. */
+#ifndef UART_RX_RTS_SLACK
+#define UART_RX_RTS_SLACK	16
+#endif
+
+/* RTS is deasserted once the RX ring holds this many bytes. In DMA mode the
+ * level is only seen at the half and full ring marks and at idle line, so
+ * half a ring must still fit on top of it. */
+#ifndef UART_RX_HIGH_WATERMARK
+#if UART_RX_MODE == UART_RX_MODE_DMA
+#define UART_RX_HIGH_WATERMARK	(UART_RX_RING_SIZE / 2 - UART_RX_RTS_SLACK)
+#else
+#define UART_RX_HIGH_WATERMARK	(UART_RX_RING_SIZE - UART_RX_RTS_SLACK)
+#endif
+#endif
+
+/* RTS is asserted again once the consumer has drained the ring to this. */
+#ifndef UART_RX_LOW_WATERMARK
+#define UART_RX_LOW_WATERMARK	(UART_RX_HIGH_WATERMARK / 2)
+#endif
+
+/**
+ * Counters used to compare the cost of the TX and RX paths. 'tx_cycles' is
+ * the number of DWT cycles spent inside the transmit path (the ISR body, or
+ * the running portions of the UART task), 'tx_wakeups' is how many times
+ * a task had to be scheduled to move the data.
+ */
+typedef struct {
+	uint32_t tx_bytes;
+	uint32_t tx_cycles;
+	uint32_t tx_wakeups;
+	uint32_t rx_bytes;
+	uint32_t rx_irqs;		// Interrupts taken to receive 'rx_bytes'.
+	uint32_t rx_dropped;	// Bytes overwritten before the consumer read them.
+	uint32_t rx_overruns;	// USART overrun errors (per burst in DMA mode).
+	uint32_t rx_throttled;	// Times RTS was deasserted.
+} UartStats;
+
+/* Ports that can run at the same time. Pins are the default (unremapped)
+ * ones; the DMA channels are fixed by the F1. */
+typedef enum {
+	UART_PORT1,		/* USART1: TX PA9, RX PA10, CTS PA11, RTS PA12, DMA1 4/5. */
+	UART_PORT2,		/* USART2: TX PA2, RX PA3, CTS PA0, RTS PA1, DMA1 7/6. */
+	UART_PORT3,		/* USART3: TX PB10, RX PB11, CTS PB13, RTS PB14, DMA1 2/3. */
+	UART_PORT_COUNT
+} UartPortId;
+
+/**
+ * Line settings for uart_init(). With 'flow_control', CTS holds back the
+ * transmitter in hardware and RTS is driven by the driver from the RX ring
+ * level, since the USART's own RTS only covers its single data register.
+ */
+typedef struct {
+	uint32_t baud;
+	bool flow_control;
+} UartConfig;
+
+/* One driver instance per port, holding its rings, DMA state and stats. */
+typedef struct Uart Uart;
+
+Uart* uart_init(UartPortId id, const UartConfig* cfg);
+void uart_putc(Uart* u, char ch);
+void uart_puts(Uart* u, const char* str);
+void uart_puts_static(Uart* u, const char* str);
+void uart_write(Uart* u, const void* data, uint32_t len);
+void uart_write_static(Uart* u, const void* data, uint32_t len);
+uint32_t uart_write_span(Uart* u, uint8_t** span);
+void uart_write_commit(Uart* u, uint32_t len);
+char uart_getc(Uart* u);
+uint32_t uart_read_span(Uart* u, const uint8_t** data, TickType_t timeout);
+void uart_read_consume(Uart* u, uint32_t len);
+uint32_t uart_read(Uart* u, void* data, uint32_t len, TickType_t timeout);
+int32_t uart_read_line(Uart* u, char* line, uint32_t size, TickType_t timeout);
+void uart_flush(Uart* u);
+bool uart_set_baud(Uart* u, uint32_t baud, UartBaud* res);
+void uart_get_baud(Uart* u, UartBaud* res);
+bool uart_autobaud(Uart* u, TickType_t timeout, UartBaud* res);
+void uart_get_stats(Uart* u, UartStats* stats);
+
+#endif // !UART_H
@@ -0,0 +1,202 @@
+#include <stdlib.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "uart_baud.h"
+
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/timer.h>
+#include <libopencm3/stm32/dma.h>
+#include <libopencm3/cm3/nvic.h>
+
+/* USART1_RX on PA10 is also TIM1_CH3, whose capture requests are served by
+ * DMA1 channel 6. */
+#define DETECT_TIMER		TIM1
+#define DETECT_DMA_CHANNEL	DMA_CHANNEL6
+#define DETECT_IRQ_PRIORITY	(configMAX_SYSCALL_INTERRUPT_PRIORITY + 0x10)
+
+/* Falling edges captured per attempt. In a stream of 0x55 ('U') characters
+ * every falling edge is two bit times after the previous one, start bits
+ * included, so any five consecutive edges span eight bit times. */
+#define DETECT_EDGES		5
+
+static volatile uint16_t captures[DETECT_EDGES];
+static TaskHandle_t volatile detector;
+static volatile bool detecting;
+
+/**
+ * Computes the USART_BRR divisor for 'baud' from the peripheral 'clock' and
+ * the error it leaves. Returns false if 'baud' is out of range (above
+ * clock / 16 or below clock / 65535) or the error exceeds
+ * UART_BAUD_MAX_ERROR_PPM; 'res' is filled in anyway when a divisor exists.
+ */
+bool
+uart_baud_calc(uint32_t clock, uint32_t baud, UartBaud* res)
+{
+	uint32_t brr;
+	int64_t real;
+
+	res->baud = baud;
+	res->actual = 0;
+	res->error_ppm = 0;
+	res->brr = 0;
+
+	if (baud == 0 || baud > clock / 16)
+		return (false);
+
+	brr = (clock + baud / 2) / baud;
+	if (brr > 0xFFFF)
+		return (false);
+
+	real = (int64_t)brr * baud;
+	res->brr = brr;
+	res->actual = (clock + brr / 2) / brr;
+	res->error_ppm = (int32_t)(((int64_t)clock - real) * 1000000 / real);
+
+	return (abs(res->error_ppm) <= UART_BAUD_MAX_ERROR_PPM);
+}
+
+/**
+ * DMA1 channel 6 interrupt while a detection is running. The channel also
+ * serves USART2 RX, so the vector lives in the UART driver, which calls this
+ * first. Returns false if the interrupt is not ours.
+ */
+bool
+uart_baud_detect_isr(void)
+{
+	BaseType_t hpTask = pdFALSE;
+	TaskHandle_t task;
+
+	if (!detecting)
+		return (false);
+
+	dma_clear_interrupt_flags(DMA1, DETECT_DMA_CHANNEL, DMA_TCIF);
+
+	task = __atomic_exchange_n(&detector, NULL, __ATOMIC_SEQ_CST);
+	if (task != NULL)
+		vTaskNotifyGiveFromISR(task, &hpTask);
+
+	portYIELD_FROM_ISR(hpTask);
+	return (true);
+}
+
+/** Arms the DMA channel for the next DETECT_EDGES captures. */
+static void
+detect_arm(void)
+{
+	dma_disable_channel(DMA1, DETECT_DMA_CHANNEL);
+	dma_clear_interrupt_flags(DMA1, DETECT_DMA_CHANNEL, DMA_TCIF);
+	dma_set_memory_address(DMA1, DETECT_DMA_CHANNEL, (uint32_t)captures);
+	dma_set_number_of_data(DMA1, DETECT_DMA_CHANNEL, DETECT_EDGES);
+
+	__atomic_store_n(&detector, xTaskGetCurrentTaskHandle(), __ATOMIC_SEQ_CST);
+	dma_enable_channel(DMA1, DETECT_DMA_CHANNEL);
+}
+
+static void
+detect_start(void)
+{
+	detecting = true;
+
+	rcc_periph_clock_enable(RCC_DMA1);
+	rcc_periph_clock_enable(RCC_TIM1);
+	rcc_periph_reset_pulse(RST_TIM1);
+
+	/* Free running at the full timer clock, capturing falling edges. The
+	 * CC3P bit selects the falling edge when the channel is an input. */
+	timer_set_prescaler(DETECT_TIMER, 0);
+	timer_set_period(DETECT_TIMER, 0xFFFF);
+	timer_ic_set_input(DETECT_TIMER, TIM_IC3, TIM_IC_IN_TI3);
+	timer_ic_set_filter(DETECT_TIMER, TIM_IC3, TIM_IC_CK_INT_N_2);
+	timer_ic_set_prescaler(DETECT_TIMER, TIM_IC3, TIM_IC_PSC_OFF);
+	TIM_CCER(DETECT_TIMER) |= TIM_CCER_CC3P;
+	timer_ic_enable(DETECT_TIMER, TIM_IC3);
+	timer_enable_irq(DETECT_TIMER, TIM_DIER_CC3DE);
+
+	dma_channel_reset(DMA1, DETECT_DMA_CHANNEL);
+	dma_set_peripheral_address(DMA1, DETECT_DMA_CHANNEL, (uint32_t)&TIM_CCR3(DETECT_TIMER));
+	dma_set_read_from_peripheral(DMA1, DETECT_DMA_CHANNEL);
+	dma_enable_memory_increment_mode(DMA1, DETECT_DMA_CHANNEL);
+	dma_set_peripheral_size(DMA1, DETECT_DMA_CHANNEL, DMA_CCR_PSIZE_16BIT);
+	dma_set_memory_size(DMA1, DETECT_DMA_CHANNEL, DMA_CCR_MSIZE_16BIT);
+	dma_set_priority(DMA1, DETECT_DMA_CHANNEL, DMA_CCR_PL_VERY_HIGH);
+	dma_enable_transfer_complete_interrupt(DMA1, DETECT_DMA_CHANNEL);
+
+	nvic_set_priority(NVIC_DMA1_CHANNEL6_IRQ, DETECT_IRQ_PRIORITY);
+	nvic_enable_irq(NVIC_DMA1_CHANNEL6_IRQ);
+
+	timer_enable_counter(DETECT_TIMER);
+}
+
+static void
+detect_stop(void)
+{
+	__atomic_store_n(&detector, NULL, __ATOMIC_SEQ_CST);
+
+	nvic_disable_irq(NVIC_DMA1_CHANNEL6_IRQ);
+	dma_disable_channel(DMA1, DETECT_DMA_CHANNEL);
+	timer_disable_counter(DETECT_TIMER);
+	rcc_periph_clock_disable(RCC_TIM1);
+	detecting = false;
+}
+
+/**
+ * Checks that the captured edges are evenly spaced and converts them to a
+ * baud rate. Returns 0 if they do not come from a 0x55 stream.
+ */
+static uint32_t
+detect_eval(uint32_t clock)
+{
+	uint16_t gap[DETECT_EDGES - 1];
+	uint32_t span = 0;
+
+	for (uint32_t x = 0; x < DETECT_EDGES - 1; ++x) {
+		gap[x] = captures[x + 1] - captures[x];
+		span += gap[x];
+	}
+
+	/* Each gap is two bit times, within 1/8 of the average. */
+	for (uint32_t x = 0; x < DETECT_EDGES - 1; ++x) {
+		uint32_t scaled = gap[x] * (DETECT_EDGES - 1);
+
+		if (scaled + span / 8 < span || scaled > span + span / 8)
+			return (0);
+	}
+
+	if (span < 8 * 16 || span > 0xFFFF)
+		return (0);	// Above clock / 16, or may have wrapped.
+
+	return ((clock * 8 + span / 2) / span);
+}
+
+/**
+ * Measures the baud rate of a remote end sending a stream of 'U' (0x55)
+ * characters on RX, using TIM1 channel 3 input capture fed to DMA so that
+ * multi-megabaud edges need no interrupt per edge. Rates from
+ * UART_BAUD_DETECT_MIN up to the timer clock / 16 are measured.
+ *
+ * Returns the measured rate, or 0 if no valid pattern was seen within
+ * 'timeout' ticks. The USART itself is left untouched.
+ */
+uint32_t
+uart_baud_detect(TickType_t timeout)
+{
+	uint32_t clock = rcc_apb2_frequency;	// TIM1 sees PCLK2 with an APB2 prescaler of 1.
+	uint32_t baud = 0;
+	TimeOut_t start;
+
+	vTaskSetTimeOutState(&start);
+	detect_start();
+
+	while (baud == 0) {
+		detect_arm();
+		if (ulTaskNotifyTake(pdTRUE, timeout) == 0)
+			break;
+		baud = detect_eval(clock);
+		if (xTaskCheckForTimeOut(&start, &timeout) != pdFALSE)
+			break;
+	}
+
+	detect_stop();
+	return (baud);
+}
@@ -0,0 +1,34 @@
+#ifndef UART_BAUD_H
+#define UART_BAUD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "FreeRTOS.h"
+
+/* Largest rate error accepted by uart_baud_calc(), in parts per million.
+ * With 16x oversampling the receiver tolerates about 3.75% over a frame;
+ * this leaves the other half of that to the remote end. */
+#ifndef UART_BAUD_MAX_ERROR_PPM
+#define UART_BAUD_MAX_ERROR_PPM	20000
+#endif
+
+/* Lowest rate uart_baud_detect() can measure: eight bit times must fit in
+ * the 16-bit capture timer running at 72 MHz. */
+#define UART_BAUD_DETECT_MIN	9600
+
+/**
+ * A divisor for a requested baud rate, and what it really gives.
+ */
+typedef struct {
+	uint32_t baud;		// Requested rate.
+	uint32_t actual;	// Rate produced by 'brr'.
+	int32_t error_ppm;	// (actual - baud) / baud, in parts per million.
+	uint16_t brr;		// Value for USART_BRR.
+} UartBaud;
+
+bool uart_baud_calc(uint32_t clock, uint32_t baud, UartBaud* res);
+uint32_t uart_baud_detect(TickType_t timeout);
+bool uart_baud_detect_isr(void);
+
+#endif // !UART_BAUD_H
@@ -0,0 +1,287 @@
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "queue.h"
+#include "semphr.h"
+#include "uart_frame.h"
+
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/crc.h>
+
+/* Frames end with a zero byte; COBS keeps zeros out of the frame body. */
+#define FRAME_DELIMITER		0x00
+
+/* Longest COBS block: a code byte of 0xFF and 254 data bytes. */
+#define FRAME_BLOCK_MAX		254
+
+/* The CRC unit has a single state, shared by every framer. */
+static SemaphoreHandle_t crc_lock;
+
+/**
+ * CRC-32 of 'data' on the CRC unit: polynomial 0x04C11DB7, initial value
+ * 0xFFFFFFFF, no reflection and no final XOR, fed 32-bit little-endian
+ * words with the last one zero-padded. A word-aligned buffer is fed to the
+ * unit as it is.
+ */
+static uint32_t
+frame_crc(const uint8_t* data, uint32_t len)
+{
+	uint32_t words = len / 4;
+	uint32_t crc, word;
+
+	xSemaphoreTake(crc_lock, portMAX_DELAY);
+	crc_reset();
+
+	if (((uintptr_t)data & 3) == 0) {
+		crc = crc_calculate_block((uint32_t*)data, words);
+	} else {
+		crc = CRC_DR;
+		for (uint32_t x = 0; x < words; ++x) {
+			memcpy(&word, &data[x * 4], 4);
+			crc = crc_calculate(word);
+		}
+	}
+
+	if ((len & 3) != 0) {
+		word = 0;
+		memcpy(&word, &data[words * 4], len & 3);
+		crc = crc_calculate(word);
+	}
+
+	xSemaphoreGive(crc_lock);
+	return (crc);
+}
+
+/** Sets up 'f' over port 'u'. The framer must stay allocated. */
+void
+uart_frame_init(UartFramer* f, Uart* u)
+{
+	memset(f, 0, sizeof *f);
+	f->uart = u;
+	f->ready = xQueueCreate(UART_FRAME_POOL, sizeof(UartFrame*));
+	f->empty = xQueueCreate(UART_FRAME_POOL, sizeof(UartFrame*));
+	configASSERT(f->ready != NULL && f->empty != NULL);
+
+	for (uint32_t x = 0; x < UART_FRAME_POOL; ++x) {
+		UartFrame* frame = &f->pool[x];
+
+		xQueueSend(f->empty, &frame, 0);
+	}
+
+	if (crc_lock == NULL) {
+		rcc_periph_clock_enable(RCC_CRC);
+		crc_lock = xSemaphoreCreateMutex();
+		configASSERT(crc_lock != NULL);
+	}
+}
+
+/* A frame being encoded straight into the TX ring. */
+typedef struct {
+	Uart* uart;
+	uint8_t* span;		// Free run of the TX ring being filled.
+	uint32_t size;		// Bytes in 'span'.
+	uint32_t used;		// Bytes of 'span' filled so far.
+} FrameOut;
+
+/** Appends 'len' bytes, sending each span of the ring once it is full. */
+static void
+frame_out(FrameOut* o, const uint8_t* data, uint32_t len)
+{
+	while (len > 0) {
+		uint32_t n;
+
+		if (o->used == o->size) {
+			uart_write_commit(o->uart, o->used);
+			o->size = uart_write_span(o->uart, &o->span);
+			o->used = 0;
+		}
+
+		n = o->size - o->used;
+		if (n > len)
+			n = len;
+		memcpy(&o->span[o->used], data, n);
+		o->used += n;
+		data += n;
+		len -= n;
+	}
+}
+
+/**
+ * Appends bytes [from, to) of the payload followed by its CRC, which the
+ * encoder sees as one stream.
+ */
+static void
+frame_put(FrameOut* o, const uint8_t* data, uint32_t len, const uint8_t* crc,
+	uint32_t from, uint32_t to)
+{
+	if (from < len) {
+		uint32_t n = (to < len ? to : len) - from;
+
+		frame_out(o, &data[from], n);
+		from += n;
+	}
+	if (from < to)
+		frame_out(o, &crc[from - len], to - from);
+}
+
+/**
+ * Sends 'len' bytes as one frame. The payload is COBS-encoded from 'data'
+ * directly into the TX ring, and the DMA sends the encoded frame from there
+ * in place: no staging copy is made on either side. Returns false if it is
+ * too long.
+ */
+bool
+uart_frame_send(UartFramer* f, const void* data, uint32_t len)
+{
+	static const uint8_t delimiter = FRAME_DELIMITER;
+	const uint8_t* src = data;
+	FrameOut out = { .uart = f->uart };
+	uint8_t crc[4];
+	uint32_t total = len + sizeof crc;
+	uint32_t start = 0;
+	uint32_t value;
+
+	if (len > UART_FRAME_MAX)
+		return (false);
+
+	value = frame_crc(src, len);
+	memcpy(crc, &value, sizeof crc);
+
+	for (;;) {
+		uint32_t end = start;
+		uint8_t code;
+
+		while (end < total && end - start < FRAME_BLOCK_MAX
+			&& (end < len ? src[end] : crc[end - len]) != 0)
+			++end;
+
+		code = end - start + 1;
+		frame_out(&out, &code, 1);
+		frame_put(&out, src, len, crc, start, end);
+
+		if (end == total)
+			break;
+		start = code == 0xFF ? end : end + 1;	// Skip the zero the code stands for.
+	}
+
+	frame_out(&out, &delimiter, 1);
+	uart_write_commit(f->uart, out.used);
+	++f->stats.tx_frames;
+	return (true);
+}
+
+/** Checks the frame being decoded and queues it, or recycles its buffer. */
+static void
+frame_end(UartFramer* f)
+{
+	UartFrame* frame = f->cur;
+
+	if (frame != NULL) {
+		uint32_t crc;
+
+		if (!f->discard && f->left == 0 && f->pos >= sizeof crc) {
+			frame->len = f->pos - sizeof crc;
+			memcpy(&crc, &frame->data[frame->len], sizeof crc);
+			if (frame_crc(frame->data, frame->len) == crc) {
+				++f->stats.rx_frames;
+				xQueueSend(f->ready, &frame, 0);
+				frame = NULL;
+			}
+		}
+		if (frame != NULL) {
+			if (!f->discard)
+				++f->stats.rx_crc_errors;
+			xQueueSend(f->empty, &frame, 0);
+		}
+	}
+
+	f->cur = NULL;
+	f->pos = 0;
+	f->left = 0;
+	f->zero_pending = false;
+	f->discard = false;
+}
+
+/** Stores one decoded byte, or gives up on a frame that has grown too long. */
+static void
+frame_store(UartFramer* f, uint8_t ch)
+{
+	if (f->pos < sizeof f->cur->data) {
+		f->cur->data[f->pos++] = ch;
+	} else {
+		f->discard = true;
+		++f->stats.rx_oversize;
+	}
+}
+
+/** Runs the COBS decoder over 'len' received bytes. */
+static void
+frame_decode(UartFramer* f, const uint8_t* data, uint32_t len)
+{
+	for (uint32_t x = 0; x < len; ++x) {
+		uint8_t ch = data[x];
+
+		if (ch == FRAME_DELIMITER) {
+			frame_end(f);
+			continue;
+		}
+		if (f->discard)
+			continue;
+
+		if (f->cur == NULL && xQueueReceive(f->empty, &f->cur, 0) != pdTRUE) {
+			f->cur = NULL;
+			f->discard = true;
+			++f->stats.rx_no_buffer;
+			continue;
+		}
+
+		if (f->left == 0) {
+			if (f->zero_pending)
+				frame_store(f, 0);
+			f->zero_pending = ch != 0xFF;
+			f->left = ch - 1;
+		} else {
+			frame_store(f, ch);
+			--f->left;
+		}
+	}
+}
+
+/**
+ * Decodes whatever the port has received, waiting up to 'timeout' ticks for
+ * the first byte. Bytes are decoded straight out of the RX ring into the
+ * frame buffer; each complete frame with a good CRC is queued for
+ * uart_frame_receive().
+ */
+void
+uart_frame_poll(UartFramer* f, TickType_t timeout)
+{
+	const uint8_t* span;
+	uint32_t n;
+
+	while ((n = uart_read_span(f->uart, &span, timeout)) != 0) {
+		frame_decode(f, span, n);
+		uart_read_consume(f->uart, n);
+		timeout = 0;
+	}
+}
+
+/**
+ * Takes the next complete frame, waiting up to 'timeout' ticks. Returns
+ * NULL on timeout. The frame must be handed back with uart_frame_free().
+ */
+UartFrame*
+uart_frame_receive(UartFramer* f, TickType_t timeout)
+{
+	UartFrame* frame;
+
+	if (xQueueReceive(f->ready, &frame, timeout) != pdTRUE)
+		return (NULL);
+	return (frame);
+}
+
+void
+uart_frame_free(UartFramer* f, UartFrame* frame)
+{
+	xQueueSend(f->empty, &frame, 0);
+}
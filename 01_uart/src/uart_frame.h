@@ -0,0 +1,65 @@
+#ifndef UART_FRAME_H
+#define UART_FRAME_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "FreeRTOS.h"
+#include "queue.h"
+#include "uart.h"
+
+/* Largest payload of one frame, in bytes. */
+#ifndef UART_FRAME_MAX
+#define UART_FRAME_MAX		128
+#endif
+
+/* Receive buffers per framer. While the consumer holds all of them, frames
+ * that arrive are dropped. */
+#ifndef UART_FRAME_POOL
+#define UART_FRAME_POOL		4
+#endif
+
+/**
+ * A received frame. 'data' is decoded into in place, CRC included, and is
+ * word aligned for the CRC unit.
+ */
+typedef struct {
+	uint32_t len;	// Payload bytes, without the CRC.
+	uint8_t data[UART_FRAME_MAX + 4] __attribute__((aligned(4)));
+} UartFrame;
+
+typedef struct {
+	uint32_t tx_frames;
+	uint32_t rx_frames;
+	uint32_t rx_crc_errors;	// Bad CRC, or cut short.
+	uint32_t rx_oversize;	// Longer than UART_FRAME_MAX.
+	uint32_t rx_no_buffer;	// The consumer held every buffer.
+} UartFrameStats;
+
+/**
+ * COBS framing with a CRC-32 trailer over one port. One task sends, one
+ * task runs uart_frame_poll() and any task takes the frames it queues.
+ */
+typedef struct {
+	Uart* uart;
+	QueueHandle_t ready;		// Checked frames, for the consumer.
+	QueueHandle_t empty;		// Buffers to decode into.
+	UartFrame pool[UART_FRAME_POOL];
+
+	/* Decoder state. */
+	UartFrame* cur;
+	uint32_t pos;				// Bytes decoded into 'cur'.
+	uint8_t left;				// Data bytes left in the current COBS block.
+	bool zero_pending;			// A zero follows the block if another one starts.
+	bool discard;				// Skip to the next delimiter.
+
+	UartFrameStats stats;
+} UartFramer;
+
+void uart_frame_init(UartFramer* f, Uart* u);
+bool uart_frame_send(UartFramer* f, const void* data, uint32_t len);
+void uart_frame_poll(UartFramer* f, TickType_t timeout);
+UartFrame* uart_frame_receive(UartFramer* f, TickType_t timeout);
+void uart_frame_free(UartFramer* f, UartFrame* frame);
+
+#endif // !UART_FRAME_H
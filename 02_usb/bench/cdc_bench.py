@@ -0,0 +1,519 @@
+#!/usr/bin/env python3
+"""Host tests and benchmark for the 02_usb CDC-ACM data path (USB_CDC_bench.elf).
+
+The CDC counterpart of libopencm3/tests/gadget-zero/test_gadget0.py: the
+same source, sink and loopback traffic, but through the firmware's pipe and
+rings and the host's cdc_acm/tty layer instead of raw bulk endpoints.
+
+The functional tests check that nothing is lost, doubled or reordered for
+write sizes around the packet size, including transfers that end on a full
+packet and so need a zero-length packet. TestCdcPerformance, run with
+--perf, prints MB/s per write size for each direction and for loopback, and
+echo round-trip latency percentiles; --latency sets the firmware's latency
+timer for it, to see small writes coalesce.
+
+The port is driven through termios only, so it runs against:
+
+  --port /dev/ttyACM0   the board,
+  --stand-in pty        a Python model of the firmware on a pseudo terminal,
+  --stand-in gadget     the same model behind a real USB stack: a configfs
+                        ACM gadget bound to dummy_hcd. The host side is a
+                        genuine /dev/ttyACM* on the cdc_acm driver. Needs
+                        root and the dummy_hcd, libcomposite and usb_f_acm
+                        modules.
+
+The stand-ins let the harness run in CI without a board; their numbers only
+reflect the host. Protocol: see the comment at the top of src/bench_main.c.
+"""
+
+import argparse
+import glob
+import os
+import select
+import struct
+import subprocess
+import sys
+import termios
+import threading
+import time
+import unittest
+
+INFO, ECHO, SINK, SOURCE, LOOP, STATS, LATENCY = (ord(c) for c in "IESGLTY")
+REQ_SIZE = 16
+PATTERN = 255
+
+VENDOR_ID = 0x0483
+PRODUCT_ID = 0x5740
+
+STATS_NAMES = (
+	"irqs", "wakeups", "polls", "sofs",
+	"in_packets", "in_bytes", "in_zlps", "in_timed", "in_expired", "in_flushed",
+	"in_latency_sum", "in_latency_max",
+	"out_packets", "out_bytes", "out_latency_sum", "out_latency_max", "out_throttled",
+)
+
+# Set from the command line before the tests run.
+OPTS = None
+PORT = None
+
+
+def pattern(count, phase=0):
+	return bytes(1 + (phase + x) % PATTERN for x in range(count))
+
+
+def percentile(values, p):
+	values = sorted(values)
+	return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+
+class Link:
+	"""A raw tty with exact-length reads and the request/reply framing."""
+
+	def __init__(self, path=None, fd=None):
+		self.fd = os.open(path, os.O_RDWR | os.O_NOCTTY) if fd is None else fd
+		if os.isatty(self.fd):
+			attr = termios.tcgetattr(self.fd)
+			attr[0] = 0							# iflag
+			attr[1] = 0							# oflag
+			attr[2] = termios.CS8 | termios.CREAD | termios.CLOCAL
+			attr[3] = 0							# lflag
+			attr[6][termios.VMIN] = 0
+			attr[6][termios.VTIME] = 0
+			termios.tcsetattr(self.fd, termios.TCSANOW, attr)
+		self.pending = bytearray()
+
+	def close(self):
+		os.close(self.fd)
+
+	def write(self, data):
+		view = memoryview(data)
+		while view:
+			select.select([], [self.fd], [])
+			view = view[os.write(self.fd, view):]
+
+	def fill(self, timeout):
+		"""Reads what has arrived into 'pending'; False if nothing did in time."""
+		if not select.select([self.fd], [], [], timeout)[0]:
+			return False
+		chunk = os.read(self.fd, 65536)
+		self.pending += chunk
+		return bool(chunk)
+
+	def read_exact(self, count, timeout=2.0):
+		"""Returns 'count' bytes, or fewer if the port was quiet for 'timeout'."""
+		while len(self.pending) < count and self.fill(timeout):
+			pass
+		data = bytes(self.pending[:count])
+		del self.pending[:count]
+		return data
+
+	def send(self, cmd, *args, payload=b""):
+		args = (args + (0, 0, 0))[:3]
+		self.write(struct.pack("<B3x3I", cmd, *args) + payload)
+
+	def reply(self, cmd, timeout=2.0):
+		head = self.read_exact(4, timeout)
+		if len(head) < 4:
+			raise TimeoutError("no reply from target")
+		if head[0] != cmd:
+			raise ValueError("unexpected reply %r" % head[:1])
+		body = self.read_exact(4 * head[1], timeout)
+		return struct.unpack("<%dI" % head[1], body)
+
+	def call(self, cmd, *args, payload=b"", timeout=2.0):
+		self.send(cmd, *args, payload=payload)
+		return self.reply(cmd, timeout)
+
+	def drain(self):
+		self.pending.clear()
+		while select.select([self.fd], [], [], 0.05)[0]:
+			if not os.read(self.fd, 65536):
+				break
+
+
+class StandIn(threading.Thread):
+	"""Answers the benchmark protocol the way src/bench_main.c does."""
+
+	CPU_HZ = 72000000
+	IDLE = 0.5
+
+	def __init__(self, link):
+		super().__init__(daemon=True)
+		self.link = link
+		self.stats = [0] * len(STATS_NAMES)
+		self.latency = 0
+
+	def cycles(self):
+		return int(time.perf_counter() * self.CPU_HZ) & 0xFFFFFFFF
+
+	def reply(self, cmd, *words):
+		self.link.write(struct.pack("<BB2x%dI" % len(words), cmd, len(words), *words))
+
+	def take(self, limit):
+		"""Returns up to 'limit' received bytes, waiting up to IDLE for any."""
+		if not self.link.pending and not self.link.fill(self.IDLE):
+			return b""
+		data = bytes(self.link.pending[:limit])
+		del self.link.pending[:limit]
+		self.stats[STATS_NAMES.index("out_packets")] += 1
+		self.stats[STATS_NAMES.index("out_bytes")] += len(data)
+		return data
+
+	def run(self):
+		while True:
+			req = self.link.read_exact(REQ_SIZE, 3600)
+			if len(req) < REQ_SIZE:
+				continue
+			cmd, a0, a1, _ = struct.unpack("<B3x3I", req)
+			if cmd == INFO:
+				self.reply(INFO, self.CPU_HZ, 64, 512, 512, 1, 0, 1, self.latency)
+			elif cmd == ECHO:
+				payload = self.link.read_exact(a0, self.IDLE)
+				if len(payload) == a0:
+					self.reply(ECHO, a0)
+					self.link.write(payload)
+			elif cmd == SINK:
+				self.sink(a0)
+			elif cmd == SOURCE:
+				start = self.cycles()
+				self.link.write(pattern(a0))
+				self.reply(SOURCE, (self.cycles() - start) & 0xFFFFFFFF, a0)
+			elif cmd == LOOP:
+				self.loop(a0)
+			elif cmd == STATS:
+				self.reply(STATS, *self.stats)
+			elif cmd == LATENCY:
+				self.latency = a0 & 0xFF
+				self.reply(LATENCY, self.latency)
+
+	def sink(self, count):
+		self.reply(SINK)
+		received = first = bad = 0
+		start = end = 0
+		while received < count:
+			data = self.take(count - received)
+			if not data:
+				break
+			if received == 0:
+				start, first = self.cycles(), len(data)
+			bad += sum(a != b for a, b in zip(data, pattern(len(data), received)))
+			received += len(data)
+			end = self.cycles()
+		self.reply(SINK, received, (end - start) & 0xFFFFFFFF, first, bad, 0)
+
+	def loop(self, count):
+		received = 0
+		start = end = 0
+		while received < count:
+			data = self.take(count - received)
+			if not data:
+				break
+			if received == 0:
+				start = self.cycles()
+			self.link.write(data)
+			received += len(data)
+			end = self.cycles()
+		self.reply(LOOP, received, (end - start) & 0xFFFFFFFF)
+
+
+def find_tty(vid, pid, serial=None):
+	"""Returns the /dev/ttyACM* of port 0 (interface 0) of a matching device."""
+	def attr(path, name):
+		try:
+			with open(os.path.join(path, name)) as f:
+				return f.read().strip()
+		except OSError:
+			return None
+
+	for tty in sorted(glob.glob("/sys/class/tty/ttyACM*")):
+		iface = os.path.realpath(os.path.join(tty, "device"))
+		usbdev = os.path.dirname(iface)
+		if attr(iface, "bInterfaceNumber") != "00":
+			continue
+		if attr(usbdev, "idVendor") != "%04x" % vid or attr(usbdev, "idProduct") != "%04x" % pid:
+			continue
+		if serial is not None and attr(usbdev, "serial") != serial:
+			continue
+		return "/dev/" + os.path.basename(tty)
+	return None
+
+
+class Gadget:
+	"""An ACM function of a configfs gadget, bound to the dummy_hcd UDC."""
+
+	ROOT = "/sys/kernel/config/usb_gadget/cdc_bench"
+	SERIAL = "cdc-bench-stand-in"
+
+	def __init__(self):
+		self.device_tty = None
+		self.host_tty = None
+
+	def put(self, name, value):
+		with open(os.path.join(self.ROOT, name), "w") as f:
+			f.write(value)
+
+	def start(self):
+		for module in ("dummy_hcd", "libcomposite", "usb_f_acm"):
+			subprocess.run(["modprobe", module], check=True)
+		if not os.path.isdir("/sys/kernel/config/usb_gadget"):
+			subprocess.run(["mount", "-t", "configfs", "none", "/sys/kernel/config"], check=True)
+		udcs = [u for u in os.listdir("/sys/class/udc") if u.startswith("dummy_udc")]
+		if not udcs:
+			raise RuntimeError("no dummy_udc; is dummy_hcd loaded?")
+
+		for sub in ("", "strings/0x409", "configs/c.1", "configs/c.1/strings/0x409", "functions/acm.usb0"):
+			os.makedirs(os.path.join(self.ROOT, sub), exist_ok=True)
+		self.put("idVendor", "0x%04x" % VENDOR_ID)
+		self.put("idProduct", "0x%04x" % PRODUCT_ID)
+		self.put("strings/0x409/manufacturer", "cdc_bench")
+		self.put("strings/0x409/product", "CDC bench stand-in")
+		self.put("strings/0x409/serialnumber", self.SERIAL)
+		self.put("configs/c.1/strings/0x409/configuration", "ACM")
+		link = os.path.join(self.ROOT, "configs/c.1/acm.usb0")
+		if not os.path.islink(link):
+			os.symlink(os.path.join(self.ROOT, "functions/acm.usb0"), link)
+		self.put("UDC", udcs[0])
+
+		with open(os.path.join(self.ROOT, "functions/acm.usb0/port_num")) as f:
+			self.device_tty = "/dev/ttyGS%d" % int(f.read())
+		deadline = time.monotonic() + 5
+		while self.host_tty is None and time.monotonic() < deadline:
+			time.sleep(0.1)
+			self.host_tty = find_tty(VENDOR_ID, PRODUCT_ID, self.SERIAL)
+		if self.host_tty is None:
+			raise RuntimeError("the host did not enumerate the gadget")
+
+	def stop(self):
+		for step in (
+			lambda: self.put("UDC", "\n"),
+			lambda: os.unlink(os.path.join(self.ROOT, "configs/c.1/acm.usb0")),
+			lambda: os.rmdir(os.path.join(self.ROOT, "configs/c.1/strings/0x409")),
+			lambda: os.rmdir(os.path.join(self.ROOT, "configs/c.1")),
+			lambda: os.rmdir(os.path.join(self.ROOT, "functions/acm.usb0")),
+			lambda: os.rmdir(os.path.join(self.ROOT, "strings/0x409")),
+			lambda: os.rmdir(self.ROOT),
+		):
+			try:
+				step()
+			except OSError:
+				pass
+
+
+class CdcTestCase(unittest.TestCase):
+	def setUp(self):
+		self.assertIsNotNone(PORT, "Couldn't find the CDC bench device")
+		self.link = Link(PORT)
+		self.link.drain()
+		self.info = self.link.call(INFO)
+		self.cpu_hz, self.packet = self.info[0], self.info[1]
+		self.longMessage = True
+
+	def tearDown(self):
+		self.link.close()
+
+	def sink(self, count, chunk):
+		"""Sends 'count' pattern bytes in writes of 'chunk'; returns the reply and host seconds."""
+		self.link.call(SINK, count)
+		data = pattern(count)
+		start = time.perf_counter()
+		for x in range(0, count, chunk):
+			self.link.write(data[x:x + chunk])
+		reply = self.link.reply(SINK, timeout=5.0)
+		return reply, time.perf_counter() - start
+
+	def source(self, count, chunk):
+		"""Returns the received bytes, the reply and host seconds."""
+		self.link.send(SOURCE, count, chunk)
+		start = time.perf_counter()
+		data = self.link.read_exact(count)
+		elapsed = time.perf_counter() - start
+		return data, self.link.reply(SOURCE), elapsed
+
+	def loop(self, count, chunk):
+		"""Writes 'count' pattern bytes from a thread while reading them back."""
+		data = pattern(count)
+
+		def writer():
+			for x in range(0, count, chunk):
+				self.link.write(data[x:x + chunk])
+
+		self.link.send(LOOP, count)
+		thread = threading.Thread(target=writer)
+		start = time.perf_counter()
+		thread.start()
+		back = self.link.read_exact(count)
+		elapsed = time.perf_counter() - start
+		thread.join()
+		return back, self.link.reply(LOOP, timeout=5.0), elapsed
+
+	def echo(self, size):
+		payload = pattern(size)
+		start = time.perf_counter()
+		(length,) = self.link.call(ECHO, size, payload=payload)
+		back = self.link.read_exact(length)
+		elapsed = time.perf_counter() - start
+		self.assertEqual(payload, back, "echo of %d bytes should come back intact" % size)
+		return elapsed
+
+
+class TestCdcEcho(CdcTestCase):
+	def test_sizes(self):
+		for size in (1, self.packet - 1, self.packet, self.packet + 1, 4 * self.packet, 1024):
+			self.echo(size)
+
+	def test_back_to_back(self):
+		for _ in range(50):
+			self.echo(self.packet)
+
+
+class TestCdcSourceSink(CdcTestCase):
+	def test_sink(self):
+		for chunk in (1, self.packet - 1, self.packet, self.packet + 1, 512):
+			(received, _, _, bad, _), _ = self.sink(16384, chunk)
+			self.assertEqual(16384, received, "chunk %d: target should get every byte" % chunk)
+			self.assertEqual(0, bad, "chunk %d: target should get the pattern" % chunk)
+
+	def test_source(self):
+		for chunk in (1, self.packet - 1, self.packet, self.packet + 1, 512):
+			data, (_, sent), _ = self.source(16384, chunk)
+			self.assertEqual(16384, sent)
+			self.assertEqual(pattern(16384), data, "chunk %d: host should get the pattern" % chunk)
+
+	def test_source_full_packets(self):
+		"""A transfer of whole packets must be closed by a ZLP, or the host waits."""
+		for count in (self.packet, 2 * self.packet, 8 * self.packet):
+			data, _, elapsed = self.source(count, count)
+			self.assertEqual(pattern(count), data)
+			self.assertLess(elapsed, 1.0, "%d bytes should not wait for more" % count)
+
+
+class TestCdcLoopBack(CdcTestCase):
+	def test_loopback(self):
+		for chunk in (1, self.packet, 100, 1024):
+			back, (received, _), _ = self.loop(16384, chunk)
+			self.assertEqual(16384, received)
+			self.assertEqual(pattern(16384), back, "chunk %d: loopback should be intact" % chunk)
+
+
+class TestCdcLatencyTimer(CdcTestCase):
+	"""Held short packets must still arrive, and flushed ones at once."""
+
+	def tearDown(self):
+		self.link.call(LATENCY, self.info[7])
+		super().tearDown()
+
+	def test_held_data_arrives(self):
+		self.link.call(LATENCY, 16)
+		for chunk in (1, self.packet - 1, self.packet + 1):
+			data, _, _ = self.source(4096 + 5, chunk)
+			self.assertEqual(pattern(4096 + 5), data, "chunk %d: held data should arrive" % chunk)
+
+	def test_flush_beats_timer(self):
+		self.link.call(LATENCY, 100)
+		times = [self.echo(size) for size in (1, self.packet - 1, self.packet) for _ in range(10)]
+		self.assertLess(percentile(times, 50), 0.05, "flushed echoes should not wait for the timer")
+
+
+class TestCdcPerformance(CdcTestCase):
+	"""
+	Throughput per write size and echo latency. Only on demand (--perf).
+	"""
+
+	def setUp(self):
+		if not OPTS.perf:
+			self.skipTest("Perf tests only on demand (--perf)")
+		super().setUp()
+		self.saved_latency = self.info[7]
+		if OPTS.latency is not None:
+			self.link.call(LATENCY, OPTS.latency)
+			self.info = self.link.call(INFO)
+
+	def tearDown(self):
+		self.link.call(LATENCY, self.saved_latency)
+		super().tearDown()
+
+	def mbps(self, count, seconds):
+		return count / 1e6 / seconds if seconds > 0 else 0
+
+	def test_throughput(self):
+		count = OPTS.bytes
+		print("\n%d bytes, packet %d, rings %d/%d, mode %d, double buffer %d, latency %d ms"
+			% (count, self.packet, self.info[2], self.info[3], self.info[4], self.info[5], self.info[7]))
+		print("%6s %10s %10s %10s %10s %10s %9s" % ("write", "sink MB/s", "target",
+			"src MB/s", "target", "loop MB/s", "throttled"))
+		for chunk in OPTS.sizes:
+			(received, cycles, first, bad, throttled), sink_s = self.sink(count, chunk)
+			self.assertEqual((count, 0), (received, bad))
+			data, (src_cycles, sent), source_s = self.source(count, chunk)
+			self.assertEqual(pattern(count), data)
+			back, _, loop_s = self.loop(count, chunk)
+			self.assertEqual(pattern(count), back)
+			print("%6d %10.3f %10.3f %10.3f %10.3f %10.3f %9d" % (chunk,
+				self.mbps(count, sink_s),
+				self.mbps(received - first, cycles / self.cpu_hz),
+				self.mbps(count, source_s),
+				self.mbps(sent, src_cycles / self.cpu_hz),
+				self.mbps(count, loop_s), throttled))
+
+	def test_latency(self):
+		print("\n%6s %10s %10s %10s %10s" % ("size", "p50 us", "p90 us", "p99 us", "max us"))
+		for size in OPTS.sizes:
+			if size > 1024:
+				continue
+			times = [self.echo(size) * 1e6 for _ in range(OPTS.echoes)]
+			print("%6d %10.0f %10.0f %10.0f %10.0f" % (size, percentile(times, 50),
+				percentile(times, 90), percentile(times, 99), max(times)))
+
+	def test_stats(self):
+		words = self.link.call(STATS)
+		print("\n" + "  ".join("%s %d" % kv for kv in zip(STATS_NAMES, words)))
+
+
+def get_parser():
+	parser = argparse.ArgumentParser(description=__doc__.split("\n")[0])
+	where = parser.add_mutually_exclusive_group()
+	where.add_argument("--port", help="tty of the target; found by VID:PID if not given")
+	where.add_argument("--stand-in", choices=("pty", "gadget"), help="run against a stand-in")
+	parser.add_argument("--perf", action="store_true", help="also run TestCdcPerformance")
+	parser.add_argument("--bytes", type=int, default=262144, help="bulk transfer size")
+	parser.add_argument("--sizes", default="1,16,63,64,65,512,4096", help="write sizes in bytes")
+	parser.add_argument("--echoes", type=int, default=200)
+	parser.add_argument("--latency", type=int, help="latency timer in ms for the perf tests")
+	parser.add_argument("-X", "--xunit", action="store_true",
+		help="Write xml 'junit' style outputs, intended for CI use")
+	return parser
+
+
+def main():
+	global OPTS, PORT
+
+	OPTS, rest = get_parser().parse_known_args()
+	OPTS.sizes = [int(s) for s in OPTS.sizes.split(",")]
+
+	gadget = None
+	if OPTS.stand_in == "pty":
+		master, slave = os.openpty()
+		StandIn(Link(fd=master)).start()
+		PORT = os.ttyname(slave)
+	elif OPTS.stand_in == "gadget":
+		gadget = Gadget()
+		gadget.start()
+		StandIn(Link(gadget.device_tty)).start()
+		PORT = gadget.host_tty
+	else:
+		PORT = OPTS.port or find_tty(VENDOR_ID, PRODUCT_ID)
+
+	runner = None
+	if OPTS.xunit:
+		import xmlrunner
+		runner = xmlrunner.XMLTestRunner(output="tests/test-cdc")
+	try:
+		result = unittest.main(exit=False, argv=[sys.argv[0]] + rest, testRunner=runner).result
+	finally:
+		if gadget is not None:
+			gadget.stop()
+	return 0 if result.wasSuccessful() else 1
+
+
+if __name__ == "__main__":
+	sys.exit(main())
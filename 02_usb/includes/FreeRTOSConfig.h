@@ -87,6 +87,7 @@
 
 #define configUSE_PREEMPTION		1
 #define configUSE_IDLE_HOOK			0
+#define configUSE_TICKLESS_IDLE		1
 #define configUSE_TICK_HOOK			0
 #define configCPU_CLOCK_HZ			( ( unsigned long ) 72000000 )	
 #define configSYSTICK_CLOCK_HZ 		( configCPU_CLOCK_HZ / 8 )
@@ -100,6 +101,18 @@
 #define configIDLE_SHOULD_YIELD		1
 #define configUSE_MUTEXES			1
 
+/* Run time stats, clocked by TIM2 which keeps counting during tickless
+sleep. Used to report the idle load. */
+#include "runtime_stats.h"
+#define configGENERATE_RUN_TIME_STATS				1
+#define portCONFIGURE_TIMER_FOR_RUN_TIME_STATS()	runtime_stats_init()
+#define portGET_RUN_TIME_COUNTER_VALUE()			runtime_stats_counter()
+
+/* While the USB bus is suspended the tickless idle enters Stop mode rather
+than sleeping. */
+#include "usb_power.h"
+#define configPRE_SLEEP_PROCESSING(x)	usb_power_sleep(&(x))
+
 /* Co-routine definitions. */
 #define configUSE_CO_ROUTINES 			0
 #define configMAX_CO_ROUTINE_PRIORITIES	( 2 )
@@ -116,6 +129,7 @@ to exclude the API function. */
 #define INCLUDE_vTaskSuspend			1
 #define INCLUDE_vTaskDelayUntil			1
 #define INCLUDE_vTaskDelay				1
+#define INCLUDE_xTaskGetIdleTaskHandle	1
 
 /* This is the raw value as per the Cortex-M3 NVIC.  Values can be 255
 (lowest) to 0 (1?) (highest). */
@@ -0,0 +1,342 @@
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "usbcdc.h"
+#include "cdcacm.h"
+#include "usb_power.h"
+
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/dbgmcu.h>
+#include <libopencm3/cm3/dwt.h>
+
+/*
+ * Benchmark image for the CDC-ACM data path, driven by bench/cdc_bench.py.
+ * It is the CDC counterpart of the source/sink and loopback configurations
+ * of libopencm3's gadget-zero: the same traffic, but through the pipe, the
+ * rings and the tty layer of the host that the product uses.
+ *
+ * The host talks to port 0. A request is BENCH_REQ_SIZE bytes: the command,
+ * three zero bytes and three little-endian 32-bit arguments. Every reply
+ * starts with the command and the number of 32-bit words that follow, then
+ * two zero bytes. Bulk data is sent raw, as the pattern 1, 2, ... 255, 1,
+ * 2, ... so that a lost or doubled packet shows up as a mismatch.
+ */
+#define BENCH_INFO		'I'	// -> cpu_hz, packet, tx_ring, rx_ring, service_mode, double_buffer, ports, latency
+#define BENCH_ECHO		'E'	// size, payload -> size, payload
+#define BENCH_SINK		'S'	// count -> (ready) ... received, cycles, first, mismatches, throttled
+#define BENCH_SOURCE	'G'	// count, chunk -> raw data ... cycles, sent
+#define BENCH_LOOP		'L'	// count -> raw data echoed ... received, cycles
+#define BENCH_STATS		'T'	// -> UsbStats, UsbPipeStats
+#define BENCH_LATENCY	'Y'	// frames -> frames; sets the latency timer
+
+#define BENCH_REQ_SIZE	16
+
+/* The sink and loopback give up after the port has been quiet this long. */
+#define BENCH_IDLE		pdMS_TO_TICKS(500)
+
+/* Largest write BENCH_SOURCE issues, and largest echo payload. */
+#define BENCH_CHUNK_MAX		1024
+
+#define BENCH_PATTERN		255
+
+#define BENCH_PORT		0
+
+static UsbPipe* pipe;
+
+/* Pattern bytes, long enough to send any chunk from any phase. */
+static uint8_t pattern[BENCH_PATTERN + BENCH_CHUNK_MAX];
+
+static uint8_t reply[4 + 32 * sizeof(uint32_t)];
+static uint32_t reply_len;
+
+static void
+reply_start(uint8_t cmd)
+{
+	reply[0] = cmd;
+	reply[1] = 0;
+	reply[2] = 0;
+	reply[3] = 0;
+	reply_len = 4;
+}
+
+static void
+reply_u32(uint32_t value)
+{
+	memcpy(&reply[reply_len], &value, sizeof value);
+	reply_len += sizeof value;
+	++reply[1];
+}
+
+static void
+reply_words(const void* words, uint32_t count)
+{
+	memcpy(&reply[reply_len], words, count * sizeof(uint32_t));
+	reply_len += count * sizeof(uint32_t);
+	reply[1] += count;
+}
+
+/** Sends the reply and flushes it, so the host never waits for a latency timer. */
+static void
+reply_send(void)
+{
+	usb_pipe_write(pipe, reply, reply_len);
+	usb_pipe_flush(pipe);
+}
+
+/**
+ * Reads exactly 'len' bytes into 'data', waiting up to BENCH_IDLE for each
+ * part. Returns false if the host went quiet first.
+ */
+static bool
+read_exact(void* data, uint32_t len)
+{
+	uint8_t* dst = data;
+
+	while (len > 0) {
+		uint32_t n = usb_pipe_read(pipe, dst, len, BENCH_IDLE);
+
+		if (n == 0)
+			return (false);
+		dst += n;
+		len -= n;
+	}
+	return (true);
+}
+
+static void
+bench_info(void)
+{
+	reply_start(BENCH_INFO);
+	reply_u32(rcc_ahb_frequency);
+	reply_u32(CDC_ACM_PACKET_SIZE);
+	reply_u32(CDC_ACM_TX_RING_SIZE);
+	reply_u32(CDC_ACM_RX_RING_SIZE);
+	reply_u32(USB_SERVICE_MODE);
+	reply_u32(CDC_ACM_DOUBLE_BUFFER);
+	reply_u32(CDC_ACM_PORTS);
+	reply_u32(pipe->latency);
+	reply_send();
+}
+
+/**
+ * Sends the payload back in one write, for the host to time round trips of
+ * 'size' bytes.
+ */
+static void
+bench_echo(uint32_t size)
+{
+	static uint8_t payload[BENCH_CHUNK_MAX];
+
+	if (size > sizeof payload || !read_exact(payload, size))
+		return;
+
+	reply_start(BENCH_ECHO);
+	reply_u32(size);
+	usb_pipe_write(pipe, reply, reply_len);
+	usb_pipe_write(pipe, payload, size);
+	usb_pipe_flush(pipe);
+}
+
+/**
+ * Receives 'count' raw pattern bytes, timing them from the first span to
+ * the last. The host only starts sending once the ready reply is in.
+ */
+static void
+bench_sink(uint32_t count)
+{
+	UsbPipeStats before, after;
+	uint32_t received = 0, first = 0, mismatches = 0;
+	uint32_t start = 0, end = 0;
+	uint8_t expect = 1;
+
+	usb_pipe_get_stats(pipe, &before);
+	reply_start(BENCH_SINK);
+	reply_send();
+
+	while (received < count) {
+		const uint8_t* span;
+		uint32_t n = usb_pipe_read_span(pipe, &span, BENCH_IDLE);
+
+		if (n == 0)
+			break;
+		if (n > count - received)
+			n = count - received;
+		if (received == 0) {
+			start = dwt_read_cycle_counter();
+			first = n;
+		}
+
+		for (uint32_t x = 0; x < n; ++x) {
+			if (span[x] != expect)
+				++mismatches;
+			expect = expect == BENCH_PATTERN ? 1 : expect + 1;
+		}
+
+		received += n;
+		usb_pipe_read_consume(pipe, n);
+		end = dwt_read_cycle_counter();
+	}
+
+	usb_pipe_get_stats(pipe, &after);
+
+	reply_start(BENCH_SINK);
+	reply_u32(received);
+	reply_u32(end - start);
+	reply_u32(first);
+	reply_u32(mismatches);
+	reply_u32(after.out_throttled - before.out_throttled);
+	reply_send();
+}
+
+/**
+ * Sends 'count' raw pattern bytes in writes of 'chunk' and times them until
+ * the last one is queued. The host knows the count, so no delimiter follows.
+ */
+static void
+bench_source(uint32_t count, uint32_t chunk)
+{
+	uint32_t sent = 0;
+	uint32_t start;
+
+	if (chunk == 0 || chunk > BENCH_CHUNK_MAX)
+		chunk = BENCH_CHUNK_MAX;
+
+	start = dwt_read_cycle_counter();
+	while (sent < count) {
+		uint32_t n = count - sent < chunk ? count - sent : chunk;
+
+		usb_pipe_write(pipe, &pattern[sent % BENCH_PATTERN], n);
+		sent += n;
+	}
+
+	reply_start(BENCH_SOURCE);
+	reply_u32(dwt_read_cycle_counter() - start);
+	reply_u32(sent);
+	reply_send();
+}
+
+/**
+ * Sends the next 'count' bytes back as they arrive, span by span and
+ * flushed, the way the console does. The host writes and reads at the same time, so this
+ * runs both directions at once.
+ */
+static void
+bench_loop(uint32_t count)
+{
+	uint32_t received = 0;
+	uint32_t start = 0, end = 0;
+
+	while (received < count) {
+		const uint8_t* span;
+		uint32_t n = usb_pipe_read_span(pipe, &span, BENCH_IDLE);
+
+		if (n == 0)
+			break;
+		if (n > count - received)
+			n = count - received;
+		if (received == 0)
+			start = dwt_read_cycle_counter();
+
+		usb_pipe_write(pipe, span, n);
+		usb_pipe_flush(pipe);
+		usb_pipe_read_consume(pipe, n);
+		received += n;
+		end = dwt_read_cycle_counter();
+	}
+
+	reply_start(BENCH_LOOP);
+	reply_u32(received);
+	reply_u32(end - start);
+	reply_send();
+}
+
+static void
+bench_stats(void)
+{
+	UsbStats usb;
+	UsbPipeStats st;
+
+	usb_get_stats(&usb);
+	usb_pipe_get_stats(pipe, &st);
+
+	reply_start(BENCH_STATS);
+	reply_words(&usb, sizeof usb / sizeof(uint32_t));
+	reply_words(&st, sizeof st / sizeof(uint32_t));
+	reply_send();
+}
+
+static void
+bench_request(const uint8_t* req)
+{
+	uint32_t args[3];
+
+	memcpy(args, &req[4], sizeof args);
+
+	switch (req[0]) {
+	case BENCH_INFO:
+		bench_info();
+		break;
+	case BENCH_ECHO:
+		bench_echo(args[0]);
+		break;
+	case BENCH_SINK:
+		bench_sink(args[0]);
+		break;
+	case BENCH_SOURCE:
+		bench_source(args[0], args[1]);
+		break;
+	case BENCH_LOOP:
+		bench_loop(args[0]);
+		break;
+	case BENCH_STATS:
+		bench_stats();
+		break;
+	case BENCH_LATENCY:
+		usb_pipe_set_latency(pipe, args[0]);
+		reply_start(BENCH_LATENCY);
+		reply_u32(pipe->latency);
+		reply_send();
+		break;
+	}
+}
+
+static void
+task_bench(void* args __attribute((unused)))
+{
+	for (;;) {
+		uint8_t req[BENCH_REQ_SIZE];
+		uint32_t len = usb_pipe_read(pipe, req, sizeof req, portMAX_DELAY);
+
+		/* The ring may hand a request over in two parts; one the host
+		 * never finished, as after an aborted run, is dropped. */
+		if (len < sizeof req && !read_exact(&req[len], sizeof req - len))
+			continue;
+		bench_request(req);
+	}
+}
+
+int
+main(void)
+{
+	rcc_clock_setup_pll(&rcc_hse_configs[RCC_CLOCK_HSE8_72MHZ]);
+	usb_power_init(&rcc_hse_configs[RCC_CLOCK_HSE8_72MHZ]);
+
+	/* Keep the core clock, and with it the DWT cycle counter, running
+	 * while the idle task sleeps in WFI. */
+	DBGMCU_CR |= DBGMCU_CR_SLEEP;
+
+	for (uint32_t x = 0; x < sizeof pattern; ++x)
+		pattern[x] = 1 + x % BENCH_PATTERN;
+
+	usb_start();
+	pipe = cdcacm_pipe(cdcacm_get(BENCH_PORT));
+
+	xTaskCreate(task_bench, "BENCH", 200, NULL, tskIDLE_PRIORITY + 1, NULL);
+
+	vTaskStartScheduler();
+
+	for (;;);
+
+	return (0);
+}
@@ -0,0 +1,417 @@
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "usbcdc.h"
+#include "cdcacm.h"
+
+#if (CDC_ACM_TX_RING_SIZE & (CDC_ACM_TX_RING_SIZE - 1)) != 0
+#error "CDC_ACM_TX_RING_SIZE must be a power of two"
+#endif
+
+#if (CDC_ACM_RX_RING_SIZE & (CDC_ACM_RX_RING_SIZE - 1)) != 0
+#error "CDC_ACM_RX_RING_SIZE must be a power of two"
+#endif
+
+#if CDC_ACM_RX_RING_SIZE < 2 * CDC_ACM_PACKET_SIZE
+#error "CDC_ACM_RX_RING_SIZE must hold two packets"
+#endif
+
+#if CDC_ACM_EP_COUNT > 7
+#error "The CDC-ACM ports need more endpoints than there are"
+#endif
+
+/* SERIAL_STATE bits that are events rather than levels: reported once. */
+#define CDC_ACM_STATE_EVENTS	(CDC_ACM_STATE_BREAK | CDC_ACM_STATE_RING \
+	| CDC_ACM_STATE_FRAMING | CDC_ACM_STATE_PARITY | CDC_ACM_STATE_OVERRUN)
+
+#define CDC_ACM_COMM_IFACE(n)	(2 * (n))
+#define CDC_ACM_DATA_IFACE(n)	(2 * (n) + 1)
+
+typedef usbd_control_complete_callback* FnComplete;
+
+/** Class-specific descriptors that follow the communication interface. */
+typedef struct {
+	struct usb_cdc_header_descriptor header;
+	struct usb_cdc_call_management_descriptor call_mgmt;
+	struct usb_cdc_acm_descriptor acm;
+	struct usb_cdc_union_descriptor cdc_union;
+} __attribute__((packed)) CdcAcmFunctional;
+
+struct CdcAcm {
+	uint8_t port;
+	UsbPipe pipe;					// Data interface.
+	bool notify_busy;				// The notification endpoint holds a packet.
+	volatile bool notify_pending;	// 'serial_state' changed since it was last sent.
+	volatile uint16_t serial_state;
+	volatile uint16_t lines;		// CDC_ACM_LINE_* from the host.
+	struct usb_cdc_line_coding coding;
+	uint8_t txbuf[CDC_ACM_TX_RING_SIZE];
+	uint8_t rxbuf[CDC_ACM_RX_RING_SIZE];
+};
+
+static CdcAcm cdc_ports[CDC_ACM_PORTS];
+
+#define CDC_ACM_ASSOC(n) { \
+	.bLength = USB_DT_INTERFACE_ASSOCIATION_SIZE, \
+	.bDescriptorType = USB_DT_INTERFACE_ASSOCIATION, \
+	.bFirstInterface = CDC_ACM_COMM_IFACE(n), \
+	.bInterfaceCount = 2, \
+	.bFunctionClass = USB_CLASS_CDC, \
+	.bFunctionSubClass = USB_CDC_SUBCLASS_ACM, \
+	.bFunctionProtocol = USB_CDC_PROTOCOL_NONE, \
+	.iFunction = 0, \
+}
+
+#define CDC_ACM_NOTIFY_ENDPOINT(n) { \
+	.bLength = USB_DT_ENDPOINT_SIZE, \
+	.bDescriptorType = USB_DT_ENDPOINT, \
+	.bEndpointAddress = CDC_ACM_NOTIFY_EP(n), \
+	.bmAttributes = USB_ENDPOINT_ATTR_INTERRUPT, \
+	.wMaxPacketSize = CDC_ACM_NOTIFY_SIZE, \
+	.bInterval = 255, \
+}
+
+#define CDC_ACM_DATA_ENDPOINTS(n) { { \
+	.bLength = USB_DT_ENDPOINT_SIZE, \
+	.bDescriptorType = USB_DT_ENDPOINT, \
+	.bEndpointAddress = CDC_ACM_DATA_OUT_EP(n), \
+	.bmAttributes = USB_ENDPOINT_ATTR_BULK, \
+	.wMaxPacketSize = CDC_ACM_PACKET_SIZE, \
+	.bInterval = 1, \
+}, { \
+	.bLength = USB_DT_ENDPOINT_SIZE, \
+	.bDescriptorType = USB_DT_ENDPOINT, \
+	.bEndpointAddress = CDC_ACM_DATA_IN_EP(n), \
+	.bmAttributes = USB_ENDPOINT_ATTR_BULK, \
+	.wMaxPacketSize = CDC_ACM_PACKET_SIZE, \
+	.bInterval = 1, \
+} }
+
+/* ACM capability bit 1: SET/GET_LINE_CODING, SET_CONTROL_LINE_STATE and
+ * SERIAL_STATE are supported. No call management. */
+#define CDC_ACM_FUNCTIONAL(n) { \
+	.header = { \
+		.bFunctionLength = sizeof(struct usb_cdc_header_descriptor), \
+		.bDescriptorType = CS_INTERFACE, \
+		.bDescriptorSubtype = USB_CDC_TYPE_HEADER, \
+		.bcdCDC = 0x0110, \
+	}, \
+	.call_mgmt = { \
+		.bFunctionLength = sizeof(struct usb_cdc_call_management_descriptor), \
+		.bDescriptorType = CS_INTERFACE, \
+		.bDescriptorSubtype = USB_CDC_TYPE_CALL_MANAGEMENT, \
+		.bmCapabilities = 0, \
+		.bDataInterface = CDC_ACM_DATA_IFACE(n), \
+	}, \
+	.acm = { \
+		.bFunctionLength = sizeof(struct usb_cdc_acm_descriptor), \
+		.bDescriptorType = CS_INTERFACE, \
+		.bDescriptorSubtype = USB_CDC_TYPE_ACM, \
+		.bmCapabilities = 0x02, \
+	}, \
+	.cdc_union = { \
+		.bFunctionLength = sizeof(struct usb_cdc_union_descriptor), \
+		.bDescriptorType = CS_INTERFACE, \
+		.bDescriptorSubtype = USB_CDC_TYPE_UNION, \
+		.bControlInterface = CDC_ACM_COMM_IFACE(n), \
+		.bSubordinateInterface0 = CDC_ACM_DATA_IFACE(n), \
+	}, \
+}
+
+#define CDC_ACM_COMM_INTERFACE(n) { \
+	.bLength = USB_DT_INTERFACE_SIZE, \
+	.bDescriptorType = USB_DT_INTERFACE, \
+	.bInterfaceNumber = CDC_ACM_COMM_IFACE(n), \
+	.bAlternateSetting = 0, \
+	.bNumEndpoints = 1, \
+	.bInterfaceClass = USB_CLASS_CDC, \
+	.bInterfaceSubClass = USB_CDC_SUBCLASS_ACM, \
+	.bInterfaceProtocol = USB_CDC_PROTOCOL_NONE, \
+	.iInterface = 0, \
+	.endpoint = &notify_endp[n], \
+	.extra = &functional[n], \
+	.extralen = sizeof(CdcAcmFunctional), \
+}
+
+#define CDC_ACM_DATA_INTERFACE(n) { \
+	.bLength = USB_DT_INTERFACE_SIZE, \
+	.bDescriptorType = USB_DT_INTERFACE, \
+	.bInterfaceNumber = CDC_ACM_DATA_IFACE(n), \
+	.bAlternateSetting = 0, \
+	.bNumEndpoints = 2, \
+	.bInterfaceClass = USB_CLASS_DATA, \
+	.bInterfaceSubClass = 0, \
+	.bInterfaceProtocol = 0, \
+	.iInterface = 0, \
+	.endpoint = data_endp[n], \
+}
+
+const struct usb_iface_assoc_descriptor cdcacm_assoc[CDC_ACM_PORTS] = {
+	CDC_ACM_EACH(CDC_ACM_ASSOC)
+};
+
+static const struct usb_endpoint_descriptor notify_endp[CDC_ACM_PORTS] = {
+	CDC_ACM_EACH(CDC_ACM_NOTIFY_ENDPOINT)
+};
+
+static const struct usb_endpoint_descriptor data_endp[CDC_ACM_PORTS][2] = {
+	CDC_ACM_EACH(CDC_ACM_DATA_ENDPOINTS)
+};
+
+static const CdcAcmFunctional functional[CDC_ACM_PORTS] = {
+	CDC_ACM_EACH(CDC_ACM_FUNCTIONAL)
+};
+
+const struct usb_interface_descriptor cdcacm_comm_iface[CDC_ACM_PORTS] = {
+	CDC_ACM_EACH(CDC_ACM_COMM_INTERFACE)
+};
+
+const struct usb_interface_descriptor cdcacm_data_iface[CDC_ACM_PORTS] = {
+	CDC_ACM_EACH(CDC_ACM_DATA_INTERFACE)
+};
+
+/** Port whose notification endpoint is 'ep'. */
+static CdcAcm*
+cdcacm_of_ep(uint8_t ep)
+{
+	return (&cdc_ports[((ep & 0x7F) - 1) / CDC_ACM_PORT_EPS]);
+}
+
+/**
+ * A callback function used to handle specislized messages, addressed to
+ * the communication interface of a port.
+ * @return USBD_REQ_HANDLED on successfull handling, USBD_REQ_NOTSUPP otherwise.
+ */
+static enum usbd_request_return_codes
+cdcacm_control_request(
+	usbd_device* sbd_dev __attribute((unused)),
+	struct usb_setup_data* req,
+	uint8_t** buf,
+	uint16_t* len,
+	FnComplete complete __attribute__((unused)))
+{
+	uint8_t iface = req->wIndex & 0xFF;
+	CdcAcm* p;
+
+	if (iface >= CDC_ACM_COMM_IFACE(CDC_ACM_PORTS) || (iface & 1) != 0)
+		return (USBD_REQ_NEXT_CALLBACK);
+	p = &cdc_ports[iface / 2];
+
+	switch (req->bRequest) {
+		case USB_CDC_REQ_SET_CONTROL_LINE_STATE:
+		/* The linux cdc_acm driver requires this to be implemented
+		 * even though it's optional in the CDC spec. */
+		p->lines = req->wValue & (CDC_ACM_LINE_DTR | CDC_ACM_LINE_RTS);
+		return (USBD_REQ_HANDLED);
+
+		case USB_CDC_REQ_SET_LINE_CODING:
+			if (*len < sizeof(struct usb_cdc_line_coding)) {
+				return (USBD_REQ_NOTSUPP);
+			}
+		memcpy(&p->coding, *buf, sizeof p->coding);
+		return (USBD_REQ_HANDLED);
+
+		case USB_CDC_REQ_GET_LINE_CODING:
+		*buf = (uint8_t*)&p->coding;
+		if (*len > sizeof p->coding)
+			*len = sizeof p->coding;
+		return (USBD_REQ_HANDLED);
+	}
+
+	return (USBD_REQ_NOTSUPP);
+}
+
+/** Sends a SERIAL_STATE notification if the state changed since the last. */
+static void
+cdcacm_notify(usbd_device* udev, CdcAcm* p)
+{
+	uint8_t buf[sizeof(struct usb_cdc_notification) + 2];
+	struct usb_cdc_notification* notif = (struct usb_cdc_notification*)buf;
+	uint16_t state;
+
+	if (!p->notify_pending || p->notify_busy)
+		return;
+
+	taskENTER_CRITICAL();
+	state = p->serial_state;
+	p->serial_state &= ~CDC_ACM_STATE_EVENTS;
+	p->notify_pending = false;
+	taskEXIT_CRITICAL();
+
+	notif->bmRequestType = 0xA1;
+	notif->bNotification = USB_CDC_NOTIFY_SERIAL_STATE;
+	notif->wValue = 0;
+	notif->wIndex = CDC_ACM_COMM_IFACE(p->port);
+	notif->wLength = 2;
+	buf[sizeof *notif] = state & 0xFF;
+	buf[sizeof *notif + 1] = state >> 8;
+
+	usbd_ep_write_packet(udev, CDC_ACM_NOTIFY_EP(p->port), buf, sizeof buf);
+	p->notify_busy = true;
+}
+
+static void
+cdcacm_notify_cb(usbd_device* usbd_dev, uint8_t ep)
+{
+	CdcAcm* p = cdcacm_of_ep(ep);
+
+	p->notify_busy = false;
+	cdcacm_notify(usbd_dev, p);
+}
+
+/** Sets up the pipe of every port. Called once, before the device starts. */
+void
+cdcacm_init(void)
+{
+	for (uint32_t n = 0; n < CDC_ACM_PORTS; ++n) {
+		CdcAcm* p = &cdc_ports[n];
+
+		p->port = n;
+		usb_pipe_init(&p->pipe, CDC_ACM_DATA_OUT_EP(n), CDC_ACM_DATA_IN_EP(n),
+			CDC_ACM_PACKET_SIZE, p->txbuf, sizeof p->txbuf, p->rxbuf, sizeof p->rxbuf);
+#if CDC_ACM_DOUBLE_BUFFER
+		usb_pipe_double_buffer(&p->pipe);
+#endif
+		usb_pipe_set_latency(&p->pipe, CDC_ACM_LATENCY);
+		p->coding.dwDTERate = 115200;
+		p->coding.bCharFormat = USB_CDC_1_STOP_BITS;
+		p->coding.bParityType = USB_CDC_NO_PARITY;
+		p->coding.bDataBits = 8;
+	}
+}
+
+/**
+ * Called when the host selects the configuration: sets up the endpoints of
+ * every port and reports carrier, so the host sees the line up.
+ */
+void
+cdcacm_set_config(usbd_device* udev)
+{
+	for (uint32_t n = 0; n < CDC_ACM_PORTS; ++n) {
+		CdcAcm* p = &cdc_ports[n];
+
+		usb_pipe_set_config(&p->pipe, udev);
+		usbd_ep_setup(udev, CDC_ACM_NOTIFY_EP(n), USB_ENDPOINT_ATTR_INTERRUPT,
+			CDC_ACM_NOTIFY_SIZE, cdcacm_notify_cb);
+
+		p->notify_busy = false;
+		p->lines = 0;
+		cdcacm_set_serial_state(p, CDC_ACM_STATE_DCD | CDC_ACM_STATE_DSR);
+	}
+
+	usbd_register_control_callback(udev, USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+										USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+										cdcacm_control_request);
+}
+
+/** Called on a bus reset: the ports are down until the next configuration. */
+void
+cdcacm_reset(void)
+{
+	for (uint32_t n = 0; n < CDC_ACM_PORTS; ++n) {
+		usb_pipe_reset(&cdc_ports[n].pipe);
+		cdc_ports[n].lines = 0;
+	}
+}
+
+/**
+ * Called by the USB task after servicing the peripheral: moves the data of
+ * every port and sends pending notifications.
+ */
+void
+cdcacm_poll(usbd_device* udev)
+{
+	for (uint32_t n = 0; n < CDC_ACM_PORTS; ++n) {
+		CdcAcm* p = &cdc_ports[n];
+
+		if (!p->pipe.configured)
+			continue;
+
+		usb_pipe_poll(&p->pipe, udev);
+		cdcacm_notify(udev, p);
+	}
+}
+
+/**
+ * Tells whether a port holds a short packet back for its latency timer, for
+ * the USB task to take SOF interrupts only then.
+ */
+bool
+cdcacm_tx_held(void)
+{
+	for (uint32_t n = 0; n < CDC_ACM_PORTS; ++n) {
+		if (usb_pipe_tx_held(&cdc_ports[n].pipe))
+			return (true);
+	}
+	return (false);
+}
+
+/** Tells whether a port has data queued for the host, to wake it up. */
+bool
+cdcacm_tx_pending(void)
+{
+	for (uint32_t n = 0; n < CDC_ACM_PORTS; ++n) {
+		if (usb_pipe_tx_pending(&cdc_ports[n].pipe))
+			return (true);
+	}
+	return (false);
+}
+
+/** Called on every start of frame while cdcacm_tx_held(). */
+void
+cdcacm_sof(void)
+{
+	for (uint32_t n = 0; n < CDC_ACM_PORTS; ++n)
+		usb_pipe_sof(&cdc_ports[n].pipe);
+}
+
+CdcAcm*
+cdcacm_get(uint32_t port)
+{
+	configASSERT(port < CDC_ACM_PORTS);
+	return (&cdc_ports[port]);
+}
+
+/** The byte stream of the port's data interface. */
+UsbPipe*
+cdcacm_pipe(CdcAcm* p)
+{
+	return (&p->pipe);
+}
+
+/** True while the host has the port configured. */
+bool
+cdcacm_configured(CdcAcm* p)
+{
+	return (p->pipe.configured);
+}
+
+/** CDC_ACM_LINE_* bits last set by the host; DTR means a terminal is open. */
+uint16_t
+cdcacm_control_lines(CdcAcm* p)
+{
+	return (p->lines);
+}
+
+void
+cdcacm_get_line_coding(CdcAcm* p, struct usb_cdc_line_coding* coding)
+{
+	taskENTER_CRITICAL();
+	*coding = p->coding;
+	taskEXIT_CRITICAL();
+}
+
+/**
+ * Reports CDC_ACM_STATE_* bits to the host on the notification endpoint.
+ * Event bits (break, ring, errors) are sent once; the level bits stay.
+ */
+void
+cdcacm_set_serial_state(CdcAcm* p, uint16_t state)
+{
+	taskENTER_CRITICAL();
+	p->serial_state = state;
+	p->notify_pending = true;
+	taskEXIT_CRITICAL();
+	usb_wake();
+}
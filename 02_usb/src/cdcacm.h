@@ -0,0 +1,121 @@
+#ifndef CDCACM_H
+#define CDCACM_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "FreeRTOS.h"
+#include "usb_pipe.h"
+
+#include <libopencm3/usb/usbd.h>
+#include <libopencm3/usb/cdc.h>
+
+/* Number of CDC-ACM functions. Port n uses interfaces 2n (communication)
+ * and 2n + 1 (data), endpoint 2n + 1 for bulk data in both directions and
+ * endpoint 2n + 2 IN for notifications. The ports are grouped into
+ * functions of a composite device by interface association descriptors. */
+#ifndef CDC_ACM_PORTS
+#define CDC_ACM_PORTS		2
+#endif
+
+/* Double-buffer the bulk data endpoints: the host sends the next packet
+ * while the last is copied out, and gets the next IN packet without waiting
+ * for the USB task. Double-buffered endpoints work one way only, so port n
+ * then takes endpoint 3n + 1 for data OUT, 3n + 2 for data IN and 3n + 3
+ * for notifications, and twice the packet memory: one port fits. */
+#ifndef CDC_ACM_DOUBLE_BUFFER
+#define CDC_ACM_DOUBLE_BUFFER	0
+#endif
+
+#if CDC_ACM_DOUBLE_BUFFER
+#define CDC_ACM_PORT_EPS	3
+#else
+#define CDC_ACM_PORT_EPS	2
+#endif
+
+#define CDC_ACM_DATA_OUT_EP(n)	(CDC_ACM_PORT_EPS * (n) + 1)
+#define CDC_ACM_DATA_IN_EP(n)	(0x80 | (CDC_ACM_PORT_EPS * (n) + CDC_ACM_PORT_EPS - 1))
+#define CDC_ACM_NOTIFY_EP(n)	(0x80 | (CDC_ACM_PORT_EPS * (n) + CDC_ACM_PORT_EPS))
+
+/* Endpoint numbers the ports take, from 1. */
+#define CDC_ACM_EP_COUNT	(CDC_ACM_PORT_EPS * CDC_ACM_PORTS)
+
+/* Expands 'm(n)' for every port, comma separated, to build per-port
+ * descriptor tables at compile time. */
+#if CDC_ACM_PORTS == 1
+#define CDC_ACM_EACH(m)		m(0)
+#elif CDC_ACM_PORTS == 2
+#define CDC_ACM_EACH(m)		m(0), m(1)
+#elif CDC_ACM_PORTS == 3
+#define CDC_ACM_EACH(m)		m(0), m(1), m(2)
+#else
+#error "CDC_ACM_PORTS must be 1 to 3"
+#endif
+
+/* Size of the bulk data endpoints, the most a full-speed bulk packet holds. */
+#define CDC_ACM_PACKET_SIZE	64
+
+/* Latency timer of the data IN endpoints in frames of 1 ms, as on FTDI
+ * adapters: a short packet is held this long for more writes to fill it,
+ * unless usb_pipe_flush() sends it first. 0 sends at once. Can be changed
+ * per port with usb_pipe_set_latency(). */
+#ifndef CDC_ACM_LATENCY
+#define CDC_ACM_LATENCY		0
+#endif
+
+/* Size of the TX ring in bytes. Must be a power of two. A few packets'
+ * worth lets the IN endpoint be reloaded from its completion while the
+ * application keeps writing. */
+#ifndef CDC_ACM_TX_RING_SIZE
+#define CDC_ACM_TX_RING_SIZE	512
+#endif
+
+/* Size of the RX ring in bytes. Must be a power of two. */
+#ifndef CDC_ACM_RX_RING_SIZE
+#define CDC_ACM_RX_RING_SIZE	512
+#endif
+
+/* Size of the notification endpoint; SERIAL_STATE takes 10 bytes. */
+#define CDC_ACM_NOTIFY_SIZE	16
+
+/* Packet memory the endpoints of one port take. */
+#define CDC_ACM_PMA_SIZE	((CDC_ACM_DOUBLE_BUFFER + 1) * 2 * CDC_ACM_PACKET_SIZE \
+	+ CDC_ACM_NOTIFY_SIZE)
+
+/* SET_CONTROL_LINE_STATE bits set by the host. */
+#define CDC_ACM_LINE_DTR	0x0001
+#define CDC_ACM_LINE_RTS	0x0002
+
+/* SERIAL_STATE bits reported to the host (CDC PSTN 6.5.4). */
+#define CDC_ACM_STATE_DCD		0x0001	/* bRxCarrier */
+#define CDC_ACM_STATE_DSR		0x0002	/* bTxCarrier */
+#define CDC_ACM_STATE_BREAK		0x0004
+#define CDC_ACM_STATE_RING		0x0008
+#define CDC_ACM_STATE_FRAMING	0x0010
+#define CDC_ACM_STATE_PARITY	0x0020
+#define CDC_ACM_STATE_OVERRUN	0x0040
+
+/* One CDC-ACM function, holding its data pipe and line state. */
+typedef struct CdcAcm CdcAcm;
+
+/* Descriptors of every port, for the configuration descriptor. */
+extern const struct usb_iface_assoc_descriptor cdcacm_assoc[CDC_ACM_PORTS];
+extern const struct usb_interface_descriptor cdcacm_comm_iface[CDC_ACM_PORTS];
+extern const struct usb_interface_descriptor cdcacm_data_iface[CDC_ACM_PORTS];
+
+void cdcacm_init(void);
+void cdcacm_set_config(usbd_device* udev);
+void cdcacm_reset(void);
+void cdcacm_poll(usbd_device* udev);
+bool cdcacm_tx_held(void);
+bool cdcacm_tx_pending(void);
+void cdcacm_sof(void);
+
+CdcAcm* cdcacm_get(uint32_t port);
+UsbPipe* cdcacm_pipe(CdcAcm* p);
+bool cdcacm_configured(CdcAcm* p);
+uint16_t cdcacm_control_lines(CdcAcm* p);
+void cdcacm_get_line_coding(CdcAcm* p, struct usb_cdc_line_coding* coding);
+void cdcacm_set_serial_state(CdcAcm* p, uint16_t state);
+
+#endif // !CDCACM_H
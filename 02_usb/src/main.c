@@ -2,21 +2,307 @@
 #include "task.h"
 #include "semphr.h"
 #include "usbcdc.h"
+#include "cdcacm.h"
+#include "usb_power.h"
+#include "usb_vendor.h"
+#include "runtime_stats.h"
+#include "pma_bench.h"
 
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/dbgmcu.h>
 #include <libopencm3/cm3/nvic.h>
 
+#define KEY_STATUS	0x14	// Ctrl-T, as in BSD's SIGINFO.
+#define KEY_BENCH	0x02	// Ctrl-B
+
+/* Port 0 is the console; port 1, if there is one, carries telemetry. */
+#define CONSOLE_PORT	0
+#define TELEMETRY_PORT	1
+
+#define TELEMETRY_PERIOD	pdMS_TO_TICKS(1000)
+
+static CdcAcm* console;
+
+/* Packet memory copy timings, taken before the USB peripheral starts. */
+static PmaBenchResult pma_results[PMA_BENCH_COUNT];
+
+static void
+write_string(UsbPipe* out, const char* str)
+{
+	uint32_t len = 0;
+
+	while (str[len] != '\0')
+		++len;
+	usb_pipe_write(out, str, len);
+}
+
+static void
+write_number(UsbPipe* out, uint32_t num)
+{
+	char buf[11];
+	char* p = &buf[sizeof buf - 1];
+
+	*p = '\0';
+	do {
+		*--p = '0' + (num % 10);
+		num /= 10;
+	} while (num != 0);
+
+	write_string(out, p);
+}
+
+/**
+ * Prints the share of time spent in the idle task since the last call,
+ * from the run-time stats counters. This is the CPU headroom the USB
+ * service mode leaves to the application.
+ */
+static void
+write_idle(UsbPipe* out)
+{
+	static uint32_t last_idle, last_total;
+	uint32_t idle = ulTaskGetIdleRunTimeCounter();
+	uint32_t total = runtime_stats_counter();
+	uint32_t d_idle = idle - last_idle;
+	uint32_t d_total = total - last_total;
+
+	last_idle = idle;
+	last_total = total;
+
+	write_string(out, "idle: ");
+	write_number(out, d_total ? (uint32_t)((uint64_t)d_idle * 100 / d_total) : 0);
+	write_string(out, "%\r\n");
+}
+
+/** Prints an average and maximum latency in microseconds. */
+static void
+write_latency(UsbPipe* out, const char* name, uint32_t sum, uint32_t count, uint32_t max)
+{
+	uint32_t per_us = rcc_ahb_frequency / 1000000;
+
+	write_string(out, name);
+	write_number(out, count ? sum / count / per_us : 0);
+	write_string(out, " us avg, ");
+	write_number(out, max / per_us);
+	write_string(out, " us max\r\n");
+}
+
+/** Prints the traffic counters of 'pipe'. */
+static void
+write_pipe(UsbPipe* out, const char* name, UsbPipe* pipe)
+{
+	UsbPipeStats st;
+
+	usb_pipe_get_stats(pipe, &st);
+
+	write_string(out, name);
+	write_string(out, " in packets: ");
+	write_number(out, st.in_packets);
+	write_string(out, " bytes: ");
+	write_number(out, st.in_bytes);
+	write_string(out, " zlps: ");
+	write_number(out, st.in_zlps);
+	write_string(out, " expired: ");
+	write_number(out, st.in_expired);
+	write_string(out, " flushed: ");
+	write_number(out, st.in_flushed);
+	write_string(out, "\r\n");
+	write_string(out, name);
+	write_string(out, " out packets: ");
+	write_number(out, st.out_packets);
+	write_string(out, " bytes: ");
+	write_number(out, st.out_bytes);
+	write_string(out, " throttled: ");
+	write_number(out, st.out_throttled);
+	write_string(out, "\r\n");
+	write_latency(out, "in latency: ", st.in_latency_sum, st.in_timed, st.in_latency_max);
+	write_latency(out, "out latency: ", st.out_latency_sum, st.out_packets, st.out_latency_max);
+}
+
+static void
+write_status(void)
+{
+	UsbPipe* out = cdcacm_pipe(console);
+	UsbStats usb;
+	UsbPowerStats power;
+	struct usb_cdc_line_coding coding;
+
+	usb_get_stats(&usb);
+	usb_power_get_stats(&power);
+	cdcacm_get_line_coding(console, &coding);
+
+	write_string(out, "\r\nmode: ");
+	write_string(out, USB_SERVICE_MODE == USB_SERVICE_IRQ ? "irq" : "poll");
+	write_string(out, " irqs: ");
+	write_number(out, usb.irqs);
+	write_string(out, " wakeups: ");
+	write_number(out, usb.wakeups);
+	write_string(out, " polls: ");
+	write_number(out, usb.polls);
+	write_string(out, " sofs: ");
+	write_number(out, usb.sofs);
+	write_string(out, "\r\nsuspends: ");
+	write_number(out, power.suspends);
+	write_string(out, " resumes: ");
+	write_number(out, power.resumes);
+	write_string(out, " stops: ");
+	write_number(out, power.stops);
+	write_string(out, " remote wakeups: ");
+	write_number(out, power.remote_wakeups);
+	write_string(out, "\r\nline: ");
+	write_number(out, coding.dwDTERate);
+	write_string(out, " baud, dtr: ");
+	write_number(out, (cdcacm_control_lines(console) & CDC_ACM_LINE_DTR) != 0);
+	write_string(out, " rts: ");
+	write_number(out, (cdcacm_control_lines(console) & CDC_ACM_LINE_RTS) != 0);
+	write_string(out, "\r\n");
+	write_pipe(out, "console", out);
+#if USB_VENDOR
+	write_pipe(out, "vendor", usb_vendor_pipe());
+#endif
+	write_idle(out);
+}
+
+static void
+write_cycles(UsbPipe* out, const char* name, uint32_t cycles)
+{
+	write_string(out, name);
+	write_number(out, cycles);
+}
+
+/** Prints the packet memory copy timings, in cycles per packet. */
+static void
+write_bench(void)
+{
+	UsbPipe* out = cdcacm_pipe(console);
+
+	write_string(out, "\r\npma copy cycles per packet");
+	for (uint32_t x = 0; x < PMA_BENCH_COUNT; ++x) {
+		const PmaBenchResult* res = &pma_results[x];
+
+		write_string(out, "\r\n");
+		write_number(out, res->bytes);
+		write_cycles(out, " bytes to pm: ref ", res->to_ref);
+		write_cycles(out, " new ", res->to_pm);
+		write_cycles(out, " odd ", res->to_pm_odd);
+		write_cycles(out, " bounce ", res->to_bounce);
+		write_cycles(out, " gather ", res->to_sg);
+		write_cycles(out, "\r\n   from pm: ref ", res->from_ref);
+		write_cycles(out, " new ", res->from_pm);
+		write_cycles(out, " odd ", res->from_pm_odd);
+		write_cycles(out, " bounce ", res->from_bounce);
+		write_cycles(out, " scatter ", res->from_sg);
+	}
+	write_string(out, "\r\n");
+}
+
+/**
+ * Echoes what the host sends, straight out of the RX ring; Ctrl-T prints
+ * the USB and load counters, Ctrl-B the packet memory copy timings. Each
+ * echo is flushed, so typing never waits for the latency timer.
+ */
+static void
+task_main(void* args __attribute((unused)))
+{
+	UsbPipe* pipe = cdcacm_pipe(console);
+
+	for (;;) {
+		const uint8_t* data;
+		uint32_t len = usb_pipe_read_span(pipe, &data, portMAX_DELAY);
+		uint32_t start = 0;
+
+		for (uint32_t x = 0; x < len; ++x) {
+			if (data[x] == KEY_STATUS || data[x] == KEY_BENCH) {
+				usb_pipe_write(pipe, &data[start], x - start);
+				if (data[x] == KEY_STATUS)
+					write_status();
+				else
+					write_bench();
+				start = x + 1;
+			}
+		}
+		usb_pipe_write(pipe, &data[start], len - start);
+		usb_pipe_flush(pipe);
+		usb_pipe_read_consume(pipe, len);
+		gpio_toggle(GPIOC, GPIO13);
+	}
+}
+
+#if CDC_ACM_PORTS > TELEMETRY_PORT
+
+/**
+ * Streams the console port's counters once a second while a terminal has
+ * the telemetry port open. Nothing is queued while it is closed, so the
+ * task never blocks on a full ring nobody reads. The lines are not flushed:
+ * with a latency timer they go out in as few packets as fit.
+ */
+static void
+task_telemetry(void* args __attribute((unused)))
+{
+	CdcAcm* port = cdcacm_get(TELEMETRY_PORT);
+	UsbPipe* out = cdcacm_pipe(port);
+	TickType_t wake = xTaskGetTickCount();
+
+	for (;;) {
+		vTaskDelayUntil(&wake, TELEMETRY_PERIOD);
+		if ((cdcacm_control_lines(port) & CDC_ACM_LINE_DTR) == 0)
+			continue;
+
+		write_number(out, wake);
+		write_string(out, " ticks\r\n");
+		write_pipe(out, "console", cdcacm_pipe(console));
+	}
+}
+
+#endif
+
+#if USB_VENDOR
+
+/**
+ * Sends back whatever arrives on the vendor interface, for host tools to
+ * check the channel. A firmware update service would sit here.
+ */
+static void
+task_vendor(void* args __attribute((unused)))
+{
+	UsbPipe* pipe = usb_vendor_pipe();
+
+	for (;;) {
+		const uint8_t* data;
+		uint32_t len = usb_pipe_read_span(pipe, &data, portMAX_DELAY);
+
+		usb_pipe_write(pipe, data, len);
+		usb_pipe_read_consume(pipe, len);
+	}
+}
+
+#endif
+
 int
 main(void)
 {
 	rcc_clock_setup_pll(&rcc_hse_configs[RCC_CLOCK_HSE8_72MHZ]);
+	usb_power_init(&rcc_hse_configs[RCC_CLOCK_HSE8_72MHZ]);
 	rcc_periph_clock_enable(RCC_GPIOC);
 	gpio_set_mode(GPIOC, GPIO_MODE_OUTPUT_2_MHZ, GPIO_CNF_OUTPUT_PUSHPULL, GPIO13);
 
+	/* Keep the DWT cycle counter behind the latency figures running while
+	 * the idle task sleeps in WFI. */
+	DBGMCU_CR |= DBGMCU_CR_SLEEP;
+
+	pma_bench_all(pma_results);
 	usb_start();
-	
+	console = cdcacm_get(CONSOLE_PORT);
+
+	xTaskCreate(task_main, "MAIN", 200, NULL, tskIDLE_PRIORITY + 1, NULL);
+#if CDC_ACM_PORTS > TELEMETRY_PORT
+	xTaskCreate(task_telemetry, "TELEM", 200, NULL, tskIDLE_PRIORITY + 1, NULL);
+#endif
+#if USB_VENDOR
+	xTaskCreate(task_vendor, "VENDOR", 100, NULL, tskIDLE_PRIORITY + 1, NULL);
+#endif
+
 	vTaskStartScheduler();
-	for (;;)
+	for (;;);
 	return (0);
-}
\ No newline at end of file
+}
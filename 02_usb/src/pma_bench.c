@@ -0,0 +1,188 @@
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "pma_bench.h"
+
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/st_usbfs.h>
+#include <libopencm3/cm3/dwt.h>
+
+/* libopencm3's packet memory copies; their prototypes are in its private
+ * st_usbfs_core.h. */
+void st_usbfs_copy_to_pm(volatile void* vPM, const void* buf, uint16_t len);
+void st_usbfs_copy_from_pm(void* buf, const volatile void* vPM, uint16_t len);
+void st_usbfs_copy_to_pm_sg(volatile void* vPM, const void* buf1, uint16_t len1,
+	const void* buf2, uint16_t len2);
+void st_usbfs_copy_from_pm_sg(void* buf1, uint16_t len1, void* buf2, uint16_t len2,
+	const volatile void* vPM);
+
+#define BENCH_RUNS		8		// Best of this many runs.
+#define BENCH_PACKET	64		// Largest packet timed.
+#define BENCH_PMA		0x40	// Packet memory offset used, past the buffer table.
+
+/* Where a ring wraps in the gather/scatter cases: an odd split, the worst. */
+#define BENCH_SPLIT(bytes)	((bytes) / 2 | 1)
+
+/* Packet memory as the CPU sees it: halfword n of a buffer at byte 4n. */
+#define BENCH_PM	((volatile void*)(USB_PMA_BASE + BENCH_PMA * 2))
+
+static uint32_t bench_ram[BENCH_PACKET / 4 + 1];
+static uint32_t bench_seg1[BENCH_PACKET / 4 + 1];
+static uint32_t bench_seg2[BENCH_PACKET / 4 + 1];
+
+/** The copy to packet memory st_usbfs_v1 had before, for reference. */
+static void
+ref_copy_to_pm(volatile void* vPM, const void* buf, uint16_t len)
+{
+	const uint16_t* lbuf = buf;
+	volatile uint32_t* PM = vPM;
+
+	for (len = (len + 1) >> 1; len; len--)
+		*PM++ = *lbuf++;
+}
+
+/** The copy from packet memory st_usbfs_v1 had before, for reference. */
+static void
+ref_copy_from_pm(void* buf, const volatile void* vPM, uint16_t len)
+{
+	uint16_t* lbuf = buf;
+	const volatile uint16_t* PM = vPM;
+	uint8_t odd = len & 1;
+
+	for (len >>= 1; len; PM += 2, lbuf++, len--)
+		*lbuf = *PM;
+
+	if (odd)
+		*(uint8_t*)lbuf = *(uint8_t*)PM;
+}
+
+/* The cases, each moving one packet of 'bytes' bytes. */
+
+static void
+case_to_ref(uint32_t bytes)
+{
+	ref_copy_to_pm(BENCH_PM, bench_ram, bytes);
+}
+
+static void
+case_to_pm(uint32_t bytes)
+{
+	st_usbfs_copy_to_pm(BENCH_PM, bench_ram, bytes);
+}
+
+static void
+case_to_pm_odd(uint32_t bytes)
+{
+	st_usbfs_copy_to_pm(BENCH_PM, (uint8_t*)bench_ram + 1, bytes);
+}
+
+static void
+case_to_bounce(uint32_t bytes)
+{
+	uint8_t packet[BENCH_PACKET];
+
+	memcpy(packet, bench_seg1, BENCH_SPLIT(bytes));
+	memcpy(packet + BENCH_SPLIT(bytes), bench_seg2, bytes - BENCH_SPLIT(bytes));
+	st_usbfs_copy_to_pm(BENCH_PM, packet, bytes);
+}
+
+static void
+case_to_sg(uint32_t bytes)
+{
+	st_usbfs_copy_to_pm_sg(BENCH_PM, bench_seg1, BENCH_SPLIT(bytes),
+		bench_seg2, bytes - BENCH_SPLIT(bytes));
+}
+
+static void
+case_from_ref(uint32_t bytes)
+{
+	ref_copy_from_pm(bench_ram, BENCH_PM, bytes);
+}
+
+static void
+case_from_pm(uint32_t bytes)
+{
+	st_usbfs_copy_from_pm(bench_ram, BENCH_PM, bytes);
+}
+
+static void
+case_from_pm_odd(uint32_t bytes)
+{
+	st_usbfs_copy_from_pm((uint8_t*)bench_ram + 1, BENCH_PM, bytes);
+}
+
+static void
+case_from_bounce(uint32_t bytes)
+{
+	uint8_t packet[BENCH_PACKET];
+
+	st_usbfs_copy_from_pm(packet, BENCH_PM, bytes);
+	memcpy(bench_seg1, packet, BENCH_SPLIT(bytes));
+	memcpy(bench_seg2, packet + BENCH_SPLIT(bytes), bytes - BENCH_SPLIT(bytes));
+}
+
+static void
+case_from_sg(uint32_t bytes)
+{
+	st_usbfs_copy_from_pm_sg(bench_seg1, BENCH_SPLIT(bytes),
+		bench_seg2, bytes - BENCH_SPLIT(bytes), BENCH_PM);
+}
+
+/** Best time of BENCH_RUNS runs of 'fn', with interrupts masked. */
+static uint32_t
+bench_time(void (*fn)(uint32_t), uint32_t bytes)
+{
+	uint32_t best = UINT32_MAX;
+
+	for (uint32_t run = 0; run < BENCH_RUNS; ++run) {
+		uint32_t start, cycles;
+
+		taskENTER_CRITICAL();
+		start = dwt_read_cycle_counter();
+		fn(bytes);
+		cycles = dwt_read_cycle_counter() - start;
+		taskEXIT_CRITICAL();
+
+		if (cycles < best)
+			best = cycles;
+	}
+	return (best);
+}
+
+/**
+ * Times the packet memory copies for one packet size against the loops
+ * they replaced, and ring-segment gather/scatter against a bounce buffer.
+ * It scribbles on the packet memory, so it must run before usb_start()
+ * sets up the peripheral.
+ */
+void
+pma_bench(uint32_t bytes, PmaBenchResult* res)
+{
+	configASSERT(bytes > 1 && bytes <= BENCH_PACKET);
+
+	rcc_periph_clock_enable(RCC_USB);
+	dwt_enable_cycle_counter();
+
+	res->bytes = bytes;
+	res->to_ref = bench_time(case_to_ref, bytes);
+	res->to_pm = bench_time(case_to_pm, bytes);
+	res->to_pm_odd = bench_time(case_to_pm_odd, bytes);
+	res->to_bounce = bench_time(case_to_bounce, bytes);
+	res->to_sg = bench_time(case_to_sg, bytes);
+	res->from_ref = bench_time(case_from_ref, bytes);
+	res->from_pm = bench_time(case_from_pm, bytes);
+	res->from_pm_odd = bench_time(case_from_pm_odd, bytes);
+	res->from_bounce = bench_time(case_from_bounce, bytes);
+	res->from_sg = bench_time(case_from_sg, bytes);
+}
+
+/** Runs pma_bench() for every size in PMA_BENCH_SIZES. */
+void
+pma_bench_all(PmaBenchResult res[PMA_BENCH_COUNT])
+{
+	static const uint32_t sizes[PMA_BENCH_COUNT] = PMA_BENCH_SIZES;
+
+	for (uint32_t x = 0; x < PMA_BENCH_COUNT; ++x)
+		pma_bench(sizes[x], &res[x]);
+}
@@ -0,0 +1,31 @@
+#ifndef PMA_BENCH_H
+#define PMA_BENCH_H
+
+#include <stdint.h>
+
+/* Packet sizes timed by pma_bench_all(). */
+#define PMA_BENCH_SIZES		{ 8, 16, 32, 63, 64 }
+#define PMA_BENCH_COUNT		5
+
+/**
+ * DWT cycles needed to move one packet of 'bytes' bytes between RAM and the
+ * USB packet memory, best of several runs.
+ */
+typedef struct {
+	uint32_t bytes;
+	uint32_t to_ref;		// Halfword loop st_usbfs_v1 used to have.
+	uint32_t to_pm;			// st_usbfs_copy_to_pm(), word-aligned buffer.
+	uint32_t to_pm_odd;		// st_usbfs_copy_to_pm(), buffer at an odd address.
+	uint32_t to_bounce;		// Two ring segments gathered into a buffer, then copied.
+	uint32_t to_sg;			// st_usbfs_copy_to_pm_sg() from the two segments.
+	uint32_t from_ref;
+	uint32_t from_pm;
+	uint32_t from_pm_odd;
+	uint32_t from_bounce;
+	uint32_t from_sg;
+} PmaBenchResult;
+
+void pma_bench(uint32_t bytes, PmaBenchResult* res);
+void pma_bench_all(PmaBenchResult res[PMA_BENCH_COUNT]);
+
+#endif // !PMA_BENCH_H
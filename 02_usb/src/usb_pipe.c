@@ -0,0 +1,407 @@
+#include <string.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+#include "usbcdc.h"
+#include "usb_pipe.h"
+
+#include <libopencm3/cm3/dwt.h>
+
+/* Largest full-speed bulk packet. */
+#define USB_PIPE_PACKET_MAX	64
+
+/* Endpoint numbers of the USB peripheral. */
+#define USB_PIPE_EP_COUNT	8
+
+/* Pipe on each endpoint number, for the endpoint callbacks. */
+static UsbPipe* pipe_of_ep[USB_PIPE_EP_COUNT];
+
+/**
+ * Sets up 'p' on bulk endpoints 'ep_out' and 'ep_in' with rings over 'txbuf'
+ * and 'rxbuf', whose sizes must be powers of two; the RX ring must hold at
+ * least two packets. The pipe must stay allocated.
+ */
+void
+usb_pipe_init(UsbPipe* p, uint8_t ep_out, uint8_t ep_in, uint16_t packet_size,
+	uint8_t* txbuf, uint32_t txsize, uint8_t* rxbuf, uint32_t rxsize)
+{
+	uint8_t in = ep_in & 0x7F;
+
+	configASSERT(ep_out > 0 && ep_out < USB_PIPE_EP_COUNT && pipe_of_ep[ep_out] == NULL);
+	configASSERT(in > 0 && in < USB_PIPE_EP_COUNT && (in == ep_out || pipe_of_ep[in] == NULL));
+	configASSERT(packet_size <= USB_PIPE_PACKET_MAX && rxsize >= 2 * packet_size);
+
+	memset(p, 0, sizeof *p);
+	p->ep_out = ep_out;
+	p->ep_in = 0x80 | in;
+	p->packet_size = packet_size;
+	ringbuf_init(&p->txq, txbuf, txsize);
+	ringbuf_init(&p->rxq, rxbuf, rxsize);
+
+	/* Two packets must fit on top of the high watermark: the one that
+	 * crossed it and the one already in the endpoint. */
+	p->rx_high = rxsize - 2 * packet_size;
+	p->rx_low = p->rx_high / 2;
+
+	pipe_of_ep[ep_out] = p;
+	pipe_of_ep[in] = p;
+}
+
+/**
+ * Double-buffers both endpoints of 'p', which must have different numbers
+ * then. The IN endpoint takes two packets at a time and the OUT endpoint
+ * receives the next packet while the last is read. Call before the device
+ * starts.
+ */
+void
+usb_pipe_double_buffer(UsbPipe* p)
+{
+	configASSERT(p->ep_out != (p->ep_in & 0x7F));
+	p->double_buffer = true;
+}
+
+/**
+ * Tells whether a short IN packet may go out now: without a latency timer,
+ * once the timer has run out, or while data flushed by usb_pipe_flush() or
+ * the zero-length packet closing it are still in the ring.
+ */
+static bool
+usb_pipe_tx_due(UsbPipe* p)
+{
+	return (p->latency == 0 || p->tx_age >= p->latency || p->tx_flush != p->tx_flushed);
+}
+
+/**
+ * Loads the next IN packet. It is full whenever the ring holds that much,
+ * copied straight from the ring into packet memory: from both segments if
+ * the bytes wrap. A transfer that ends on a full packet is closed with a
+ * zero-length one, or the host would wait for more. A short packet, which
+ * closes the transfer, waits for usb_pipe_tx_due(). Returns false if there
+ * was nothing to send.
+ */
+static bool
+usb_pipe_tx(UsbPipe* p, usbd_device* udev)
+{
+	const uint8_t* txbuf;
+	uint32_t len1 = ringbuf_read_span(&p->txq, &txbuf);
+	uint32_t len2 = 0;
+	uint32_t txlen, flush;
+
+	if (len1 >= p->packet_size) {
+		len1 = p->packet_size;
+	} else {
+		len2 = ringbuf_used(&p->txq) - len1;
+		if (len2 > p->packet_size - len1)
+			len2 = p->packet_size - len1;
+	}
+	txlen = len1 + len2;
+
+	if (txlen == 0 && !p->tx_zlp) {
+		flush = p->tx_flush;
+		if ((int32_t)(p->txq.tail - flush) >= 0)
+			p->tx_flushed = flush;	// Everything it covered is out.
+		return (false);
+	}
+	if (txlen < p->packet_size && !usb_pipe_tx_due(p))
+		return (false);	// Held; a write, a flush or the next SOF looks again.
+	/* A busy endpoint takes nothing, which the driver reports as 0 bytes
+	 * written: for a ZLP, the same as success. Counted here instead. */
+	if (p->tx_queued == (p->double_buffer ? 2 : 1))
+		return (false);	// Still busy; its completion calls us again.
+	if (usbd_ep_write_packet_gather(udev, p->ep_in, txbuf, len1, p->txq.buf, len2) != txlen)
+		return (false);
+
+	++p->tx_queued;
+	p->tx_zlp = txlen == p->packet_size;
+	if (txlen < p->packet_size) {
+		/* The transfer is closed: count what made the packet go and
+		 * retire the flush once everything it covered is out. */
+		flush = p->tx_flush;
+		if (p->latency != 0 && p->tx_age >= p->latency)
+			++p->stats.in_expired;
+		else if (flush != p->tx_flushed)
+			++p->stats.in_flushed;
+		if ((int32_t)(p->txq.tail + txlen - flush) >= 0)
+			p->tx_flushed = flush;
+	}
+	p->tx_age = 0;
+
+	if (txlen == 0) {
+		++p->stats.in_zlps;
+		return (true);
+	}
+
+	ringbuf_read_release(&p->txq, txlen);	// Data have been sent successfully
+	++p->stats.in_packets;
+	p->stats.in_bytes += txlen;
+
+	if (p->tx_timing) {
+		uint32_t latency = dwt_read_cycle_counter() - p->tx_stamp;
+
+		p->tx_timing = false;
+		++p->stats.in_timed;
+		p->stats.in_latency_sum += latency;
+		if (latency > p->stats.in_latency_max)
+			p->stats.in_latency_max = latency;
+	}
+	return (true);
+}
+
+/**
+ * Loads IN packets until the endpoint is full: one, or two if it is
+ * double-buffered.
+ */
+static void
+usb_pipe_tx_fill(UsbPipe* p, usbd_device* udev)
+{
+	while (usb_pipe_tx(p, udev) && p->double_buffer)
+		;
+}
+
+/**
+ * Invoked when the host has taken the IN packet. The next one is loaded
+ * right away, so the endpoint stays busy for as long as there is data.
+ */
+static void
+usb_pipe_tx_cb(usbd_device* usbd_dev, uint8_t ep)
+{
+	UsbPipe* p = pipe_of_ep[ep & 0x7F];
+
+	if (p->tx_queued > 0)
+		--p->tx_queued;
+	usb_pipe_tx_fill(p, usbd_dev);
+}
+
+/**
+ * This callback function is invoked by the USB infrastructure when data
+ * has been sent over the bus to the STM32 MCU.
+ *
+ * The packet is read straight into the RX ring, scattered over both ends
+ * where the free space wraps. Once the ring is past its high watermark the
+ * endpoint is left NAKing after this read, so the ring always has room for
+ * the packet in the endpoint and none is dropped.
+ */
+static void
+usb_pipe_rx_cb(usbd_device* usbd_dev, uint8_t ep)
+{
+	UsbPipe* p = pipe_of_ep[ep];
+	uint8_t* span;
+	uint32_t len1, len, latency;
+
+	if (ringbuf_used(&p->rxq) > p->rx_high) {
+		usbd_ep_nak_set(usbd_dev, ep, 1);
+		p->rx_throttled = true;
+		++p->stats.out_throttled;
+	}
+
+	len1 = ringbuf_write_span(&p->rxq, &span);
+	if (len1 >= p->packet_size) {
+		len = usbd_ep_read_packet(usbd_dev, ep, span, p->packet_size);
+	} else {
+		len = usbd_ep_read_packet_scatter(usbd_dev, ep, span, len1,
+			p->rxq.buf, p->packet_size - len1);
+	}
+	ringbuf_write_commit(&p->rxq, len);
+
+	latency = dwt_read_cycle_counter() - usb_event_time();
+	++p->stats.out_packets;
+	p->stats.out_bytes += len;
+	p->stats.out_latency_sum += latency;
+	if (latency > p->stats.out_latency_max)
+		p->stats.out_latency_max = latency;
+}
+
+/** Sets up the endpoints of 'p' when the host selects the configuration. */
+void
+usb_pipe_set_config(UsbPipe* p, usbd_device* udev)
+{
+	uint8_t type = USB_ENDPOINT_ATTR_BULK | (p->double_buffer ? USBD_EP_DOUBLE_BUFFER : 0);
+
+	usbd_ep_setup(udev, p->ep_out, type, p->packet_size, usb_pipe_rx_cb);
+	usbd_ep_setup(udev, p->ep_in, type, p->packet_size, usb_pipe_tx_cb);
+	usbd_ep_nak_set(udev, p->ep_out, 0);	// NAK forcing outlives a reset.
+
+	p->tx_queued = 0;
+	p->tx_zlp = false;
+	p->tx_age = 0;
+	p->rx_throttled = false;
+	p->configured = true;
+}
+
+/** Called on a bus reset or deconfiguration. */
+void
+usb_pipe_reset(UsbPipe* p)
+{
+	p->configured = false;
+}
+
+/**
+ * Called by the USB task after servicing the peripheral: re-arms the OUT
+ * endpoint once drained and loads IN packets if the endpoint has room.
+ */
+void
+usb_pipe_poll(UsbPipe* p, usbd_device* udev)
+{
+	if (!p->configured)
+		return;
+
+	if (p->rx_throttled && ringbuf_used(&p->rxq) <= p->rx_low) {
+		p->rx_throttled = false;
+		usbd_ep_nak_set(udev, p->ep_out, 0);
+	}
+	usb_pipe_tx_fill(p, udev);
+}
+
+/**
+ * Sets the latency timer of 'p': a short IN packet is held for up to
+ * 'frames' frames of 1 ms, so that writes in between fill it up. 0 sends
+ * whatever there is as soon as the endpoint is free.
+ */
+void
+usb_pipe_set_latency(UsbPipe* p, uint8_t frames)
+{
+	p->latency = frames;	// A packet held already is looked at on the next SOF.
+}
+
+/**
+ * Tells whether 'p' holds a short packet back for its latency timer, and so
+ * needs usb_pipe_sof() on every frame.
+ */
+bool
+usb_pipe_tx_held(const UsbPipe* p)
+{
+	return (p->configured && p->latency != 0 && p->tx_queued == 0
+		&& (ringbuf_used(&p->txq) != 0 || p->tx_zlp));
+}
+
+/** Tells whether 'p' has data queued for the host. */
+bool
+usb_pipe_tx_pending(const UsbPipe* p)
+{
+	return (p->configured && ringbuf_used(&p->txq) != 0);
+}
+
+/**
+ * Called by the USB task on every start of frame while a pipe is held: ages
+ * the held packet, which usb_pipe_poll() then sends once it is due.
+ */
+void
+usb_pipe_sof(UsbPipe* p)
+{
+	if (usb_pipe_tx_held(p) && p->tx_age < p->latency)
+		++p->tx_age;
+}
+
+/**
+ * Waits up to 'timeout' ticks for room in the TX ring and returns the
+ * contiguous free space at '*span'. Fill it and hand it over with
+ * usb_pipe_write_commit(); several writes can be batched into one span.
+ */
+uint32_t
+usb_pipe_write_span(UsbPipe* p, uint8_t** span, TickType_t timeout)
+{
+	if (!ringbuf_wait_write(&p->txq, 1, timeout))
+		return (0);
+	return (ringbuf_write_span(&p->txq, span));
+}
+
+/** Queues 'len' bytes written into the span for the host. */
+void
+usb_pipe_write_commit(UsbPipe* p, uint32_t len)
+{
+	if (!p->tx_timing && ringbuf_used(&p->txq) == 0) {
+		p->tx_stamp = dwt_read_cycle_counter();
+		p->tx_timing = true;
+	}
+
+	ringbuf_write_commit(&p->txq, len);
+	usb_wake();
+}
+
+/**
+ * Sends everything written so far without waiting for the latency timer,
+ * closing the transfer. Interactive output calls this after each reply.
+ */
+void
+usb_pipe_flush(UsbPipe* p)
+{
+	p->tx_flush = p->txq.head;
+	usb_wake();
+}
+
+/**
+ * Queues 'len' bytes for the host, waiting for room in the TX ring as
+ * needed. Returns 'len'.
+ */
+uint32_t
+usb_pipe_write(UsbPipe* p, const void* data, uint32_t len)
+{
+	const uint8_t* src = data;
+	uint32_t left = len;
+
+	while (left > 0) {
+		uint8_t* span;
+		uint32_t n = usb_pipe_write_span(p, &span, portMAX_DELAY);
+
+		if (n > left)
+			n = left;
+		memcpy(span, src, n);
+		usb_pipe_write_commit(p, n);
+		src += n;
+		left -= n;
+	}
+	return (len);
+}
+
+/** Gets the USB task to re-arm the OUT endpoint once the ring has drained. */
+static void
+usb_pipe_rx_drained(UsbPipe* p)
+{
+	if (p->rx_throttled && ringbuf_used(&p->rxq) <= p->rx_low)
+		usb_wake();
+}
+
+/**
+ * Waits up to 'timeout' ticks for received data and returns the contiguous
+ * part of it at '*data', to be used in place and handed back with
+ * usb_pipe_read_consume(). Returns 0 on timeout.
+ */
+uint32_t
+usb_pipe_read_span(UsbPipe* p, const uint8_t** data, TickType_t timeout)
+{
+	if (!ringbuf_wait_read(&p->rxq, 1, timeout))
+		return (0);
+	return (ringbuf_read_span(&p->rxq, data));
+}
+
+void
+usb_pipe_read_consume(UsbPipe* p, uint32_t len)
+{
+	ringbuf_read_release(&p->rxq, len);
+	usb_pipe_rx_drained(p);
+}
+
+/**
+ * Reads up to 'len' bytes from the host, waiting up to 'timeout' ticks for
+ * the first one. Returns the number of bytes read.
+ */
+uint32_t
+usb_pipe_read(UsbPipe* p, void* data, uint32_t len, TickType_t timeout)
+{
+	uint32_t n;
+
+	if (!ringbuf_wait_read(&p->rxq, 1, timeout))
+		return (0);
+
+	n = ringbuf_read(&p->rxq, data, len);
+	usb_pipe_rx_drained(p);
+	return (n);
+}
+
+void
+usb_pipe_get_stats(UsbPipe* p, UsbPipeStats* out)
+{
+	taskENTER_CRITICAL();
+	*out = p->stats;
+	taskEXIT_CRITICAL();
+}
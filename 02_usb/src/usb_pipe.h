@@ -0,0 +1,95 @@
+#ifndef USB_PIPE_H
+#define USB_PIPE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "FreeRTOS.h"
+#include "ringbuf.h"
+
+#include <libopencm3/usb/usbd.h>
+
+/**
+ * Byte stream over a bulk OUT/IN endpoint pair, as used by the CDC-ACM data
+ * interface and the vendor interface. The two share a number unless they
+ * are double-buffered.
+ *
+ * IN packets are sent from the TX ring, full whenever it holds that much,
+ * and the next one is loaded from the completion of the last; a transfer
+ * ending on a full packet is closed with a zero-length one. OUT packets
+ * are read straight into the RX ring; once that is past its high watermark
+ * the endpoint NAKs the host until the consumer has drained it to the low
+ * watermark, so nothing is dropped. Every pipe has its own rings and
+ * endpoint state, so one that is stalled by its consumer holds up no other.
+ *
+ * With a latency timer, as on FTDI adapters, a short IN packet is held back
+ * so that small writes coalesce into full packets: it goes out once it has
+ * waited that many frames (counted on SOF) or when usb_pipe_flush() asks
+ * for it. Full packets never wait.
+ */
+
+/**
+ * Counters of one pipe. Latencies are in DWT cycles: 'in' runs from a write
+ * into an empty TX ring to the IN endpoint taking the first packet of it,
+ * 'out' from the event that made the USB task look at the bus (see
+ * usb_event_time()) to an OUT packet being in the RX ring.
+ */
+typedef struct {
+	uint32_t in_packets;
+	uint32_t in_bytes;
+	uint32_t in_zlps;		// Zero-length packets closing a transfer of full packets.
+	uint32_t in_timed;		// IN packets that closed an 'in' latency sample.
+	uint32_t in_expired;	// Short packets sent because the latency timer ran out.
+	uint32_t in_flushed;	// Short packets sent because of usb_pipe_flush().
+	uint32_t in_latency_sum;
+	uint32_t in_latency_max;
+	uint32_t out_packets;
+	uint32_t out_bytes;
+	uint32_t out_latency_sum;
+	uint32_t out_latency_max;
+	uint32_t out_throttled;	// Times the OUT endpoint was NAKed for lack of RX ring space.
+} UsbPipeStats;
+
+typedef struct {
+	uint8_t ep_out;
+	uint8_t ep_in;					// With the direction bit.
+	uint16_t packet_size;
+	bool double_buffer;
+	volatile bool configured;
+	RingBuf txq;					// tx ring to communicate to the USB stream
+	RingBuf rxq;					// rx ring to communicate from the USB stream
+	uint32_t rx_high;				// NAK the host past this many bytes in 'rxq'.
+	uint32_t rx_low;				// Re-arm once drained to this.
+	volatile uint8_t tx_queued;		// IN packets the endpoint holds: 1, or 2 if double-buffered.
+	bool tx_zlp;					// The last packet was full; the transfer is still open.
+	uint8_t latency;				// Frames a short IN packet may be held; 0 sends at once.
+	uint8_t tx_age;					// Frames the held short packet has waited.
+	volatile uint32_t tx_flush;		// 'txq' head at the last usb_pipe_flush().
+	uint32_t tx_flushed;			// 'tx_flush' the USB task has sent out up to.
+	volatile bool tx_timing;		// 'tx_stamp' opens an IN latency sample.
+	uint32_t tx_stamp;
+	volatile bool rx_throttled;		// The OUT endpoint is NAKed until the RX ring drains.
+	UsbPipeStats stats;
+} UsbPipe;
+
+void usb_pipe_init(UsbPipe* p, uint8_t ep_out, uint8_t ep_in, uint16_t packet_size,
+	uint8_t* txbuf, uint32_t txsize, uint8_t* rxbuf, uint32_t rxsize);
+void usb_pipe_double_buffer(UsbPipe* p);
+void usb_pipe_set_config(UsbPipe* p, usbd_device* udev);
+void usb_pipe_reset(UsbPipe* p);
+void usb_pipe_poll(UsbPipe* p, usbd_device* udev);
+void usb_pipe_sof(UsbPipe* p);
+bool usb_pipe_tx_held(const UsbPipe* p);
+bool usb_pipe_tx_pending(const UsbPipe* p);
+void usb_pipe_set_latency(UsbPipe* p, uint8_t frames);
+
+uint32_t usb_pipe_write(UsbPipe* p, const void* data, uint32_t len);
+uint32_t usb_pipe_write_span(UsbPipe* p, uint8_t** span, TickType_t timeout);
+void usb_pipe_write_commit(UsbPipe* p, uint32_t len);
+void usb_pipe_flush(UsbPipe* p);
+uint32_t usb_pipe_read_span(UsbPipe* p, const uint8_t** data, TickType_t timeout);
+void usb_pipe_read_consume(UsbPipe* p, uint32_t len);
+uint32_t usb_pipe_read(UsbPipe* p, void* data, uint32_t len, TickType_t timeout);
+void usb_pipe_get_stats(UsbPipe* p, UsbPipeStats* stats);
+
+#endif // !USB_PIPE_H
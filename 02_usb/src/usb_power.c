@@ -0,0 +1,145 @@
+#include "FreeRTOS.h"
+#include "task.h"
+#include "usb_power.h"
+
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/pwr.h>
+#include <libopencm3/stm32/exti.h>
+#include <libopencm3/stm32/st_usbfs.h>
+#include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/scb.h>
+
+/* Below the USB interrupt, which may have to run right after it. */
+#define USB_WAKEUP_PRIORITY	(configMAX_SYSCALL_INTERRUPT_PRIORITY + 0x20)
+
+typedef enum {
+	USB_POWER_ACTIVE,
+	USB_POWER_SUSPENDED,		// Peripheral in low-power mode; Stop allowed.
+	USB_POWER_WAKING,			// Signalling remote wakeup; clocks must run.
+} UsbPowerState;
+
+static volatile UsbPowerState usb_power_state;
+static const struct rcc_clock_scale* usb_power_clock;
+static UsbPowerStats usb_power_stats;
+
+/**
+ * 'clock' is the configuration main() set the system clock up with, to be
+ * restored after Stop mode. Without it the MCU only sleeps while suspended.
+ * Call before usb_start().
+ */
+void
+usb_power_init(const struct rcc_clock_scale* clock)
+{
+	usb_power_clock = USB_POWER_STOP ? clock : NULL;
+	rcc_periph_clock_enable(RCC_PWR);
+}
+
+/** Sets up the USB wake-up line, once the USB task is there to be woken. */
+void
+usb_power_start(void)
+{
+	exti_set_trigger(EXTI18, EXTI_TRIGGER_RISING);
+	exti_enable_request(EXTI18);
+	nvic_set_priority(NVIC_USB_WAKEUP_IRQ, USB_WAKEUP_PRIORITY);
+	nvic_enable_irq(NVIC_USB_WAKEUP_IRQ);
+}
+
+/**
+ * Suspend callback, from usbd_poll() in the USB task: the bus has been idle
+ * for 3 ms. The peripheral goes into low-power mode, in the order the
+ * reference manual asks for; the hardware leaves it on any bus activity.
+ */
+void
+usb_power_suspend(void)
+{
+	*USB_CNTR_REG |= USB_CNTR_FSUSP;
+	*USB_CNTR_REG |= USB_CNTR_LP_MODE;
+
+	if (usb_power_state == USB_POWER_ACTIVE) {
+		usb_power_state = USB_POWER_SUSPENDED;
+		++usb_power_stats.suspends;
+	}
+}
+
+/**
+ * Resume callback, from usbd_poll() in the USB task, and called on a bus
+ * reset: the host is driving the bus again.
+ */
+void
+usb_power_resume(void)
+{
+	*USB_CNTR_REG &= ~(USB_CNTR_LP_MODE | USB_CNTR_FSUSP);
+
+	if (usb_power_state != USB_POWER_ACTIVE) {
+		usb_power_state = USB_POWER_ACTIVE;
+		++usb_power_stats.resumes;
+	}
+}
+
+bool
+usb_power_suspended(void)
+{
+	return (usb_power_state == USB_POWER_SUSPENDED);
+}
+
+/**
+ * Wakes a suspended host, if it has allowed that. Blocks the USB task for
+ * about 15 ms while it signals resume. Returns false if it may not.
+ */
+bool
+usb_power_remote_wakeup(usbd_device* udev)
+{
+	if (usb_power_state != USB_POWER_SUSPENDED || !usbd_remote_wakeup_enabled(udev))
+		return (false);
+
+	/* Keeps the idle task out of Stop, so that the delays run. The bus may
+	 * only just have gone idle; it must have been for a while. */
+	usb_power_state = USB_POWER_WAKING;
+	vTaskDelay(pdMS_TO_TICKS(USB_POWER_SUSPEND_MIN_MS) + 1);
+
+	*USB_CNTR_REG &= ~(USB_CNTR_LP_MODE | USB_CNTR_FSUSP);
+	*USB_CNTR_REG |= USB_CNTR_RESUME;
+	vTaskDelay(pdMS_TO_TICKS(USB_POWER_RESUME_MS));
+	*USB_CNTR_REG &= ~USB_CNTR_RESUME;
+
+	usb_power_state = USB_POWER_ACTIVE;
+	++usb_power_stats.remote_wakeups;
+	++usb_power_stats.resumes;
+	return (true);
+}
+
+/**
+ * configPRE_SLEEP_PROCESSING() of the tickless idle, run with interrupts
+ * masked. While suspended it enters Stop mode itself and clears
+ * '*idle_ticks' so the port does not sleep again. Stop restarts the system
+ * on HSI, so the clock is set up again here, before the wake-up interrupt
+ * is let in.
+ */
+void
+usb_power_sleep(uint32_t* idle_ticks)
+{
+	if (usb_power_state != USB_POWER_SUSPENDED || usb_power_clock == NULL)
+		return;
+
+	pwr_set_stop_mode();
+	pwr_voltage_regulator_low_power_in_stop();
+	SCB_SCR |= SCB_SCR_SLEEPDEEP;
+
+	__asm volatile ("dsb" ::: "memory");
+	__asm volatile ("wfi");
+	__asm volatile ("isb");
+
+	SCB_SCR &= ~SCB_SCR_SLEEPDEEP;
+	rcc_clock_setup_pll(usb_power_clock);
+
+	++usb_power_stats.stops;
+	*idle_ticks = 0;
+}
+
+void
+usb_power_get_stats(UsbPowerStats* out)
+{
+	taskENTER_CRITICAL();
+	*out = usb_power_stats;
+	taskEXIT_CRITICAL();
+}
@@ -0,0 +1,58 @@
+#ifndef USB_POWER_H
+#define USB_POWER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <libopencm3/usb/usbd.h>
+
+struct rcc_clock_scale;
+
+/*
+ * USB suspend and resume. Included by FreeRTOSConfig.h for the tickless
+ * idle hook, so it must not include FreeRTOS headers itself.
+ *
+ * When the host suspends the bus the peripheral is put in low-power mode
+ * and the USB task stops servicing it. Once every task is blocked, the
+ * tickless idle enters Stop mode instead of Sleep: clocks off, regulator in
+ * low power, RAM and registers (and with them the device address and
+ * configuration) kept. Only the USB wake-up line, EXTI18, ends it; the
+ * system clock is then set up again before any interrupt runs.
+ *
+ * The tick stands still in Stop mode, so timeouts and delays are frozen
+ * while the bus is suspended.
+ */
+
+/* Enter Stop mode while suspended. 0 only sleeps, with the clocks on. */
+#ifndef USB_POWER_STOP
+#define USB_POWER_STOP			1
+#endif
+
+/* Advertise remote wakeup: a port with data to send wakes the host, if the
+ * host has allowed it. */
+#ifndef USB_REMOTE_WAKEUP
+#define USB_REMOTE_WAKEUP		1
+#endif
+
+/* The device must stay suspended this long before signalling resume, and
+ * hold RESUME for 1 to 15 ms (USB 2.0, 7.1.7.7). */
+#define USB_POWER_SUSPEND_MIN_MS	5
+#define USB_POWER_RESUME_MS			10
+
+typedef struct {
+	uint32_t suspends;
+	uint32_t resumes;
+	uint32_t stops;				// Times Stop mode was entered.
+	uint32_t remote_wakeups;
+} UsbPowerStats;
+
+void usb_power_init(const struct rcc_clock_scale* clock);
+void usb_power_start(void);
+void usb_power_suspend(void);
+void usb_power_resume(void);
+bool usb_power_suspended(void);
+bool usb_power_remote_wakeup(usbd_device* udev);
+void usb_power_sleep(uint32_t* idle_ticks);
+void usb_power_get_stats(UsbPowerStats* stats);
+
+#endif // !USB_POWER_H
@@ -0,0 +1,79 @@
+#include "FreeRTOS.h"
+#include "usb_vendor.h"
+
+#if USB_VENDOR
+
+#if USB_VENDOR_EP > 7
+#error "No endpoint left for the vendor interface"
+#endif
+
+#if USB_VENDOR_RX_RING_SIZE < 2 * USB_VENDOR_PACKET_SIZE
+#error "USB_VENDOR_RX_RING_SIZE must hold two packets"
+#endif
+
+static UsbPipe vendor_pipe;
+static uint8_t vendor_txbuf[USB_VENDOR_TX_RING_SIZE];
+static uint8_t vendor_rxbuf[USB_VENDOR_RX_RING_SIZE];
+
+static const struct usb_endpoint_descriptor vendor_endp[] = { {
+	.bLength = USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType = USB_DT_ENDPOINT,
+	.bEndpointAddress = USB_VENDOR_EP,
+	.bmAttributes = USB_ENDPOINT_ATTR_BULK,
+	.wMaxPacketSize = USB_VENDOR_PACKET_SIZE,
+	.bInterval = 1,
+}, {
+	.bLength = USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType = USB_DT_ENDPOINT,
+	.bEndpointAddress = 0x80 | USB_VENDOR_EP,
+	.bmAttributes = USB_ENDPOINT_ATTR_BULK,
+	.wMaxPacketSize = USB_VENDOR_PACKET_SIZE,
+	.bInterval = 1,
+} };
+
+const struct usb_interface_descriptor usb_vendor_iface = {
+	.bLength = USB_DT_INTERFACE_SIZE,
+	.bDescriptorType = USB_DT_INTERFACE,
+	.bInterfaceNumber = USB_VENDOR_IFACE,
+	.bAlternateSetting = 0,
+	.bNumEndpoints = 2,
+	.bInterfaceClass = USB_CLASS_VENDOR,
+	.bInterfaceSubClass = 0,
+	.bInterfaceProtocol = 0,
+	.iInterface = 0,
+	.endpoint = vendor_endp,
+};
+
+void
+usb_vendor_init(void)
+{
+	usb_pipe_init(&vendor_pipe, USB_VENDOR_EP, 0x80 | USB_VENDOR_EP, USB_VENDOR_PACKET_SIZE,
+		vendor_txbuf, sizeof vendor_txbuf, vendor_rxbuf, sizeof vendor_rxbuf);
+}
+
+void
+usb_vendor_set_config(usbd_device* udev)
+{
+	usb_pipe_set_config(&vendor_pipe, udev);
+}
+
+void
+usb_vendor_reset(void)
+{
+	usb_pipe_reset(&vendor_pipe);
+}
+
+void
+usb_vendor_poll(usbd_device* udev)
+{
+	usb_pipe_poll(&vendor_pipe, udev);
+}
+
+/** The byte stream of the vendor interface. */
+UsbPipe*
+usb_vendor_pipe(void)
+{
+	return (&vendor_pipe);
+}
+
+#endif // USB_VENDOR
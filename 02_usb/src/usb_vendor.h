@@ -0,0 +1,49 @@
+#ifndef USB_VENDOR_H
+#define USB_VENDOR_H
+
+#include "usb_pipe.h"
+#include "cdcacm.h"
+
+#include <libopencm3/usb/usbd.h>
+
+/* Vendor-specific interface with one bulk pair, for tools that talk to the
+ * device directly (libusb) rather than through a tty. It follows the
+ * CDC-ACM ports: interface 2 * CDC_ACM_PORTS, the endpoint after theirs. */
+#ifndef USB_VENDOR
+#define USB_VENDOR			1
+#endif
+
+#define USB_VENDOR_IFACE	(2 * CDC_ACM_PORTS)
+#define USB_VENDOR_EP		(CDC_ACM_EP_COUNT + 1)
+
+/* Size of the bulk endpoints. Kept below the CDC ports' so that both fit
+ * the packet memory. */
+#ifndef USB_VENDOR_PACKET_SIZE
+#define USB_VENDOR_PACKET_SIZE	32
+#endif
+
+/* Sizes of the rings in bytes. Must be powers of two. */
+#ifndef USB_VENDOR_TX_RING_SIZE
+#define USB_VENDOR_TX_RING_SIZE	256
+#endif
+
+#ifndef USB_VENDOR_RX_RING_SIZE
+#define USB_VENDOR_RX_RING_SIZE	256
+#endif
+
+/* Packet memory the endpoints take. */
+#if USB_VENDOR
+#define USB_VENDOR_PMA_SIZE	(2 * USB_VENDOR_PACKET_SIZE)
+#else
+#define USB_VENDOR_PMA_SIZE	0
+#endif
+
+extern const struct usb_interface_descriptor usb_vendor_iface;
+
+void usb_vendor_init(void);
+void usb_vendor_set_config(usbd_device* udev);
+void usb_vendor_reset(void);
+void usb_vendor_poll(usbd_device* udev);
+UsbPipe* usb_vendor_pipe(void);
+
+#endif // !USB_VENDOR_H
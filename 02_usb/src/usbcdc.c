@@ -2,188 +2,342 @@
 
 #include "FreeRTOS.h"
 #include "task.h"
-#include "queue.h"
+#include "usbcdc.h"
+#include "cdcacm.h"
+#include "usb_vendor.h"
+#include "usb_power.h"
 
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/gpio.h>
+#include <libopencm3/stm32/st_usbfs.h>
+#include <libopencm3/stm32/desig.h>
+#include <libopencm3/stm32/exti.h>
 #include <libopencm3/cm3/nvic.h>
+#include <libopencm3/cm3/dwt.h>
 #include <libopencm3/usb/usbd.h>
-#include <libopencm3/usb/cdc.h>
 
-static volatile bool isInitialized = false;
-static QueueHandle_t usb_txq;	// FreeRTOS tx buffer to communicate to the USB stream
-static QueueHandle_t usb_rxq;	// FreeRTOS rx buffer to communicate from the USB stream
+/* The interrupt must stay below configMAX_SYSCALL_INTERRUPT_PRIORITY to be
+ * allowed to call the FromISR API. */
+#define USB_IRQ_PRIORITY	(configMAX_SYSCALL_INTERRUPT_PRIORITY + 0x10)
 
-static const struct usb_device_descriptor dev = {};
-static const struct usb_config_descriptor config = {};
-static const char* usb_strings[] = {};
-static uint8_t usbd_control_buffer[128];
+#if USB_SERVICE_MODE == USB_SERVICE_IRQ
+#define USB_TASK_PRIORITY	(configMAX_PRIORITIES - 1)
+#else
+/* taskYIELD() only gives way to tasks of the same priority; any higher and
+ * the application tasks would never run. */
+#define USB_TASK_PRIORITY	(tskIDLE_PRIORITY + 1)
+#endif
 
-typedef void (**FnAccomplish)(usbd_device* usbd_dev, struct usb_setup_data* req);
+/* ISTR events, all of which have the same bit in CNTR as their mask. */
+#define USB_EVENTS		0xFF00
+
+/* Size of the control endpoint. 32 rather than 64 leaves room in the packet
+ * memory for another port; control transfers are not on the data path. */
+#define USB_EP0_SIZE	32
+
+/*
+ * The 512-byte packet memory starts with the 64-byte buffer table, then
+ * libopencm3 hands out endpoint buffers one after another: the control
+ * endpoint's two, then those of every function as it sets them up. They
+ * must all fit or the endpoints past the end would be left disabled.
+ */
+#define USB_PMA_BTABLE	64
+#define USB_PMA_USED	(USB_PMA_BTABLE + 2 * USB_EP0_SIZE \
+	+ CDC_ACM_PORTS * CDC_ACM_PMA_SIZE + USB_VENDOR_PMA_SIZE)
+
+#if USB_PMA_USED > USB_PMA_SIZE
+#error "The USB functions do not fit the packet memory"
+#endif
+
+static const struct usb_device_descriptor dev = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bDeviceClass = 0xEF,		// Miscellaneous: functions are grouped
+	.bDeviceSubClass = 0x02,	// by interface association descriptors.
+	.bDeviceProtocol = 0x01,
+	.bMaxPacketSize0 = USB_EP0_SIZE,
+	.idVendor = USB_VID,
+	.idProduct = USB_PID,
+	.bcdDevice = 0x0100,
+	.iManufacturer = 1,
+	.iProduct = 2,
+	.iSerialNumber = 3,
+	.bNumConfigurations = 1,
+};
+
+#define CDC_ACM_INTERFACES(n) { \
+	.num_altsetting = 1, \
+	.iface_assoc = &cdcacm_assoc[n], \
+	.altsetting = &cdcacm_comm_iface[n], \
+}, { \
+	.num_altsetting = 1, \
+	.altsetting = &cdcacm_data_iface[n], \
+}
+
+/* Interface numbers are the indices: the CDC-ACM ports, then the vendor
+ * interface. */
+static const struct usb_interface ifaces[] = {
+	CDC_ACM_EACH(CDC_ACM_INTERFACES),
+#if USB_VENDOR
+	{ .num_altsetting = 1, .altsetting = &usb_vendor_iface },
+#endif
+};
+
+static const struct usb_config_descriptor config = {
+	.bLength = USB_DT_CONFIGURATION_SIZE,
+	.bDescriptorType = USB_DT_CONFIGURATION,
+	.wTotalLength = 0,	// Filled in by usb_standard.c.
+	.bNumInterfaces = sizeof ifaces / sizeof ifaces[0],
+	.bConfigurationValue = 1,
+	.iConfiguration = 0,
+#if USB_REMOTE_WAKEUP
+	.bmAttributes = 0x80 | USB_CONFIG_ATTR_REMOTE_WAKEUP,	// Bus powered.
+#else
+	.bmAttributes = 0x80,	// Bus powered.
+#endif
+	.bMaxPower = 50,		// 100 mA.
+	.interface = ifaces,
+};
+
+/* The 96-bit unique device ID in hex, filled in at start. */
+static char usb_serial[25];
+
+static const char* usb_strings[] = {
+	"libopencm3",
+	"FreeRTOS CDC-ACM",
+	usb_serial,
+};
+
+/* Holds the whole configuration descriptor: 164 bytes with two ports and
+ * the vendor interface. */
+static uint8_t usbd_control_buffer[256];
+
+static TaskHandle_t usb_task_handle;
+static UsbStats usb_stats;
+static volatile uint32_t usb_event_stamp;	// DWT cycles at the event being serviced.
+static bool usb_sof_enabled;
+
+/** Called on a bus reset: every function is down until configured again. */
+static void
+usb_reset(void)
+{
+	usb_power_resume();
+	cdcacm_reset();
+#if USB_VENDOR
+	usb_vendor_reset();
+#endif
+}
 
 /**
- * Used to act on specialized messages. This driver reacts to two type of messages,
- * the first of which is to satisfy a Linux deficiency, and the second one checks the
- * length of a structure.
+ * Called by the Host system upon USB peripheral connection.
+ * This callback function configures/reconfigures the USB CDC device. Its signature
+ * must match with the one defined in libopencm3/include/libopencm3/usb/usbd.h:
+ * 
+ * typedef void (*usbd_set_config_callback)(usbd_device *usbd_dev, uint16_t wValue);
  */
-static int32_t
-cdcacm_control_request(
-	usbd_device* usbd_dev __attribute__((unused)),
-	struct usb_setup_data* req,
-	uint8_t** buf __attribute((unused)),
-	uint16_t* len, FnAccomplish complete __attribute__((unused)))
+static void
+usb_set_config(usbd_device* usbd_dev, uint16_t wValue)
 {
-	switch (req->bRequest) {
-		case USB_CDC_REQ_SET_CONTROL_LINE_STATE:
-		return (1);
-
-		case USB_CDC_REQ_SET_LINE_CODING:
-			if (*len < sizeof(struct usb_cdc_line_coding))
-				return (0);
-			else
-				return (1);
+	if (wValue == 0) {
+		usb_reset();
+		return;
 	}
 
-	return (0);
+	cdcacm_set_config(usbd_dev);
+#if USB_VENDOR
+	usb_vendor_set_config(usbd_dev);
+#endif
+}
+
+/** Ages the short packets the CDC-ACM ports hold back, once per frame. */
+static void
+usb_sof(void)
+{
+	++usb_stats.sofs;
+	cdcacm_sof();
 }
 
 /**
- * This callbak is invoked by the USB infrastructure when data has been sent over
- * the bus to the STM32 MCU.
+ * Takes SOF interrupts only while a latency timer runs: 1000 of them a
+ * second would otherwise keep the USB task, and the CPU, from idling.
+ * usbd_poll() syncs SOFM with the callback at its end, but with
+ * USB_SERVICE_IRQ the next call may be a while away, so the mask is set
+ * here too. A stale SOF flag is cleared first so that the timer counts
+ * whole frames.
  */
 static void
-cdcacm_data_rx_cb(usbd_device* usbd_dev, uint8_t ep __attribute__((unused)))
+usb_sof_update(usbd_device* udev)
 {
-	uint32_t rx_avail = uxQueueSpacesAvailable(usb_rxq);
-	char buf[64];
-	int32_t len;
+	bool held = cdcacm_tx_held();
 
-	if (rx_avail == 0)
-		return;	// No space to receive a data.
-	
-	// Bytes to read.
-	len = sizeof buf < rx_avail ? sizeof buf : rx_avail;
-
-	// Read what we can, leave the rest.
-	len = usbd_ep_read_packet(usbd_dev, 0x01, buf, len);
+	if (held == usb_sof_enabled)
+		return;
 
-	for (uint32_t x = 0; x < len; ++x) {
-		// send data to the rx queue
-		xQueueSend(usb_rxq, &buf[x], 0);
+	usb_sof_enabled = held;
+	if (held) {
+		usbd_register_sof_callback(udev, usb_sof);
+		USB_CLR_ISTR_SOF();
+		*USB_CNTR_REG |= USB_CNTR_SOFM;
+	} else {
+		usbd_register_sof_callback(udev, NULL);
+		*USB_CNTR_REG &= ~USB_CNTR_SOFM;
 	}
 }
 
 /**
- * A callback function used to handle specislized messages.
- * This driver reacts to two req->bRequest message types.
- * @return '1' on successfull handling. '0' otherwise.
+ * Gets the USB task to look at the rings of the functions again. In
+ * USB_SERVICE_POLL it only sleeps while suspended, when a write may call
+ * for a remote wakeup.
  */
-static int32_t
-cdcacm_control_request(
-	usbd_device* sbd_dev __attribute((unused)),
-	struct usb_setup_data* req,
-	uint8_t** buf __attribute((unused)),
-	uint16_t* len,
-	FnComplete complete __attribute__((unused)))
+void
+usb_wake(void)
 {
-	switch (req->bRequest) {
-		case USB_CDC_REQ_SET_CONTROL_LINE_STATE:
-		/* The linux cdc_acm driver requires this to be implemented
-		 * even though it's optional in the CDC spec, and we don't
-		 * advertise it in the ACM functinoal description. */
-		return (1);
-
-		case USB_CDC_REQ_SET_LINE_CODING:
-			if (*len < sizeof(struct usb_cdc_line_coding)) {
-				return (0);
-			}
-		return (1);
-	}
+#if USB_SERVICE_MODE == USB_SERVICE_POLL
+	if (!usb_power_suspended())
+		return;
+#endif
+	xTaskNotifyGive(usb_task_handle);
+}
 
-	return (0);
+/**
+ * The USB wake-up line: bus activity while suspended, and the only event
+ * that ends Stop mode. The clock is running again by the time this runs
+ * (see usb_power_sleep()). In USB_SERVICE_IRQ the WKUP flag raises the USB
+ * interrupt as well; in USB_SERVICE_POLL this gets the task polling again.
+ */
+void
+USBWakeUp_IRQHandler(void)
+{
+	BaseType_t hpTask = pdFALSE;
+
+	exti_reset_request(EXTI18);
+	usb_event_stamp = dwt_read_cycle_counter();
+	vTaskNotifyGiveFromISR(usb_task_handle, &hpTask);
+	portYIELD_FROM_ISR(hpTask);
 }
 
+#if USB_SERVICE_MODE == USB_SERVICE_IRQ
+
 /**
- * This callback function is invoked by the USB infrastructure when data 
- * has been sent over the bus to the STM32 MCU.
+ * Hands the events over to the USB task. The interrupt stays masked until
+ * the task has run usbd_poll() over all of them, since ISTR keeps it raised
+ * until then.
  */
-static void
-cdcacm_data_rx_cb(usbd_device* usbd_dev, uint8_t ep __attribute__((unused)))
+void
+USB_LP_CAN1_RX0_IRQHandler(void)
 {
-	// How much queue capacity left?
-	int32_t rx_avail = uxQueueSpacesAvailable(usb_rxq);
-	char buf[64];	// rx buffer.
-	int32_t len;
+	BaseType_t hpTask = pdFALSE;
 
-	if (rx_avail <= 0)
-		return;	// No space available to RX.
+	usb_event_stamp = dwt_read_cycle_counter();
+	++usb_stats.irqs;
 
-	// Bytes to read
-	len = sizeof buf < rx_avail ? sizeof buf : rx_avail;
+	nvic_disable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
+	vTaskNotifyGiveFromISR(usb_task_handle, &hpTask);
+	portYIELD_FROM_ISR(hpTask);
+}
 
-	// Read what we can, leave the rest.
-	for (int32_t x = 0; x < len; ++x) {
-		// Send data to the rx queue
-		xQueueSend(usb_rxq, &buf[x], 0);
+/** Runs usbd_poll() until no enabled event is left, then unmasks the interrupt. */
+static void
+usb_service(usbd_device* udev)
+{
+	while ((*USB_ISTR_REG & *USB_CNTR_REG & USB_EVENTS) != 0) {
+		++usb_stats.polls;
+		usbd_poll(udev);
 	}
+	nvic_enable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
 }
 
+#else
+
 /**
- * Called by the Host system upon USB peripheral connection.
- * This callback function configures/reconfigures the USB CDC device. Its signature
- * must match with the one defined in libopencm3/include/libopencm3/usb/usbd.h:
- * 
- * typedef void (*usbd_set_config_callback)(usbd_device *usbd_dev, uint16_t wValue);
- * 
- * Upon return, the 'isInitialized' global variable is set to inform that FreeRTOS task
- * can know the ready state of the USB infrastructure.
+ * Runs usbd_poll() once. An event may have come in at any time since the
+ * previous call, so that is when it is taken to have happened.
  */
 static void
-cdcacm_set_config(usbd_device* usbd_dev, uint16_t wValue __attribute__((unused)))
+usb_service(usbd_device* udev)
 {
-	usbd_ep_setup(usbd_dev, 0x01, USB_ENDPOINT_ATTR_BULK, 64, cdcacm_data_rx_cb);
-	usbd_ep_setup(usbd_dev, 0x82, USB_ENDPOINT_ATTR_BULK, 64, NULL);
-	usbd_register_control_callback(usbd_dev, USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
-											USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
-											cdcacm_control_request);
-	isInitialized = true;
+	static uint32_t last_poll;
+
+	usb_event_stamp = last_poll;
+	last_poll = dwt_read_cycle_counter();
+	++usb_stats.polls;
+	usbd_poll(udev);
 }
 
-/** Sends queued bytes of data to the USB Host. */
+#endif // USB_SERVICE_MODE
+
+/**
+ * Services the USB peripheral and moves the data of every function. With
+ * USB_SERVICE_IRQ the task sleeps until the interrupt, a write, a drained
+ * RX ring or a serial state change wakes it; an IN packet still waiting
+ * for the endpoint is sent from the transfer-complete interrupt. With
+ * USB_SERVICE_POLL it spins, except while the bus is suspended: it then
+ * sleeps like in USB_SERVICE_IRQ, so that the MCU can enter Stop mode.
+ * Data queued while suspended wakes the host if it allows that.
+ */
 static void
 usb_task(void* arg)
 {
 	usbd_device* udev = (usbd_device*)arg;
-	char txbuf[32];
-	int32_t txlen = 0;
 
 	for (;;) {
-		
-		/* Called frequently enough that the USB link is maintained by the Host. */
-		usbd_poll(udev);
-		if (!isInitialized)
-			continue;
-		
-		while (txlen < sizeof txbuf && xQueueReceive(usb_txq, &txbuf[txlen], 0) == pdPASS)
-			++txlen;	// Count the number of bytes to be sent
-		
-		if (txlen > 0) {
-			if (usbd_ep_write_packet(udev, 0x82, txbuf, txlen) != 0)
-				txlen = 0;	// Reset if data have been sent successfully
-		} else {
-			taskYIELD();	// No data to send. Give up the CPU.
+#if USB_SERVICE_MODE == USB_SERVICE_IRQ
+		ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+		++usb_stats.wakeups;
+#else
+		if (usb_power_suspended()) {
+			ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+			++usb_stats.wakeups;
 		}
+#endif
+		/* Called frequently enough that the USB link is maintained by the Host. */
+		usb_service(udev);
+		cdcacm_poll(udev);
+#if USB_VENDOR
+		usb_vendor_poll(udev);
+#endif
+		usb_sof_update(udev);
+
+		if (usb_power_suspended() && cdcacm_tx_pending())
+			usb_power_remote_wakeup(udev);
+
+#if USB_SERVICE_MODE == USB_SERVICE_POLL
+		taskYIELD();	// Give up the CPU to the application tasks.
+#endif
 	}
 }
 
+/**
+ * DWT cycle count of the event being serviced: the interrupt that woke the
+ * USB task, or in USB_SERVICE_POLL the previous usbd_poll(), when the event
+ * may have come in at the latest.
+ */
+uint32_t
+usb_event_time(void)
+{
+	return (usb_event_stamp);
+}
+
+void
+usb_get_stats(UsbStats* out)
+{
+	taskENTER_CRITICAL();
+	*out = usb_stats;
+	taskEXIT_CRITICAL();
+}
+
 /** Start USB driver. */
 void
 usb_start(void)
 {
 	usbd_device* udev = NULL;
 
-	usb_txq = xQueueCreate(128, sizeof(char));
-	usb_rxq = xQueueCreate(128, sizeof(char));
+	cdcacm_init();
+#if USB_VENDOR
+	usb_vendor_init();
+#endif
+	desig_get_unique_id_as_string(usb_serial, sizeof usb_serial);
 
 	/* Since enabling the USB peripheral automatically takes over
 	 * the GPIOs PA11 and PA12, all we have to do is enable the GPIO
@@ -193,11 +347,22 @@ usb_start(void)
 
 	/* PA11 = USB_DM, PA12 = USB_DP. */
 	udev = usbd_init(&st_usbfs_v1_usb_driver, &dev, &config,
-					usb_strings, 3,
+					usb_strings, sizeof usb_strings / sizeof usb_strings[0],
 					usbd_control_buffer, sizeof(usbd_control_buffer));
 	
-	usbd_register_set_config_callback(udev, cdcacm_set_config);
+	usbd_register_set_config_callback(udev, usb_set_config);
+	usbd_register_reset_callback(udev, usb_reset);
+	usbd_register_suspend_callback(udev, usb_power_suspend);
+	usbd_register_resume_callback(udev, usb_power_resume);
+
+	dwt_enable_cycle_counter();
 
 	/* Create the FreeRTOS task to service the USB events. */
-	xTaskCreate(usb_task, "USB", 200, udev, configMAX_PRIORITIES - 1, NULL);
+	xTaskCreate(usb_task, "USB", 200, udev, USB_TASK_PRIORITY, &usb_task_handle);
+	usb_power_start();
+
+#if USB_SERVICE_MODE == USB_SERVICE_IRQ
+	nvic_set_priority(NVIC_USB_LP_CAN_RX0_IRQ, USB_IRQ_PRIORITY);
+	nvic_enable_irq(NVIC_USB_LP_CAN_RX0_IRQ);
+#endif
 }
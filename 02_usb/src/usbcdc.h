@@ -1,6 +1,41 @@
 #ifndef USB_CDC_H
 #define USB_CDC_H
 
+#include <stdint.h>
+
+#include "FreeRTOS.h"
+
+/* How the USB peripheral is serviced. */
+#define USB_SERVICE_POLL	0	/* USB task spins on usbd_poll(), yielding between rounds. */
+#define USB_SERVICE_IRQ		1	/* USB_LP_CAN_RX0 wakes the USB task, which sleeps otherwise. */
+
+#ifndef USB_SERVICE_MODE
+#define USB_SERVICE_MODE	USB_SERVICE_IRQ
+#endif
+
+/* Device identity. The default is the ST Virtual COM Port one. */
+#ifndef USB_VID
+#define USB_VID				0x0483
+#endif
+
+#ifndef USB_PID
+#define USB_PID				0x5740
+#endif
+
+/**
+ * Counters used to compare the service modes. Per-port traffic and latency
+ * figures are in UsbPipeStats.
+ */
+typedef struct {
+	uint32_t irqs;			// USB_LP_CAN_RX0 interrupts taken.
+	uint32_t wakeups;		// Times the USB task was woken to do work.
+	uint32_t polls;			// usbd_poll() calls.
+	uint32_t sofs;			// Start-of-frame events taken for the latency timers.
+} UsbStats;
+
 void usb_start(void);
+void usb_wake(void);
+uint32_t usb_event_time(void);
+void usb_get_stats(UsbStats* stats);
 
-#endif // !USB_CDC_H
\ No newline at end of file
+#endif // !USB_CDC_H
@@ -0,0 +1,278 @@
+#include <string.h>
+
+#include "ringbuf.h"
+
+/*
+ * The producer's stores into 'buf' must be visible before the new 'head',
+ * and the consumer must be done with 'buf' before the new 'tail'; on the
+ * Cortex-M3 these compile to a plain LDR/STR with a DMB. The waiter
+ * hand-over is sequentially consistent so that "publish index, then look
+ * for a waiter" cannot cross "register as waiter, then look at the index".
+ */
+#define load_acquire(p)		__atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v)	__atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#define store_seq(p, v)		__atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+
+/** Wakes the task registered in '*waiter', if any, from task or ISR context. */
+static void
+ringbuf_wake(TaskHandle_t volatile* waiter)
+{
+	TaskHandle_t task = __atomic_exchange_n(waiter, NULL, __ATOMIC_SEQ_CST);
+
+	if (task == NULL)
+		return;
+
+	if (xPortIsInsideInterrupt()) {
+		BaseType_t hpTask = pdFALSE;
+
+		vTaskNotifyGiveFromISR(task, &hpTask);
+		portYIELD_FROM_ISR(hpTask);
+	} else {
+		xTaskNotifyGive(task);
+	}
+}
+
+/**
+ * Initializes 'rb' over 'buf', which must be 'size' bytes long with 'size'
+ * a power of two.
+ */
+void
+ringbuf_init(RingBuf* rb, uint8_t* buf, uint32_t size)
+{
+	configASSERT((size & (size - 1)) == 0);
+
+	memset(rb, 0, sizeof *rb);
+	rb->buf = buf;
+	rb->size = size;
+}
+
+/** Number of bytes ready for the consumer. */
+uint32_t
+ringbuf_used(const RingBuf* rb)
+{
+	uint32_t used = load_acquire(&rb->head) - rb->tail;
+
+	return (used > rb->size ? rb->size : used);
+}
+
+/** Number of bytes the producer may still write. */
+uint32_t
+ringbuf_space(const RingBuf* rb)
+{
+	uint32_t used = rb->head - load_acquire(&rb->tail);
+
+	return (used > rb->size ? 0 : rb->size - used);
+}
+
+/**
+ * Producer side: points '*span' at the contiguous free space following
+ * 'head' and returns its length. The space is only published by
+ * ringbuf_write_commit().
+ */
+uint32_t
+ringbuf_write_span(RingBuf* rb, uint8_t** span)
+{
+	uint32_t offs = rb->head & (rb->size - 1);
+	uint32_t len = ringbuf_space(rb);
+
+	if (len > rb->size - offs)
+		len = rb->size - offs;
+
+	*span = &rb->buf[offs];
+	return (len);
+}
+
+/**
+ * Publishes 'len' bytes written at the span, and wakes the consumer if that
+ * brought the ring up to what it waits for.
+ *
+ * A producer that does not look at the free space (a circular DMA channel)
+ * may commit more than fits; the consumer then skips the bytes that were
+ * overwritten and counts them in 'overwritten'.
+ */
+void
+ringbuf_write_commit(RingBuf* rb, uint32_t len)
+{
+	store_seq(&rb->head, rb->head + len);
+
+	if (rb->reader != NULL && ringbuf_used(rb) >= rb->read_need)
+		ringbuf_wake(&rb->reader);
+}
+
+/** Copies as much of 'data' as fits, returning the number of bytes taken. */
+uint32_t
+ringbuf_write(RingBuf* rb, const void* data, uint32_t len)
+{
+	const uint8_t* src = data;
+	uint32_t done = 0;
+
+	while (done < len) {
+		uint8_t* span;
+		uint32_t n = ringbuf_write_span(rb, &span);
+
+		if (n == 0)
+			break;
+		if (n > len - done)
+			n = len - done;
+
+		memcpy(span, src + done, n);
+		done += n;
+		store_release(&rb->head, rb->head + n);
+	}
+
+	if (done > 0)
+		ringbuf_write_commit(rb, 0);
+
+	return (done);
+}
+
+/**
+ * Consumer side: points '*span' at the contiguous data following 'tail' and
+ * returns its length. The data stays valid until ringbuf_read_release().
+ */
+uint32_t
+ringbuf_read_span(RingBuf* rb, const uint8_t** span)
+{
+	uint32_t head = load_acquire(&rb->head);
+	uint32_t tail = rb->tail;
+	uint32_t len, offs;
+
+	if ((head - tail) > rb->size) {
+		rb->overwritten += (head - tail) - rb->size;
+		tail = head - rb->size;
+		store_release(&rb->tail, tail);
+	}
+
+	len = head - tail;
+	offs = tail & (rb->size - 1);
+	if (len > rb->size - offs)
+		len = rb->size - offs;
+
+	*span = &rb->buf[offs];
+	return (len);
+}
+
+/**
+ * Frees 'len' bytes returned by ringbuf_read_span(), and wakes the producer
+ * if that made as much room as it waits for.
+ */
+void
+ringbuf_read_release(RingBuf* rb, uint32_t len)
+{
+	store_seq(&rb->tail, rb->tail + len);
+
+	if (rb->writer != NULL && ringbuf_space(rb) >= rb->write_need)
+		ringbuf_wake(&rb->writer);
+}
+
+/** Copies up to 'len' bytes out, returning the number of bytes read. */
+uint32_t
+ringbuf_read(RingBuf* rb, void* data, uint32_t len)
+{
+	uint8_t* dst = data;
+	uint32_t done = 0;
+
+	while (done < len) {
+		const uint8_t* span;
+		uint32_t n = ringbuf_read_span(rb, &span);
+
+		if (n == 0)
+			break;
+		if (n > len - done)
+			n = len - done;
+
+		memcpy(dst + done, span, n);
+		done += n;
+		store_release(&rb->tail, rb->tail + n);
+	}
+
+	if (done > 0)
+		ringbuf_read_release(rb, 0);
+
+	return (done);
+}
+
+/**
+ * Copies up to 'len' bytes starting 'offset' bytes past 'tail', without
+ * releasing anything. Returns the number of bytes copied. Consumer only.
+ */
+uint32_t
+ringbuf_peek(const RingBuf* rb, uint32_t offset, void* data, uint32_t len)
+{
+	uint8_t* dst = data;
+	uint32_t used = ringbuf_used(rb);
+	uint32_t pos, n;
+
+	if (offset >= used)
+		return (0);
+	if (len > used - offset)
+		len = used - offset;
+
+	pos = (rb->tail + offset) & (rb->size - 1);
+	n = rb->size - pos < len ? rb->size - pos : len;
+
+	memcpy(dst, &rb->buf[pos], n);
+	memcpy(dst + n, rb->buf, len - n);
+	return (len);
+}
+
+/**
+ * Sleeps until at least 'need' bytes can be read, or 'timeout' ticks have
+ * passed. Returns true if the data is there. Only the consumer may wait.
+ */
+bool
+ringbuf_wait_read(RingBuf* rb, uint32_t need, TickType_t timeout)
+{
+	TimeOut_t start;
+
+	if (need > rb->size)
+		need = rb->size;
+
+	vTaskSetTimeOutState(&start);
+	while (ringbuf_used(rb) < need) {
+		rb->read_need = need;
+		store_seq(&rb->reader, xTaskGetCurrentTaskHandle());
+
+		if (ringbuf_used(rb) < need) {
+			if (xTaskCheckForTimeOut(&start, &timeout) != pdFALSE) {
+				store_seq(&rb->reader, NULL);
+				break;
+			}
+			ulTaskNotifyTake(pdTRUE, timeout);
+		}
+		store_seq(&rb->reader, NULL);
+	}
+
+	return (ringbuf_used(rb) >= need);
+}
+
+/**
+ * Sleeps until at least 'need' bytes can be written, or 'timeout' ticks
+ * have passed. Returns true if the space is there. Only the producer may
+ * wait.
+ */
+bool
+ringbuf_wait_write(RingBuf* rb, uint32_t need, TickType_t timeout)
+{
+	TimeOut_t start;
+
+	if (need > rb->size)
+		need = rb->size;
+
+	vTaskSetTimeOutState(&start);
+	while (ringbuf_space(rb) < need) {
+		rb->write_need = need;
+		store_seq(&rb->writer, xTaskGetCurrentTaskHandle());
+
+		if (ringbuf_space(rb) < need) {
+			if (xTaskCheckForTimeOut(&start, &timeout) != pdFALSE) {
+				store_seq(&rb->writer, NULL);
+				break;
+			}
+			ulTaskNotifyTake(pdTRUE, timeout);
+		}
+		store_seq(&rb->writer, NULL);
+	}
+
+	return (ringbuf_space(rb) >= need);
+}
@@ -0,0 +1,55 @@
+#ifndef RINGBUF_H
+#define RINGBUF_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "FreeRTOS.h"
+#include "task.h"
+
+/**
+ * Single-producer/single-consumer byte ring.
+ *
+ * 'head' is only written by the producer and 'tail' only by the consumer,
+ * both running freely and masked on access, so no lock is needed: the
+ * indices are published with acquire/release atomics and the waiter
+ * hand-over uses LDREX/STREX. Either side may be an ISR.
+ *
+ * Data moves in spans: the producer asks for contiguous free space, fills
+ * it and commits; the consumer asks for contiguous data, uses it in place
+ * and releases it. ringbuf_write()/ringbuf_read() copy on top of that.
+ *
+ * A task can sleep until a threshold is reached (data available for the
+ * consumer, free space for the producer). It is woken with a direct task
+ * notification only when the other side crosses that threshold, not on
+ * every byte.
+ */
+typedef struct {
+	uint8_t* buf;
+	uint32_t size;					// Power of two.
+	volatile uint32_t head;			// Advanced by the producer only.
+	volatile uint32_t tail;			// Advanced by the consumer only.
+	TaskHandle_t volatile reader;	// Consumer sleeping in ringbuf_wait_read().
+	TaskHandle_t volatile writer;	// Producer sleeping in ringbuf_wait_write().
+	volatile uint32_t read_need;	// Bytes 'reader' waits for.
+	volatile uint32_t write_need;	// Free bytes 'writer' waits for.
+	uint32_t overwritten;			// Bytes a free-running producer overwrote.
+} RingBuf;
+
+void ringbuf_init(RingBuf* rb, uint8_t* buf, uint32_t size);
+uint32_t ringbuf_used(const RingBuf* rb);
+uint32_t ringbuf_space(const RingBuf* rb);
+
+uint32_t ringbuf_write_span(RingBuf* rb, uint8_t** span);
+void ringbuf_write_commit(RingBuf* rb, uint32_t len);
+uint32_t ringbuf_write(RingBuf* rb, const void* data, uint32_t len);
+
+uint32_t ringbuf_read_span(RingBuf* rb, const uint8_t** span);
+void ringbuf_read_release(RingBuf* rb, uint32_t len);
+uint32_t ringbuf_read(RingBuf* rb, void* data, uint32_t len);
+uint32_t ringbuf_peek(const RingBuf* rb, uint32_t offset, void* data, uint32_t len);
+
+bool ringbuf_wait_read(RingBuf* rb, uint32_t need, TickType_t timeout);
+bool ringbuf_wait_write(RingBuf* rb, uint32_t need, TickType_t timeout);
+
+#endif // !RINGBUF_H
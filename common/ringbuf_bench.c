@@ -0,0 +1,108 @@
+#include "FreeRTOS.h"
+#include "task.h"
+#include "queue.h"
+#include "ringbuf.h"
+#include "ringbuf_bench.h"
+
+#include <libopencm3/cm3/dwt.h>
+
+#define BENCH_DEPTH		256	// Capacity of each buffer under test.
+#define BENCH_BATCH		64	// Bytes produced before the consumer drains.
+
+static uint8_t bench_buf[BENCH_DEPTH];
+
+static uint32_t
+bench_queue(uint32_t bytes)
+{
+	QueueHandle_t q = xQueueCreate(BENCH_DEPTH, sizeof(uint8_t));
+	uint32_t start, cycles;
+	uint8_t ch = 0;
+
+	if (q == NULL)
+		return (0);
+
+	start = dwt_read_cycle_counter();
+	for (uint32_t done = 0; done < bytes; done += BENCH_BATCH) {
+		for (uint32_t x = 0; x < BENCH_BATCH; ++x)
+			xQueueSend(q, &ch, 0);
+		for (uint32_t x = 0; x < BENCH_BATCH; ++x)
+			xQueueReceive(q, &ch, 0);
+	}
+	cycles = dwt_read_cycle_counter() - start;
+
+	vQueueDelete(q);
+	return (cycles);
+}
+
+static uint32_t
+bench_ring_byte(uint32_t bytes)
+{
+	RingBuf rb;
+	uint32_t start;
+	uint8_t ch = 0;
+
+	ringbuf_init(&rb, bench_buf, sizeof bench_buf);
+
+	start = dwt_read_cycle_counter();
+	for (uint32_t done = 0; done < bytes; done += BENCH_BATCH) {
+		for (uint32_t x = 0; x < BENCH_BATCH; ++x)
+			ringbuf_write(&rb, &ch, 1);
+		for (uint32_t x = 0; x < BENCH_BATCH; ++x)
+			ringbuf_read(&rb, &ch, 1);
+	}
+	return (dwt_read_cycle_counter() - start);
+}
+
+static uint32_t
+bench_ring_span(uint32_t bytes)
+{
+	RingBuf rb;
+	uint32_t start;
+
+	ringbuf_init(&rb, bench_buf, sizeof bench_buf);
+
+	start = dwt_read_cycle_counter();
+	for (uint32_t done = 0; done < bytes; done += BENCH_BATCH) {
+		uint32_t left = BENCH_BATCH;
+
+		while (left > 0) {
+			uint8_t* span;
+			uint32_t n = ringbuf_write_span(&rb, &span);
+
+			n = n < left ? n : left;
+			for (uint32_t x = 0; x < n; ++x)
+				span[x] = (uint8_t)x;
+			ringbuf_write_commit(&rb, n);
+			left -= n;
+		}
+
+		while (ringbuf_used(&rb) != 0) {
+			const uint8_t* span;
+			uint32_t n = ringbuf_read_span(&rb, &span);
+			volatile uint8_t sink;
+
+			for (uint32_t x = 0; x < n; ++x)
+				sink = span[x];
+			(void)sink;
+			ringbuf_read_release(&rb, n);
+		}
+	}
+	return (dwt_read_cycle_counter() - start);
+}
+
+/**
+ * Compares the per-byte FreeRTOS queue the drivers used to have with the
+ * SPSC ring, used per byte and per span. 'bytes' is rounded up to a
+ * multiple of BENCH_BATCH. The span variant still touches every byte, as a
+ * real producer and consumer would.
+ */
+void
+ringbuf_bench(uint32_t bytes, RingBenchResult* res)
+{
+	dwt_enable_cycle_counter();
+
+	res->bytes = (bytes + BENCH_BATCH - 1) / BENCH_BATCH * BENCH_BATCH;
+	res->queue_cycles = bench_queue(res->bytes);
+	res->ring_byte_cycles = bench_ring_byte(res->bytes);
+	res->ring_span_cycles = bench_ring_span(res->bytes);
+}
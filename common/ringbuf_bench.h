@@ -0,0 +1,19 @@
+#ifndef RINGBUF_BENCH_H
+#define RINGBUF_BENCH_H
+
+#include <stdint.h>
+
+/**
+ * DWT cycles needed to push 'bytes' bytes through each buffer design and
+ * back out again, producer and consumer running in the calling task.
+ */
+typedef struct {
+	uint32_t bytes;
+	uint32_t queue_cycles;		// xQueueSend/xQueueReceive, one byte per call.
+	uint32_t ring_byte_cycles;	// ringbuf_write/ringbuf_read, one byte per call.
+	uint32_t ring_span_cycles;	// ringbuf_write_span/ringbuf_read_span, whole spans.
+} RingBenchResult;
+
+void ringbuf_bench(uint32_t bytes, RingBenchResult* res);
+
+#endif // !RINGBUF_BENCH_H
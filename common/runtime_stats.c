@@ -0,0 +1,66 @@
+#include "runtime_stats.h"
+
+#include <libopencm3/stm32/rcc.h>
+#include <libopencm3/stm32/timer.h>
+#include <libopencm3/cm3/nvic.h>
+
+/* The overflow interrupt makes no FreeRTOS calls, so it is allowed to sit
+ * above configMAX_SYSCALL_INTERRUPT_PRIORITY and keep counting inside
+ * critical sections. */
+#define RUNTIME_STATS_IRQ_PRIORITY	0x40
+
+static volatile uint32_t overflows;
+
+/**
+ * Time base for configGENERATE_RUN_TIME_STATS.
+ *
+ * The DWT cycle counter stops with the core clock in WFI, so idle time spent
+ * in tickless sleep would never be accounted. TIM2 keeps running in Sleep
+ * mode: it is prescaled to RUNTIME_STATS_HZ and extended to 32 bits by
+ * counting its overflows, which costs one interrupt every 6.5 s.
+ */
+void
+runtime_stats_init(void)
+{
+	rcc_periph_clock_enable(RCC_TIM2);
+	rcc_periph_reset_pulse(RST_TIM2);
+
+	/* APB1 runs at 36 MHz, so the timers see 72 MHz. */
+	timer_set_prescaler(TIM2, rcc_apb1_frequency * 2 / RUNTIME_STATS_HZ - 1);
+	timer_set_period(TIM2, 0xFFFF);
+	timer_generate_event(TIM2, TIM_EGR_UG);	// Load the prescaler now.
+	timer_clear_flag(TIM2, TIM_SR_UIF);
+	timer_enable_irq(TIM2, TIM_DIER_UIE);
+
+	nvic_set_priority(NVIC_TIM2_IRQ, RUNTIME_STATS_IRQ_PRIORITY);
+	nvic_enable_irq(NVIC_TIM2_IRQ);
+
+	timer_enable_counter(TIM2);
+}
+
+void
+TIM2_IRQHandler(void)
+{
+	timer_clear_flag(TIM2, TIM_SR_UIF);
+	++overflows;
+}
+
+/**
+ * Current run-time stats count. Also correct with interrupts disabled,
+ * when a wrap may be pending but not yet counted.
+ */
+uint32_t
+runtime_stats_counter(void)
+{
+	uint32_t seen, hi, lo;
+
+	do {
+		seen = overflows;
+		hi = seen;
+		lo = TIM_CNT(TIM2);
+		if ((TIM_SR(TIM2) & TIM_SR_UIF) != 0 && lo < 0x8000)
+			hi += 1;	// Wrapped, but the overflow has not been counted yet.
+	} while (seen != overflows);
+
+	return ((hi << 16) | lo);
+}
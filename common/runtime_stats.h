@@ -0,0 +1,12 @@
+#ifndef RUNTIME_STATS_H
+#define RUNTIME_STATS_H
+
+#include <stdint.h>
+
+/* Ticks per second of the run-time stats clock. */
+#define RUNTIME_STATS_HZ	10000
+
+void runtime_stats_init(void);
+uint32_t runtime_stats_counter(void);
+
+#endif // !RUNTIME_STATS_H
@@ -273,6 +273,30 @@ LGPL License Terms @ref lgpl_license
 		GET_REG(USB_EP_REG(EP)) & \
 		(USB_EP_NTOGGLE_MSK | USB_EP_RX_DTOG))
 
+/* Macros for toggling DTOG bits, leaving CTR bits set in the meantime alone */
+#define USB_TOG_EP_TX_DTOG(EP) \
+	SET_REG(USB_EP_REG(EP), \
+		(GET_REG(USB_EP_REG(EP)) & USB_EP_NTOGGLE_MSK) | \
+		USB_EP_RX_CTR | USB_EP_TX_CTR | USB_EP_TX_DTOG)
+
+#define USB_TOG_EP_RX_DTOG(EP) \
+	SET_REG(USB_EP_REG(EP), \
+		(GET_REG(USB_EP_REG(EP)) & USB_EP_NTOGGLE_MSK) | \
+		USB_EP_RX_CTR | USB_EP_TX_CTR | USB_EP_RX_DTOG)
+
+/*
+ * Double-buffered bulk endpoints (EP_KIND set) work in one direction only.
+ * The DTOG bit of the other direction becomes SW_BUF: the buffer the
+ * application owns, while the peripheral uses the one DTOG points at. When
+ * both are equal the peripheral NAKs. The application toggles SW_BUF to
+ * hand its buffer over.
+ */
+#define USB_EP_TX_SW_BUF	USB_EP_RX_DTOG
+#define USB_EP_RX_SW_BUF	USB_EP_TX_DTOG
+
+#define USB_TOG_EP_TX_SW_BUF(EP)	USB_TOG_EP_RX_DTOG(EP)
+#define USB_TOG_EP_RX_SW_BUF(EP)	USB_TOG_EP_TX_DTOG(EP)
+
 
 /* --- USB BTABLE registers ------------------------------------------------ */
 
@@ -289,6 +313,25 @@ LGPL License Terms @ref lgpl_license
 #define USB_SET_EP_RX_ADDR(EP, ADDR)	SET_REG(USB_EP_RX_ADDR(EP), ADDR)
 #define USB_SET_EP_RX_COUNT(EP, COUNT)	SET_REG(USB_EP_RX_COUNT(EP), COUNT)
 
+/*
+ * Buffers of a double-buffered endpoint: buffer 0 takes the TX entry of the
+ * buffer table and buffer 1 the RX one, whatever the direction.
+ */
+#define USB_GET_EP_DBL_BUFF(EP, BUF) \
+	((BUF) ? USB_GET_EP_RX_BUFF(EP) : USB_GET_EP_TX_BUFF(EP))
+
+#define USB_GET_EP_DBL_COUNT(EP, BUF) \
+	((BUF) ? USB_GET_EP_RX_COUNT(EP) : USB_GET_EP_TX_COUNT(EP))
+
+#define USB_SET_EP_DBL_COUNT(EP, BUF, COUNT) \
+	do { \
+		if (BUF) { \
+			USB_SET_EP_RX_COUNT(EP, COUNT); \
+		} else { \
+			USB_SET_EP_TX_COUNT(EP, COUNT); \
+		} \
+	} while (0)
+
 
 
 /**@}*/
@@ -36,6 +36,9 @@
 
 #include <libopencm3/stm32/common/st_usbfs_common.h>
 
+/* Size of the packet memory in bytes, buffer table included */
+#define USB_PMA_SIZE		512
+
 /* --- USB BTABLE Registers ------------------------------------------------ */
 
 #define USB_EP_TX_ADDR(EP) \
@@ -81,6 +81,47 @@ typedef struct _usbd_mass_storage usbd_mass_storage;
 #define USB_MSC_REQ_BULK_ONLY_RESET	0xFF
 #define USB_MSC_REQ_GET_MAX_LUN		0xFE
 
+/** Size of the blocks the mass storage layer hands to a backend. */
+#define USB_MSC_BLOCK_SIZE		512
+
+/** Most logical units one mass storage interface can have. */
+#ifndef USB_MSC_MAX_LUNS
+#define USB_MSC_MAX_LUNS		4
+#endif
+
+/** @brief Asynchronous block device behind a mass storage interface.
+
+A backend starts a block transfer in @ref read_submit or @ref write_submit
+and returns; it reports the result later with usb_msc_complete(). At most as
+many blocks as usb_msc_set_backend() was given buffers for are outstanding at
+once, and they must be completed in the order they were submitted. A backend
+may also complete a block from within the submit call itself. Each logical
+unit has a backend of its own, told apart by @a lun.
+
+A backend whose blocks are in addressable memory, such as a RAM disk or
+memory-mapped flash, can also map them: blocks are then sent straight from,
+or received straight into, that memory instead of a buffer.
+*/
+struct usb_msc_backend {
+	/** Reads block @a lba into the USB_MSC_BLOCK_SIZE bytes at @a copy_to. */
+	void (*read_submit)(usbd_mass_storage *ms, uint8_t lun, uint32_t lba,
+			    uint8_t *copy_to);
+	/** Writes the block at @a copy_from to @a lba. The buffer is left alone
+	 * until the write is completed. */
+	void (*write_submit)(usbd_mass_storage *ms, uint8_t lun, uint32_t lba,
+			     const uint8_t *copy_from);
+	/** Optional. Returns block @a lba in the backend's memory, which must
+	 * stay put until the block has been sent, or NULL on a read error.
+	 * Replaces @ref read_submit. */
+	const uint8_t *(*read_map)(usbd_mass_storage *ms, uint8_t lun,
+				   uint32_t lba);
+	/** Optional. Returns where to receive block @a lba, or NULL on a
+	 * write error. Once received, that memory is passed to
+	 * @ref write_submit. */
+	uint8_t *(*write_map)(usbd_mass_storage *ms, uint8_t lun,
+			      uint32_t lba);
+};
+
 usbd_mass_storage *usb_msc_init(usbd_device *usbd_dev,
 				 uint8_t ep_in, uint8_t ep_in_size,
 				 uint8_t ep_out, uint8_t ep_out_size,
@@ -91,6 +132,25 @@ usbd_mass_storage *usb_msc_init(usbd_device *usbd_dev,
 				 int (*read_block)(uint32_t lba, uint8_t *copy_to),
 				 int (*write_block)(uint32_t lba, const uint8_t *copy_from));
 
+int usb_msc_add_lun(usbd_mass_storage *ms, const uint32_t block_count,
+		    int (*read_block)(uint32_t lba, uint8_t *copy_to),
+		    int (*write_block)(uint32_t lba, const uint8_t *copy_from));
+
+void usb_msc_set_backend(usbd_mass_storage *ms, uint8_t lun,
+			 const struct usb_msc_backend *backend,
+			 uint8_t *buffers, uint8_t buffer_count);
+
+void usb_msc_complete(usbd_mass_storage *ms, int status);
+
+void usb_msc_set_cache(usbd_mass_storage *ms, uint8_t lun, uint8_t *buffer,
+		       uint8_t unit_blocks, uint16_t idle_ms,
+		       int (*write_unit)(uint32_t lba,
+					 const uint8_t *copy_from));
+
+void usb_msc_flush(usbd_mass_storage *ms);
+
+void usb_msc_tick(usbd_mass_storage *ms);
+
 #endif
 
 /**@}*/
@@ -114,6 +114,18 @@ extern void usbd_register_resume_callback(usbd_device *usbd_dev,
 extern void usbd_register_sof_callback(usbd_device *usbd_dev,
 				       void (*callback)(void));
 
+/**
+ * Tells whether the host has enabled remote wakeup with
+ * SET_FEATURE(DEVICE_REMOTE_WAKEUP). Cleared by CLEAR_FEATURE and by a bus
+ * reset. Only then may the device signal resume while suspended; the
+ * configuration must advertise USB_CONFIG_ATTR_REMOTE_WAKEUP for the host
+ * to do so.
+ *
+ * @param usbd_dev the usb device handle returned from @ref usbd_init
+ * @return true if the device may signal remote wakeup
+ */
+extern bool usbd_remote_wakeup_enabled(usbd_device *usbd_dev);
+
 typedef void (*usbd_control_complete_callback)(usbd_device *usbd_dev,
 		struct usb_setup_data *req);
 
@@ -149,6 +161,26 @@ extern int usbd_register_control_callback(usbd_device *usbd_dev, uint8_t type,
 					  uint8_t type_mask,
 					  usbd_control_callback callback);
 
+/** Registers a control callback for one interface or endpoint.
+ *
+ * As usbd_register_control_callback(), but the callback is only called for
+ * requests whose wIndex has @a index in its low byte: the interface number
+ * or endpoint address they are for. Requests are routed to it without
+ * asking the callbacks of other interfaces first, which suits composite
+ * devices with a function per interface.
+ * @param usbd_dev the usb device handle returned from @ref usbd_init
+ * @param type Handled request type
+ * @param type_mask Mask to apply before matching request type
+ * @param index Interface number or endpoint address to match
+ * @param callback your desired callback function
+ * @return 0 if successful
+ */
+extern int usbd_register_control_callback_index(usbd_device *usbd_dev,
+						uint8_t type,
+						uint8_t type_mask,
+						uint8_t index,
+						usbd_control_callback callback);
+
 /* <usb_standard.c> */
 /** Registers a "Set Config" callback
  * @param usbd_dev the usb device handle returned from @ref usbd_init
@@ -181,10 +213,17 @@ extern void usbd_poll(usbd_device *usbd_dev);
  */
 extern void usbd_disconnect(usbd_device *usbd_dev, bool disconnected);
 
+/** Flag for the type of @ref usbd_ep_setup: double-buffer a bulk endpoint.
+ * The endpoint works in one direction only then, so an OUT and IN pair
+ * needs two endpoint numbers. Drivers without double buffering ignore it.
+ */
+#define USBD_EP_DOUBLE_BUFFER	0x80
+
 /** Setup an endpoint
  * @param usbd_dev the usb device handle returned from @ref usbd_init
  * @param addr Full EP address including direction (e.g. 0x01 or 0x81)
- * @param type Value for bmAttributes (USB_ENDPOINT_ATTR_*)
+ * @param type Value for bmAttributes (USB_ENDPOINT_ATTR_*), optionally
+ * ORed with USBD_EP_DOUBLE_BUFFER
  * @param max_size Endpoint max size
  * @param callback your desired callback function
  * @note The stack only supports 8 endpoints, 0..7, so don't try
@@ -213,6 +252,39 @@ extern uint16_t usbd_ep_write_packet(usbd_device *usbd_dev, uint8_t addr,
  */
 extern uint16_t usbd_ep_read_packet(usbd_device *usbd_dev, uint8_t addr,
 			       void *buf, uint16_t len);
+
+/** Write a packet gathered from two buffers
+ *
+ * Sends the bytes of @a buf1 followed by those of @a buf2 as one packet,
+ * e.g. the two segments of a ring buffer, without a copy in between.
+ * Drivers that cannot gather bounce packets of up to 64 bytes.
+ * @param usbd_dev the usb device handle returned from @ref usbd_init
+ * @param addr EP address (direction is ignored)
+ * @param buf1 pointer to the first part of the packet
+ * @param len1 # of bytes in it
+ * @param buf2 pointer to the rest of the packet
+ * @param len2 # of bytes in it, may be 0
+ * @return 0 if failed, len1 + len2 if successful
+ */
+extern uint16_t usbd_ep_write_packet_gather(usbd_device *usbd_dev,
+		uint8_t addr, const void *buf1, uint16_t len1,
+		const void *buf2, uint16_t len2);
+
+/** Read a packet scattered to two buffers
+ *
+ * Fills @a buf1, then @a buf2 with the rest of the packet.
+ * Drivers that cannot scatter bounce packets of up to 64 bytes.
+ * @param usbd_dev the usb device handle returned from @ref usbd_init
+ * @param addr EP address
+ * @param buf1 user buffer that will receive the first part
+ * @param len1 # of bytes it holds
+ * @param buf2 user buffer that will receive the rest
+ * @param len2 # of bytes it holds, may be 0
+ * @return Actual # of bytes read
+ */
+extern uint16_t usbd_ep_read_packet_scatter(usbd_device *usbd_dev,
+		uint8_t addr, void *buf1, uint16_t len1,
+		void *buf2, uint16_t len2);
 /** Set/clear STALL condition on an endpoint
  * @param usbd_dev the usb device handle returned from @ref usbd_init
  * @param addr Full EP address (with direction bit)
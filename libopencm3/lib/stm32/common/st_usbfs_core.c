@@ -18,6 +18,7 @@
  * along with this library.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stddef.h>
 #include <libopencm3/cm3/common.h>
 #include <libopencm3/stm32/rcc.h>
 #include <libopencm3/stm32/tools.h>
@@ -30,6 +31,24 @@
 uint8_t st_usbfs_force_nak[8];
 struct _usbd_device st_usbfs_dev;
 
+/*
+ * Packet memory of each endpoint and direction (USB_TRANSACTION_IN/OUT),
+ * kept so that setting an endpoint up again, as on SET_INTERFACE, reuses its
+ * buffers rather than taking more. Everything past EP0 is reclaimed when the
+ * configuration changes, everything on a bus reset.
+ */
+static struct {
+	uint16_t addr;
+	uint16_t size;
+} st_usbfs_pma[8][2];
+
+/* Bit n set if endpoint n is double-buffered. */
+static uint8_t st_usbfs_dbl_buf;
+
+/* IN packets a double-buffered endpoint holds, 0 to 2. The second is only
+ * handed to the peripheral once the first is out. */
+static uint8_t st_usbfs_dbl_pending[8];
+
 void st_usbfs_set_address(usbd_device *dev, uint8_t addr)
 {
 	(void)dev;
@@ -77,6 +96,106 @@ uint16_t st_usbfs_set_ep_rx_bufsize(usbd_device *dev, uint8_t ep, uint32_t size)
 	return realsize;
 }
 
+/**
+ * Allocate packet memory for one direction of an endpoint.
+ *
+ * An endpoint set up again gets its old buffer back if that is big enough.
+ *
+ * @param dev the usb device handle returned from @ref usbd_init
+ * @param ep Index of the endpoint.
+ * @param dir USB_TRANSACTION_IN or USB_TRANSACTION_OUT.
+ * @param size Size in bytes, even.
+ * @returns (uint16) Offset in packet memory, or 0 if it is exhausted.
+ */
+static uint16_t st_usbfs_pma_alloc(usbd_device *dev, uint8_t ep, uint8_t dir,
+				   uint16_t size)
+{
+	if (st_usbfs_pma[ep][dir].size >= size) {
+		return st_usbfs_pma[ep][dir].addr;
+	}
+	if (dev->pm_top + size > USB_PMA_SIZE) {
+		return 0;
+	}
+
+	st_usbfs_pma[ep][dir].addr = dev->pm_top;
+	st_usbfs_pma[ep][dir].size = size;
+	dev->pm_top += size;
+	return st_usbfs_pma[ep][dir].addr;
+}
+
+/**
+ * Free the packet memory of endpoints 'first' to 7.
+ *
+ * @param dev the usb device handle returned from @ref usbd_init
+ * @param first Index of the first endpoint to free.
+ * @param top Start of free packet memory afterwards.
+ */
+static void st_usbfs_pma_free(usbd_device *dev, uint8_t first, uint16_t top)
+{
+	int i;
+
+	for (i = first; i < 8; i++) {
+		st_usbfs_pma[i][USB_TRANSACTION_IN].size = 0;
+		st_usbfs_pma[i][USB_TRANSACTION_OUT].size = 0;
+		st_usbfs_dbl_buf &= ~(1 << i);
+		st_usbfs_dbl_pending[i] = 0;
+	}
+	dev->pm_top = top;
+}
+
+/**
+ * Set up a double-buffered bulk endpoint. Both buffers are in one block of
+ * packet memory; they take the TX and RX entries of the buffer table.
+ */
+static void st_usbfs_ep_setup_dbl(usbd_device *dev, uint8_t addr, uint8_t dir,
+				  uint16_t max_size,
+				  usbd_endpoint_callback callback)
+{
+	uint16_t size, pm;
+
+	if (dir) {
+		size = (max_size + 1) & ~1;
+		pm = st_usbfs_pma_alloc(dev, addr, USB_TRANSACTION_IN, 2 * size);
+	} else {
+		size = st_usbfs_set_ep_rx_bufsize(dev, addr, max_size);
+		pm = st_usbfs_pma_alloc(dev, addr, USB_TRANSACTION_OUT, 2 * size);
+	}
+	if (pm == 0) {
+		return;
+	}
+
+	USB_SET_EP_KIND(addr);
+	USB_SET_EP_TX_ADDR(addr, pm);
+	USB_SET_EP_RX_ADDR(addr, pm + size);
+	st_usbfs_dbl_buf |= 1 << addr;
+	st_usbfs_dbl_pending[addr] = 0;
+
+	if (dir) {
+		if (callback) {
+			dev->user_callback_ctr[addr][USB_TRANSACTION_IN] =
+			    callback;
+		}
+		/* Both empty, the application owns buffer 0: NAK until written. */
+		USB_CLR_EP_TX_DTOG(addr);
+		USB_CLR_EP_RX_DTOG(addr);
+		USB_SET_EP_RX_STAT(addr, USB_EP_RX_STAT_DISABLED);
+		USB_SET_EP_TX_STAT(addr, USB_EP_TX_STAT_VALID);
+	} else {
+		if (callback) {
+			dev->user_callback_ctr[addr][USB_TRANSACTION_OUT] =
+			    callback;
+		}
+		/* Both count fields describe the buffer size. */
+		USB_SET_EP_TX_COUNT(addr, USB_GET_EP_RX_COUNT(addr));
+		/* Both empty, the peripheral fills buffer 0 first. */
+		USB_CLR_EP_RX_DTOG(addr);
+		USB_CLR_EP_TX_DTOG(addr);
+		USB_TOG_EP_RX_SW_BUF(addr);
+		USB_SET_EP_TX_STAT(addr, USB_EP_TX_STAT_DISABLED);
+		USB_SET_EP_RX_STAT(addr, USB_EP_RX_STAT_VALID);
+	}
+}
+
 void st_usbfs_ep_setup(usbd_device *dev, uint8_t addr, uint8_t type,
 		uint16_t max_size,
 		void (*callback) (usbd_device *usbd_dev,
@@ -89,35 +208,55 @@ void st_usbfs_ep_setup(usbd_device *dev, uint8_t addr, uint8_t type,
 		[USB_ENDPOINT_ATTR_BULK] = USB_EP_TYPE_BULK,
 		[USB_ENDPOINT_ATTR_INTERRUPT] = USB_EP_TYPE_INTERRUPT,
 	};
+	bool dbl = type & USBD_EP_DOUBLE_BUFFER;
 	uint8_t dir = addr & 0x80;
 	addr &= 0x7f;
+	type &= USB_ENDPOINT_ATTR_TYPE;
 
 	/* Assign address. */
 	USB_SET_EP_ADDR(addr, addr);
 	USB_SET_EP_TYPE(addr, typelookup[type]);
 
+	if (type != USB_ENDPOINT_ATTR_CONTROL) {
+		/* EP_KIND is left over if the endpoint was double-buffered. */
+		USB_CLR_EP_KIND(addr);
+		if (dbl && type == USB_ENDPOINT_ATTR_BULK) {
+			st_usbfs_ep_setup_dbl(dev, addr, dir, max_size,
+					      callback);
+			return;
+		}
+	}
+	st_usbfs_dbl_buf &= ~(1 << addr);
+
 	if (dir || (addr == 0)) {
-		USB_SET_EP_TX_ADDR(addr, dev->pm_top);
+		uint16_t pm = st_usbfs_pma_alloc(dev, addr, USB_TRANSACTION_IN,
+						 (max_size + 1) & ~1);
+		if (pm == 0) {
+			return;
+		}
+		USB_SET_EP_TX_ADDR(addr, pm);
 		if (callback) {
 			dev->user_callback_ctr[addr][USB_TRANSACTION_IN] =
 			    (void *)callback;
 		}
 		USB_CLR_EP_TX_DTOG(addr);
 		USB_SET_EP_TX_STAT(addr, USB_EP_TX_STAT_NAK);
-		dev->pm_top += max_size;
 	}
 
 	if (!dir) {
-		uint16_t realsize;
-		USB_SET_EP_RX_ADDR(addr, dev->pm_top);
+		uint16_t realsize, pm;
 		realsize = st_usbfs_set_ep_rx_bufsize(dev, addr, max_size);
+		pm = st_usbfs_pma_alloc(dev, addr, USB_TRANSACTION_OUT, realsize);
+		if (pm == 0) {
+			return;
+		}
+		USB_SET_EP_RX_ADDR(addr, pm);
 		if (callback) {
 			dev->user_callback_ctr[addr][USB_TRANSACTION_OUT] =
 			    (void *)callback;
 		}
 		USB_CLR_EP_RX_DTOG(addr);
 		USB_SET_EP_RX_STAT(addr, USB_EP_RX_STAT_VALID);
-		dev->pm_top += realsize;
 	}
 }
 
@@ -130,7 +269,9 @@ void st_usbfs_endpoints_reset(usbd_device *dev)
 		USB_SET_EP_TX_STAT(i, USB_EP_TX_STAT_DISABLED);
 		USB_SET_EP_RX_STAT(i, USB_EP_RX_STAT_DISABLED);
 	}
-	dev->pm_top = USBD_PM_TOP + (2 * dev->desc->bMaxPacketSize0);
+	st_usbfs_pma_free(dev, 1,
+		st_usbfs_pma[0][USB_TRANSACTION_OUT].addr +
+		st_usbfs_pma[0][USB_TRANSACTION_OUT].size);
 }
 
 void st_usbfs_ep_stall_set(usbd_device *dev, uint8_t addr,
@@ -145,6 +286,18 @@ void st_usbfs_ep_stall_set(usbd_device *dev, uint8_t addr,
 	if (addr & 0x80) {
 		addr &= 0x7F;
 
+		if (st_usbfs_dbl_buf & (1 << addr)) {
+			/* Reset to DATA0 with both buffers empty. */
+			if (!stall) {
+				USB_CLR_EP_TX_DTOG(addr);
+				USB_CLR_EP_RX_DTOG(addr);
+				st_usbfs_dbl_pending[addr] = 0;
+			}
+			USB_SET_EP_TX_STAT(addr, stall ? USB_EP_TX_STAT_STALL :
+					   USB_EP_TX_STAT_VALID);
+			return;
+		}
+
 		USB_SET_EP_TX_STAT(addr, stall ? USB_EP_TX_STAT_STALL :
 				   USB_EP_TX_STAT_NAK);
 
@@ -156,6 +309,11 @@ void st_usbfs_ep_stall_set(usbd_device *dev, uint8_t addr,
 		/* Reset to DATA0 if clearing stall condition. */
 		if (!stall) {
 			USB_CLR_EP_RX_DTOG(addr);
+			if (st_usbfs_dbl_buf & (1 << addr)) {
+				/* Both buffers empty again. */
+				USB_CLR_EP_TX_DTOG(addr);
+				USB_TOG_EP_RX_SW_BUF(addr);
+			}
 		}
 
 		USB_SET_EP_RX_STAT(addr, stall ? USB_EP_RX_STAT_STALL :
@@ -197,33 +355,138 @@ void st_usbfs_ep_nak_set(usbd_device *dev, uint8_t addr, uint8_t nak)
 	}
 }
 
-uint16_t st_usbfs_ep_write_packet(usbd_device *dev, uint8_t addr,
-				     const void *buf, uint16_t len)
+/** Copy a packet made of one or two buffers to packet memory. */
+static void st_usbfs_copy_packet_to_pm(volatile void *vPM,
+				       const void *buf1, uint16_t len1,
+				       const void *buf2, uint16_t len2)
+{
+	if (len2) {
+		st_usbfs_copy_to_pm_sg(vPM, buf1, len1, buf2, len2);
+	} else {
+		st_usbfs_copy_to_pm(vPM, buf1, len1);
+	}
+}
+
+/**
+ * Copy a received packet of 'count' bytes to one or two buffers, as much as
+ * fits. Returns the number of bytes copied.
+ */
+static uint16_t st_usbfs_copy_packet_from_pm(void *buf1, uint16_t len1,
+					     void *buf2, uint16_t len2,
+					     const volatile void *vPM,
+					     uint16_t count)
+{
+	count = MIN(count, len1 + len2);
+	if (count > len1) {
+		st_usbfs_copy_from_pm_sg(buf1, len1, buf2, count - len1, vPM);
+	} else {
+		st_usbfs_copy_from_pm(buf1, vPM, count);
+	}
+	return count;
+}
+
+/**
+ * Fill the buffer the application owns. With the other one empty it is
+ * handed to the peripheral at once; with the other one still queued it is
+ * handed over by the CTR_TX of that one, in @ref st_usbfs_poll. Toggling
+ * SW_BUF twice in a row would make it equal DTOG again, which the
+ * peripheral takes for both buffers empty and NAKs.
+ */
+static uint16_t st_usbfs_ep_write_packet_dbl(uint8_t addr,
+					     const void *buf1, uint16_t len1,
+					     const void *buf2, uint16_t len2)
+{
+	uint8_t sw_buf;
+
+	if (st_usbfs_dbl_pending[addr] == 2) {
+		return 0;
+	}
+
+	sw_buf = (*USB_EP_REG(addr) & USB_EP_TX_SW_BUF) != 0;
+	st_usbfs_copy_packet_to_pm(USB_GET_EP_DBL_BUFF(addr, sw_buf),
+				   buf1, len1, buf2, len2);
+	USB_SET_EP_DBL_COUNT(addr, sw_buf, len1 + len2);
+	if (st_usbfs_dbl_pending[addr]++ == 0) {
+		USB_TOG_EP_TX_SW_BUF(addr);
+	}
+
+	return len1 + len2;
+}
+
+uint16_t st_usbfs_ep_write_packet_gather(usbd_device *dev, uint8_t addr,
+					 const void *buf1, uint16_t len1,
+					 const void *buf2, uint16_t len2)
 {
 	(void)dev;
 	addr &= 0x7F;
 
+	if (st_usbfs_dbl_buf & (1 << addr)) {
+		return st_usbfs_ep_write_packet_dbl(addr, buf1, len1,
+						    buf2, len2);
+	}
+
 	if ((*USB_EP_REG(addr) & USB_EP_TX_STAT) == USB_EP_TX_STAT_VALID) {
 		return 0;
 	}
 
-	st_usbfs_copy_to_pm(USB_GET_EP_TX_BUFF(addr), buf, len);
-	USB_SET_EP_TX_COUNT(addr, len);
+	st_usbfs_copy_packet_to_pm(USB_GET_EP_TX_BUFF(addr),
+				   buf1, len1, buf2, len2);
+	USB_SET_EP_TX_COUNT(addr, len1 + len2);
 	USB_SET_EP_TX_STAT(addr, USB_EP_TX_STAT_VALID);
 
-	return len;
+	return len1 + len2;
 }
 
-uint16_t st_usbfs_ep_read_packet(usbd_device *dev, uint8_t addr,
-					 void *buf, uint16_t len)
+uint16_t st_usbfs_ep_write_packet(usbd_device *dev, uint8_t addr,
+				     const void *buf, uint16_t len)
 {
+	return st_usbfs_ep_write_packet_gather(dev, addr, buf, len, NULL, 0);
+}
+
+/**
+ * Take the buffer the peripheral has filled and give it the one the
+ * application owned, before copying, so the next packet comes in while this
+ * one is copied out. The endpoint stays VALID; a forced NAK is left to
+ * STAT_RX by @ref st_usbfs_ep_nak_set.
+ */
+static uint16_t st_usbfs_ep_read_packet_dbl(uint8_t addr,
+					    void *buf1, uint16_t len1,
+					    void *buf2, uint16_t len2)
+{
+	uint8_t sw_buf;
+
+	if (!(*USB_EP_REG(addr) & USB_EP_RX_CTR)) {
+		return 0;
+	}
+
+	/* Clear CTR first, so a packet completing meanwhile raises it again. */
+	USB_CLR_EP_RX_CTR(addr);
+	USB_TOG_EP_RX_SW_BUF(addr);
+	sw_buf = (*USB_EP_REG(addr) & USB_EP_RX_SW_BUF) != 0;
+
+	return st_usbfs_copy_packet_from_pm(buf1, len1, buf2, len2,
+		USB_GET_EP_DBL_BUFF(addr, sw_buf),
+		USB_GET_EP_DBL_COUNT(addr, sw_buf) & 0x3ff);
+}
+
+uint16_t st_usbfs_ep_read_packet_scatter(usbd_device *dev, uint8_t addr,
+					void *buf1, uint16_t len1,
+					void *buf2, uint16_t len2)
+{
+	uint16_t len;
+
 	(void)dev;
+	if (st_usbfs_dbl_buf & (1 << addr)) {
+		return st_usbfs_ep_read_packet_dbl(addr, buf1, len1,
+						   buf2, len2);
+	}
+
 	if ((*USB_EP_REG(addr) & USB_EP_RX_STAT) == USB_EP_RX_STAT_VALID) {
 		return 0;
 	}
 
-	len = MIN(USB_GET_EP_RX_COUNT(addr) & 0x3ff, len);
-	st_usbfs_copy_from_pm(buf, USB_GET_EP_RX_BUFF(addr), len);
+	len = st_usbfs_copy_packet_from_pm(buf1, len1, buf2, len2,
+		USB_GET_EP_RX_BUFF(addr), USB_GET_EP_RX_COUNT(addr) & 0x3ff);
 	USB_CLR_EP_RX_CTR(addr);
 
 	if (!st_usbfs_force_nak[addr]) {
@@ -233,13 +496,19 @@ uint16_t st_usbfs_ep_read_packet(usbd_device *dev, uint8_t addr,
 	return len;
 }
 
+uint16_t st_usbfs_ep_read_packet(usbd_device *dev, uint8_t addr,
+					 void *buf, uint16_t len)
+{
+	return st_usbfs_ep_read_packet_scatter(dev, addr, buf, len, NULL, 0);
+}
+
 void st_usbfs_poll(usbd_device *dev)
 {
 	uint16_t istr = *USB_ISTR_REG;
 
 	if (istr & USB_ISTR_RESET) {
 		USB_CLR_ISTR_RESET();
-		dev->pm_top = USBD_PM_TOP;
+		st_usbfs_pma_free(dev, 0, USBD_PM_TOP);
 		_usbd_reset(dev);
 		return;
 	}
@@ -259,6 +528,18 @@ void st_usbfs_poll(usbd_device *dev)
 		} else {
 			type = USB_TRANSACTION_IN;
 			USB_CLR_EP_TX_CTR(ep);
+			if (st_usbfs_dbl_buf & (1 << ep)) {
+				/*
+				 * The buffer the peripheral had went out.
+				 * Hand it the one filled meanwhile, if any.
+				 */
+				if (st_usbfs_dbl_pending[ep] == 2) {
+					USB_TOG_EP_TX_SW_BUF(ep);
+				}
+				if (st_usbfs_dbl_pending[ep] > 0) {
+					st_usbfs_dbl_pending[ep]--;
+				}
+			}
 		}
 
 		if (dev->user_callback_ctr[ep][type]) {
@@ -48,6 +48,12 @@ uint16_t st_usbfs_ep_write_packet(usbd_device *usbd_dev, uint8_t addr,
 				  const void *buf, uint16_t len);
 uint16_t st_usbfs_ep_read_packet(usbd_device *usbd_dev, uint8_t addr,
 				 void *buf, uint16_t len);
+uint16_t st_usbfs_ep_write_packet_gather(usbd_device *usbd_dev, uint8_t addr,
+					 const void *buf1, uint16_t len1,
+					 const void *buf2, uint16_t len2);
+uint16_t st_usbfs_ep_read_packet_scatter(usbd_device *usbd_dev, uint8_t addr,
+					void *buf1, uint16_t len1,
+					void *buf2, uint16_t len2);
 void st_usbfs_poll(usbd_device *usbd_dev);
 
 /* These must be implemented by the device specific driver */
@@ -70,6 +76,30 @@ void st_usbfs_copy_from_pm(void *buf, const volatile void *vPM, uint16_t len);
  */
 void st_usbfs_copy_to_pm(volatile void *vPM, const void *buf, uint16_t len);
 
+/**
+ * Copy two data buffers to packet memory, one after the other.
+ *
+ * @param vPM Destination pointer into packet memory.
+ * @param buf1 Source pointer to the first data buffer.
+ * @param len1 Number of bytes to copy from it.
+ * @param buf2 Source pointer to the second data buffer.
+ * @param len2 Number of bytes to copy from it.
+ */
+void st_usbfs_copy_to_pm_sg(volatile void *vPM, const void *buf1, uint16_t len1,
+			    const void *buf2, uint16_t len2);
+
+/**
+ * Copy packet memory to two data buffers, filling the first one first.
+ *
+ * @param buf1 Destination pointer to the first data buffer.
+ * @param len1 Number of bytes to copy to it.
+ * @param buf2 Destination pointer to the second data buffer.
+ * @param len2 Number of bytes to copy to it.
+ * @param vPM Source pointer into packet memory.
+ */
+void st_usbfs_copy_from_pm_sg(void *buf1, uint16_t len1, void *buf2,
+			      uint16_t len2, const volatile void *vPM);
+
 extern uint8_t st_usbfs_force_nak[8];
 extern struct _usbd_device st_usbfs_dev;
 
@@ -37,7 +37,10 @@ const struct _usbd_driver st_usbfs_v1_usb_driver = {
 	.ep_nak_set = st_usbfs_ep_nak_set,
 	.ep_write_packet = st_usbfs_ep_write_packet,
 	.ep_read_packet = st_usbfs_ep_read_packet,
+	.ep_write_packet_gather = st_usbfs_ep_write_packet_gather,
+	.ep_read_packet_scatter = st_usbfs_ep_read_packet_scatter,
 	.poll = st_usbfs_poll,
+	.double_buffer = true,
 };
 
 /** Initialize the USB device controller hardware of the STM32. */
@@ -54,33 +57,197 @@ static usbd_device *st_usbfs_v1_usbd_init(void)
 	return &st_usbfs_dev;
 }
 
+/*
+ * The packet memory is 16 bits wide and sits at 32-bit strides on the APB
+ * bus: halfword n of a buffer is at byte offset 4n. Every PMA access is a
+ * slow bus cycle, so the copies below keep the CPU side cheap: whole words
+ * from and to RAM when aligned, unrolled four words (16 bytes, eight PMA
+ * accesses) at a time, and no byte past the end of the buffer touched.
+ */
+
+/**
+ * Copy a data buffer to packet memory.
+ *
+ * @param vPM Destination pointer into packet memory.
+ * @param buf Source pointer to data buffer.
+ * @param len Number of bytes to copy.
+ */
 void st_usbfs_copy_to_pm(volatile void *vPM, const void *buf, uint16_t len)
 {
-	const uint16_t *lbuf = buf;
-	volatile uint32_t *PM = vPM;
-	for (len = (len + 1) >> 1; len; len--) {
-		*PM++ = *lbuf++;
+	volatile uint16_t *PM = vPM;
+	const uint8_t *src = buf;
+	uint32_t n;
+
+	if (((uintptr_t) src & 3) == 0) {
+		const uint32_t *wbuf = (const uint32_t *) src;
+
+		for (n = len >> 4; n; n--) {
+			uint32_t w0 = wbuf[0];
+			uint32_t w1 = wbuf[1];
+			uint32_t w2 = wbuf[2];
+			uint32_t w3 = wbuf[3];
+
+			PM[0] = w0;
+			PM[2] = w0 >> 16;
+			PM[4] = w1;
+			PM[6] = w1 >> 16;
+			PM[8] = w2;
+			PM[10] = w2 >> 16;
+			PM[12] = w3;
+			PM[14] = w3 >> 16;
+			PM += 16;
+			wbuf += 4;
+		}
+		for (n = (len >> 2) & 3; n; n--) {
+			uint32_t w = *wbuf++;
+
+			PM[0] = w;
+			PM[2] = w >> 16;
+			PM += 4;
+		}
+		src = (const uint8_t *) wbuf;
+		len &= 3;
+	}
+
+	if (((uintptr_t) src & 1) == 0) {
+		const uint16_t *hbuf = (const uint16_t *) src;
+
+		for (n = len >> 1; n; n--) {
+			*PM = *hbuf++;
+			PM += 2;
+		}
+		src = (const uint8_t *) hbuf;
+	} else {
+		for (n = len >> 1; n; n--) {
+			*PM = src[0] | (src[1] << 8);
+			PM += 2;
+			src += 2;
+		}
+	}
+
+	if (len & 1) {
+		*PM = *src;
 	}
 }
 
 /**
  * Copy a data buffer from packet memory.
  *
- * @param buf Source pointer to data buffer.
- * @param vPM Destination pointer into packet memory.
+ * @param buf Destination pointer for data buffer.
+ * @param vPM Source pointer into packet memory.
  * @param len Number of bytes to copy.
  */
 void st_usbfs_copy_from_pm(void *buf, const volatile void *vPM, uint16_t len)
 {
-	uint16_t *lbuf = buf;
 	const volatile uint16_t *PM = vPM;
-	uint8_t odd = len & 1;
+	uint8_t *dst = buf;
+	uint32_t n;
+
+	if (((uintptr_t) dst & 3) == 0) {
+		uint32_t *wbuf = (uint32_t *) dst;
+
+		for (n = len >> 4; n; n--) {
+			wbuf[0] = PM[0] | ((uint32_t) PM[2] << 16);
+			wbuf[1] = PM[4] | ((uint32_t) PM[6] << 16);
+			wbuf[2] = PM[8] | ((uint32_t) PM[10] << 16);
+			wbuf[3] = PM[12] | ((uint32_t) PM[14] << 16);
+			PM += 16;
+			wbuf += 4;
+		}
+		for (n = (len >> 2) & 3; n; n--) {
+			*wbuf++ = PM[0] | ((uint32_t) PM[2] << 16);
+			PM += 4;
+		}
+		dst = (uint8_t *) wbuf;
+		len &= 3;
+	}
+
+	if (((uintptr_t) dst & 1) == 0) {
+		uint16_t *hbuf = (uint16_t *) dst;
+
+		for (n = len >> 1; n; n--) {
+			*hbuf++ = *PM;
+			PM += 2;
+		}
+		dst = (uint8_t *) hbuf;
+	} else {
+		for (n = len >> 1; n; n--) {
+			uint16_t value = *PM;
 
-	for (len >>= 1; len; PM += 2, lbuf++, len--) {
-		*lbuf = *PM;
+			dst[0] = value;
+			dst[1] = value >> 8;
+			PM += 2;
+			dst += 2;
+		}
 	}
 
-	if (odd) {
-		*(uint8_t *) lbuf = *(uint8_t *) PM;
+	if (len & 1) {
+		*dst = *PM;
 	}
 }
+
+/**
+ * Copy two data buffers to packet memory, one after the other.
+ *
+ * @param vPM Destination pointer into packet memory.
+ * @param buf1 Source pointer to the first data buffer.
+ * @param len1 Number of bytes to copy from it.
+ * @param buf2 Source pointer to the second data buffer.
+ * @param len2 Number of bytes to copy from it.
+ */
+void st_usbfs_copy_to_pm_sg(volatile void *vPM, const void *buf1, uint16_t len1,
+			    const void *buf2, uint16_t len2)
+{
+	volatile uint16_t *PM = vPM;
+	const uint8_t *src2 = buf2;
+
+	st_usbfs_copy_to_pm(PM, buf1, len1 & ~1);
+	PM += (len1 >> 1) * 2;
+
+	/* A halfword straddling both buffers. */
+	if (len1 & 1) {
+		uint16_t value = ((const uint8_t *) buf1)[len1 - 1];
+
+		if (len2) {
+			value |= *src2++ << 8;
+			len2--;
+		}
+		*PM = value;
+		PM += 2;
+	}
+
+	st_usbfs_copy_to_pm(PM, src2, len2);
+}
+
+/**
+ * Copy packet memory to two data buffers, filling the first one first.
+ *
+ * @param buf1 Destination pointer to the first data buffer.
+ * @param len1 Number of bytes to copy to it.
+ * @param buf2 Destination pointer to the second data buffer.
+ * @param len2 Number of bytes to copy to it.
+ * @param vPM Source pointer into packet memory.
+ */
+void st_usbfs_copy_from_pm_sg(void *buf1, uint16_t len1, void *buf2,
+			      uint16_t len2, const volatile void *vPM)
+{
+	const volatile uint16_t *PM = vPM;
+	uint8_t *dst2 = buf2;
+
+	st_usbfs_copy_from_pm(buf1, PM, len1 & ~1);
+	PM += (len1 >> 1) * 2;
+
+	/* A halfword straddling both buffers. */
+	if (len1 & 1) {
+		uint16_t value = *PM;
+
+		((uint8_t *) buf1)[len1 - 1] = value;
+		if (len2) {
+			*dst2++ = value >> 8;
+			len2--;
+		}
+		PM += 2;
+	}
+
+	st_usbfs_copy_from_pm(dst2, PM, len2);
+}
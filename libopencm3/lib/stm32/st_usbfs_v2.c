@@ -85,6 +85,70 @@ void st_usbfs_copy_from_pm(void *buf, const volatile void *vPM, uint16_t len)
 	}
 }
 
+/**
+ * Copy two data buffers to packet memory, one after the other.
+ *
+ * @param vPM Destination pointer into packet memory.
+ * @param buf1 Source pointer to the first data buffer.
+ * @param len1 Number of bytes to copy from it.
+ * @param buf2 Source pointer to the second data buffer.
+ * @param len2 Number of bytes to copy from it.
+ */
+void st_usbfs_copy_to_pm_sg(volatile void *vPM, const void *buf1, uint16_t len1,
+			    const void *buf2, uint16_t len2)
+{
+	volatile uint16_t *PM = vPM;
+	const uint8_t *lbuf2 = buf2;
+
+	st_usbfs_copy_to_pm(PM, buf1, len1 & ~1);
+	PM += len1 >> 1;
+
+	/* A halfword straddling both buffers. */
+	if (len1 & 1) {
+		uint16_t value = ((const uint8_t *) buf1)[len1 - 1];
+
+		if (len2) {
+			value |= *lbuf2++ << 8;
+			len2--;
+		}
+		*PM++ = value;
+	}
+
+	st_usbfs_copy_to_pm(PM, lbuf2, len2);
+}
+
+/**
+ * Copy packet memory to two data buffers, filling the first one first.
+ *
+ * @param buf1 Destination pointer to the first data buffer.
+ * @param len1 Number of bytes to copy to it.
+ * @param buf2 Destination pointer to the second data buffer.
+ * @param len2 Number of bytes to copy to it.
+ * @param vPM Source pointer into packet memory.
+ */
+void st_usbfs_copy_from_pm_sg(void *buf1, uint16_t len1, void *buf2,
+			      uint16_t len2, const volatile void *vPM)
+{
+	const volatile uint16_t *PM = vPM;
+	uint8_t *lbuf2 = buf2;
+
+	st_usbfs_copy_from_pm(buf1, PM, len1 & ~1);
+	PM += len1 >> 1;
+
+	/* A halfword straddling both buffers. */
+	if (len1 & 1) {
+		uint16_t value = *PM++;
+
+		((uint8_t *) buf1)[len1 - 1] = value;
+		if (len2) {
+			*lbuf2++ = value >> 8;
+			len2--;
+		}
+	}
+
+	st_usbfs_copy_from_pm(lbuf2, PM, len2);
+}
+
 static void st_usbfs_v2_disconnect(usbd_device *usbd_dev, bool disconnected)
 {
 	(void)usbd_dev;
@@ -106,6 +170,9 @@ const struct _usbd_driver st_usbfs_v2_usb_driver = {
 	.ep_nak_set = st_usbfs_ep_nak_set,
 	.ep_write_packet = st_usbfs_ep_write_packet,
 	.ep_read_packet = st_usbfs_ep_read_packet,
+	.ep_write_packet_gather = st_usbfs_ep_write_packet_gather,
+	.ep_read_packet_scatter = st_usbfs_ep_read_packet_scatter,
 	.disconnect = st_usbfs_v2_disconnect,
 	.poll = st_usbfs_poll,
+	.double_buffer = true,
 };
@@ -96,6 +96,11 @@ void usbd_register_sof_callback(usbd_device *usbd_dev, void (*callback)(void))
 	usbd_dev->user_callback_sof = callback;
 }
 
+bool usbd_remote_wakeup_enabled(usbd_device *usbd_dev)
+{
+	return usbd_dev->remote_wakeup;
+}
+
 void usbd_register_extra_string(usbd_device *usbd_dev, int index, const char* string)
 {
     /*
@@ -114,6 +119,7 @@ void _usbd_reset(usbd_device *usbd_dev)
 {
 	usbd_dev->current_address = 0;
 	usbd_dev->current_config = 0;
+	usbd_dev->remote_wakeup = false;
 	usbd_ep_setup(usbd_dev, 0, USB_ENDPOINT_ATTR_CONTROL, usbd_dev->desc->bMaxPacketSize0, NULL);
 	usbd_dev->driver->set_address(usbd_dev, 0);
 
@@ -140,6 +146,9 @@ __attribute__((weak)) void usbd_disconnect(usbd_device *usbd_dev,
 void usbd_ep_setup(usbd_device *usbd_dev, uint8_t addr, uint8_t type,
 		   uint16_t max_size, usbd_endpoint_callback callback)
 {
+	if (!usbd_dev->driver->double_buffer) {
+		type &= ~USBD_EP_DOUBLE_BUFFER;
+	}
 	usbd_dev->driver->ep_setup(usbd_dev, addr, type, max_size, callback);
 }
 
@@ -155,6 +164,52 @@ uint16_t usbd_ep_read_packet(usbd_device *usbd_dev, uint8_t addr, void *buf,
 	return usbd_dev->driver->ep_read_packet(usbd_dev, addr, buf, len);
 }
 
+uint16_t usbd_ep_write_packet_gather(usbd_device *usbd_dev, uint8_t addr,
+				    const void *buf1, uint16_t len1,
+				    const void *buf2, uint16_t len2)
+{
+	uint8_t packet[USBD_BOUNCE_SIZE];
+
+	if (usbd_dev->driver->ep_write_packet_gather) {
+		return usbd_dev->driver->ep_write_packet_gather(usbd_dev, addr,
+						buf1, len1, buf2, len2);
+	}
+	if (len2 == 0) {
+		return usbd_ep_write_packet(usbd_dev, addr, buf1, len1);
+	}
+	if (len1 + len2 > sizeof(packet)) {
+		return 0;
+	}
+
+	memcpy(packet, buf1, len1);
+	memcpy(packet + len1, buf2, len2);
+	return usbd_ep_write_packet(usbd_dev, addr, packet, len1 + len2);
+}
+
+uint16_t usbd_ep_read_packet_scatter(usbd_device *usbd_dev, uint8_t addr,
+				    void *buf1, uint16_t len1,
+				    void *buf2, uint16_t len2)
+{
+	uint8_t packet[USBD_BOUNCE_SIZE];
+	uint16_t len;
+
+	if (usbd_dev->driver->ep_read_packet_scatter) {
+		return usbd_dev->driver->ep_read_packet_scatter(usbd_dev, addr,
+						buf1, len1, buf2, len2);
+	}
+	if (len2 == 0) {
+		return usbd_ep_read_packet(usbd_dev, addr, buf1, len1);
+	}
+
+	len = usbd_ep_read_packet(usbd_dev, addr, packet,
+				  MIN(len1 + len2, sizeof(packet)));
+	memcpy(buf1, packet, MIN(len, len1));
+	if (len > len1) {
+		memcpy(buf2, packet + len1, len - len1);
+	}
+	return len;
+}
+
 void usbd_ep_stall_set(usbd_device *usbd_dev, uint8_t addr, uint8_t stall)
 {
 	usbd_dev->driver->ep_stall_set(usbd_dev, addr, stall);
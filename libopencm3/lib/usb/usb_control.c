@@ -36,6 +36,7 @@ LGPL License Terms @ref lgpl_license
 /**@{*/
 
 #include <stdlib.h>
+#include <string.h>
 #include <libopencm3/usb/usbd.h>
 #include "usb_private.h"
 
@@ -69,10 +70,40 @@ static bool needs_zlp(uint16_t len, uint16_t wLength, uint8_t ep_size)
 	return false;
 }
 
-/* Register application callback function for handling USB control requests. */
-int usbd_register_control_callback(usbd_device *usbd_dev, uint8_t type,
-				   uint8_t type_mask,
-				   usbd_control_callback callback)
+/*
+ * Adds callback i to the dispatch index: to every type and recipient that a
+ * request could have and still match it, and to the wIndex it is for. The
+ * index only narrows the search; the match itself is checked on dispatch.
+ */
+static void control_index_add(usbd_device *usbd_dev, int i)
+{
+	struct user_control_callback *cb = &usbd_dev->user_control_callback[i];
+	uint8_t type, recipient, mask;
+
+	for (type = 0; type < 4; type++) {
+		for (recipient = 0; recipient < 4; recipient++) {
+			/* Bucket 3 holds recipients 3 to 31. */
+			mask = cb->type_mask & (recipient < 3 ?
+				(USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT) :
+				USB_REQ_TYPE_TYPE);
+			if ((((type << 5) | recipient) & mask) ==
+			    (cb->type & mask)) {
+				usbd_dev->control_index[type][recipient] |=
+					1 << i;
+			}
+		}
+	}
+
+	for (type = 0; type < 16; type++) {
+		if (cb->any_index || (cb->index & 0x0f) == type) {
+			usbd_dev->control_target[type] |= 1 << i;
+		}
+	}
+}
+
+static int control_register(usbd_device *usbd_dev, uint8_t type,
+			    uint8_t type_mask, uint8_t index, bool any_index,
+			    usbd_control_callback callback)
 {
 	int i;
 
@@ -83,13 +114,33 @@ int usbd_register_control_callback(usbd_device *usbd_dev, uint8_t type,
 
 		usbd_dev->user_control_callback[i].type = type;
 		usbd_dev->user_control_callback[i].type_mask = type_mask;
+		usbd_dev->user_control_callback[i].index = index;
+		usbd_dev->user_control_callback[i].any_index = any_index;
 		usbd_dev->user_control_callback[i].cb = callback;
+		control_index_add(usbd_dev, i);
 		return 0;
 	}
 
 	return -1;
 }
 
+/* Register application callback function for handling USB control requests. */
+int usbd_register_control_callback(usbd_device *usbd_dev, uint8_t type,
+				   uint8_t type_mask,
+				   usbd_control_callback callback)
+{
+	return control_register(usbd_dev, type, type_mask, 0, true, callback);
+}
+
+/* Register a callback for the control requests of one interface or endpoint. */
+int usbd_register_control_callback_index(usbd_device *usbd_dev, uint8_t type,
+					 uint8_t type_mask, uint8_t index,
+					 usbd_control_callback callback)
+{
+	return control_register(usbd_dev, type, type_mask, index, false,
+				callback);
+}
+
 static void usb_control_send_chunk(usbd_device *usbd_dev)
 {
 	if (usbd_dev->desc->bMaxPacketSize0 <
@@ -144,14 +195,23 @@ usb_control_request_dispatch(usbd_device *usbd_dev,
 {
 	int i, result = 0;
 	struct user_control_callback *cb = usbd_dev->user_control_callback;
+	uint8_t recipient = req->bmRequestType & USB_REQ_TYPE_RECIPIENT;
+	uint8_t candidates;
+
+	/* Only the callbacks the index gives may match; try those in the
+	 * order they were registered. */
+	candidates = usbd_dev->control_index[(req->bmRequestType >> 5) & 3]
+					    [MIN(recipient, 3)] &
+		     usbd_dev->control_target[req->wIndex & 0x0f];
 
 	/* Call user command hook function. */
-	for (i = 0; i < MAX_USER_CONTROL_CALLBACK; i++) {
-		if (cb[i].cb == NULL) {
-			break;
+	for (i = 0; candidates; i++, candidates >>= 1) {
+		if (!(candidates & 1)) {
+			continue;
 		}
 
-		if ((req->bmRequestType & cb[i].type_mask) == cb[i].type) {
+		if ((req->bmRequestType & cb[i].type_mask) == cb[i].type &&
+		    (cb[i].any_index || cb[i].index == (req->wIndex & 0xff))) {
 			result = cb[i].cb(usbd_dev, req,
 					  &(usbd_dev->control_state.ctrl_buf),
 					  &(usbd_dev->control_state.ctrl_len),
@@ -219,6 +279,14 @@ static void usb_control_setup_write(usbd_device *usbd_dev,
 /* Do not appear to belong to the API, so are omitted from docs */
 /**@}*/
 
+void _usbd_control_clear_callbacks(usbd_device *usbd_dev)
+{
+	memset(usbd_dev->user_control_callback, 0,
+	       sizeof(usbd_dev->user_control_callback));
+	memset(usbd_dev->control_index, 0, sizeof(usbd_dev->control_index));
+	memset(usbd_dev->control_target, 0, sizeof(usbd_dev->control_target));
+}
+
 void _usbd_control_setup(usbd_device *usbd_dev, uint8_t ea)
 {
 	struct usb_setup_data *req = &usbd_dev->control_state.req;
@@ -103,6 +103,7 @@ enum sbc_asc {
 	SBC_ASC_INVALID_COMMAND_OPERATION_CODE	= 0x20,
 	SBC_ASC_LBA_OUT_OF_RANGE		= 0x21,
 	SBC_ASC_INVALID_FIELD_IN_CDB		= 0x24,
+	SBC_ASC_LOGICAL_UNIT_NOT_SUPPORTED	= 0x25,
 	SBC_ASC_WRITE_PROTECTED			= 0x27,
 	SBC_ASC_NOT_READY_TO_READY_CHANGE	= 0x28,
 	SBC_ASC_FORMAT_ERROR			= 0x31,
@@ -158,7 +159,13 @@ struct usb_msc_trans {
 					   to bytes_to_write. */
 	uint32_t lba_start;
 	uint32_t block_count;
-	uint32_t current_block;
+	uint32_t submitted;		/* Blocks handed to the backend */
+	uint32_t completed;		/* Blocks the backend has finished */
+	bool failed;			/* A block failed; the rest are
+					   skipped and the CSW fails. */
+	bool phase_error;		/* The host expects another data
+					   phase than the command's. */
+	uint8_t *data;			/* Block mapped by the backend */
 
 	uint8_t msd_buf[512];
 
@@ -170,6 +177,31 @@ struct usb_msc_trans {
 	} csw;
 };
 
+/* A logical unit: a medium of its own, behind a backend of its own. */
+struct msc_lun {
+	uint32_t block_count;		/* Last LBA */
+
+	int (*read_block)(uint32_t lba, uint8_t *copy_to);
+	int (*write_block)(uint32_t lba, const uint8_t *copy_from);
+
+	/* Block i of a transfer goes through buffer i % buf_count. */
+	const struct usb_msc_backend *backend;
+	uint8_t *buf;
+	uint8_t buf_count;
+
+	/* Write-back cache of the erase unit at cache_lba. */
+	int (*write_unit)(uint32_t lba, const uint8_t *copy_from);
+	uint8_t *cache;
+	uint8_t unit_blocks;
+	uint32_t cache_lba;
+	uint32_t cache_valid;		/* Blocks of the unit in the cache */
+	bool cache_dirty;
+	uint16_t idle_ms;
+	uint16_t idle;
+
+	struct sbc_sense_info sense;
+};
+
 struct _usbd_mass_storage {
 	usbd_device *usbd_dev;
 	uint8_t ep_in;
@@ -180,16 +212,24 @@ struct _usbd_mass_storage {
 	const char *vendor_id;
 	const char *product_id;
 	const char *product_revision_level;
-	uint32_t block_count;
-
-	int (*read_block)(uint32_t lba, uint8_t *copy_to);
-	int (*write_block)(uint32_t lba, const uint8_t *copy_from);
 
 	void (*lock)(void);
 	void (*unlock)(void);
 
+	struct msc_lun lun[USB_MSC_MAX_LUNS];
+	uint8_t lun_count;
+	struct msc_lun *lu;		/* Of the command, NULL if it has none */
+
+	uint8_t outstanding;		/* Blocks the backend is working on */
+	uint8_t stale;			/* Of those, from an aborted transfer */
+
+	bool in_busy;
+	bool out_nak;
+	bool advancing;
+	bool advance_again;
+	bool flush_pending;		/* Flush once the command is done */
+
 	struct usb_msc_trans trans;
-	struct sbc_sense_info sense;
 };
 
 static usbd_mass_storage _mass_storage;
@@ -231,6 +271,114 @@ static const uint8_t _spc3_request_sense[18] = {
 	0x00	/* Byte 17: SenseKeySpecific[0] = 0 */
 };
 
+/*-- Write-back Cache --------------------------------------------------------*/
+
+/* Media such as internal flash are erased in units of several blocks, and a
+ * block can only be rewritten by erasing and programming its whole unit.
+ * The cache holds the unit last written to and writes it back in one go:
+ * when another unit is written, on SYNCHRONIZE CACHE, on eject, or once
+ * writes have stopped for a while. Blocks of the unit the host has not
+ * written are read from the medium first. */
+
+#define CACHE_NONE	0xffffffff
+
+static int msc_cache_flush(struct msc_lun *lu)
+{
+	uint32_t i;
+	int ret;
+
+	if (!lu->cache_dirty) {
+		return 0;
+	}
+
+	for (i = 0; i < lu->unit_blocks; i++) {
+		if (0 == (lu->cache_valid & (1UL << i))) {
+			ret = (*lu->read_block)(lu->cache_lba + i,
+						&lu->cache[i << 9]);
+			if (0 != ret) {
+				lu->cache_dirty = false;
+				lu->cache_lba = CACHE_NONE;
+				return ret;
+			}
+		}
+	}
+	lu->cache_valid = (1UL << (lu->unit_blocks - 1) << 1) - 1;
+	lu->cache_dirty = false;
+
+	ret = (*lu->write_unit)(lu->cache_lba, lu->cache);
+	if (0 != ret) {
+		lu->cache_lba = CACHE_NONE;
+	}
+	return ret;
+}
+
+/* A failed write-back is reported to the next REQUEST SENSE of its LUN. */
+static void msc_cache_flush_all(usbd_mass_storage *ms)
+{
+	struct msc_lun *lu;
+
+	ms->flush_pending = false;
+	for (lu = ms->lun; lu < &ms->lun[ms->lun_count]; lu++) {
+		if (NULL != lu->cache && 0 != msc_cache_flush(lu)) {
+			lu->sense.key = SBC_SENSE_KEY_MEDIUM_ERROR;
+			lu->sense.asc = SBC_ASC_PERIPHERAL_DEVICE_WRITE_FAULT;
+			lu->sense.ascq = SBC_ASCQ_NA;
+		}
+	}
+}
+
+static const uint8_t *msc_cache_read_map(usbd_mass_storage *ms, uint8_t lun,
+					 uint32_t lba)
+{
+	struct msc_lun *lu = &ms->lun[lun];
+	uint32_t i = lba - lu->cache_lba;
+
+	if (lba >= lu->cache_lba && i < lu->unit_blocks &&
+	    0 != (lu->cache_valid & (1UL << i))) {
+		return &lu->cache[i << 9];
+	}
+
+	if (0 != (*lu->read_block)(lba, lu->buf)) {
+		return NULL;
+	}
+	return lu->buf;
+}
+
+static uint8_t *msc_cache_write_map(usbd_mass_storage *ms, uint8_t lun,
+				    uint32_t lba)
+{
+	struct msc_lun *lu = &ms->lun[lun];
+	uint32_t unit = lba - lba % lu->unit_blocks;
+
+	if (unit != lu->cache_lba) {
+		if (0 != msc_cache_flush(lu)) {
+			return NULL;
+		}
+		lu->cache_lba = unit;
+		lu->cache_valid = 0;
+	}
+	return &lu->cache[(lba - unit) << 9];
+}
+
+static void msc_cache_write(usbd_mass_storage *ms, uint8_t lun, uint32_t lba,
+			    const uint8_t *copy_from)
+{
+	struct msc_lun *lu = &ms->lun[lun];
+
+	(void)copy_from;
+
+	lu->cache_valid |= 1UL << (lba - lu->cache_lba);
+	lu->cache_dirty = true;
+	lu->idle = 0;
+	usb_msc_complete(ms, 0);
+}
+
+static const struct usb_msc_backend msc_cache_backend = {
+	.write_submit = msc_cache_write,
+	.read_map = msc_cache_read_map,
+	.write_map = msc_cache_write_map,
+};
+
 /*-- SCSI Layer --------------------------------------------------------------*/
 
 static void set_sbc_status(usbd_mass_storage *ms,
@@ -238,9 +386,15 @@ static void set_sbc_status(usbd_mass_storage *ms,
 			   enum sbc_asc asc,
 			   enum sbc_ascq ascq)
 {
-	ms->sense.key = (uint8_t) key;
-	ms->sense.asc = (uint8_t) asc;
-	ms->sense.ascq = (uint8_t) ascq;
+	/* A LUN that does not exist keeps no sense; REQUEST SENSE reports
+	 * that instead. */
+	if (NULL == ms->lu) {
+		return;
+	}
+
+	ms->lu->sense.key = (uint8_t) key;
+	ms->lu->sense.asc = (uint8_t) asc;
+	ms->lu->sense.ascq = (uint8_t) ascq;
 }
 
 static void set_sbc_status_good(usbd_mass_storage *ms)
@@ -256,6 +410,38 @@ static uint8_t *get_cbw_buf(struct usb_msc_trans *trans)
 	return &trans->cbw.cbw.CBWCB[0];
 }
 
+/* A transfer past the end of the medium still runs its data phase, so that
+ * the host stays in step, but it never reaches the backend. */
+static void check_block_range(usbd_mass_storage *ms,
+			      struct usb_msc_trans *trans)
+{
+	uint32_t last = ms->lu->block_count;
+
+	if (trans->lba_start > last ||
+	    trans->block_count > last - trans->lba_start + 1) {
+		set_sbc_status(ms, SBC_SENSE_KEY_ILLEGAL_REQUEST,
+			       SBC_ASC_LBA_OUT_OF_RANGE,
+			       SBC_ASCQ_NA);
+		trans->failed = true;
+	}
+}
+
+/* A transfer of more bytes than the 32-bit data phase can hold is refused
+ * before it starts. Only the 12-byte commands can ask for one. */
+static bool check_transfer_length(usbd_mass_storage *ms,
+				  struct usb_msc_trans *trans)
+{
+	if (trans->block_count > (UINT32_MAX >> 9)) {
+		set_sbc_status(ms, SBC_SENSE_KEY_ILLEGAL_REQUEST,
+			       SBC_ASC_INVALID_FIELD_IN_CDB,
+			       SBC_ASCQ_NA);
+		trans->block_count = 0;
+		trans->failed = true;
+		return false;
+	}
+	return true;
+}
+
 static void scsi_read_6(usbd_mass_storage *ms,
 			struct usb_msc_trans *trans,
 			enum trans_event event)
@@ -267,14 +453,12 @@ static void scsi_read_6(usbd_mass_storage *ms,
 
 		trans->lba_start = (buf[2] << 8) | buf[3];
 		trans->block_count = buf[4];
-		trans->current_block = 0;
-
-		/* TODO: Check the lba & block_count for range. */
 
 		/* both are in terms of 512 byte blocks, so shift by 9 */
 		trans->bytes_to_write = trans->block_count << 9;
 
 		set_sbc_status_good(ms);
+		check_block_range(ms, trans);
 	}
 }
 
@@ -282,8 +466,6 @@ static void scsi_write_6(usbd_mass_storage *ms,
 			 struct usb_msc_trans *trans,
 			 enum trans_event event)
 {
-	(void) ms;
-
 	if (EVENT_CBW_VALID == event) {
 		uint8_t *buf;
 
@@ -292,9 +474,11 @@ static void scsi_write_6(usbd_mass_storage *ms,
 		trans->lba_start = ((0x1f & buf[1]) << 16)
 				    | (buf[2] << 8) | buf[3];
 		trans->block_count = buf[4];
-		trans->current_block = 0;
 
 		trans->bytes_to_read = trans->block_count << 9;
+
+		set_sbc_status_good(ms);
+		check_block_range(ms, trans);
 	}
 }
 
@@ -302,8 +486,6 @@ static void scsi_write_10(usbd_mass_storage *ms,
 			  struct usb_msc_trans *trans,
 			  enum trans_event event)
 {
-	(void) ms;
-
 	if (EVENT_CBW_VALID == event) {
 		uint8_t *buf;
 
@@ -312,9 +494,11 @@ static void scsi_write_10(usbd_mass_storage *ms,
 		trans->lba_start = (buf[2] << 24) | (buf[3] << 16) |
 					(buf[4] << 8) | buf[5];
 		trans->block_count = (buf[7] << 8) | buf[8];
-		trans->current_block = 0;
 
 		trans->bytes_to_read = trans->block_count << 9;
+
+		set_sbc_status_good(ms);
+		check_block_range(ms, trans);
 	}
 }
 
@@ -331,12 +515,60 @@ static void scsi_read_10(usbd_mass_storage *ms,
 				   | (buf[4] << 8) | buf[5];
 		trans->block_count = (buf[7] << 8) | buf[8];
 
-		/* TODO: Check the lba & block_count for range. */
+		/* both are in terms of 512 byte blocks, so shift by 9 */
+		trans->bytes_to_write = trans->block_count << 9;
+
+		set_sbc_status_good(ms);
+		check_block_range(ms, trans);
+	}
+}
+
+static void scsi_write_12(usbd_mass_storage *ms,
+			  struct usb_msc_trans *trans,
+			  enum trans_event event)
+{
+	if (EVENT_CBW_VALID == event) {
+		uint8_t *buf;
+
+		buf = get_cbw_buf(trans);
+
+		trans->lba_start = (buf[2] << 24) | (buf[3] << 16) |
+					(buf[4] << 8) | buf[5];
+		trans->block_count = (buf[6] << 24) | (buf[7] << 16) |
+					(buf[8] << 8) | buf[9];
+
+		if (!check_transfer_length(ms, trans)) {
+			return;
+		}
+		trans->bytes_to_read = trans->block_count << 9;
+
+		set_sbc_status_good(ms);
+		check_block_range(ms, trans);
+	}
+}
+
+static void scsi_read_12(usbd_mass_storage *ms,
+			 struct usb_msc_trans *trans,
+			 enum trans_event event)
+{
+	if (EVENT_CBW_VALID == event) {
+		uint8_t *buf;
+
+		buf = get_cbw_buf(trans);
+
+		trans->lba_start = (buf[2] << 24) | (buf[3] << 16)
+				   | (buf[4] << 8) | buf[5];
+		trans->block_count = (buf[6] << 24) | (buf[7] << 16)
+				     | (buf[8] << 8) | buf[9];
 
+		if (!check_transfer_length(ms, trans)) {
+			return;
+		}
 		/* both are in terms of 512 byte blocks, so shift by 9 */
 		trans->bytes_to_write = trans->block_count << 9;
 
 		set_sbc_status_good(ms);
+		check_block_range(ms, trans);
 	}
 }
 
@@ -345,10 +577,12 @@ static void scsi_read_capacity(usbd_mass_storage *ms,
 			       enum trans_event event)
 {
 	if (EVENT_CBW_VALID == event) {
-		trans->msd_buf[0] = ms->block_count >> 24;
-		trans->msd_buf[1] = 0xff & (ms->block_count >> 16);
-		trans->msd_buf[2] = 0xff & (ms->block_count >> 8);
-		trans->msd_buf[3] = 0xff & ms->block_count;
+		uint32_t last = ms->lu->block_count;
+
+		trans->msd_buf[0] = last >> 24;
+		trans->msd_buf[1] = 0xff & (last >> 16);
+		trans->msd_buf[2] = 0xff & (last >> 8);
+		trans->msd_buf[3] = 0xff & last;
 
 		/* Block size: 512 */
 		trans->msd_buf[4] = 0;
@@ -365,12 +599,21 @@ static void scsi_format_unit(usbd_mass_storage *ms,
 			     enum trans_event event)
 {
 	if (EVENT_CBW_VALID == event) {
+		struct msc_lun *lu = ms->lu;
 		uint32_t i;
 
-		memset(trans->msd_buf, 0, 512);
+		/* Only a synchronous block device can be cleared from here;
+		 * any other keeps its contents, as its format is fixed. */
+		if (NULL != lu->write_block) {
+			if (NULL != lu->cache) {
+				msc_cache_flush(lu);
+				lu->cache_lba = CACHE_NONE;
+			}
+			memset(trans->msd_buf, 0, 512);
 
-		for (i = 0; i < ms->block_count; i++) {
-			(*ms->write_block)(i, trans->msd_buf);
+			for (i = 0; i < lu->block_count; i++) {
+				(*lu->write_block)(i, trans->msd_buf);
+			}
 		}
 
 		set_sbc_status_good(ms);
@@ -390,9 +633,14 @@ static void scsi_request_sense(usbd_mass_storage *ms,
 		memcpy(trans->msd_buf, _spc3_request_sense,
 		       sizeof(_spc3_request_sense));
 
-		trans->msd_buf[2] = ms->sense.key;
-		trans->msd_buf[12] = ms->sense.asc;
-		trans->msd_buf[13] = ms->sense.ascq;
+		if (NULL != ms->lu) {
+			trans->msd_buf[2] = ms->lu->sense.key;
+			trans->msd_buf[12] = ms->lu->sense.asc;
+			trans->msd_buf[13] = ms->lu->sense.ascq;
+		} else {
+			trans->msd_buf[2] = SBC_SENSE_KEY_ILLEGAL_REQUEST;
+			trans->msd_buf[12] = SBC_ASC_LOGICAL_UNIT_NOT_SUPPORTED;
+		}
 	}
 }
 
@@ -400,8 +648,6 @@ static void scsi_mode_sense_6(usbd_mass_storage *ms,
 			      struct usb_msc_trans *trans,
 			      enum trans_event event)
 {
-	(void) ms;
-
 	if (EVENT_CBW_VALID == event) {
 #if 0
 		uint8_t *buf;
@@ -419,7 +665,7 @@ static void scsi_mode_sense_6(usbd_mass_storage *ms,
 			trans->msd_buf[0] = 3;	/* Num bytes that follow */
 			trans->msd_buf[1] = 0;	/* Medium Type */
 			trans->msd_buf[2] = 0;	/* Device specific param */
-			trans->csw.csw.dCSWDataResidue = 4;
+			set_sbc_status_good(ms);
 #if 0
 		} else if (0x01 == page_code) {	/* Error recovery */
 		} else if (0x3F == page_code) {	/* All */
@@ -435,6 +681,26 @@ static void scsi_mode_sense_6(usbd_mass_storage *ms,
 	}
 }
 
+static void scsi_mode_sense_10(usbd_mass_storage *ms,
+			       struct usb_msc_trans *trans,
+			       enum trans_event event)
+{
+	if (EVENT_CBW_VALID == event) {
+		uint8_t *buf;
+		uint16_t allocation_length;
+
+		buf = get_cbw_buf(trans);
+		allocation_length = (buf[7] << 8) | buf[8];
+
+		/* The header alone, as for MODE SENSE(6): no block
+		 * descriptors, no pages. */
+		memset(trans->msd_buf, 0, 8);
+		trans->msd_buf[1] = 6;	/* Num bytes that follow */
+		trans->bytes_to_write = MIN(allocation_length, 8);
+		set_sbc_status_good(ms);
+	}
+}
+
 static void scsi_inquiry(usbd_mass_storage *ms,
 			 struct usb_msc_trans *trans,
 			 enum trans_event event)
@@ -451,6 +717,10 @@ static void scsi_inquiry(usbd_mass_storage *ms,
 			trans->bytes_to_write = sizeof(_spc3_inquiry_response);
 			memcpy(trans->msd_buf, _spc3_inquiry_response,
 			       sizeof(_spc3_inquiry_response));
+			if (NULL == ms->lu) {
+				/* Peripheral Qualifier = 3: no such LUN */
+				trans->msd_buf[0] = 0x7f;
+			}
 
 			len = strlen(ms->vendor_id);
 			len = MIN(len, 8);
@@ -465,9 +735,6 @@ static void scsi_inquiry(usbd_mass_storage *ms,
 			memcpy(&trans->msd_buf[32], ms->product_revision_level,
 			       len);
 
-			trans->csw.csw.dCSWDataResidue =
-				sizeof(_spc3_inquiry_response);
-
 			set_sbc_status_good(ms);
 		} else {
 			/* TODO: Add VPD 0x83 support */
@@ -476,11 +743,157 @@ static void scsi_inquiry(usbd_mass_storage *ms,
 	}
 }
 
+static void scsi_synchronize_cache(usbd_mass_storage *ms,
+				   struct usb_msc_trans *trans,
+				   enum trans_event event)
+{
+	if (EVENT_CBW_VALID == event) {
+		if (0 != msc_cache_flush(ms->lu)) {
+			set_sbc_status(ms, SBC_SENSE_KEY_MEDIUM_ERROR,
+				       SBC_ASC_PERIPHERAL_DEVICE_WRITE_FAULT,
+				       SBC_ASCQ_NA);
+			trans->failed = true;
+		} else {
+			set_sbc_status_good(ms);
+		}
+	}
+}
+
+static void scsi_start_stop_unit(usbd_mass_storage *ms,
+				 struct usb_msc_trans *trans,
+				 enum trans_event event)
+{
+	if (EVENT_CBW_VALID == event) {
+		uint8_t *buf;
+
+		buf = get_cbw_buf(trans);
+
+		/* LOEJ without START: the host is about to eject. */
+		if (0x02 == (buf[4] & 0x03)) {
+			scsi_synchronize_cache(ms, trans, event);
+		} else {
+			set_sbc_status_good(ms);
+		}
+	}
+}
+
+static void scsi_read_format_capacities(usbd_mass_storage *ms,
+					struct usb_msc_trans *trans,
+					enum trans_event event)
+{
+	if (EVENT_CBW_VALID == event) {
+		uint8_t *buf;
+		uint16_t allocation_length;
+		uint32_t count = ms->lu->block_count + 1;
+
+		buf = get_cbw_buf(trans);
+		allocation_length = (buf[7] << 8) | buf[8];
+
+		/* Capacity List Header, then the current capacity only */
+		memset(trans->msd_buf, 0, 12);
+		trans->msd_buf[3] = 8;		/* Capacity List Length */
+		trans->msd_buf[4] = count >> 24;
+		trans->msd_buf[5] = 0xff & (count >> 16);
+		trans->msd_buf[6] = 0xff & (count >> 8);
+		trans->msd_buf[7] = 0xff & count;
+		trans->msd_buf[8] = 0x02;	/* Formatted media */
+		trans->msd_buf[10] = 0x02;	/* Block size: 512 */
+		trans->bytes_to_write = MIN(allocation_length, 12);
+		set_sbc_status_good(ms);
+	}
+}
+
+static void scsi_report_luns(usbd_mass_storage *ms,
+			     struct usb_msc_trans *trans,
+			     enum trans_event event)
+{
+	if (EVENT_CBW_VALID == event) {
+		uint8_t *buf;
+		uint32_t allocation_length;
+		uint32_t len = 8 + 8 * ms->lun_count;
+		uint8_t i;
+
+		buf = get_cbw_buf(trans);
+		allocation_length = (buf[6] << 24) | (buf[7] << 16) |
+				    (buf[8] << 8) | buf[9];
+
+		/* LUN List Length, then each LUN in single level format. */
+		memset(trans->msd_buf, 0, len);
+		trans->msd_buf[3] = len - 8;
+		for (i = 0; i < ms->lun_count; i++) {
+			trans->msd_buf[8 + 8 * i + 1] = i;
+		}
+		trans->bytes_to_write = MIN(allocation_length, len);
+		set_sbc_status_good(ms);
+	}
+}
+
+static void scsi_no_data(usbd_mass_storage *ms,
+			 struct usb_msc_trans *trans,
+			 enum trans_event event)
+{
+	(void) trans;
+	(void) event;
+
+	/* Do nothing, just send the success. */
+	set_sbc_status_good(ms);
+}
+
+/* The commands, in opcode order. A command runs only for a LUN that exists,
+ * unless it is marked for any LUN; it is failed with ILLEGAL REQUEST
+ * otherwise, as are commands not in the table. */
+struct scsi_handler {
+	uint8_t opcode;
+	bool any_lun;
+	void (*handle)(usbd_mass_storage *ms, struct usb_msc_trans *trans,
+		       enum trans_event event);
+};
+
+static const struct scsi_handler scsi_handlers[] = {
+	{ SCSI_TEST_UNIT_READY,			false,	scsi_no_data },
+	{ SCSI_REQUEST_SENSE,			true,	scsi_request_sense },
+	{ SCSI_FORMAT_UNIT,			false,	scsi_format_unit },
+	{ SCSI_READ_6,				false,	scsi_read_6 },
+	{ SCSI_WRITE_6,				false,	scsi_write_6 },
+	{ SCSI_INQUIRY,				true,	scsi_inquiry },
+	{ SCSI_MODE_SENSE_6,			false,	scsi_mode_sense_6 },
+	{ SCSI_START_STOP_UNIT,			false,	scsi_start_stop_unit },
+	{ SCSI_SEND_DIAGNOSTIC,			false,	scsi_no_data },
+	{ SCSI_PREVENT_ALLOW_MEDIUM_REMOVAL,	false,	scsi_no_data },
+	{ SCSI_READ_FORMAT_CAPACITIES,		false,
+	  scsi_read_format_capacities },
+	{ SCSI_READ_CAPACITY,			false,	scsi_read_capacity },
+	{ SCSI_READ_10,				false,	scsi_read_10 },
+	{ SCSI_WRITE_10,			false,	scsi_write_10 },
+	{ SCSI_SYNCHRONIZE_CACHE,		false,	scsi_synchronize_cache },
+	{ SCSI_MODE_SENSE_10,			false,	scsi_mode_sense_10 },
+	{ SCSI_REPORT_LUNS,			true,	scsi_report_luns },
+	{ SCSI_READ_12,				false,	scsi_read_12 },
+	{ SCSI_WRITE_12,			false,	scsi_write_12 },
+};
+
+static const struct scsi_handler *scsi_find_handler(uint8_t opcode)
+{
+	const struct scsi_handler *h;
+
+	for (h = scsi_handlers;
+	     h < &scsi_handlers[sizeof(scsi_handlers) / sizeof(*h)]; h++) {
+		if (opcode == h->opcode) {
+			return h;
+		}
+	}
+	return NULL;
+}
+
 static void scsi_command(usbd_mass_storage *ms,
 			 struct usb_msc_trans *trans,
 			 enum trans_event event)
 {
+	const struct scsi_handler *handler;
+
 	if (EVENT_CBW_VALID == event) {
+		uint8_t lun = 0x0f & trans->cbw.cbw.bCBWLUN;
+
 		/* Setup the default success */
 		trans->csw_sent = 0;
 		trans->csw.csw.dCSWSignature = CSW_SIGNATURE;
@@ -491,243 +904,420 @@ static void scsi_command(usbd_mass_storage *ms,
 		trans->bytes_to_write = 0;
 		trans->bytes_to_read = 0;
 		trans->byte_count = 0;
+		trans->block_count = 0;
+		trans->submitted = 0;
+		trans->completed = 0;
+		trans->failed = false;
+		trans->phase_error = false;
+		trans->data = NULL;
+
+		ms->lu = lun < ms->lun_count ? &ms->lun[lun] : NULL;
 	}
 
-	switch (trans->cbw.cbw.CBWCB[0]) {
-	case SCSI_TEST_UNIT_READY:
-	case SCSI_SEND_DIAGNOSTIC:
-		/* Do nothing, just send the success. */
-		set_sbc_status_good(ms);
-		break;
-	case SCSI_FORMAT_UNIT:
-		scsi_format_unit(ms, trans, event);
-		break;
-	case SCSI_REQUEST_SENSE:
-		scsi_request_sense(ms, trans, event);
-		break;
-	case SCSI_MODE_SENSE_6:
-		scsi_mode_sense_6(ms, trans, event);
-		break;
-	case SCSI_READ_6:
-		scsi_read_6(ms, trans, event);
-		break;
-	case SCSI_INQUIRY:
-		scsi_inquiry(ms, trans, event);
-		break;
-	case SCSI_READ_CAPACITY:
-		scsi_read_capacity(ms, trans, event);
-		break;
-	case SCSI_READ_10:
-		scsi_read_10(ms, trans, event);
-		break;
-	case SCSI_WRITE_6:
-		scsi_write_6(ms, trans, event);
-		break;
-	case SCSI_WRITE_10:
-		scsi_write_10(ms, trans, event);
-		break;
-	default:
+	handler = scsi_find_handler(trans->cbw.cbw.CBWCB[0]);
+	if (NULL != handler && (NULL != ms->lu || handler->any_lun)) {
+		handler->handle(ms, trans, event);
+	} else if (EVENT_CBW_VALID == event) {
 		set_sbc_status(ms, SBC_SENSE_KEY_ILLEGAL_REQUEST,
 					SBC_ASC_INVALID_COMMAND_OPERATION_CODE,
 					SBC_ASCQ_NA);
 
 		trans->bytes_to_write = 0;
 		trans->bytes_to_read = 0;
-		trans->csw.csw.bCSWStatus = CSW_STATUS_FAILED;
-		break;
+		trans->failed = true;
+	}
+
+	if (EVENT_NEED_STATUS == event) {
+		if (trans->phase_error) {
+			trans->csw.csw.bCSWStatus = CSW_STATUS_PHASE_ERROR;
+		} else if (trans->failed) {
+			trans->csw.csw.bCSWStatus = CSW_STATUS_FAILED;
+		}
 	}
 }
 
-/*-- USB Mass Storage Layer --------------------------------------------------*/
+/*-- Block Transfers ---------------------------------------------------------*/
 
-/** @brief Handle the USB 'OUT' requests. */
-static void msc_data_rx_cb(usbd_device *usbd_dev, uint8_t ep)
+/* A block transfer streams through the buffer ring: READ submits blocks to
+ * the backend as far ahead as there are free buffers and sends each one as
+ * soon as it has completed; WRITE submits each block as soon as it has been
+ * received, and NAKs the OUT endpoint while every buffer is in use. The CSW
+ * of a WRITE waits for the last block to complete.
+ *
+ * A block the backend maps is sent from, or received into, its memory
+ * instead, one block at a time. */
+
+/* Zeros to pad a data-in phase with. */
+static const uint8_t msc_pad[64];
+
+static uint32_t host_bytes(struct usb_msc_trans *trans)
 {
-	usbd_mass_storage *ms;
-	struct usb_msc_trans *trans;
-	int len, max_len, left;
-	void *p;
+	return trans->cbw.cbw.dCBWDataTransferLength;
+}
 
-	ms = &_mass_storage;
-	trans = &ms->trans;
+static bool host_in(struct usb_msc_trans *trans)
+{
+	return 0 != (0x80 & trans->cbw.cbw.bmCBWFlags);
+}
 
-	/* RX only */
-	left = sizeof(struct usb_msc_cbw) - trans->cbw_cnt;
-	if (0 < left) {
-		max_len = MIN(ms->ep_out_size, left);
-		p = &trans->cbw.buf[0x1ff & trans->cbw_cnt];
-		len = usbd_ep_read_packet(usbd_dev, ep, p, max_len);
-		trans->cbw_cnt += len;
+/* Lines the data phase of the command up with the one the host expects, as
+ * BOT 6.7 requires. The host's dCBWDataTransferLength always moves in the
+ * host's direction: a command with less data pads a data-in phase with
+ * zeros, and reads and drops the rest of a data-out phase. A reply longer
+ * than the host asked for is cut short, as by an allocation length. A
+ * block transfer the host has no room for, or data in the other direction,
+ * is a phase error and never reaches the backend. */
+static void msc_check_phase(struct usb_msc_trans *trans)
+{
+	uint32_t len = host_bytes(trans);
+	bool in = host_in(trans);
 
-		if (sizeof(struct usb_msc_cbw) == trans->cbw_cnt) {
-			scsi_command(ms, trans, EVENT_CBW_VALID);
-			if (trans->byte_count < trans->bytes_to_read) {
-				/* We must wait until there is something to
-				 * read again. */
-				return;
-			}
-		}
+	if (0 == trans->block_count && in) {
+		trans->bytes_to_write = MIN(trans->bytes_to_write, len);
 	}
 
-	if (trans->byte_count < trans->bytes_to_read) {
-		if (0 < trans->block_count) {
-			if ((0 == trans->byte_count) && (NULL != ms->lock)) {
-				(*ms->lock)();
-			}
-		}
+	if ((0 < trans->bytes_to_write && (!in || trans->bytes_to_write > len)) ||
+	    (0 < trans->bytes_to_read && (in || trans->bytes_to_read > len))) {
+		trans->bytes_to_write = 0;
+		trans->bytes_to_read = 0;
+		trans->block_count = 0;
+		trans->phase_error = true;
+	}
 
-		left = trans->bytes_to_read - trans->byte_count;
-		max_len = MIN(ms->ep_out_size, left);
-		p = &trans->msd_buf[0x1ff & trans->byte_count];
-		len = usbd_ep_read_packet(usbd_dev, ep, p, max_len);
-		trans->byte_count += len;
+	trans->csw.csw.dCSWDataResidue = len - trans->bytes_to_write -
+					 trans->bytes_to_read;
+}
 
-		if (0 < trans->block_count) {
-			if (0 == (0x1ff & trans->byte_count)) {
-				uint32_t lba;
-
-				lba = trans->lba_start + trans->current_block;
-				if (0 != (*ms->write_block)(lba,
-							    trans->msd_buf)) {
-					/* Error */
-				}
-				trans->current_block++;
+static uint8_t *block_buf(usbd_mass_storage *ms, uint32_t block)
+{
+	if (NULL != ms->trans.data) {
+		return ms->trans.data;
+	}
+	return &ms->lu->buf[(block % ms->lu->buf_count) << 9];
+}
+
+static void block_failed(usbd_mass_storage *ms, struct usb_msc_trans *trans)
+{
+	if (!trans->failed) {
+		set_sbc_status(ms, SBC_SENSE_KEY_MEDIUM_ERROR,
+			       0 < trans->bytes_to_read ?
+			       SBC_ASC_PERIPHERAL_DEVICE_WRITE_FAULT :
+			       SBC_ASC_UNRECOVERED_READ_ERROR,
+			       SBC_ASCQ_NA);
+		trans->failed = true;
+	}
+}
+
+/* Blocks of the current transfer that may be handed to the backend now. */
+static bool block_ready(usbd_mass_storage *ms, struct usb_msc_trans *trans)
+{
+	uint32_t window;
+
+	if (trans->submitted >= trans->block_count) {
+		return false;
+	}
+	if (0 < trans->bytes_to_read) {
+		return trans->submitted < (trans->byte_count >> 9);
+	}
+	window = NULL != ms->lu->backend->read_map ? 1 : ms->lu->buf_count;
+	return trans->submitted - (trans->byte_count >> 9) < window;
+}
+
+static void msc_submit(usbd_mass_storage *ms)
+{
+	struct usb_msc_trans *trans = &ms->trans;
+	uint8_t lun = ms->lu - ms->lun;
+
+	while (0 == ms->stale && block_ready(ms, trans)) {
+		const struct usb_msc_backend *backend = ms->lu->backend;
+		uint32_t block = trans->submitted;
+		uint32_t lba = trans->lba_start + block;
+
+		if (trans->failed) {
+			/* Skipped, once those before it are done. */
+			if (trans->completed != block) {
+				break;
 			}
+			trans->submitted++;
+			trans->completed++;
+			trans->data = NULL;
+			continue;
 		}
 
-		/* Fix "writes aren't acknowledged" bug on Linux (PR #409) */
-		if (false == trans->csw_valid) {
-			scsi_command(ms, trans, EVENT_NEED_STATUS);
-			trans->csw_valid = true;
-		}
-		left = sizeof(struct usb_msc_csw) - trans->csw_sent;
-		if (0 < left) {
-			max_len = MIN(ms->ep_out_size, left);
-			p = &trans->csw.buf[trans->csw_sent];
-			len = usbd_ep_write_packet(usbd_dev, ms->ep_in, p,
-						   max_len);
-			trans->csw_sent += len;
+		trans->submitted++;
+		if (0 < trans->bytes_to_read) {
+			ms->outstanding++;
+			backend->write_submit(ms, lun, lba, block_buf(ms, block));
+			trans->data = NULL;
+		} else if (NULL != backend->read_map) {
+			trans->data = (uint8_t *)backend->read_map(ms, lun, lba);
+			trans->completed++;
+			if (NULL == trans->data) {
+				block_failed(ms, trans);
+			}
+		} else {
+			ms->outstanding++;
+			backend->read_submit(ms, lun, lba, block_buf(ms, block));
 		}
+	}
+}
 
-	} else if (trans->byte_count < trans->bytes_to_write) {
-		if (0 < trans->block_count) {
-			if ((0 == trans->byte_count) && (NULL != ms->lock)) {
-				(*ms->lock)();
-			}
+/* Lets the host send the next packet once there is a buffer to take it.
+ * Buffers still held by blocks of an aborted transfer hold off even the
+ * next CBW. */
+static void msc_release_out(usbd_mass_storage *ms)
+{
+	struct usb_msc_trans *trans = &ms->trans;
+
+	if (ms->out_nak && 0 == ms->stale &&
+	    (0 == trans->block_count ||
+	     (trans->byte_count >> 9) - trans->completed < ms->lu->buf_count)) {
+		ms->out_nak = false;
+		usbd_ep_nak_set(ms->usbd_dev, ms->ep_out, 0);
+	}
+}
+
+static void msc_end_transaction(usbd_mass_storage *ms)
+{
+	struct usb_msc_trans *trans = &ms->trans;
+
+	if (0 < trans->block_count && NULL != ms->unlock) {
+		(*ms->unlock)();
+	}
+
+	trans->lba_start = 0xffffffff;
+	trans->block_count = 0;
+	trans->submitted = 0;
+	trans->completed = 0;
+	trans->failed = false;
+	trans->phase_error = false;
+	trans->data = NULL;
+	trans->cbw_cnt = 0;
+	trans->bytes_to_read = 0;
+	trans->bytes_to_write = 0;
+	trans->byte_count = 0;
+	trans->csw_sent = 0;
+	trans->csw_valid = false;
+	ms->lu = NULL;
+
+	if (ms->flush_pending) {
+		msc_cache_flush_all(ms);
+	}
+}
 
-			if (0 == (0x1ff & trans->byte_count)) {
-				uint32_t lba;
+/* Sends the next packet of the data phase or of the CSW, if there is one
+ * ready and the IN endpoint is free. */
+static void msc_send(usbd_mass_storage *ms)
+{
+	struct usb_msc_trans *trans = &ms->trans;
+	uint32_t len, max_len, left;
+	void *p;
 
-				lba = trans->lba_start + trans->current_block;
-				if (0 != (*ms->read_block)(lba,
-							   trans->msd_buf)) {
-					/* Error */
-				}
-				trans->current_block++;
+	if (ms->in_busy || sizeof(struct usb_msc_cbw) != trans->cbw_cnt) {
+		return;
+	}
+
+	if (trans->byte_count < trans->bytes_to_write) {
+		if (0 < trans->block_count) {
+			uint32_t block = trans->byte_count >> 9;
+
+			if (block >= trans->completed) {
+				return;
 			}
+			p = block_buf(ms, block) + (0x1ff & trans->byte_count);
+		} else {
+			p = &trans->msd_buf[0x1ff & trans->byte_count];
 		}
 
 		left = trans->bytes_to_write - trans->byte_count;
-		max_len = MIN(ms->ep_out_size, left);
-		p = &trans->msd_buf[0x1ff & trans->byte_count];
-		len = usbd_ep_write_packet(usbd_dev, ms->ep_in, p, max_len);
+		max_len = MIN(ms->ep_in_size, left);
+		len = usbd_ep_write_packet(ms->usbd_dev, ms->ep_in, p, max_len);
 		trans->byte_count += len;
-	} else {
-		if (0 < trans->block_count) {
-			if (trans->current_block == trans->block_count) {
-				uint32_t lba;
-
-				lba = trans->lba_start + trans->current_block;
-				if (0 != (*ms->write_block)(lba,
-							    trans->msd_buf)) {
-					/* Error */
-				}
-
-				trans->current_block = 0;
-				if (NULL != ms->unlock) {
-					(*ms->unlock)();
-				}
-			}
-		}
-		if (false == trans->csw_valid) {
-			scsi_command(ms, trans, EVENT_NEED_STATUS);
-			trans->csw_valid = true;
-		}
+		ms->in_busy = true;
 
-		left = sizeof(struct usb_msc_csw) - trans->csw_sent;
-		if (0 < left) {
-			max_len = MIN(ms->ep_out_size, left);
-			p = &trans->csw.buf[trans->csw_sent];
-			len = usbd_ep_write_packet(usbd_dev, ms->ep_in, p,
-						   max_len);
-			trans->csw_sent += len;
-		}
+		/* A block fully sent frees its buffer. */
+		ms->advance_again = true;
+		return;
+	}
+
+	if (host_in(trans) && trans->byte_count < host_bytes(trans)) {
+		left = host_bytes(trans) - trans->byte_count;
+		max_len = MIN(ms->ep_in_size, left);
+		len = usbd_ep_write_packet(ms->usbd_dev, ms->ep_in, msc_pad,
+					   max_len);
+		trans->byte_count += len;
+		ms->in_busy = true;
+		return;
+	}
+
+	if (trans->byte_count < trans->bytes_to_read ||
+	    trans->completed < trans->block_count ||
+	    (!host_in(trans) && trans->byte_count < host_bytes(trans))) {
+		return;
+	}
+
+	/* Fix "writes aren't acknowledged" bug on Linux (PR #409) */
+	if (false == trans->csw_valid) {
+		scsi_command(ms, trans, EVENT_NEED_STATUS);
+		trans->csw_valid = true;
+	}
+
+	left = sizeof(struct usb_msc_csw) - trans->csw_sent;
+	max_len = MIN(ms->ep_in_size, left);
+	p = &trans->csw.buf[trans->csw_sent];
+	len = usbd_ep_write_packet(ms->usbd_dev, ms->ep_in, p, max_len);
+	trans->csw_sent += len;
+	ms->in_busy = true;
+
+	if (sizeof(struct usb_msc_csw) == trans->csw_sent) {
+		msc_end_transaction(ms);
 	}
 }
 
-/** @brief Handle the USB 'IN' requests. */
-static void msc_data_tx_cb(usbd_device *usbd_dev, uint8_t ep)
+/* Moves the current transfer on as far as it will go. Completions may come
+ * from inside a submit, so this only loops at the outermost level. */
+static void msc_advance(usbd_mass_storage *ms)
+{
+	if (ms->advancing) {
+		ms->advance_again = true;
+		return;
+	}
+
+	ms->advancing = true;
+	do {
+		ms->advance_again = false;
+		msc_submit(ms);
+		msc_release_out(ms);
+		msc_send(ms);
+	} while (ms->advance_again);
+	ms->advancing = false;
+}
+
+/* Drops the current transfer. Blocks still with the backend are waited out
+ * before any other is submitted, as they still own their buffers. */
+static void msc_reset(usbd_mass_storage *ms)
+{
+	ms->stale = ms->outstanding;
+	ms->in_busy = false;
+
+	/* NAK forcing outlives a reset. */
+	ms->out_nak = 0 < ms->stale;
+	usbd_ep_nak_set(ms->usbd_dev, ms->ep_out, ms->out_nak);
+
+	msc_end_transaction(ms);
+}
+
+/* The legacy read_block()/write_block() callbacks, run as a backend that
+ * completes every block straight away. */
+static void msc_sync_read(usbd_mass_storage *ms, uint8_t lun, uint32_t lba,
+			  uint8_t *copy_to)
+{
+	usb_msc_complete(ms, (*ms->lun[lun].read_block)(lba, copy_to));
+}
+
+static void msc_sync_write(usbd_mass_storage *ms, uint8_t lun, uint32_t lba,
+			   const uint8_t *copy_from)
+{
+	usb_msc_complete(ms, (*ms->lun[lun].write_block)(lba, copy_from));
+}
+
+static const struct usb_msc_backend msc_sync_backend = {
+	.read_submit = msc_sync_read,
+	.write_submit = msc_sync_write,
+};
+
+/*-- USB Mass Storage Layer --------------------------------------------------*/
+
+/** @brief Handle the USB 'OUT' requests. */
+static void msc_data_rx_cb(usbd_device *usbd_dev, uint8_t ep)
 {
 	usbd_mass_storage *ms;
 	struct usb_msc_trans *trans;
-	int len, max_len, left;
+	uint32_t len, max_len, left;
 	void *p;
 
 	ms = &_mass_storage;
 	trans = &ms->trans;
 
-	if (trans->byte_count < trans->bytes_to_write) {
-		if (0 < trans->block_count) {
-			if (0 == (0x1ff & trans->byte_count)) {
-				uint32_t lba;
-
-				lba = trans->lba_start + trans->current_block;
-				if (0 != (*ms->read_block)(lba,
-							   trans->msd_buf)) {
-					/* Error */
-				}
-				trans->current_block++;
+	/* RX only */
+	left = sizeof(struct usb_msc_cbw) - trans->cbw_cnt;
+	if (0 < left) {
+		max_len = MIN(ms->ep_out_size, left);
+		p = &trans->cbw.buf[0x1ff & trans->cbw_cnt];
+		len = usbd_ep_read_packet(usbd_dev, ep, p, max_len);
+		trans->cbw_cnt += len;
+
+		if (sizeof(struct usb_msc_cbw) == trans->cbw_cnt) {
+			scsi_command(ms, trans, EVENT_CBW_VALID);
+			msc_check_phase(trans);
+			if (0 < trans->block_count && NULL != ms->lock) {
+				(*ms->lock)();
 			}
+			msc_advance(ms);
 		}
+		return;
+	}
+
+	/* Past the command's own data once surplus host data is dropped. */
+	left = trans->byte_count < trans->bytes_to_read ?
+	       trans->bytes_to_read - trans->byte_count : 0;
+	if (0 < left && 0 < trans->block_count) {
+		const struct usb_msc_backend *backend = ms->lu->backend;
+		uint32_t next;
 
-		left = trans->bytes_to_write - trans->byte_count;
 		max_len = MIN(ms->ep_out_size, left);
-		p = &trans->msd_buf[0x1ff & trans->byte_count];
-		len = usbd_ep_write_packet(usbd_dev, ep, p, max_len);
-		trans->byte_count += len;
-	} else {
-		if (0 < trans->block_count) {
-			if (trans->current_block == trans->block_count) {
-				trans->current_block = 0;
-				if (NULL != ms->unlock) {
-					(*ms->unlock)();
-				}
+		if (0 == (0x1ff & trans->byte_count) &&
+		    NULL != backend->write_map && !trans->failed) {
+			trans->data = backend->write_map(ms, ms->lu - ms->lun,
+				trans->lba_start + (trans->byte_count >> 9));
+			if (NULL == trans->data) {
+				block_failed(ms, trans);
 			}
 		}
-		if (false == trans->csw_valid) {
-			scsi_command(ms, trans, EVENT_NEED_STATUS);
-			trans->csw_valid = true;
+		p = block_buf(ms, trans->byte_count >> 9) +
+		    (0x1ff & trans->byte_count);
+
+		/* Hold the host off after this packet if the one after it
+		 * would have no buffer. */
+		next = (trans->byte_count + max_len) >> 9;
+		if (next < trans->block_count &&
+		    next - trans->completed >= ms->lu->buf_count) {
+			ms->out_nak = true;
+			usbd_ep_nak_set(usbd_dev, ep, 1);
 		}
-
-		left = sizeof(struct usb_msc_csw) - trans->csw_sent;
+	} else {
+		/* Not block data: kept in msd_buf if expected, else dropped,
+		 * past what the command takes as well. */
 		if (0 < left) {
 			max_len = MIN(ms->ep_out_size, left);
-			p = &trans->csw.buf[trans->csw_sent];
-			len = usbd_ep_write_packet(usbd_dev, ep, p, max_len);
-			trans->csw_sent += len;
-		} else if (sizeof(struct usb_msc_csw) == trans->csw_sent) {
-			/* End of transaction */
-			trans->lba_start = 0xffffffff;
-			trans->block_count = 0;
-			trans->current_block = 0;
-			trans->cbw_cnt = 0;
-			trans->bytes_to_read = 0;
-			trans->bytes_to_write = 0;
-			trans->byte_count = 0;
-			trans->csw_sent = 0;
-			trans->csw_valid = false;
+			p = &trans->msd_buf[0x1ff & trans->byte_count];
+		} else {
+			max_len = ms->ep_out_size;
+			p = trans->msd_buf;
 		}
 	}
+
+	len = usbd_ep_read_packet(usbd_dev, ep, p, max_len);
+	if (0 < left) {
+		trans->byte_count += MIN(len, left);
+	} else if (!host_in(trans) && trans->byte_count < host_bytes(trans)) {
+		trans->byte_count += MIN(len,
+					 host_bytes(trans) - trans->byte_count);
+	}
+
+	msc_advance(ms);
+}
+
+/** @brief Handle the USB 'IN' requests. */
+static void msc_data_tx_cb(usbd_device *usbd_dev, uint8_t ep)
+{
+	usbd_mass_storage *ms = &_mass_storage;
+
+	(void)usbd_dev;
+	(void)ep;
+
+	ms->in_busy = false;
+	msc_advance(ms);
 }
 
 /** @brief Handle various control requests related to the msc storage
@@ -743,11 +1333,11 @@ msc_control_request(usbd_device *usbd_dev,
 
 	switch (req->bRequest) {
 	case USB_MSC_REQ_BULK_ONLY_RESET:
-		/* Do any special reset code here. */
+		msc_reset(&_mass_storage);
 		return USBD_REQ_HANDLED;
 	case USB_MSC_REQ_GET_MAX_LUN:
-		/* Return the number of LUNs.  We use 0. */
-		*buf[0] = 0;
+		/* Return the highest LUN. */
+		*buf[0] = _mass_storage.lun_count - 1;
 		*len = 1;
 		return USBD_REQ_HANDLED;
 	}
@@ -767,6 +1357,8 @@ static void msc_set_config(usbd_device *usbd_dev, uint16_t wValue)
 	usbd_ep_setup(usbd_dev, ms->ep_out, USB_ENDPOINT_ATTR_BULK,
 		      ms->ep_out_size, msc_data_rx_cb);
 
+	msc_reset(ms);
+
 	usbd_register_control_callback(
 				usbd_dev,
 				USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
@@ -790,11 +1382,11 @@ static void msc_set_config(usbd_device *usbd_dev, uint16_t wValue)
 @param[in] product_id The SCSI product ID to return.  Maximum used length is 16.
 @param[in] product_revision_level The SCSI product revision level to return.
 		Maximum used length is 4.
-@param[in] block_count The number of 512-byte blocks available.
+@param[in] block_count The number of 512-byte blocks available on LUN 0.
 @param[in] read_block The function called when the host requests to read a LBA
-		block.  Must _NOT_ be NULL.
+		block.  May only be NULL if usb_msc_set_backend() follows.
 @param[in] write_block The function called when the host requests to write a
-		LBA block.  Must _NOT_ be NULL.
+		LBA block.  May only be NULL if usb_msc_set_backend() follows.
 
 @return Pointer to the usbd_mass_storage struct.
 */
@@ -818,27 +1410,192 @@ usbd_mass_storage *usb_msc_init(usbd_device *usbd_dev,
 	_mass_storage.vendor_id = vendor_id;
 	_mass_storage.product_id = product_id;
 	_mass_storage.product_revision_level = product_revision_level;
-	_mass_storage.block_count = block_count - 1;
-	_mass_storage.read_block = read_block;
-	_mass_storage.write_block = write_block;
 	_mass_storage.lock = NULL;
 	_mass_storage.unlock = NULL;
 
-	_mass_storage.trans.lba_start = 0xffffffff;
-	_mass_storage.trans.block_count = 0;
-	_mass_storage.trans.current_block = 0;
-	_mass_storage.trans.cbw_cnt = 0;
-	_mass_storage.trans.bytes_to_read = 0;
-	_mass_storage.trans.bytes_to_write = 0;
-	_mass_storage.trans.byte_count = 0;
-	_mass_storage.trans.csw_valid = false;
-	_mass_storage.trans.csw_sent = 0;
+	_mass_storage.lun_count = 0;
+	_mass_storage.outstanding = 0;
+	_mass_storage.stale = 0;
+	_mass_storage.in_busy = false;
+	_mass_storage.out_nak = false;
+	_mass_storage.advancing = false;
+	_mass_storage.flush_pending = false;
+	msc_end_transaction(&_mass_storage);
 
-	set_sbc_status_good(&_mass_storage);
+	usb_msc_add_lun(&_mass_storage, block_count, read_block, write_block);
 
 	usbd_register_set_config_callback(usbd_dev, msc_set_config);
 
 	return &_mass_storage;
 }
 
+/** @brief Adds another logical unit, with a medium of its own.
+
+The host finds the logical units with GET MAX LUN and addresses each command
+to one of them. Call before the host configures the device.
+
+@param[in] ms The mass storage instance from usb_msc_init().
+@param[in] block_count The number of 512-byte blocks available.
+@param[in] read_block As for usb_msc_init().
+@param[in] write_block As for usb_msc_init().
+
+@return The number of the new LUN, for usb_msc_set_backend() and
+	usb_msc_set_cache(), or -1 if there are USB_MSC_MAX_LUNS already.
+*/
+int usb_msc_add_lun(usbd_mass_storage *ms, const uint32_t block_count,
+		    int (*read_block)(uint32_t lba, uint8_t *copy_to),
+		    int (*write_block)(uint32_t lba, const uint8_t *copy_from))
+{
+	struct msc_lun *lu;
+
+	if (USB_MSC_MAX_LUNS == ms->lun_count) {
+		return -1;
+	}
+
+	lu = &ms->lun[ms->lun_count];
+	lu->block_count = block_count - 1;
+	lu->read_block = read_block;
+	lu->write_block = write_block;
+	lu->backend = &msc_sync_backend;
+	lu->buf = ms->trans.msd_buf;
+	lu->buf_count = 1;
+	lu->cache = NULL;
+	lu->cache_dirty = false;
+	lu->sense.key = SBC_SENSE_KEY_NO_SENSE;
+	lu->sense.asc = SBC_ASC_NO_ADDITIONAL_SENSE_INFORMATION;
+	lu->sense.ascq = SBC_ASCQ_NA;
+
+	return ms->lun_count++;
+}
+
+/** @brief Replaces the read_block/write_block callbacks of a LUN with an
+asynchronous backend.
+
+The backend may work on as many blocks at once as there are buffers: a
+multi-block READ is read ahead of the host, and a multi-block WRITE keeps the
+host sending while earlier blocks are still being written. Call before the
+host configures the device.
+
+@param[in] ms The mass storage instance from usb_msc_init().
+@param[in] lun The LUN: 0, or as returned by usb_msc_add_lun().
+@param[in] backend The block device.
+@param[in] buffers buffer_count * USB_MSC_BLOCK_SIZE bytes for blocks in
+		flight.
+@param[in] buffer_count The number of buffers, at least 1.
+*/
+void usb_msc_set_backend(usbd_mass_storage *ms, uint8_t lun,
+			 const struct usb_msc_backend *backend,
+			 uint8_t *buffers, uint8_t buffer_count)
+{
+	struct msc_lun *lu = &ms->lun[lun];
+
+	lu->backend = backend;
+	lu->buf = buffers;
+	lu->buf_count = buffer_count;
+}
+
+/** @brief Puts a write-back cache of one erase unit in front of the
+read_block callback of a LUN and a write_unit one.
+
+For media that can only be rewritten a whole erase unit at a time, such as
+internal flash: blocks written to a unit collect in the cache, and the unit
+is erased and programmed once, when a block of another unit is written, on
+SYNCHRONIZE CACHE, when the host ejects the medium, after @a idle_ms without
+writes, or on usb_msc_flush(). Blocks in the cache are read from there.
+Replaces any backend set with usb_msc_set_backend().
+
+@param[in] ms The mass storage instance from usb_msc_init().
+@param[in] lun The LUN: 0, or as returned by usb_msc_add_lun().
+@param[in] buffer unit_blocks * USB_MSC_BLOCK_SIZE bytes for the cache.
+@param[in] unit_blocks Blocks per erase unit, 1 to 32.
+@param[in] idle_ms Milliseconds without writes before the cache is written
+		back, counted by usb_msc_tick(). 0 waits for the host.
+@param[in] write_unit Erases the unit of unit_blocks blocks at @a lba, and
+		writes them from @a copy_from. Returns 0 on success.
+*/
+void usb_msc_set_cache(usbd_mass_storage *ms, uint8_t lun, uint8_t *buffer,
+		       uint8_t unit_blocks, uint16_t idle_ms,
+		       int (*write_unit)(uint32_t lba,
+					 const uint8_t *copy_from))
+{
+	struct msc_lun *lu = &ms->lun[lun];
+
+	lu->backend = &msc_cache_backend;
+	lu->buf = ms->trans.msd_buf;
+	lu->buf_count = 1;
+
+	lu->write_unit = write_unit;
+	lu->cache = buffer;
+	lu->unit_blocks = unit_blocks;
+	lu->cache_lba = CACHE_NONE;
+	lu->cache_valid = 0;
+	lu->cache_dirty = false;
+	lu->idle_ms = idle_ms;
+	lu->idle = 0;
+}
+
+/** @brief Writes the caches of all LUNs back to the medium.
+
+Call before the device may lose power, e.g. when the bus is suspended. If a
+command is running, the caches are written back once it has ended.
+
+@param[in] ms The mass storage instance.
+*/
+void usb_msc_flush(usbd_mass_storage *ms)
+{
+	ms->flush_pending = true;
+	if (0 == ms->trans.cbw_cnt) {
+		msc_cache_flush_all(ms);
+	}
+}
+
+/** @brief Counts a millisecond towards the idle timeouts of the caches.
+
+Call once per millisecond, e.g. from the SOF callback, in the context
+usbd_poll() runs in.
+
+@param[in] ms The mass storage instance.
+*/
+void usb_msc_tick(usbd_mass_storage *ms)
+{
+	struct msc_lun *lu;
+
+	for (lu = ms->lun; lu < &ms->lun[ms->lun_count]; lu++) {
+		if (NULL == lu->cache || !lu->cache_dirty || 0 == lu->idle_ms) {
+			continue;
+		}
+
+		if (++lu->idle >= lu->idle_ms) {
+			usb_msc_flush(ms);
+		}
+	}
+}
+
+/** @brief Reports that the oldest block submitted to the backend is done.
+
+Call from the context usbd_poll() runs in, or with the USB interrupt masked,
+e.g. from the storage driver's interrupt handler while polling the USB
+peripheral from its interrupt handler at the same priority.
+
+@param[in] ms The mass storage instance.
+@param[in] status 0 on success; anything else fails the SCSI command with a
+		medium error.
+*/
+void usb_msc_complete(usbd_mass_storage *ms, int status)
+{
+	struct usb_msc_trans *trans = &ms->trans;
+
+	ms->outstanding--;
+	if (0 < ms->stale) {
+		ms->stale--;
+	} else {
+		trans->completed++;
+		if (0 != status) {
+			block_failed(ms, trans);
+		}
+	}
+
+	msc_advance(ms);
+}
+
 /** @} */
@@ -38,11 +38,15 @@ LGPL License Terms @ref lgpl_license
 #ifndef __USB_PRIVATE_H
 #define __USB_PRIVATE_H
 
-#define MAX_USER_CONTROL_CALLBACK	4
+#define MAX_USER_CONTROL_CALLBACK	4	/* At most 8, see control_index */
 #define MAX_USER_SET_CONFIG_CALLBACK	4
 
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 
+/* Largest packet usbd_ep_write_packet_gather/usbd_ep_read_packet_scatter
+ * bounce through the stack for drivers that cannot split it themselves */
+#define USBD_BOUNCE_SIZE	64
+
 /** Internal collection of device information. */
 struct _usbd_device {
 	const struct usb_device_descriptor *desc;
@@ -55,6 +59,7 @@ struct _usbd_device {
 
 	uint8_t current_address;
 	uint8_t current_config;
+	bool remote_wakeup; /**< Host has enabled DEVICE_REMOTE_WAKEUP */
 
 	uint16_t pm_top;    /**< Top of allocated endpoint buffer memory */
 
@@ -81,8 +86,17 @@ struct _usbd_device {
 		usbd_control_callback cb;
 		uint8_t type;
 		uint8_t type_mask;
+		uint8_t index;		/**< Low byte of wIndex to match */
+		bool any_index;
 	} user_control_callback[MAX_USER_CONTROL_CALLBACK];
 
+	/* Dispatch index of the control callbacks, one bit per slot above:
+	 * those that may take requests of each type and recipient (3 also
+	 * stands for the reserved ones), and those that may take requests
+	 * whose wIndex ends in each nibble. */
+	uint8_t control_index[4][4];
+	uint8_t control_target[16];
+
 	usbd_endpoint_callback user_callback_ctr[8][3];
 
 	/* User callback function for some standard USB function hooks */
@@ -126,6 +140,7 @@ enum _usbd_transaction {
 void _usbd_control_in(usbd_device *usbd_dev, uint8_t ea);
 void _usbd_control_out(usbd_device *usbd_dev, uint8_t ea);
 void _usbd_control_setup(usbd_device *usbd_dev, uint8_t ea);
+void _usbd_control_clear_callbacks(usbd_device *usbd_dev);
 
 enum usbd_request_return_codes _usbd_standard_request_device(usbd_device *usbd_dev,
 				  struct usb_setup_data *req, uint8_t **buf,
@@ -156,10 +171,17 @@ struct _usbd_driver {
 				    const void *buf, uint16_t len);
 	uint16_t (*ep_read_packet)(usbd_device *usbd_dev, uint8_t addr,
 				   void *buf, uint16_t len);
+	uint16_t (*ep_write_packet_gather)(usbd_device *usbd_dev, uint8_t addr,
+					   const void *buf1, uint16_t len1,
+					   const void *buf2, uint16_t len2);
+	uint16_t (*ep_read_packet_scatter)(usbd_device *usbd_dev, uint8_t addr,
+					   void *buf1, uint16_t len1,
+					   void *buf2, uint16_t len2);
 	void (*poll)(usbd_device *usbd_dev);
 	void (*disconnect)(usbd_device *usbd_dev, bool disconnected);
 	uint32_t base_address;
 	bool set_address_before_status;
+	bool double_buffer;	/**< ep_setup takes USBD_EP_DOUBLE_BUFFER */
 	uint16_t rx_fifo_size;
 };
 
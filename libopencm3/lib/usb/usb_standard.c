@@ -309,9 +309,7 @@ usb_standard_set_configuration(usbd_device *usbd_dev,
 		 * Flush control callbacks. These will be reregistered
 		 * by the user handler.
 		 */
-		for (i = 0; i < MAX_USER_CONTROL_CALLBACK; i++) {
-			usbd_dev->user_control_callback[i].cb = NULL;
-		}
+		_usbd_control_clear_callbacks(usbd_dev);
 
 		for (i = 0; i < MAX_USER_SET_CONFIG_CALLBACK; i++) {
 			if (usbd_dev->user_callback_set_config[i]) {
@@ -408,7 +406,6 @@ usb_standard_device_get_status(usbd_device *usbd_dev,
 			       struct usb_setup_data *req,
 			       uint8_t **buf, uint16_t *len)
 {
-	(void)usbd_dev;
 	(void)req;
 
 	/* bit 0: self powered */
@@ -416,12 +413,25 @@ usb_standard_device_get_status(usbd_device *usbd_dev,
 	if (*len > 2) {
 		*len = 2;
 	}
-	(*buf)[0] = 0;
+	(*buf)[0] = usbd_dev->remote_wakeup ? USB_DEV_STATUS_REMOTE_WAKEUP : 0;
 	(*buf)[1] = 0;
 
 	return USBD_REQ_HANDLED;
 }
 
+static enum usbd_request_return_codes
+usb_standard_device_remote_wakeup(usbd_device *usbd_dev,
+				  struct usb_setup_data *req,
+				  uint8_t **buf, uint16_t *len)
+{
+	(void)buf;
+	(void)len;
+
+	usbd_dev->remote_wakeup = req->bRequest == USB_REQ_SET_FEATURE;
+
+	return USBD_REQ_HANDLED;
+}
+
 static enum usbd_request_return_codes
 usb_standard_interface_get_status(usbd_device *usbd_dev,
 				  struct usb_setup_data *req,
@@ -498,7 +508,9 @@ _usbd_standard_request_device(usbd_device *usbd_dev,
 	case USB_REQ_CLEAR_FEATURE:
 	case USB_REQ_SET_FEATURE:
 		if (req->wValue == USB_FEAT_DEVICE_REMOTE_WAKEUP) {
-			/* Device wakeup code goes here. */
+			/* Signalling it is up to the application, see
+			 * usbd_remote_wakeup_enabled(). */
+			command = usb_standard_device_remote_wakeup;
 		}
 
 		if (req->wValue == USB_FEAT_TEST_MODE) {
@@ -0,0 +1,373 @@
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * The control endpoint state machine of usb_control.c and the routing of
+ * requests to the registered control callbacks, driven through whole
+ * control transfers on a composite device of three interfaces.
+ *
+ *	control-test
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <libopencm3/usb/usbd.h>
+#include "host-usbd.h"
+
+#define EP0_SIZE	16
+#define CTRL_BUF_SIZE	64
+
+static const struct usb_device_descriptor dev_descr = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bDeviceClass = 0,
+	.bDeviceSubClass = 0,
+	.bDeviceProtocol = 0,
+	.bMaxPacketSize0 = EP0_SIZE,
+	.idVendor = 0x0483,
+	.idProduct = 0x5740,
+	.bcdDevice = 0x0200,
+	.iManufacturer = 1,
+	.iProduct = 2,
+	.iSerialNumber = 0,
+	.bNumConfigurations = 1,
+};
+
+static const struct usb_interface_descriptor fn_iface[3] = {{
+	.bLength = USB_DT_INTERFACE_SIZE,
+	.bDescriptorType = USB_DT_INTERFACE,
+	.bInterfaceNumber = 0,
+	.bInterfaceClass = 0xff,
+}, {
+	.bLength = USB_DT_INTERFACE_SIZE,
+	.bDescriptorType = USB_DT_INTERFACE,
+	.bInterfaceNumber = 1,
+	.bInterfaceClass = 0xff,
+}, {
+	.bLength = USB_DT_INTERFACE_SIZE,
+	.bDescriptorType = USB_DT_INTERFACE,
+	.bInterfaceNumber = 2,
+	.bInterfaceClass = 0xff,
+}};
+
+static const struct usb_interface ifaces[] = {{
+	.num_altsetting = 1,
+	.altsetting = &fn_iface[0],
+}, {
+	.num_altsetting = 1,
+	.altsetting = &fn_iface[1],
+}, {
+	.num_altsetting = 1,
+	.altsetting = &fn_iface[2],
+}};
+
+static const struct usb_config_descriptor config_descr = {
+	.bLength = USB_DT_CONFIGURATION_SIZE,
+	.bDescriptorType = USB_DT_CONFIGURATION,
+	.wTotalLength = 0,
+	.bNumInterfaces = 3,
+	.bConfigurationValue = 1,
+	.iConfiguration = 0,
+	.bmAttributes = 0x80,
+	.bMaxPower = 0x32,
+	.interface = ifaces,
+};
+
+/* "Control" is 7 characters: a 16 byte descriptor, one full packet. */
+static const char * const strings[] = {
+	"Control",
+	"libopencm3 control test",
+};
+
+static uint8_t ctrl_buf[CTRL_BUF_SIZE];
+static usbd_device *usbd_dev;
+static int failures;
+
+/* Which callback took each request, and what it was given. */
+static int calls[4];
+static uint8_t received[CTRL_BUF_SIZE];
+static uint16_t received_len;
+static int completions;
+
+static void check(bool ok, const char *what)
+{
+	if (!ok) {
+		printf("FAIL: %s\n", what);
+		failures++;
+	}
+}
+
+/*-- Control callbacks --------------------------------------------------------*/
+
+static void complete(usbd_device *dev, struct usb_setup_data *req)
+{
+	(void)dev;
+	(void)req;
+	completions++;
+}
+
+/* Interface 0 and 1: bRequest 1 returns the interface number, bRequest 2
+ * takes data and bRequest 0xff is refused. */
+static enum usbd_request_return_codes
+function_request(int n, struct usb_setup_data *req, uint8_t **buf,
+		 uint16_t *len, usbd_control_complete_callback *complete_cb)
+{
+	calls[n]++;
+
+	switch (req->bRequest) {
+	case 1:
+		(*buf)[0] = n;
+		*len = 1;
+		return USBD_REQ_HANDLED;
+	case 2:
+		memcpy(received, *buf, *len);
+		received_len = *len;
+		*complete_cb = complete;
+		return USBD_REQ_HANDLED;
+	case 0xff:
+		return USBD_REQ_NOTSUPP;
+	}
+	return USBD_REQ_NEXT_CALLBACK;
+}
+
+static enum usbd_request_return_codes
+iface0_request(usbd_device *dev, struct usb_setup_data *req, uint8_t **buf,
+	       uint16_t *len, usbd_control_complete_callback *complete_cb)
+{
+	(void)dev;
+	return function_request(0, req, buf, len, complete_cb);
+}
+
+static enum usbd_request_return_codes
+iface1_request(usbd_device *dev, struct usb_setup_data *req, uint8_t **buf,
+	       uint16_t *len, usbd_control_complete_callback *complete_cb)
+{
+	(void)dev;
+	return function_request(1, req, buf, len, complete_cb);
+}
+
+/* Any class request to an interface the others did not take. */
+static enum usbd_request_return_codes
+class_request(usbd_device *dev, struct usb_setup_data *req, uint8_t **buf,
+	      uint16_t *len, usbd_control_complete_callback *complete_cb)
+{
+	(void)dev;
+	(void)complete_cb;
+
+	calls[2]++;
+	if (1 != req->bRequest) {
+		return USBD_REQ_NOTSUPP;
+	}
+	(*buf)[0] = 0xcc;
+	*len = 1;
+	return USBD_REQ_HANDLED;
+}
+
+/* Vendor requests to the device: only bRequest 1. */
+static enum usbd_request_return_codes
+vendor_request(usbd_device *dev, struct usb_setup_data *req, uint8_t **buf,
+	       uint16_t *len, usbd_control_complete_callback *complete_cb)
+{
+	(void)dev;
+	(void)buf;
+	(void)len;
+	(void)complete_cb;
+
+	calls[3]++;
+	return 1 == req->bRequest ? USBD_REQ_HANDLED : USBD_REQ_NEXT_CALLBACK;
+}
+
+static int registered;
+
+static void set_config(usbd_device *dev, uint16_t wValue)
+{
+	(void)wValue;
+
+	registered = 0;
+	registered += 0 == usbd_register_control_callback_index(dev,
+				USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+				USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+				0, iface0_request);
+	registered += 0 == usbd_register_control_callback_index(dev,
+				USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+				USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+				1, iface1_request);
+	registered += 0 == usbd_register_control_callback(dev,
+				USB_REQ_TYPE_CLASS | USB_REQ_TYPE_INTERFACE,
+				USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+				class_request);
+	registered += 0 == usbd_register_control_callback(dev,
+				USB_REQ_TYPE_VENDOR | USB_REQ_TYPE_DEVICE,
+				USB_REQ_TYPE_TYPE | USB_REQ_TYPE_RECIPIENT,
+				vendor_request);
+
+	/* The table is full. */
+	registered += 0 == usbd_register_control_callback(dev, 0, 0,
+							  vendor_request);
+}
+
+/*-- Transfers ----------------------------------------------------------------*/
+
+static int control(uint8_t type, uint8_t request, uint16_t value,
+		   uint16_t index, uint16_t length, void *data)
+{
+	struct usb_setup_data req = {
+		.bmRequestType = type,
+		.bRequest = request,
+		.wValue = value,
+		.wIndex = index,
+		.wLength = length,
+	};
+
+	memset(calls, 0, sizeof(calls));
+	return host_usbd_control(usbd_dev, &req, data);
+}
+
+static void test_standard(void)
+{
+	uint8_t buf[255];
+	struct usb_config_descriptor *config = (void *)buf;
+
+	/* Two packets, the last one short. */
+	check(USB_DT_DEVICE_SIZE == control(0x80, USB_REQ_GET_DESCRIPTOR,
+					    USB_DT_DEVICE << 8, 0, 64, buf) &&
+	      0 == memcmp(buf, &dev_descr, USB_DT_DEVICE_SIZE),
+	      "GET_DESCRIPTOR(DEVICE)");
+
+	/* Cut short by wLength. */
+	check(8 == control(0x80, USB_REQ_GET_DESCRIPTOR, USB_DT_DEVICE << 8,
+			   0, 8, buf) &&
+	      0 == memcmp(buf, &dev_descr, 8),
+	      "GET_DESCRIPTOR(DEVICE) of 8 bytes");
+
+	check(USB_DT_CONFIGURATION_SIZE + 3 * USB_DT_INTERFACE_SIZE ==
+	      control(0x80, USB_REQ_GET_DESCRIPTOR, USB_DT_CONFIGURATION << 8,
+		      0, sizeof(buf), buf) &&
+	      3 == config->bNumInterfaces &&
+	      USB_DT_CONFIGURATION_SIZE + 3 * USB_DT_INTERFACE_SIZE ==
+	      config->wTotalLength,
+	      "GET_DESCRIPTOR(CONFIGURATION)");
+
+	/* A full packet that is shorter than asked for ends with a ZLP. */
+	check(16 == control(0x80, USB_REQ_GET_DESCRIPTOR,
+			    (USB_DT_STRING << 8) | 1, 0x0409, sizeof(buf),
+			    buf) &&
+	      16 == buf[0] && 'C' == buf[2] && 'l' == buf[14],
+	      "GET_DESCRIPTOR(STRING) ending in a ZLP");
+
+	check(-1 == control(0x80, USB_REQ_GET_DESCRIPTOR,
+			    (USB_DT_STRING << 8) | 9, 0x0409, sizeof(buf),
+			    buf),
+	      "GET_DESCRIPTOR of a missing string stalls");
+
+	/* The address is taken once the status stage is done. */
+	check(0 == control(0x00, USB_REQ_SET_ADDRESS, 5, 0, 0, NULL) &&
+	      5 == host_usbd_address(),
+	      "SET_ADDRESS");
+}
+
+static void test_routing(void)
+{
+	uint8_t buf[CTRL_BUF_SIZE + 16];
+	int i;
+
+	check(0 == control(0x00, USB_REQ_SET_CONFIGURATION, 1, 0, 0, NULL) &&
+	      4 == registered,
+	      "SET_CONFIGURATION registers four callbacks, no more");
+
+	/* Each interface's requests go to its own callback only. */
+	check(1 == control(0xa1, 1, 0, 0, 1, buf) && 0 == buf[0] &&
+	      1 == calls[0] && 0 == calls[1] && 0 == calls[2],
+	      "class request to interface 0");
+	check(1 == control(0xa1, 1, 0, 1, 1, buf) && 1 == buf[0] &&
+	      0 == calls[0] && 1 == calls[1] && 0 == calls[2],
+	      "class request to interface 1");
+	check(1 == control(0xa1, 1, 0, 2, 1, buf) && 0xcc == buf[0] &&
+	      0 == calls[0] && 0 == calls[1] && 1 == calls[2],
+	      "class request to interface 2");
+
+	/* Same low nibble as interface 0, but another interface. */
+	check(1 == control(0xa1, 1, 0, 0x10, 1, buf) && 0xcc == buf[0] &&
+	      0 == calls[0] && 1 == calls[2],
+	      "class request to interface 16");
+
+	/* Passed on by interface 0's callback, refused by the next one. */
+	check(-1 == control(0xa1, 7, 0, 0, 1, buf) &&
+	      1 == calls[0] && 1 == calls[2],
+	      "NEXT_CALLBACK goes on to the next callback");
+
+	/* Refused by interface 0's callback: no other is asked. */
+	check(-1 == control(0xa1, 0xff, 0, 0, 1, buf) &&
+	      1 == calls[0] && 0 == calls[2],
+	      "NOTSUPP stops the search");
+
+	/* No callback for class requests to endpoints. */
+	check(-1 == control(0xa2, 1, 0, 0x81, 1, buf) &&
+	      0 == calls[0] + calls[1] + calls[2] + calls[3],
+	      "class request to an endpoint");
+
+	check(0 == control(0x40, 1, 0, 0, 0, NULL) && 1 == calls[3] &&
+	      0 == calls[0] + calls[1] + calls[2],
+	      "vendor request to the device");
+	check(-1 == control(0x40, 2, 0, 0, 0, NULL) && 1 == calls[3],
+	      "unhandled vendor request falls through to the standard ones");
+
+	/* Standard requests still reach usb_standard.c. */
+	check(1 == control(0x80, USB_REQ_GET_CONFIGURATION, 0, 0, 1, buf) &&
+	      1 == buf[0],
+	      "GET_CONFIGURATION");
+	check(2 == control(0x81, USB_REQ_GET_STATUS, 0, 1, 2, buf) &&
+	      0 == calls[0] + calls[1] + calls[2],
+	      "GET_STATUS of an interface");
+
+	/* A data stage of several packets, and the completion callback
+	 * once the status stage is done. */
+	for (i = 0; i < 40; i++) {
+		buf[i] = i;
+	}
+	completions = 0;
+	check(40 == control(0x21, 2, 0, 1, 40, buf) && 1 == calls[1] &&
+	      40 == received_len && 0 == memcmp(received, buf, 40) &&
+	      1 == completions,
+	      "class OUT request with 40 bytes of data");
+
+	/* Larger than the control buffer. */
+	check(-1 == control(0x21, 2, 0, 1, sizeof(buf), buf) &&
+	      0 == calls[1],
+	      "OUT request larger than the control buffer stalls");
+
+	/* The callbacks are dropped and registered again, not added to. */
+	check(0 == control(0x00, USB_REQ_SET_CONFIGURATION, 1, 0, 0, NULL) &&
+	      4 == registered,
+	      "SET_CONFIGURATION again");
+	check(1 == control(0xa1, 1, 0, 1, 1, buf) && 1 == calls[1],
+	      "callbacks registered once after SET_CONFIGURATION again");
+}
+
+int main(void)
+{
+	usbd_dev = usbd_init(&host_usbd_driver, &dev_descr, &config_descr,
+			     strings, 2, ctrl_buf, sizeof(ctrl_buf));
+	usbd_register_set_config_callback(usbd_dev, set_config);
+
+	test_standard();
+	test_routing();
+
+	printf("control  %s\n", failures ? "FAILED" : "ok");
+	return failures ? 1 : 0;
+}
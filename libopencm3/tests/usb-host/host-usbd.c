@@ -0,0 +1,282 @@
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "host-usbd.h"
+#include "usb_private.h"
+
+#define HOST_EP_SIZE	64
+
+struct host_ep {
+	uint8_t buf[HOST_EP_SIZE];
+	uint16_t len;
+	uint16_t max_size;
+	bool full;		/* IN: waiting for the host. OUT: for a read. */
+	bool armed;		/* OUT: will take the next packet */
+	bool nak;		/* OUT: NAK forced by the stack */
+	bool stall;
+};
+
+static struct _usbd_device host_dev;
+static struct host_ep host_ep[8][2];	/* [ep][0 = OUT, 1 = IN] */
+static uint8_t host_addr;
+
+static struct host_ep *ep_of(uint8_t addr)
+{
+	return &host_ep[addr & 0x7f][(addr & 0x80) ? 1 : 0];
+}
+
+static usbd_device *host_init(void)
+{
+	memset(host_ep, 0, sizeof(host_ep));
+	host_addr = 0;
+	return &host_dev;
+}
+
+static void host_set_address(usbd_device *dev, uint8_t addr)
+{
+	(void)dev;
+	host_addr = addr;
+}
+
+static void host_ep_setup(usbd_device *dev, uint8_t addr, uint8_t type,
+			  uint16_t max_size, usbd_endpoint_callback callback)
+{
+	uint8_t ep = addr & 0x7f;
+
+	(void)type;
+
+	if (0 == ep) {
+		memset(host_ep[0], 0, sizeof(host_ep[0]));
+		host_ep[0][0].max_size = max_size;
+		host_ep[0][1].max_size = max_size;
+		host_ep[0][0].armed = true;
+		return;
+	}
+
+	memset(ep_of(addr), 0, sizeof(struct host_ep));
+	ep_of(addr)->max_size = max_size;
+	if (addr & 0x80) {
+		dev->user_callback_ctr[ep][USB_TRANSACTION_IN] = callback;
+	} else {
+		ep_of(addr)->armed = true;
+		dev->user_callback_ctr[ep][USB_TRANSACTION_OUT] = callback;
+	}
+}
+
+static void host_ep_reset(usbd_device *dev)
+{
+	(void)dev;
+	memset(host_ep[1], 0, sizeof(host_ep) - sizeof(host_ep[0]));
+}
+
+static void host_ep_stall_set(usbd_device *dev, uint8_t addr, uint8_t stall)
+{
+	(void)dev;
+
+	if (0 == (addr & 0x7f)) {
+		host_ep[0][0].stall = stall;
+		host_ep[0][1].stall = stall;
+	} else {
+		ep_of(addr)->stall = stall;
+	}
+}
+
+static uint8_t host_ep_stall_get(usbd_device *dev, uint8_t addr)
+{
+	(void)dev;
+	return ep_of(addr)->stall;
+}
+
+static void host_ep_nak_set(usbd_device *dev, uint8_t addr, uint8_t nak)
+{
+	struct host_ep *ep = ep_of(addr);
+
+	(void)dev;
+
+	if (addr & 0x80) {
+		return;
+	}
+	ep->nak = nak;
+	ep->armed = !nak && !ep->full;
+}
+
+static uint16_t host_ep_write_packet(usbd_device *dev, uint8_t addr,
+				     const void *buf, uint16_t len)
+{
+	struct host_ep *ep = &host_ep[addr & 0x7f][1];
+	/* No bus reset sets EP0 up here, so its size comes from the
+	 * descriptor. */
+	uint16_t size = 0 == (addr & 0x7f) ? dev->desc->bMaxPacketSize0
+					    : ep->max_size;
+
+	/* The real drivers copy whatever they are given into packet memory,
+	 * so a packet longer than the endpoint is a stack bug, not a short
+	 * write. */
+	if (len > size || len > HOST_EP_SIZE) {
+		fprintf(stderr, "FAIL: %u byte packet on %u byte endpoint 0x%02x\n",
+			len, size, addr | 0x80);
+		abort();
+	}
+	if (ep->full) {
+		return 0;
+	}
+	if (len) {
+		memcpy(ep->buf, buf, len);
+	}
+	ep->len = len;
+	ep->full = true;
+	return len;
+}
+
+static uint16_t host_ep_read_packet(usbd_device *dev, uint8_t addr,
+				    void *buf, uint16_t len)
+{
+	struct host_ep *ep = &host_ep[addr & 0x7f][0];
+
+	(void)dev;
+
+	if (!ep->full) {
+		return 0;
+	}
+	len = len < ep->len ? len : ep->len;
+	if (len) {
+		memcpy(buf, ep->buf, len);
+	}
+	ep->full = false;
+	ep->armed = !ep->nak;
+	return len;
+}
+
+static void host_poll(usbd_device *dev)
+{
+	(void)dev;
+}
+
+const usbd_driver host_usbd_driver = {
+	.init = host_init,
+	.set_address = host_set_address,
+	.ep_setup = host_ep_setup,
+	.ep_reset = host_ep_reset,
+	.ep_stall_set = host_ep_stall_set,
+	.ep_stall_get = host_ep_stall_get,
+	.ep_nak_set = host_ep_nak_set,
+	.ep_write_packet = host_ep_write_packet,
+	.ep_read_packet = host_ep_read_packet,
+	.poll = host_poll,
+};
+
+bool host_usbd_out(usbd_device *dev, uint8_t ep, const void *buf,
+		   uint16_t len)
+{
+	struct host_ep *out = &host_ep[ep][0];
+	usbd_endpoint_callback cb;
+
+	if (out->stall || !out->armed) {
+		return false;
+	}
+
+	if (len) {
+		memcpy(out->buf, buf, len);
+	}
+	out->len = len;
+	out->full = true;
+	out->armed = false;
+
+	cb = dev->user_callback_ctr[ep][USB_TRANSACTION_OUT];
+	if (cb) {
+		cb(dev, ep);
+	}
+	return true;
+}
+
+int host_usbd_in(usbd_device *dev, uint8_t ep, void *buf)
+{
+	struct host_ep *in = &host_ep[ep][1];
+	usbd_endpoint_callback cb;
+	int len;
+
+	if (in->stall || !in->full) {
+		return -1;
+	}
+
+	len = in->len;
+	if (len) {
+		memcpy(buf, in->buf, len);
+	}
+	in->full = false;
+
+	cb = dev->user_callback_ctr[ep][USB_TRANSACTION_IN];
+	if (cb) {
+		cb(dev, ep | 0x80);
+	}
+	return len;
+}
+
+bool host_usbd_stalled(uint8_t addr)
+{
+	return ep_of(addr)->stall;
+}
+
+int host_usbd_control(usbd_device *dev, const struct usb_setup_data *req,
+		      void *data)
+{
+	uint8_t *p = data;
+	uint8_t packet[HOST_EP_SIZE];
+	uint16_t size = dev->desc->bMaxPacketSize0;
+	int done = 0, len;
+
+	/* A SETUP is always taken, and clears a stall. */
+	host_ep_stall_set(dev, 0, 0);
+	host_ep[0][1].full = false;
+	memcpy(&dev->control_state.req, req, sizeof(*req));
+	dev->user_callback_ctr[0][USB_TRANSACTION_SETUP](dev, 0);
+
+	if ((req->bmRequestType & 0x80) && req->wLength) {
+		do {
+			len = host_usbd_in(dev, 0, packet);
+			if (len < 0) {
+				return -1;
+			}
+			memcpy(p + done, packet, MIN(len, req->wLength - done));
+			done += MIN(len, req->wLength - done);
+		} while (len == size && done < req->wLength);
+
+		if (!host_usbd_out(dev, 0, NULL, 0)) {
+			return -1;
+		}
+		return host_usbd_stalled(0) ? -1 : done;
+	}
+
+	while (done < req->wLength) {
+		len = MIN(size, req->wLength - done);
+		if (!host_usbd_out(dev, 0, p + done, len)) {
+			return -1;
+		}
+		done += len;
+	}
+
+	len = host_usbd_in(dev, 0, packet);
+	return 0 == len ? done : -1;
+}
+
+uint8_t host_usbd_address(void)
+{
+	return host_addr;
+}
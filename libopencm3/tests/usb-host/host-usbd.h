@@ -0,0 +1,51 @@
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef HOST_USBD_H
+#define HOST_USBD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <libopencm3/usb/usbd.h>
+
+/*
+ * A device controller in software, for running the generic USB stack and
+ * its class drivers on the build machine. Endpoints hold one packet each,
+ * as the st_usbfs ones do, and the functions below play the host side:
+ * each packet moved runs the endpoint callback, as usbd_poll() would.
+ */
+extern const usbd_driver host_usbd_driver;
+
+/* Sends a packet to OUT endpoint 'ep'. False if it is NAKing or stalled. */
+bool host_usbd_out(usbd_device *dev, uint8_t ep, const void *buf,
+		   uint16_t len);
+
+/* Fetches the packet waiting in IN endpoint 'ep' into 'buf'. Returns its
+ * length, or -1 if there is none or the endpoint is stalled. */
+int host_usbd_in(usbd_device *dev, uint8_t ep, void *buf);
+
+bool host_usbd_stalled(uint8_t addr);
+
+/* Runs a whole control transfer on endpoint 0. 'data' is sent, or filled
+ * with up to wLength bytes. Returns the length of the data stage, or -1 if
+ * the device stalled it. */
+int host_usbd_control(usbd_device *dev, const struct usb_setup_data *req,
+		      void *data);
+
+uint8_t host_usbd_address(void);
+
+#endif
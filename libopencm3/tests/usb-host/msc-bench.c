@@ -0,0 +1,717 @@
+/*
+ * This file is part of the libopencm3 project.
+ *
+ * This library is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this library.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Sector throughput of usb_msc on a RAM disk, through each kind of block
+ * backend, with a bulk-only transport host driving the software device
+ * controller. Every run also checks what it reads back. The flash runs
+ * model a medium erased in pages, written block by block or through the
+ * write-back cache, and count the erases. A last run checks a second
+ * logical unit and the commands that go with several.
+ *
+ *	msc-bench [megabytes]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <libopencm3/usb/usbd.h>
+#include <libopencm3/usb/msc.h>
+#include "host-usbd.h"
+
+#define EP_OUT		0x01
+#define EP_IN		0x82
+#define PACKET		64
+
+#define DISK_BLOCKS	16384		/* 8 MiB, more than the caches */
+#define XFER_BLOCKS	128		/* Blocks per READ(10)/WRITE(10) */
+#define RING		4		/* Buffers for the asynchronous backend */
+#define UNIT_BLOCKS	4		/* Flash page, as on STM32F1 XL/HD */
+#define IDLE_MS		100
+#define LUN1_BLOCKS	64		/* The second LUN's disk */
+
+static const struct usb_device_descriptor dev_descr = {
+	.bLength = USB_DT_DEVICE_SIZE,
+	.bDescriptorType = USB_DT_DEVICE,
+	.bcdUSB = 0x0200,
+	.bMaxPacketSize0 = 64,
+	.idVendor = 0x0483,
+	.idProduct = 0x5741,
+	.bNumConfigurations = 1,
+};
+
+static const struct usb_endpoint_descriptor msc_endp[] = {{
+	.bLength = USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType = USB_DT_ENDPOINT,
+	.bEndpointAddress = EP_OUT,
+	.bmAttributes = USB_ENDPOINT_ATTR_BULK,
+	.wMaxPacketSize = PACKET,
+}, {
+	.bLength = USB_DT_ENDPOINT_SIZE,
+	.bDescriptorType = USB_DT_ENDPOINT,
+	.bEndpointAddress = EP_IN,
+	.bmAttributes = USB_ENDPOINT_ATTR_BULK,
+	.wMaxPacketSize = PACKET,
+}};
+
+static const struct usb_interface_descriptor msc_iface[] = {{
+	.bLength = USB_DT_INTERFACE_SIZE,
+	.bDescriptorType = USB_DT_INTERFACE,
+	.bNumEndpoints = 2,
+	.bInterfaceClass = USB_CLASS_MSC,
+	.bInterfaceSubClass = USB_MSC_SUBCLASS_SCSI,
+	.bInterfaceProtocol = USB_MSC_PROTOCOL_BBB,
+	.endpoint = msc_endp,
+}};
+
+static const struct usb_interface ifaces[] = {{
+	.num_altsetting = 1,
+	.altsetting = msc_iface,
+}};
+
+static const struct usb_config_descriptor config_descr = {
+	.bLength = USB_DT_CONFIGURATION_SIZE,
+	.bDescriptorType = USB_DT_CONFIGURATION,
+	.bNumInterfaces = 1,
+	.bConfigurationValue = 1,
+	.bMaxPower = 0x32,
+	.interface = ifaces,
+};
+
+static uint8_t ctrl_buf[128];
+static usbd_device *usbd_dev;
+static usbd_mass_storage *msc;
+
+static uint8_t disk[DISK_BLOCKS][USB_MSC_BLOCK_SIZE];
+static uint8_t lun1_disk[LUN1_BLOCKS][USB_MSC_BLOCK_SIZE];
+
+/* Blocks submitted to the asynchronous backend, completed when the host has
+ * nothing else to do, as if a DMA had finished in the meantime. */
+static struct {
+	uint32_t lba;
+	uint8_t *read_to;
+	const uint8_t *write_from;
+} pending[RING];
+static int pending_count;
+
+/*-- Backends -----------------------------------------------------------------*/
+
+/* usb_msc_init() callbacks: storage -> msd_buf -> packet. */
+static int legacy_read(uint32_t lba, uint8_t *copy_to)
+{
+	memcpy(copy_to, disk[lba], USB_MSC_BLOCK_SIZE);
+	return 0;
+}
+
+static int legacy_write(uint32_t lba, const uint8_t *copy_from)
+{
+	memcpy(disk[lba], copy_from, USB_MSC_BLOCK_SIZE);
+	return 0;
+}
+
+/* Asynchronous: storage -> ring buffer (the DMA) -> packet. */
+static void ring_read(usbd_mass_storage *ms, uint8_t lun, uint32_t lba,
+		      uint8_t *copy_to)
+{
+	(void)ms;
+	(void)lun;
+	pending[pending_count].lba = lba;
+	pending[pending_count].read_to = copy_to;
+	pending[pending_count].write_from = NULL;
+	pending_count++;
+}
+
+static void ring_write(usbd_mass_storage *ms, uint8_t lun, uint32_t lba,
+		       const uint8_t *copy_from)
+{
+	(void)ms;
+	(void)lun;
+	pending[pending_count].lba = lba;
+	pending[pending_count].read_to = NULL;
+	pending[pending_count].write_from = copy_from;
+	pending_count++;
+}
+
+static bool storage_complete(void)
+{
+	if (0 == pending_count) {
+		return false;
+	}
+	if (pending[0].read_to) {
+		memcpy(pending[0].read_to, disk[pending[0].lba],
+		       USB_MSC_BLOCK_SIZE);
+	} else {
+		memcpy(disk[pending[0].lba], pending[0].write_from,
+		       USB_MSC_BLOCK_SIZE);
+	}
+	pending_count--;
+	memmove(&pending[0], &pending[1], pending_count * sizeof(pending[0]));
+	usb_msc_complete(msc, 0);
+	return true;
+}
+
+/* Flash: a block is rewritten by erasing and programming its whole page. */
+static uint32_t erases;
+
+static void flash_program(uint32_t unit, const uint8_t *copy_from)
+{
+	memset(disk[unit], 0xff, UNIT_BLOCKS * USB_MSC_BLOCK_SIZE);
+	erases++;
+	memcpy(disk[unit], copy_from, UNIT_BLOCKS * USB_MSC_BLOCK_SIZE);
+}
+
+static int flash_write(uint32_t lba, const uint8_t *copy_from)
+{
+	uint8_t page[UNIT_BLOCKS * USB_MSC_BLOCK_SIZE];
+	uint32_t unit = lba - lba % UNIT_BLOCKS;
+
+	memcpy(page, disk[unit], sizeof(page));
+	memcpy(&page[(lba - unit) * USB_MSC_BLOCK_SIZE], copy_from,
+	       USB_MSC_BLOCK_SIZE);
+	flash_program(unit, page);
+	return 0;
+}
+
+static int flash_write_unit(uint32_t lba, const uint8_t *copy_from)
+{
+	flash_program(lba, copy_from);
+	return 0;
+}
+
+/* The second LUN, a small RAM disk of its own. */
+static int lun1_read(uint32_t lba, uint8_t *copy_to)
+{
+	memcpy(copy_to, lun1_disk[lba], USB_MSC_BLOCK_SIZE);
+	return 0;
+}
+
+static int lun1_write(uint32_t lba, const uint8_t *copy_from)
+{
+	memcpy(lun1_disk[lba], copy_from, USB_MSC_BLOCK_SIZE);
+	return 0;
+}
+
+/* Mapped: the RAM disk itself -> packet. */
+static const uint8_t *mapped_read(usbd_mass_storage *ms, uint8_t lun,
+				  uint32_t lba)
+{
+	(void)ms;
+	(void)lun;
+	return disk[lba];
+}
+
+static uint8_t *mapped_map_write(usbd_mass_storage *ms, uint8_t lun,
+				 uint32_t lba)
+{
+	(void)ms;
+	(void)lun;
+	return disk[lba];
+}
+
+static void mapped_write(usbd_mass_storage *ms, uint8_t lun, uint32_t lba,
+			 const uint8_t *copy_from)
+{
+	(void)lun;
+	(void)lba;
+	(void)copy_from;
+	usb_msc_complete(ms, 0);
+}
+
+static const struct usb_msc_backend ring_backend = {
+	.read_submit = ring_read,
+	.write_submit = ring_write,
+};
+
+static const struct usb_msc_backend mapped_backend = {
+	.write_submit = mapped_write,
+	.read_map = mapped_read,
+	.write_map = mapped_map_write,
+};
+
+/*-- Bulk-only transport host -------------------------------------------------*/
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+/* Runs one SCSI command on a LUN; returns the CSW status, or -1 if the
+ * transport broke down. Data-in with no 'data' is read and dropped. */
+static int bot_lun_command(uint8_t lun, const uint8_t *cdb, uint8_t cdb_len,
+			   bool dir_in, uint8_t *data, uint32_t len)
+{
+	uint8_t cbw[31] = { 'U', 'S', 'B', 'C', 0x78, 0x56, 0x34, 0x12 };
+	uint8_t packet[PACKET];
+	uint8_t csw[13];
+	uint32_t done = 0, csw_len = 0;
+	int n;
+
+	cbw[8] = len;
+	cbw[9] = len >> 8;
+	cbw[10] = len >> 16;
+	cbw[11] = len >> 24;
+	cbw[12] = dir_in ? 0x80 : 0x00;
+	cbw[13] = lun;
+	cbw[14] = cdb_len;
+	memcpy(&cbw[15], cdb, cdb_len);
+
+	while (!host_usbd_out(usbd_dev, EP_OUT, cbw, sizeof(cbw))) {
+		if (!storage_complete()) {
+			return -1;
+		}
+	}
+
+	while (done < len) {
+		bool moved;
+
+		if (dir_in) {
+			n = host_usbd_in(usbd_dev, EP_IN & 0x7f,
+					 NULL != data ? &data[done] : packet);
+			moved = n > 0;
+			if (moved) {
+				done += n;
+			}
+		} else {
+			n = len - done < PACKET ? len - done : PACKET;
+			moved = host_usbd_out(usbd_dev, EP_OUT, &data[done], n);
+			if (moved) {
+				done += n;
+			}
+		}
+		if (!moved && !storage_complete()) {
+			return -1;
+		}
+	}
+
+	while (csw_len < sizeof(csw)) {
+		n = host_usbd_in(usbd_dev, EP_IN & 0x7f, packet);
+		if (n > 0) {
+			memcpy(&csw[csw_len], packet, n);
+			csw_len += n;
+		} else if (!storage_complete()) {
+			return -1;
+		}
+	}
+
+	if (0 != memcmp(csw, "USBS", 4) || 0 != memcmp(&csw[4], &cbw[4], 4)) {
+		return -1;
+	}
+	return csw[12];
+}
+
+static int bot_command(const uint8_t *cdb, uint8_t cdb_len, bool dir_in,
+		       uint8_t *data, uint32_t len)
+{
+	return bot_lun_command(0, cdb, cdb_len, dir_in, data, len);
+}
+
+static int scsi_rw10(uint8_t op, uint32_t lba, uint16_t count, uint8_t *data)
+{
+	uint8_t cdb[10] = { op };
+
+	put_be32(&cdb[2], lba);
+	cdb[7] = count >> 8;
+	cdb[8] = count;
+	return bot_command(cdb, sizeof(cdb), op == 0x28, data,
+			   count * USB_MSC_BLOCK_SIZE);
+}
+
+static int scsi_rw12(uint8_t lun, uint8_t op, uint32_t lba, uint32_t count,
+		     uint8_t *data)
+{
+	uint8_t cdb[12] = { op };
+
+	put_be32(&cdb[2], lba);
+	put_be32(&cdb[6], count);
+	return bot_lun_command(lun, cdb, sizeof(cdb), op == 0xa8, data,
+			       count * USB_MSC_BLOCK_SIZE);
+}
+
+/* Sense key and ASC, as 0xKKAA. */
+static int scsi_lun_sense(uint8_t lun)
+{
+	uint8_t cdb[6] = { 0x03, 0, 0, 0, 18, 0 };
+	uint8_t sense[18];
+
+	if (0 != bot_lun_command(lun, cdb, sizeof(cdb), true, sense,
+				 sizeof(sense))) {
+		return -1;
+	}
+	return (sense[2] << 8) | sense[12];
+}
+
+static int scsi_sense_key(void)
+{
+	int sense = scsi_lun_sense(0);
+
+	return sense < 0 ? sense : sense >> 8;
+}
+
+/*-- Runs ---------------------------------------------------------------------*/
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+enum mode {
+	LEGACY,
+	ASYNC,
+	MAPPED,
+	FLASH,
+	FLASH_CACHED,
+	TWO_LUNS,
+};
+
+static void setup_device(enum mode mode)
+{
+	static uint8_t ring[RING * USB_MSC_BLOCK_SIZE];
+	static uint8_t cache[UNIT_BLOCKS * USB_MSC_BLOCK_SIZE];
+	struct usb_setup_data set_config = {
+		.bmRequestType = 0x00,
+		.bRequest = USB_REQ_SET_CONFIGURATION,
+		.wValue = 1,
+	};
+
+	usbd_dev = usbd_init(&host_usbd_driver, &dev_descr, &config_descr,
+			     NULL, 0, ctrl_buf, sizeof(ctrl_buf));
+	msc = usb_msc_init(usbd_dev, EP_IN, PACKET, EP_OUT, PACKET,
+			   "VendorID", "ProductID", "0.00", DISK_BLOCKS,
+			   legacy_read,
+			   mode == FLASH ? flash_write : legacy_write);
+	if (mode == ASYNC) {
+		usb_msc_set_backend(msc, 0, &ring_backend, ring, RING);
+	} else if (mode == MAPPED) {
+		usb_msc_set_backend(msc, 0, &mapped_backend, ring, RING);
+	} else if (mode == FLASH_CACHED) {
+		usb_msc_set_cache(msc, 0, cache, UNIT_BLOCKS, IDLE_MS,
+				  flash_write_unit);
+	} else if (mode == TWO_LUNS) {
+		usb_msc_add_lun(msc, LUN1_BLOCKS, lun1_read, lun1_write);
+	}
+	pending_count = 0;
+	erases = 0;
+	host_usbd_control(usbd_dev, &set_config, NULL);
+}
+
+/* The cache is written back on SYNCHRONIZE CACHE, and after IDLE_MS. */
+static int check_write_back(const char *name)
+{
+	uint8_t cdb[10] = { 0x35 };
+	uint8_t block[USB_MSC_BLOCK_SIZE];
+	uint32_t i;
+
+	memset(block, 0x5a, sizeof(block));
+	if (0 != scsi_rw10(0x2a, 5, 1, block) ||
+	    0 != bot_command(cdb, sizeof(cdb), false, NULL, 0) ||
+	    0 != memcmp(disk[5], block, sizeof(block))) {
+		printf("%s: not written back on SYNCHRONIZE CACHE\n", name);
+		return 1;
+	}
+
+	memset(block, 0xa5, sizeof(block));
+	if (0 != scsi_rw10(0x2a, 6, 1, block)) {
+		return 1;
+	}
+	for (i = 0; i < 2 * IDLE_MS; i++) {
+		if (0 == memcmp(disk[6], block, sizeof(block))) {
+			break;
+		}
+		usb_msc_tick(msc);
+	}
+	if (IDLE_MS != i) {
+		printf("%s: not written back after %u ms idle\n", name, i);
+		return 1;
+	}
+	return 0;
+}
+
+/* A second LUN, found through GET MAX LUN and REPORT LUNS, with a capacity
+ * and medium of its own, and one that does not exist. */
+static int check_luns(void)
+{
+	struct usb_setup_data get_max_lun = {
+		.bmRequestType = 0xa1,
+		.bRequest = USB_MSC_REQ_GET_MAX_LUN,
+		.wLength = 1,
+	};
+	uint8_t report_luns[12] = { 0xa0 };
+	uint8_t read_capacity[10] = { 0x25 };
+	uint8_t test_unit_ready[6] = { 0x00 };
+	uint8_t mode_sense_10[10] = { 0x5a, 0, 0x3f, 0, 0, 0, 0, 0, 0xff };
+	uint8_t inquiry[6] = { 0x12, 0, 0, 0, 36, 0 };
+	uint8_t out[4 * USB_MSC_BLOCK_SIZE], in[4 * USB_MSC_BLOCK_SIZE];
+	uint8_t reply[36];
+	uint32_t i;
+
+	setup_device(TWO_LUNS);
+
+	if (1 != host_usbd_control(usbd_dev, &get_max_lun, reply) ||
+	    1 != reply[0]) {
+		printf("luns: GET MAX LUN is not 1\n");
+		return 1;
+	}
+
+	put_be32(&report_luns[6], 24);
+	if (0 != bot_lun_command(0, report_luns, sizeof(report_luns), true,
+				 reply, 24) ||
+	    16 != reply[3] || 0 != reply[9] || 1 != reply[17]) {
+		printf("luns: REPORT LUNS does not list LUN 0 and 1\n");
+		return 1;
+	}
+
+	if (0 != bot_lun_command(1, read_capacity, sizeof(read_capacity), true,
+				 reply, 8) ||
+	    LUN1_BLOCKS - 1 != reply[3] || 0 != reply[2]) {
+		printf("luns: READ CAPACITY of LUN 1 is wrong\n");
+		return 1;
+	}
+
+	/* WRITE(12) and READ(12) on LUN 1 leave LUN 0 alone. */
+	for (i = 0; i < sizeof(out); i++) {
+		out[i] = rand();
+	}
+	memset(disk[LUN1_BLOCKS - 4], 0, sizeof(out));
+	if (0 != scsi_rw12(1, 0xaa, LUN1_BLOCKS - 4, 4, out) ||
+	    0 != scsi_rw12(1, 0xa8, LUN1_BLOCKS - 4, 4, in) ||
+	    0 != memcmp(in, out, sizeof(in)) ||
+	    0 != memcmp(lun1_disk[LUN1_BLOCKS - 4], out, sizeof(out)) ||
+	    0 != disk[LUN1_BLOCKS - 4][0]) {
+		printf("luns: WRITE(12)/READ(12) on LUN 1 went wrong\n");
+		return 1;
+	}
+
+	/* LUN 1 is smaller than LUN 0. */
+	if (1 != scsi_rw12(1, 0xa8, LUN1_BLOCKS - 1, 2, in) ||
+	    0x0521 != scsi_lun_sense(1) ||
+	    0 != scsi_rw12(0, 0xa8, LUN1_BLOCKS - 1, 2, in)) {
+		printf("luns: capacity of LUN 1 not enforced\n");
+		return 1;
+	}
+
+	if (0 != bot_lun_command(1, mode_sense_10, sizeof(mode_sense_10), true,
+				 reply, 8) ||
+	    6 != reply[1] || 0 != reply[7]) {
+		printf("luns: MODE SENSE(10) header is wrong\n");
+		return 1;
+	}
+
+	if (0 != bot_lun_command(2, inquiry, sizeof(inquiry), true, reply,
+				 36) ||
+	    0x7f != reply[0] ||
+	    1 != bot_lun_command(2, test_unit_ready, sizeof(test_unit_ready),
+				 false, NULL, 0) ||
+	    0x0525 != scsi_lun_sense(2)) {
+		printf("luns: LUN 2 is not reported missing\n");
+		return 1;
+	}
+
+	printf("luns     GET MAX LUN, REPORT LUNS, READ(12)/WRITE(12), "
+	       "MODE SENSE(10) ok\n");
+	return 0;
+}
+
+/* The data phase the host asks for in the CBW wins over the command's own
+ * (BOT 6.7): short replies are padded, long ones cut, and a block transfer
+ * that does not fit is a phase error that leaves the device working. */
+static int check_data_phase(void)
+{
+	uint8_t read_12[12] = { 0xa8 };
+	uint8_t read_10[10] = { 0x28, 0, 0, 0, 0, 0, 0, 0, 2 };
+	uint8_t inquiry[6] = { 0x12, 0, 0, 0, 36, 0 };
+	uint8_t read_capacity[10] = { 0x25 };
+	uint8_t mode_sense_10[10] = { 0x5a, 0, 0x3f, 0, 0, 0, 0, 0, 0xff };
+	uint8_t test_unit_ready[6] = { 0x00 };
+	uint8_t in[2 * USB_MSC_BLOCK_SIZE];
+	uint32_t i;
+
+	setup_device(TWO_LUNS);
+
+	/* READ(12) whose byte count does not fit in 32 bits. */
+	put_be32(&read_12[6], 0x800000);
+	if (1 != bot_lun_command(0, read_12, sizeof(read_12), true, in,
+				 USB_MSC_BLOCK_SIZE) ||
+	    0x0524 != scsi_lun_sense(0)) {
+		printf("phase: oversized READ(12) not rejected\n");
+		return 1;
+	}
+
+	memset(in, 0xff, sizeof(in));
+	if (0 != bot_lun_command(0, inquiry, sizeof(inquiry), true, in, 64)) {
+		printf("phase: INQUIRY into a longer data phase failed\n");
+		return 1;
+	}
+	for (i = 36; i < 64; i++) {
+		if (0 != in[i]) {
+			printf("phase: INQUIRY not padded with zeros\n");
+			return 1;
+		}
+	}
+
+	if (0 != bot_lun_command(0, inquiry, sizeof(inquiry), true, in, 8)) {
+		printf("phase: INQUIRY into a shorter data phase failed\n");
+		return 1;
+	}
+
+	if (1 != bot_lun_command(2, read_capacity, sizeof(read_capacity), true,
+				 in, 8)) {
+		printf("phase: READ CAPACITY of a missing LUN not padded\n");
+		return 1;
+	}
+
+	if (0 != bot_lun_command(0, test_unit_ready, sizeof(test_unit_ready),
+				 false, in, 64)) {
+		printf("phase: data-out to TEST UNIT READY not dropped\n");
+		return 1;
+	}
+
+	/* Two blocks into room for one, and a read the host sends data to. */
+	if (2 != bot_lun_command(0, read_10, sizeof(read_10), true, in,
+				 USB_MSC_BLOCK_SIZE) ||
+	    2 != bot_lun_command(0, read_10, sizeof(read_10), false, in,
+				 sizeof(in)) ||
+	    0 != scsi_rw10(0x28, 0, 2, in)) {
+		printf("phase: mismatched READ(10) not a phase error\n");
+		return 1;
+	}
+
+	/* A data phase of 2 GiB and more, past what a signed count holds. */
+	put_be32(&read_12[6], 0x400000);
+	if (1 != bot_lun_command(0, read_12, sizeof(read_12), true, NULL,
+				 0x400000u * USB_MSC_BLOCK_SIZE) ||
+	    0x0521 != scsi_lun_sense(0)) {
+		printf("phase: 2 GiB READ(12) did not run its data phase\n");
+		return 1;
+	}
+	put_be32(&read_12[6], 0x800000);
+
+	/* MODE SENSE(10) leaves no sense behind from the command before. */
+	if (1 != bot_lun_command(0, read_12, sizeof(read_12), true, in,
+				 USB_MSC_BLOCK_SIZE) ||
+	    0 != bot_lun_command(0, mode_sense_10, sizeof(mode_sense_10), true,
+				 in, 8) ||
+	    0 != scsi_lun_sense(0)) {
+		printf("phase: MODE SENSE(10) kept stale sense\n");
+		return 1;
+	}
+
+	printf("phase    padding, truncation, phase errors, "
+	       "oversized READ(12) ok\n");
+	return 0;
+}
+
+static int run(const char *name, enum mode mode, uint32_t megabytes)
+{
+	static uint8_t out[XFER_BLOCKS * USB_MSC_BLOCK_SIZE];
+	static uint8_t in[XFER_BLOCKS * USB_MSC_BLOCK_SIZE];
+	uint8_t sync_cache[10] = { 0x35 };
+	uint32_t xfers = megabytes * 1024 * 1024 / sizeof(out);
+	uint32_t x, i;
+	double t0, t_write, t_read;
+
+	setup_device(mode);
+
+	for (i = 0; i < sizeof(out); i++) {
+		out[i] = rand();
+	}
+
+	t0 = now();
+	for (x = 0; x < xfers; x++) {
+		uint32_t lba = (x * XFER_BLOCKS) % DISK_BLOCKS;
+
+		out[0] = x;
+		if (0 != scsi_rw10(0x2a, lba, XFER_BLOCKS, out)) {
+			printf("%s: WRITE(10) %u failed\n", name, x);
+			return 1;
+		}
+	}
+	/* Write back what the cache still holds, so that its time and
+	 * erases are counted too. */
+	if (0 != bot_command(sync_cache, sizeof(sync_cache), false, NULL, 0)) {
+		printf("%s: SYNCHRONIZE CACHE failed\n", name);
+		return 1;
+	}
+	t_write = now() - t0;
+
+	t0 = now();
+	for (x = 0; x < xfers; x++) {
+		uint32_t lba = (x * XFER_BLOCKS) % DISK_BLOCKS;
+
+		if (0 != scsi_rw10(0x28, lba, XFER_BLOCKS, in)) {
+			printf("%s: READ(10) %u failed\n", name, x);
+			return 1;
+		}
+		/* The last pass over the disk wrote these. */
+		out[0] = x;
+		if (x >= xfers - DISK_BLOCKS / XFER_BLOCKS &&
+		    0 != memcmp(in, out, sizeof(in))) {
+			printf("%s: READ(10) %u returned other data\n",
+			       name, x);
+			return 1;
+		}
+	}
+	t_read = now() - t0;
+
+	/* Past the end: fails, and says why. */
+	if (1 != scsi_rw10(0x28, DISK_BLOCKS - 1, 2, in) ||
+	    0x05 != scsi_sense_key()) {
+		printf("%s: READ(10) past the end not rejected\n", name);
+		return 1;
+	}
+
+	printf("%-8s write %7.1f MB/s %6.0f ns/block   "
+	       "read %7.1f MB/s %6.0f ns/block", name,
+	       megabytes / t_write, t_write * 1e9 / (xfers * XFER_BLOCKS),
+	       megabytes / t_read, t_read * 1e9 / (xfers * XFER_BLOCKS));
+	if (mode == FLASH || mode == FLASH_CACHED) {
+		printf("   %u erases/MiB", erases / megabytes);
+	}
+	printf("\n");
+
+	if (mode == FLASH_CACHED) {
+		return check_write_back(name);
+	}
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	uint32_t megabytes = argc > 1 ? strtoul(argv[1], NULL, 0) : 64;
+	int failed = 0;
+
+	if (megabytes * 1024 * 1024 / (XFER_BLOCKS * USB_MSC_BLOCK_SIZE) <
+	    DISK_BLOCKS / XFER_BLOCKS) {
+		megabytes = DISK_BLOCKS * USB_MSC_BLOCK_SIZE / (1024 * 1024);
+	}
+
+	failed |= run("legacy", LEGACY, megabytes);
+	failed |= run("async", ASYNC, megabytes);
+	failed |= run("mapped", MAPPED, megabytes);
+	failed |= run("flash", FLASH, megabytes);
+	failed |= run("cached", FLASH_CACHED, megabytes);
+	failed |= check_luns();
+	failed |= check_data_phase();
+
+	return failed;
+}